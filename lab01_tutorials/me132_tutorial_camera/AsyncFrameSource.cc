@@ -0,0 +1,440 @@
+/*
+ * Asynchronous frame source: background acquisition into a ring of
+ * preallocated frame slots.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "AsyncFrameSource.h"
+
+AsyncFrameSource::AsyncFrameSource(FrameSource* innerSource, bool ownInnerSource, int nSlots)
+{
+  inner = innerSource;
+  ownInner = ownInnerSource;
+  numSlots = nSlots<2 ? 2 : nSlots;
+  slots = NULL;
+  running = false;
+  finished = false;
+  lastSequence = 0;
+  demosaicMethod = DC1394_BAYER_METHOD_NEAREST;
+  memset(&stats, 0, sizeof(stats));
+  memset(&format, 0, sizeof(format));
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&frameReady, NULL);
+}
+
+AsyncFrameSource::~AsyncFrameSource()
+{
+  this->close();
+  if(ownInner)
+    delete inner;
+  pthread_cond_destroy(&frameReady);
+  pthread_mutex_destroy(&mutex);
+}
+
+// open the wrapped source, allocate the slots and start the thread
+int AsyncFrameSource::open(PGRStereoCamera_t* stereoCamera)
+{
+  if(inner->open(stereoCamera)<0)
+    return -1;
+  memcpy(&format, stereoCamera, sizeof(format));
+
+  // same buffers as BumbleBee::init_stereo(), a frame buffer per slot
+  FrameLayout layout;
+  getFrameLayout(&format, &layout);
+  if(pool.init(layout.size, numSlots)<0)
+    {
+      inner->close();
+      return -1;
+    }
+  slots = new FrameSlot[numSlots];
+  for(int k=0; k<numSlots; k++)
+    {
+      memset(&slots[k], 0, sizeof(FrameSlot));
+      slots[k].buffer = pool.acquire();
+      slots[k].deInterlaced = slots[k].buffer->data + layout.deInterlaced;
+      if(format.bColor)
+	{
+	  slots[k].rgb          = slots[k].buffer->data + layout.rgb;
+	  slots[k].redGreenBlue = slots[k].buffer->data + layout.redGreenBlue;
+	}
+      slots[k].state = SLOT_FREE;
+    }
+
+  running = true;
+  finished = false;
+  lastSequence = 0;
+  memset(&stats, 0, sizeof(stats));
+  if(pthread_create(&thread, NULL, AsyncFrameSource::acquisitionThread, this)!=0)
+    {
+      fprintf( stderr, "Cannot start the acquisition thread\n" );
+      running = false;
+      this->close();
+      return -1;
+    }
+
+  return 0;
+}
+
+void* AsyncFrameSource::acquisitionThread(void* arg)
+{
+  ((AsyncFrameSource*)arg)->acquire();
+  return NULL;
+}
+
+// acquisition loop: fill a free slot (or the oldest unread one) and
+// publish it as ready
+void AsyncFrameSource::acquire()
+{
+  unsigned int n = format.nRows * format.nCols;
+
+  while(true)
+    {
+      // sleep until the wrapped source has a frame; at the end of a
+      // recording the grab below fails
+      int waited = inner->waitFrame(ASYNC_FRAME_WAIT);
+
+      pthread_mutex_lock(&mutex);
+      if(!running)
+	{
+	  pthread_mutex_unlock(&mutex);
+	  break;
+	}
+      if(waited==GRAB_NO_FRAME)
+	{
+	  pthread_mutex_unlock(&mutex);
+	  continue;
+	}
+      FrameSlot* slot = NULL;
+      FrameSlot* oldest = NULL;
+      for(int k=0; k<numSlots; k++)
+	{
+	  if(slots[k].state==SLOT_FREE)
+	    {
+	      slot = &slots[k];
+	      break;
+	    }
+	  if(slots[k].state==SLOT_READY && (oldest==NULL || slots[k].sequence<oldest->sequence))
+	    oldest = &slots[k];
+	}
+      if(slot==NULL)
+	{
+	  // the consumer is behind; overwrite the oldest unread frame
+	  slot = oldest;
+	  stats.dropped++;
+	}
+      slot->state = SLOT_WRITING;
+      dc1394bayer_method_t method = demosaicMethod;
+      pthread_mutex_unlock(&mutex);
+
+      slot->timestamp = 0;
+      unsigned char* planar = slot->redGreenBlue;
+      int ret;
+      if(format.bColor)
+	ret = inner->grabColorRGB( method,
+				   slot->deInterlaced,
+				   slot->rgb,
+				   &planar,
+				   &slot->right,
+				   &slot->left,
+				   &slot->center,
+				   &slot->input,
+				   &slot->timestamp);
+      else
+	ret = inner->grabMono( slot->deInterlaced,
+			       &slot->right,
+			       &slot->left,
+			       &slot->center,
+			       &slot->input,
+			       &slot->timestamp);
+
+      // GRAB_NO_FRAME if the camera has no new frame yet
+      bool gotFrame = (ret==0);
+
+      if(gotFrame && format.bColor && planar!=slot->redGreenBlue)
+	{
+	  memcpy(slot->redGreenBlue, planar, 6*n);
+	  slot->input.u.rgb.red   = slot->redGreenBlue + 2*n;
+	  slot->input.u.rgb.green = slot->redGreenBlue + 3*n;
+	  slot->input.u.rgb.blue  = slot->input.u.rgb.green;
+	}
+
+      // replay sources hand out their own buffers, which are reused
+      // on the next read; keep a copy in the slot
+      if(gotFrame && format.bColor &&
+	 (slot->right < slot->rgb || slot->right >= slot->rgb + 6*n))
+	{
+	  memcpy(slot->rgb, slot->right, 3*n);
+	  memcpy(slot->rgb + 3*n, slot->left, 3*n);
+	  slot->right  = slot->rgb;
+	  slot->left   = slot->rgb + 3*n;
+	  slot->center = slot->left;
+	}
+      if(gotFrame && !format.bColor &&
+	 (slot->right < slot->deInterlaced || slot->right >= slot->deInterlaced + 2*n))
+	{
+	  memcpy(slot->deInterlaced, slot->right, n);
+	  memcpy(slot->deInterlaced + n, slot->left, n);
+	  slot->right  = slot->deInterlaced;
+	  slot->left   = slot->deInterlaced + n;
+	  slot->center = slot->left;
+	  slot->input.u.rgb.red   = slot->right;
+	  slot->input.u.rgb.green = slot->left;
+	  slot->input.u.rgb.blue  = slot->left;
+	}
+
+      pthread_mutex_lock(&mutex);
+      if(gotFrame)
+	{
+	  stats.captured++;
+	  slot->sequence = stats.captured;
+	  slot->state = SLOT_READY;
+	  pthread_cond_broadcast(&frameReady);
+	}
+      else
+	slot->state = SLOT_FREE;
+
+      // without a camera a failed grab is the end of the recording
+      if(!gotFrame && format.camera==NULL)
+	{
+	  finished = true;
+	  pthread_cond_broadcast(&frameReady);
+	  pthread_mutex_unlock(&mutex);
+	  break;
+	}
+      pthread_mutex_unlock(&mutex);
+    }
+}
+
+int AsyncFrameSource::waitFrame(int timeoutMs)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint64_t usec = (uint64_t)now.tv_usec + (uint64_t)(timeoutMs>0 ? timeoutMs : 0) * 1000;
+  struct timespec deadline;
+  deadline.tv_sec = now.tv_sec + usec / 1000000;
+  deadline.tv_nsec = (usec % 1000000) * 1000;
+
+  pthread_mutex_lock(&mutex);
+  int ret = 0;
+  while(true)
+    {
+      bool ready = false;
+      for(int k=0; k<numSlots; k++)
+	if(slots!=NULL && slots[k].state==SLOT_READY && slots[k].sequence>lastSequence)
+	  ready = true;
+      if(ready)
+	break;
+      if(finished || !running)
+	{
+	  ret = -1;
+	  break;
+	}
+      if(timeoutMs==FRAME_WAIT_FOREVER)
+	pthread_cond_wait(&frameReady, &mutex);
+      else if(timeoutMs==FRAME_WAIT_NONE ||
+	      pthread_cond_timedwait(&frameReady, &mutex, &deadline)==ETIMEDOUT)
+	{
+	  ret = GRAB_NO_FRAME;
+	  break;
+	}
+    }
+  pthread_mutex_unlock(&mutex);
+  return ret;
+}
+
+// hand out the newest ready slot, waiting only if there is none newer
+// than the last one handed out
+FrameSlot* AsyncFrameSource::takeLatest(dc1394bayer_method_t method, bool color)
+{
+  pthread_mutex_lock(&mutex);
+  if(color)
+    demosaicMethod = method;
+
+  FrameSlot* latest = NULL;
+  while(true)
+    {
+      for(int k=0; k<numSlots; k++)
+	if(slots[k].state==SLOT_READY && slots[k].sequence>lastSequence &&
+	   (latest==NULL || slots[k].sequence>latest->sequence))
+	  latest = &slots[k];
+
+      if(latest!=NULL)
+	break;
+      if(finished || !running)
+	{
+	  pthread_mutex_unlock(&mutex);
+	  return NULL;
+	}
+      pthread_cond_wait(&frameReady, &mutex);
+    }
+
+  // release the frame handed out last time and skip older unread ones
+  for(int k=0; k<numSlots; k++)
+    {
+      if(slots[k].state==SLOT_READING)
+	slots[k].state = SLOT_FREE;
+      else if(slots[k].state==SLOT_READY && slots[k].sequence<latest->sequence)
+	{
+	  slots[k].state = SLOT_FREE;
+	  stats.dropped++;
+	}
+    }
+  latest->state = SLOT_READING;
+  lastSequence = latest->sequence;
+  stats.delivered++;
+
+  pthread_mutex_unlock(&mutex);
+  return latest;
+}
+
+int AsyncFrameSource::grabColor(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+				unsigned char* pucRGB, unsigned char* pucGreen,
+				unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+				TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(!format.bColor)
+    return -1;
+  FrameSlot* slot = this->takeLatest(bayerMethod, true);
+  if(slot==NULL)
+    return -1;
+
+  // the green planes are already in the planar buffer, right then left
+  unsigned int n = format.nRows * format.nCols;
+  *ppucRightRGB  = slot->right;
+  *ppucLeftRGB   = slot->left;
+  *ppucCenterRGB = slot->center;
+  memcpy(pTriclopsInput, &slot->input, sizeof(TriclopsInput));
+  pTriclopsInput->u.rgb.red   = slot->redGreenBlue + 2 * n;
+  pTriclopsInput->u.rgb.green = slot->redGreenBlue + 3 * n;
+  pTriclopsInput->u.rgb.blue  = pTriclopsInput->u.rgb.green;
+  *timestamp = slot->timestamp;
+  return 0;
+}
+
+int AsyncFrameSource::grabColorRGB(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+				   unsigned char* pucRGB, unsigned char** ppucRedGreenBlue,
+				   unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+				   TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(!format.bColor)
+    return -1;
+  FrameSlot* slot = this->takeLatest(bayerMethod, true);
+  if(slot==NULL)
+    return -1;
+
+  *ppucRedGreenBlue = slot->redGreenBlue;
+  *ppucRightRGB  = slot->right;
+  *ppucLeftRGB   = slot->left;
+  *ppucCenterRGB = slot->center;
+  memcpy(pTriclopsInput, &slot->input, sizeof(TriclopsInput));
+  *timestamp = slot->timestamp;
+  return 0;
+}
+
+// the slots hold fully demosaiced frames; the green planes are taken
+// from them
+int AsyncFrameSource::grabGreen(int scale, unsigned char* pucGreen, TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(!format.bColor)
+    return -1;
+  FrameSlot* slot = this->takeLatest();
+  if(slot==NULL)
+    return -1;
+
+  unsigned int n = format.nRows * format.nCols;
+  scale = getGreenScale(scale);
+  int r = format.nRows / scale;
+  int c = format.nCols / scale;
+  downscalePlane(slot->redGreenBlue + 2*n, format.nRows, format.nCols, format.nCols, 1, scale, pucGreen, c);
+  downscalePlane(slot->redGreenBlue + 3*n, format.nRows, format.nCols, format.nCols, 1, scale, pucGreen + r*c, c);
+  memcpy(pTriclopsInput, &slot->input, sizeof(TriclopsInput));
+  pTriclopsInput->nrows       = r;
+  pTriclopsInput->ncols       = c;
+  pTriclopsInput->rowinc      = c;
+  pTriclopsInput->u.rgb.red   = pucGreen;
+  pTriclopsInput->u.rgb.green = pucGreen + r*c;
+  pTriclopsInput->u.rgb.blue  = pTriclopsInput->u.rgb.green;
+  *timestamp = slot->timestamp;
+  return 0;
+}
+
+int AsyncFrameSource::grabMono(unsigned char* pucDeInterleaved,
+			       unsigned char** ppucRightMono8, unsigned char** ppucLeftMono8, unsigned char** ppucCenterMono8,
+			       TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(format.bColor)
+    return -1;
+  FrameSlot* slot = this->takeLatest();
+  if(slot==NULL)
+    return -1;
+
+  *ppucRightMono8  = slot->right;
+  *ppucLeftMono8   = slot->left;
+  *ppucCenterMono8 = slot->center;
+  memcpy(pTriclopsInput, &slot->input, sizeof(TriclopsInput));
+  *timestamp = slot->timestamp;
+  return 0;
+}
+
+int AsyncFrameSource::getShutter(float* shutter)
+{
+  return inner->getShutter(shutter);
+}
+
+int AsyncFrameSource::getGain(float* gain)
+{
+  return inner->getGain(gain);
+}
+
+// stop the thread and close the wrapped source
+void AsyncFrameSource::close()
+{
+  if(slots==NULL)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  bool wasRunning = running;
+  running = false;
+  pthread_cond_broadcast(&frameReady);
+  pthread_mutex_unlock(&mutex);
+  if(wasRunning)
+    pthread_join(thread, NULL);
+
+  for(int k=0; k<numSlots; k++)
+    pool.release(slots[k].buffer);
+  delete[] slots;
+  slots = NULL;
+  pool.fini();
+
+  inner->close();
+}
+
+// true if a frame newer than the last one returned is ready
+bool AsyncFrameSource::hasNewFrame()
+{
+  bool ready = false;
+  pthread_mutex_lock(&mutex);
+  for(int k=0; k<numSlots; k++)
+    if(slots!=NULL && slots[k].state==SLOT_READY && slots[k].sequence>lastSequence)
+      ready = true;
+  pthread_mutex_unlock(&mutex);
+  return ready;
+}
+
+// get the acquisition counters
+void AsyncFrameSource::getStats(AsyncCaptureStats* s)
+{
+  pthread_mutex_lock(&mutex);
+  memcpy(s, &stats, sizeof(AsyncCaptureStats));
+  pthread_mutex_unlock(&mutex);
+}
+
+// delete the wrapped source with this one
+void AsyncFrameSource::takeOwnership()
+{
+  ownInner = true;
+}
@@ -0,0 +1,153 @@
+/*
+ * Asynchronous frame source: a background thread grabs frames from
+ * another source into a ring of preallocated slots, so that the
+ * consumer (stereo, SIFT, display) never holds up acquisition and
+ * always gets the most recent completed frame.
+ */
+
+#ifndef _ASYNC_FRAME_SOURCE_HH_
+#define _ASYNC_FRAME_SOURCE_HH_
+
+#include <pthread.h>
+
+#include "FrameSource.h"
+#include "FramePool.h"
+
+// state of a slot in the ring
+enum FrameSlotState{
+  SLOT_FREE = 0,    // unused
+  SLOT_WRITING,     // being filled by the acquisition thread
+  SLOT_READY,       // completed and not yet handed out
+  SLOT_READING,     // handed out to the consumer until its next grab
+};
+
+// one preallocated frame
+typedef struct _FrameSlot
+{
+  // frame buffer of the slot, holding the buffers below
+  FrameBuffer* buffer;
+
+  // buffers filled by the wrapped source
+  unsigned char* deInterlaced;
+  unsigned char* rgb;
+  unsigned char* redGreenBlue;
+
+  // images and stereo input pointing into the buffers above
+  unsigned char* right;
+  unsigned char* left;
+  unsigned char* center;
+  TriclopsInput input;
+
+  uint64_t timestamp;
+
+  // number of the frame since the source was opened
+  uint64_t sequence;
+
+  FrameSlotState state;
+} FrameSlot;
+
+// acquisition counters
+typedef struct _AsyncCaptureStats
+{
+  // frames completed by the acquisition thread
+  uint64_t captured;
+
+  // frames handed to the consumer
+  uint64_t delivered;
+
+  // completed frames that were overwritten or skipped before the
+  // consumer got to them
+  uint64_t dropped;
+} AsyncCaptureStats;
+
+
+class AsyncFrameSource : public FrameSource
+{
+ public:
+  // wrap a source; nSlots >= 2 (3 = triple buffering). If ownInner is
+  // true the wrapped source is deleted with this one.
+  AsyncFrameSource(FrameSource* innerSource, bool ownInner, int nSlots=3);
+  ~AsyncFrameSource();
+
+  // open the wrapped source, allocate the slots and start the thread
+  int open(PGRStereoCamera_t* stereoCamera);
+
+  // wait for a frame newer than the one returned last time
+  int waitFrame(int timeoutMs);
+
+  // These return the latest completed frame, waiting only if there is
+  // no frame newer than the one returned last time. Color frames are
+  // demosaiced ahead of the grab, with the bayerMethod of the last color
+  // grab (nearest neighbour before the first one)
+  int grabColor(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+		unsigned char* pucRGB, unsigned char* pucGreen,
+		unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+		TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabColorRGB(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+		   unsigned char* pucRGB, unsigned char** ppucRedGreenBlue,
+		   unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+		   TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabGreen(int scale, unsigned char* pucGreen, TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabMono(unsigned char* pucDeInterleaved,
+	       unsigned char** ppucRightMono8, unsigned char** ppucLeftMono8, unsigned char** ppucCenterMono8,
+	       TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+
+  // shutter and gain are read from the wrapped source
+  int getShutter(float* shutter);
+  int getGain(float* gain);
+
+  // stop the thread and close the wrapped source
+  void close();
+
+  // true if a frame newer than the last one returned is ready
+  bool hasNewFrame();
+
+  // get the acquisition counters
+  void getStats(AsyncCaptureStats* stats);
+
+  // delete the wrapped source with this one
+  void takeOwnership();
+
+ private:
+  // body of the acquisition thread
+  static void* acquisitionThread(void* arg);
+  void acquire();
+
+  // hand out the newest ready slot (see grab functions); color grabs
+  // pass their demosaicing method for the following frames
+  FrameSlot* takeLatest(dc1394bayer_method_t method=DC1394_BAYER_METHOD_NEAREST, bool color=false);
+
+  FrameSource* inner;
+  bool ownInner;
+
+  // stream format of the wrapped source
+  PGRStereoCamera_t format;
+
+  int numSlots;
+  FrameSlot* slots;
+
+  // frame buffers of the slots
+  FramePool pool;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t frameReady;
+  bool running;
+
+  // the wrapped source ran out of frames
+  bool finished;
+
+  // sequence number of the last frame handed out
+  uint64_t lastSequence;
+
+  // demosaicing method of the acquisition thread
+  dc1394bayer_method_t demosaicMethod;
+
+  AsyncCaptureStats stats;
+};
+
+// how long the acquisition thread sleeps on the wrapped source at a
+// time before it checks whether it should stop [ms]
+#define ASYNC_FRAME_WAIT 100
+
+#endif
@@ -0,0 +1,621 @@
+/*
+ * Block matching stereo. Each band of rows keeps, for every column and
+ * disparity, the matching cost summed over the maskSize rows around the
+ * current row; sliding that along the row gives the window costs of a
+ * pixel for all disparities at once, laid out contiguously so they are
+ * updated and searched 8 disparities at a time with SSE2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "BlockStereo.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// most expensive cost of a single pixel
+#define SAD_MAX_COST     255
+#define CENSUS_MAX_COST  24
+
+// per thread state
+struct BlockStereoBand
+{
+  BlockStereo* owner;
+  int row0;
+  int row1;
+
+  // disparities padded to a multiple of 8, and columns, buffers are sized for
+  int numDisp;
+  int numCols;
+
+  // cost of each pixel of one row for each disparity [ncols][numDisp]
+  uint8_t* cost;
+
+  // cost summed over the rows of the window [ncols][numDisp]
+  uint16_t* colSum;
+
+  // cost summed over the window around the current pixel [numDisp]
+  uint16_t* win;
+
+  // intensity and squared intensity summed over the rows of the window
+  int* colI;
+  int* colI2;
+
+  pthread_t thread;
+};
+
+void getDefaultBlockStereoParams(BlockStereoParams* params)
+{
+  params->minDisparity = 0;
+  params->maxDisparity = 64;
+  params->maskSize = 11;
+  params->edgeCorrelation = true;
+  params->census = false;
+  params->textureValidation = true;
+  params->textureThreshold = 1.1f;
+  params->uniquenessValidation = true;
+  params->uniquenessThreshold = 0.8f;
+  params->subpixel = true;
+  params->nThreads = 1;
+}
+
+BlockStereo::BlockStereo(const BlockStereoParams* p)
+{
+  memcpy(&params, p, sizeof(BlockStereoParams));
+  if(params.maskSize<3)
+    params.maskSize = 3;
+  if(params.maskSize>15)
+    params.maskSize = 15;
+  params.maskSize |= 1;
+  if(params.nThreads<1)
+    params.nThreads = 1;
+  this->setDisparity(params.minDisparity, params.maxDisparity);
+
+  nrows = 0;
+  ncols = 0;
+  filteredRight = NULL;
+  filteredLeft = NULL;
+  censusRight = NULL;
+  censusLeft = NULL;
+  numBands = 0;
+  bands = NULL;
+}
+
+BlockStereo::~BlockStereo()
+{
+  this->freeBuffers();
+}
+
+void BlockStereo::freeBuffers()
+{
+  delete[] filteredRight;
+  delete[] filteredLeft;
+  delete[] censusRight;
+  delete[] censusLeft;
+  for(int k=0; k<numBands; k++)
+    {
+      delete[] bands[k].cost;
+      delete[] bands[k].colSum;
+      delete[] bands[k].win;
+      delete[] bands[k].colI;
+      delete[] bands[k].colI2;
+    }
+  delete[] bands;
+  filteredRight = filteredLeft = NULL;
+  censusRight = censusLeft = NULL;
+  bands = NULL;
+  numBands = 0;
+}
+
+void BlockStereo::setDisparity(int minDisp, int maxDisp)
+{
+  params.minDisparity = minDisp<0 ? 0 : minDisp;
+  params.maxDisparity = maxDisp<params.minDisparity ? params.minDisparity : maxDisp;
+}
+
+void BlockStereo::getParams(BlockStereoParams* p)
+{
+  memcpy(p, &params, sizeof(BlockStereoParams));
+}
+
+//=============================================================================
+// vector helpers
+//=============================================================================
+
+// sum[k] += cost[k]
+static void addCost(uint16_t* sum, const uint8_t* cost, int n)
+{
+  int k = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for(; k+16<=n; k+=16)
+    {
+      __m128i c = _mm_loadu_si128((const __m128i*)(cost + k));
+      __m128i* s = (__m128i*)(sum + k);
+      _mm_storeu_si128(s,     _mm_add_epi16(_mm_loadu_si128(s),     _mm_unpacklo_epi8(c, zero)));
+      _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(c, zero)));
+    }
+#endif
+  for(; k<n; k++)
+    sum[k] += cost[k];
+}
+
+// sum[k] -= cost[k]
+static void subCost(uint16_t* sum, const uint8_t* cost, int n)
+{
+  int k = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for(; k+16<=n; k+=16)
+    {
+      __m128i c = _mm_loadu_si128((const __m128i*)(cost + k));
+      __m128i* s = (__m128i*)(sum + k);
+      _mm_storeu_si128(s,     _mm_sub_epi16(_mm_loadu_si128(s),     _mm_unpacklo_epi8(c, zero)));
+      _mm_storeu_si128(s + 1, _mm_sub_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(c, zero)));
+    }
+#endif
+  for(; k<n; k++)
+    sum[k] -= cost[k];
+}
+
+// win[k] += add[k] - sub[k] (n a multiple of 8)
+static void slideWindow(uint16_t* win, const uint16_t* add, const uint16_t* sub, int n)
+{
+  int k = 0;
+#ifdef __SSE2__
+  for(; k<n; k+=8)
+    {
+      __m128i w = _mm_loadu_si128((const __m128i*)(win + k));
+      w = _mm_add_epi16(w, _mm_loadu_si128((const __m128i*)(add + k)));
+      w = _mm_sub_epi16(w, _mm_loadu_si128((const __m128i*)(sub + k)));
+      _mm_storeu_si128((__m128i*)(win + k), w);
+    }
+#endif
+  for(; k<n; k++)
+    win[k] += add[k] - sub[k];
+}
+
+// win[k] += add[k] (n a multiple of 8)
+static void addSums(uint16_t* win, const uint16_t* add, int n)
+{
+  int k = 0;
+#ifdef __SSE2__
+  for(; k<n; k+=8)
+    {
+      __m128i w = _mm_loadu_si128((const __m128i*)(win + k));
+      _mm_storeu_si128((__m128i*)(win + k), _mm_add_epi16(w, _mm_loadu_si128((const __m128i*)(add + k))));
+    }
+#endif
+  for(; k<n; k++)
+    win[k] += add[k];
+}
+
+// smallest of win[0..n)
+static uint16_t minCost(const uint16_t* win, int n)
+{
+  int k = 0;
+  uint16_t best = 0xFFFF;
+#ifdef __SSE2__
+  if(n>=8)
+    {
+      // unsigned 16 bit min: a - max(a - b, 0)
+      __m128i m = _mm_set1_epi16((short)0xFFFF);
+      for(; k+8<=n; k+=8)
+	{
+	  __m128i w = _mm_loadu_si128((const __m128i*)(win + k));
+	  m = _mm_sub_epi16(m, _mm_subs_epu16(m, w));
+	}
+      uint16_t lanes[8];
+      _mm_storeu_si128((__m128i*)lanes, m);
+      for(int l=0; l<8; l++)
+	if(lanes[l]<best)
+	  best = lanes[l];
+    }
+#endif
+  for(; k<n; k++)
+    if(win[k]<best)
+      best = win[k];
+  return best;
+}
+
+// c[k] = Hamming distance of r and l[k]
+static void censusCostGeneric(uint32_t r, const uint32_t* l, int n, uint8_t* c)
+{
+  for(int k=0; k<n; k++)
+    c[k] = __builtin_popcount(r ^ l[k]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the same with the popcnt instruction instead of a library call
+__attribute__((target("popcnt")))
+static void censusCostPopcnt(uint32_t r, const uint32_t* l, int n, uint8_t* c)
+{
+  for(int k=0; k<n; k++)
+    c[k] = __builtin_popcount(r ^ l[k]);
+}
+#endif
+
+static void censusCost(uint32_t r, const uint32_t* l, int n, uint8_t* c)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  static int hasPopcnt = -1;
+  if(hasPopcnt<0)
+    hasPopcnt = __builtin_cpu_supports("popcnt") ? 1 : 0;
+  if(hasPopcnt)
+    {
+      censusCostPopcnt(r, l, n, c);
+      return;
+    }
+#endif
+  censusCostGeneric(r, l, n, c);
+}
+
+//=============================================================================
+// prefiltering
+//=============================================================================
+
+// horizontal Sobel response, halved and clamped around 128
+static void edgeFilter(const ImageView* image, int i, uint8_t* out)
+{
+  int n = image->width;
+  const uint8_t* above = imageViewRow(image, i>0 ? i-1 : i);
+  const uint8_t* row   = imageViewRow(image, i);
+  const uint8_t* below = imageViewRow(image, i<image->height-1 ? i+1 : i);
+
+  out[0] = out[n-1] = 128;
+  for(int j=1; j<n-1; j++)
+    {
+      int v = (above[j+1] - above[j-1]) + 2 * (row[j+1] - row[j-1]) + (below[j+1] - below[j-1]);
+      v = v/2 + 128;
+      out[j] = v<0 ? 0 : (v>255 ? 255 : v);
+    }
+}
+
+// 5x5 census transform: one bit per neighbour darker than the centre
+static void censusFilter(const ImageView* image, int i, uint32_t* out)
+{
+  int n = image->width;
+  const uint8_t* rows[5];
+  for(int r=0; r<5; r++)
+    {
+      int ii = i + r - 2;
+      ii = ii<0 ? 0 : (ii>=image->height ? image->height-1 : ii);
+      rows[r] = imageViewRow(image, ii);
+    }
+
+  for(int j=0; j<n; j++)
+    {
+      uint8_t centre = rows[2][j];
+      uint32_t bits = 0;
+      for(int r=0; r<5; r++)
+	for(int c=-2; c<=2; c++)
+	  {
+	    if(r==2 && c==0)
+	      continue;
+	    int jj = j + c;
+	    jj = jj<0 ? 0 : (jj>=n ? n-1 : jj);
+	    bits = (bits << 1) | (rows[r][jj] < centre);
+	  }
+      out[j] = bits;
+    }
+}
+
+void BlockStereo::prefilter(BlockStereoBand* band)
+{
+  for(int i=band->row0; i<band->row1; i++)
+    {
+      if(params.census)
+	{
+	  censusFilter(rightImage, i, censusRight + i*ncols);
+	  censusFilter(leftImage, i, censusLeft + i*ncols);
+	}
+      else if(params.edgeCorrelation)
+	{
+	  edgeFilter(rightImage, i, filteredRight + i*ncols);
+	  edgeFilter(leftImage, i, filteredLeft + i*ncols);
+	}
+      else
+	{
+	  memcpy(filteredRight + i*ncols, imageViewRow(rightImage, i), ncols);
+	  memcpy(filteredLeft + i*ncols, imageViewRow(leftImage, i), ncols);
+	}
+    }
+}
+
+//=============================================================================
+// matching
+//=============================================================================
+
+// cost of every pixel of row i for each of the nd disparities; the
+// disparities without a match inside the left image get the highest cost
+void BlockStereo::rowCost(int i, int nd, uint8_t* cost)
+{
+  int minD = params.minDisparity;
+  int numD = params.maxDisparity - params.minDisparity + 1;
+  memset(cost, params.census ? CENSUS_MAX_COST : SAD_MAX_COST, ncols * nd);
+
+  for(int j=0; j<ncols; j++)
+    {
+      uint8_t* c = cost + j*nd;
+      int avail = ncols - j - minD;
+      if(avail>numD)
+	avail = numD;
+
+      if(params.census)
+	{
+	  censusCost(censusRight[i*ncols + j], censusLeft + i*ncols + j + minD, avail, c);
+	  continue;
+	}
+
+      uint8_t r = filteredRight[i*ncols + j];
+      const uint8_t* l = filteredLeft + i*ncols + j + minD;
+      int k = 0;
+#ifdef __SSE2__
+      __m128i vr = _mm_set1_epi8((char)r);
+      for(; k+16<=avail; k+=16)
+	{
+	  __m128i vl = _mm_loadu_si128((const __m128i*)(l + k));
+	  _mm_storeu_si128((__m128i*)(c + k), _mm_or_si128(_mm_subs_epu8(vr, vl), _mm_subs_epu8(vl, vr)));
+	}
+#endif
+      for(; k<avail; k++)
+	c[k] = r>l[k] ? r-l[k] : l[k]-r;
+    }
+}
+
+void BlockStereo::match(BlockStereoBand* band)
+{
+  int h = params.maskSize / 2;
+  int minD = params.minDisparity;
+  int numD = params.maxDisparity - params.minDisparity + 1;
+  int nd = band->numDisp;
+  int windowPixels = params.maskSize * params.maskSize;
+  float textureVar = params.textureThreshold * params.textureThreshold;
+  int uniqueMargin = (int)ceilf(params.uniquenessThreshold * windowPixels);
+
+  uint8_t* cost = band->cost;
+  uint16_t* colSum = band->colSum;
+  uint16_t* win = band->win;
+
+  // rows too close to the top or bottom have no full window
+  int row0 = band->row0<h ? h : band->row0;
+  int row1 = band->row1>nrows-h ? nrows-h : band->row1;
+  for(int i=band->row0; i<band->row1; i++)
+    if(i<row0 || i>=row1)
+      {
+	unsigned short* out = (unsigned short*)((uint8_t*)output + i*outputRowinc);
+	for(int j=0; j<ncols; j++)
+	  out[j] = DISPARITY_OUT_OF_RANGE;
+      }
+  if(row0>=row1)
+    return;
+
+  // sums over the rows of the window of the first row
+  memset(colSum, 0, ncols * nd * sizeof(uint16_t));
+  memset(band->colI, 0, ncols * sizeof(int));
+  memset(band->colI2, 0, ncols * sizeof(int));
+  for(int r=row0-h; r<row0+h; r++)
+    {
+      this->rowCost(r, nd, cost);
+      addCost(colSum, cost, ncols * nd);
+      const uint8_t* img = imageViewRow(rightImage, r);
+      for(int j=0; j<ncols; j++)
+	{
+	  band->colI[j] += img[j];
+	  band->colI2[j] += img[j] * img[j];
+	}
+    }
+
+  for(int i=row0; i<row1; i++)
+    {
+      // bring the bottom row of the window in
+      this->rowCost(i+h, nd, cost);
+      addCost(colSum, cost, ncols * nd);
+      const uint8_t* img = imageViewRow(rightImage, i+h);
+      for(int j=0; j<ncols; j++)
+	{
+	  band->colI[j] += img[j];
+	  band->colI2[j] += img[j] * img[j];
+	}
+
+      unsigned short* out = (unsigned short*)((uint8_t*)output + i*outputRowinc);
+      for(int j=0; j<h; j++)
+	out[j] = out[ncols-1-j] = DISPARITY_OUT_OF_RANGE;
+
+      // window sums of the first pixel of the row
+      memset(win, 0, nd * sizeof(uint16_t));
+      int sumI = 0, sumI2 = 0;
+      for(int j=0; j<2*h+1 && j<ncols; j++)
+	{
+	  addSums(win, colSum + j*nd, nd);
+	  sumI += band->colI[j];
+	  sumI2 += band->colI2[j];
+	}
+
+      for(int j=h; j<ncols-h; j++)
+	{
+	  if(j>h)
+	    {
+	      slideWindow(win, colSum + (j+h)*nd, colSum + (j-h-1)*nd, nd);
+	      sumI += band->colI[j+h] - band->colI[j-h-1];
+	      sumI2 += band->colI2[j+h] - band->colI2[j-h-1];
+	    }
+
+	  // disparities whose whole window lies inside the left image
+	  int avail = ncols - h - j - minD;
+	  if(avail>numD)
+	    avail = numD;
+	  if(avail<=0)
+	    {
+	      out[j] = DISPARITY_OUT_OF_RANGE;
+	      continue;
+	    }
+
+	  if(params.textureValidation)
+	    {
+	      float mean = (float)sumI / windowPixels;
+	      float var = (float)sumI2 / windowPixels - mean * mean;
+	      if(var<textureVar)
+		{
+		  out[j] = DISPARITY_TEXTURE_INVALID;
+		  continue;
+		}
+	    }
+
+	  uint16_t best = minCost(win, avail);
+	  int k = 0;
+	  while(win[k]!=best)
+	    k++;
+
+	  if(params.uniquenessValidation)
+	    {
+	      // best cost among the others, ignoring the neighbours of k
+	      uint16_t saved[3];
+	      int k0 = k>0 ? k-1 : 0;
+	      int k1 = k<avail-1 ? k+1 : avail-1;
+	      for(int m=k0; m<=k1; m++)
+		{
+		  saved[m-k0] = win[m];
+		  win[m] = 0xFFFF;
+		}
+	      uint16_t second = minCost(win, avail);
+	      for(int m=k0; m<=k1; m++)
+		win[m] = saved[m-k0];
+	      if(second!=0xFFFF && second - best < uniqueMargin)
+		{
+		  out[j] = DISPARITY_UNIQUENESS_INVALID;
+		  continue;
+		}
+	    }
+
+	  float d = minD + k;
+	  if(params.subpixel && k>0 && k<avail-1)
+	    {
+	      int c0 = win[k-1], c1 = win[k], c2 = win[k+1];
+	      int denom = c0 - 2*c1 + c2;
+	      if(denom>0)
+		{
+		  float offset = 0.5f * (c0 - c2) / denom;
+		  d += offset<-0.5f ? -0.5f : (offset>0.5f ? 0.5f : offset);
+		}
+	    }
+	  int d16 = (int)(d * 256.0f + 0.5f);
+	  out[j] = d16>=DISPARITY_OUT_OF_RANGE ? DISPARITY_OUT_OF_RANGE : d16;
+	}
+
+      // take the top row of the window out
+      this->rowCost(i-h, nd, cost);
+      subCost(colSum, cost, ncols * nd);
+      img = imageViewRow(rightImage, i-h);
+      for(int j=0; j<ncols; j++)
+	{
+	  band->colI[j] -= img[j];
+	  band->colI2[j] -= img[j] * img[j];
+	}
+    }
+}
+
+//=============================================================================
+// threads
+//=============================================================================
+
+void* BlockStereo::prefilterThread(void* arg)
+{
+  BlockStereoBand* band = (BlockStereoBand*)arg;
+  band->owner->prefilter(band);
+  return NULL;
+}
+
+void* BlockStereo::matchThread(void* arg)
+{
+  BlockStereoBand* band = (BlockStereoBand*)arg;
+  band->owner->match(band);
+  return NULL;
+}
+
+void BlockStereo::runBands(void* (*fn)(void*))
+{
+  // the calling thread does the first band itself, and any band no
+  // thread could be started for
+  int started = 1;
+  for(; started<numBands; started++)
+    if(pthread_create(&bands[started].thread, NULL, fn, &bands[started])!=0)
+      break;
+  fn(&bands[0]);
+  for(int k=1; k<numBands; k++)
+    {
+      if(k<started)
+	pthread_join(bands[k].thread, NULL);
+      else
+	fn(&bands[k]);
+    }
+}
+
+int BlockStereo::compute(const ImageView* right, const ImageView* left,
+			 unsigned short* disparity, int rowinc)
+{
+  if(right->format!=IMAGE_MONO8 || left->format!=IMAGE_MONO8 ||
+     right->width!=left->width || right->height!=left->height)
+    {
+      fprintf( stderr, "BlockStereo: need two 8 bit images of the same size\n" );
+      return -1;
+    }
+  if(right->width<params.maskSize || right->height<params.maskSize)
+    {
+      fprintf( stderr, "BlockStereo: image smaller than the correlation mask\n" );
+      return -1;
+    }
+
+  // (re)allocate the buffers for this image size and disparity range
+  int numDisp = (params.maxDisparity - params.minDisparity + 1 + 7) & ~7;
+  if(right->width!=ncols || right->height!=nrows || bands==NULL || bands[0].numDisp!=numDisp)
+    {
+      this->freeBuffers();
+      nrows = right->height;
+      ncols = right->width;
+      int n = nrows * ncols;
+      if(params.census)
+	{
+	  censusRight = new uint32_t[n];
+	  censusLeft  = new uint32_t[n];
+	}
+      else
+	{
+	  filteredRight = new uint8_t[n];
+	  filteredLeft  = new uint8_t[n];
+	}
+
+      numBands = params.nThreads>nrows ? nrows : params.nThreads;
+      bands = new BlockStereoBand[numBands];
+      for(int k=0; k<numBands; k++)
+	{
+	  BlockStereoBand* b = &bands[k];
+	  b->owner = this;
+	  b->row0 = nrows * k / numBands;
+	  b->row1 = nrows * (k+1) / numBands;
+	  b->numDisp = numDisp;
+	  b->numCols = ncols;
+	  b->cost   = new uint8_t[ncols * numDisp];
+	  b->colSum = new uint16_t[ncols * numDisp];
+	  b->win    = new uint16_t[numDisp];
+	  b->colI   = new int[ncols];
+	  b->colI2  = new int[ncols];
+	}
+    }
+
+  rightImage = right;
+  leftImage = left;
+  output = disparity;
+  outputRowinc = rowinc;
+
+  // the bands read filtered rows of their neighbours, so all filtering
+  // is done before any matching
+  this->runBands(BlockStereo::prefilterThread);
+  this->runBands(BlockStereo::matchThread);
+  return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Block matching stereo on rectified image pairs, as an alternative to
+ * triclopsStereo(). The right image is the reference, as in Triclops:
+ * pixel (i,j) of the right image is matched against (i,j+d) of the left
+ * image for d in [minDisparity, maxDisparity], comparing maskSize x
+ * maskSize windows by the sum of absolute differences (of the raw or
+ * edge filtered images) or by the Hamming distance of census transforms.
+ *
+ * The output is a 16 bit disparity image in the format of Triclops'
+ * subpixel disparity images, so it can be used wherever those are:
+ * 8.8 fixed point disparities, and 0xFF00 + mapping for pixels failing
+ * validation (see DISPARITY_INVALID_MIN in PointCloud.h).
+ */
+
+#ifndef _BLOCK_STEREO_HH_
+#define _BLOCK_STEREO_HH_
+
+#include <stdint.h>
+
+#include "ImageView.h"
+
+// invalid disparities, with Triclops' default validation mappings
+#define DISPARITY_OUT_OF_RANGE        0xFF00  // image border or no match possible
+#define DISPARITY_TEXTURE_INVALID     0xFFFF  // TextureValidationMapping 255
+#define DISPARITY_UNIQUENESS_INVALID  0xFFFE  // UniqueValidationMapping 254
+
+// stereo implementation used by the driver
+enum StereoEngine{
+  STEREO_TRICLOPS = 0,
+  STEREO_BLOCK_SAD,       // sum of absolute differences
+  STEREO_BLOCK_CENSUS,    // Hamming distance of 5x5 census transforms
+};
+
+typedef struct _BlockStereoParams
+{
+  // disparity search range [pixels]
+  int minDisparity;
+  int maxDisparity;
+
+  // side of the (odd) correlation window, up to 15
+  int maskSize;
+
+  // SAD on horizontal edges instead of intensities (EdgeCorrelation)
+  bool edgeCorrelation;
+
+  // census transforms instead of SAD
+  bool census;
+
+  // reject pixels whose window in the reference image has an intensity
+  // standard deviation below textureThreshold [grey levels]
+  bool textureValidation;
+  float textureThreshold;
+
+  // reject pixels where the best disparity is not at least
+  // uniquenessThreshold better per pixel of the window than any other
+  // (except its neighbours)
+  bool uniquenessValidation;
+  float uniquenessThreshold;
+
+  // refine disparities to subpixel precision by fitting a parabola
+  bool subpixel;
+
+  // rows are split into this many bands, each on its own thread
+  int nThreads;
+} BlockStereoParams;
+
+// defaults matching the calibration file of the Bumblebee2
+void getDefaultBlockStereoParams(BlockStereoParams* params);
+
+// per thread buffers
+struct BlockStereoBand;
+
+class BlockStereo
+{
+ public:
+  BlockStereo(const BlockStereoParams* params);
+  ~BlockStereo();
+
+  // change the disparity search range
+  void setDisparity(int minDisp, int maxDisp);
+
+  // get the parameters in use
+  void getParams(BlockStereoParams* params);
+
+  // compute the disparity image of two rectified IMAGE_MONO8 views of
+  // the same size; disparity has the same size, with rowinc bytes per row
+  int compute(const ImageView* right, const ImageView* left,
+	      unsigned short* disparity, int rowinc);
+
+ private:
+  static void* prefilterThread(void* arg);
+  static void* matchThread(void* arg);
+  void prefilter(BlockStereoBand* band);
+  void match(BlockStereoBand* band);
+  void rowCost(int i, int nd, uint8_t* cost);
+  void freeBuffers();
+
+  // run fn on every band, on nThreads threads
+  void runBands(void* (*fn)(void*));
+
+  BlockStereoParams params;
+
+  // image size of the buffers below
+  int nrows;
+  int ncols;
+
+  // filtered images: edges or intensities (SAD), or census transforms
+  uint8_t* filteredRight;
+  uint8_t* filteredLeft;
+  uint32_t* censusRight;
+  uint32_t* censusLeft;
+
+  // input and output of the current compute()
+  const ImageView* rightImage;
+  const ImageView* leftImage;
+  unsigned short* output;
+  int outputRowinc;
+
+  int numBands;
+  BlockStereoBand* bands;
+};
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ * Several Bumblebee2 stereo heads: one bus enumeration, a pinned worker
+ * per camera, and frame sets aligned by camera timestamp.
+ */
+
+#include <string.h>
+#include <sched.h>
+
+#include "BumbleBeeManager.h"
+
+BumbleBeeManager::BumbleBeeManager()
+{
+  numCameras = 0;
+  memset(cameras, 0, sizeof(cameras));
+  running = false;
+  sets = 0;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&frameReady, NULL);
+  pthread_cond_init(&frameReleased, NULL);
+}
+
+BumbleBeeManager::~BumbleBeeManager()
+{
+  this->stop();
+  for(int k=0; k<numCameras; k++)
+    delete cameras[k].bb;
+  pthread_cond_destroy(&frameReleased);
+  pthread_cond_destroy(&frameReady);
+  pthread_mutex_destroy(&mutex);
+}
+
+int BumbleBeeManager::addCamera(int bbId, int downscale, bool enable_color, StereoEngine engine)
+{
+  if(numCameras>=MANAGER_MAX_CAMERAS)
+    {
+      fprintf( stderr, "Too many cameras (at most %d)\n", MANAGER_MAX_CAMERAS );
+      return -1;
+    }
+  ManagedCamera* cam = &cameras[numCameras];
+  memset(cam, 0, sizeof(ManagedCamera));
+  cam->manager = this;
+  cam->bb = new BumbleBee(bbId, downscale, enable_color, engine);
+  cam->live = true;
+  cam->bumblebeeId = bbId;
+  cam->core = -1;
+  return numCameras++;
+}
+
+int BumbleBeeManager::addSource(FrameSource* frameSource, int bbId, int downscale, bool enable_color,
+				StereoEngine engine)
+{
+  if(numCameras>=MANAGER_MAX_CAMERAS)
+    {
+      fprintf( stderr, "Too many cameras (at most %d)\n", MANAGER_MAX_CAMERAS );
+      return -1;
+    }
+  ManagedCamera* cam = &cameras[numCameras];
+  memset(cam, 0, sizeof(ManagedCamera));
+  cam->manager = this;
+  cam->bb = new BumbleBee(frameSource, bbId, downscale, enable_color, engine);
+  cam->live = false;
+  cam->bumblebeeId = bbId;
+  cam->core = -1;
+  return numCameras++;
+}
+
+int BumbleBeeManager::setCore(int k, int core)
+{
+  if(k<0 || k>=numCameras || running)
+    return -1;
+  cameras[k].core = core;
+  return 0;
+}
+
+// find all live cameras in one enumeration of the bus
+int BumbleBeeManager::init(float shutter)
+{
+  int nLive = 0;
+  for(int k=0; k<numCameras; k++)
+    if(cameras[k].live)
+      nLive++;
+
+  dc1394camera_t* found[MANAGER_MAX_CAMERAS];
+  memset(found, 0, sizeof(found));
+  if(nLive>0)
+    {
+      uint32_t nBus;
+      dc1394camera_t** bus = NULL;
+      if(dc1394_find_cameras( &bus, &nBus ) != DC1394_SUCCESS)
+	{
+	  fprintf( stderr, "Unable to look for cameras\n" );
+	  return -1;
+	}
+
+      for(unsigned int n=0; n<nBus; n++)
+	{
+	  int serialNumber = (int)(bus[n]->euid_64);
+	  bool used = false;
+	  for(int k=0; k<numCameras && !used; k++)
+	    if(cameras[k].live && found[k]==NULL && cameras[k].bumblebeeId==serialNumber &&
+	       isStereoCamera(bus[n]))
+	      {
+		found[k] = bus[n];
+		used = true;
+	      }
+	  if(!used)
+	    dc1394_free_camera( bus[n] );
+	}
+      free(bus);
+
+      int missing = 0;
+      for(int k=0; k<numCameras; k++)
+	if(cameras[k].live && found[k]==NULL)
+	  {
+	    fprintf( stderr, "Camera %d not found\n", cameras[k].bumblebeeId );
+	    missing++;
+	  }
+      if(missing>0)
+	{
+	  for(int k=0; k<numCameras; k++)
+	    if(found[k]!=NULL)
+	      dc1394_free_camera( found[k] );
+	  return -1;
+	}
+
+      // this frees all iso channels and bandwidth of the bus, so it is
+      // done once before any camera starts transmitting
+      for(int k=0; k<numCameras; k++)
+	if(found[k]!=NULL)
+	  {
+	    dc1394_cleanup_iso_channels_and_bandwidth( found[k] );
+	    break;
+	  }
+    }
+
+  for(int k=0; k<numCameras; k++)
+    {
+      int ret;
+      if(cameras[k].live)
+	ret = cameras[k].bb->init(found[k], shutter);
+      else
+	ret = cameras[k].bb->init(shutter);
+      if(ret<0)
+	{
+	  fprintf( stderr, "Cannot initialize camera %d\n", cameras[k].bumblebeeId );
+
+	  // the cameras not handed to a BumbleBee yet
+	  for(int j=k+1; j<numCameras; j++)
+	    if(found[j]!=NULL)
+	      dc1394_free_camera( found[j] );
+	  return -1;
+	}
+      cameras[k].initialized = true;
+    }
+  return 0;
+}
+
+int BumbleBeeManager::getNumCameras()
+{
+  return numCameras;
+}
+
+BumbleBee* BumbleBeeManager::getCamera(int k)
+{
+  if(k<0 || k>=numCameras)
+    return NULL;
+  return cameras[k].bb;
+}
+
+void* BumbleBeeManager::workerThread(void* arg)
+{
+  ManagedCamera* cam = (ManagedCamera*)arg;
+  cam->manager->work(cam);
+  return NULL;
+}
+
+// capture a frame, hand it to the consumer and wait until it is released
+void BumbleBeeManager::work(ManagedCamera* cam)
+{
+  pthread_mutex_lock(&mutex);
+  while(running)
+    {
+      if(cam->ready)
+	{
+	  pthread_cond_wait(&frameReleased, &mutex);
+	  continue;
+	}
+      pthread_mutex_unlock(&mutex);
+
+      uint64_t lastFrame = cam->bb->getFrameId();
+      int ret = cam->bb->capture();
+
+      pthread_mutex_lock(&mutex);
+      if(ret<0)
+	{
+	  cam->failures++;
+
+	  // without a camera a failed capture is the end of the recording
+	  if(!cam->live)
+	    {
+	      cam->finished = true;
+	      pthread_cond_broadcast(&frameReady);
+	      break;
+	    }
+	  continue;
+	}
+
+      // the wait for a frame timed out
+      if(cam->bb->getFrameId()==lastFrame)
+	continue;
+
+      cam->ready = true;
+      pthread_cond_broadcast(&frameReady);
+    }
+  pthread_mutex_unlock(&mutex);
+}
+
+int BumbleBeeManager::start()
+{
+  if(running)
+    return 0;
+  running = true;
+  for(int k=0; k<numCameras; k++)
+    {
+      ManagedCamera* cam = &cameras[k];
+      cam->ready = false;
+      cam->finished = false;
+      if(pthread_create(&cam->thread, NULL, workerThread, cam)!=0)
+	{
+	  fprintf( stderr, "Cannot start the worker of camera %d\n", cam->bumblebeeId );
+	  this->stop();
+	  return -1;
+	}
+      cam->started = true;
+
+      if(cam->core>=0)
+	{
+	  cpu_set_t cpus;
+	  CPU_ZERO(&cpus);
+	  CPU_SET(cam->core, &cpus);
+	  if(pthread_setaffinity_np(cam->thread, sizeof(cpu_set_t), &cpus)!=0)
+	    {
+	      fprintf( stderr, "Cannot pin the worker of camera %d to core %d\n",
+		       cam->bumblebeeId, cam->core );
+	      this->stop();
+	      return -1;
+	    }
+	}
+    }
+  return 0;
+}
+
+int BumbleBeeManager::captureFrameSet(FrameSet* set, uint64_t maxSkew)
+{
+  if(numCameras==0)
+    return -1;
+
+  pthread_mutex_lock(&mutex);
+  while(true)
+    {
+      if(!running)
+	{
+	  pthread_mutex_unlock(&mutex);
+	  return -1;
+	}
+
+      // wait until every camera holds a frame
+      bool all = true;
+      for(int k=0; k<numCameras; k++)
+	{
+	  if(cameras[k].finished)
+	    {
+	      pthread_mutex_unlock(&mutex);
+	      return -1;
+	    }
+	  if(!cameras[k].ready)
+	    all = false;
+	}
+      if(!all)
+	{
+	  pthread_cond_wait(&frameReady, &mutex);
+	  continue;
+	}
+
+      // drop the frames too old for the newest one
+      uint64_t newest = 0;
+      for(int k=0; k<numCameras; k++)
+	if(cameras[k].bb->getTimestamp() > newest)
+	  newest = cameras[k].bb->getTimestamp();
+      bool dropped = false;
+      for(int k=0; k<numCameras; k++)
+	if(newest - cameras[k].bb->getTimestamp() > maxSkew)
+	  {
+	    cameras[k].ready = false;
+	    cameras[k].skipped++;
+	    dropped = true;
+	  }
+      if(!dropped)
+	break;
+      pthread_cond_broadcast(&frameReleased);
+    }
+
+  set->numCameras = numCameras;
+  uint64_t oldest = cameras[0].bb->getTimestamp();
+  uint64_t newest = oldest;
+  for(int k=0; k<numCameras; k++)
+    {
+      uint64_t t = cameras[k].bb->getTimestamp();
+      set->timestamp[k] = t;
+      set->frameId[k] = cameras[k].bb->getFrameId();
+      if(t<oldest)
+	oldest = t;
+      if(t>newest)
+	newest = t;
+    }
+  set->skew = newest - oldest;
+  sets++;
+  pthread_mutex_unlock(&mutex);
+  return 0;
+}
+
+void BumbleBeeManager::releaseFrameSet()
+{
+  pthread_mutex_lock(&mutex);
+  for(int k=0; k<numCameras; k++)
+    cameras[k].ready = false;
+  pthread_cond_broadcast(&frameReleased);
+  pthread_mutex_unlock(&mutex);
+}
+
+void BumbleBeeManager::getStats(ManagerStats* stats)
+{
+  memset(stats, 0, sizeof(ManagerStats));
+  pthread_mutex_lock(&mutex);
+  stats->sets = sets;
+  for(int k=0; k<numCameras; k++)
+    {
+      stats->skipped[k] = cameras[k].skipped;
+      stats->failures[k] = cameras[k].failures;
+    }
+  pthread_mutex_unlock(&mutex);
+}
+
+void BumbleBeeManager::stop()
+{
+  pthread_mutex_lock(&mutex);
+  running = false;
+  pthread_cond_broadcast(&frameReleased);
+  pthread_cond_broadcast(&frameReady);
+  pthread_mutex_unlock(&mutex);
+
+  // a worker in capture() stops after its frame wait at the latest
+  for(int k=0; k<numCameras; k++)
+    if(cameras[k].started)
+      {
+	pthread_join(cameras[k].thread, NULL);
+	cameras[k].started = false;
+      }
+}
+
+int BumbleBeeManager::fini()
+{
+  this->stop();
+  for(int k=0; k<numCameras; k++)
+    if(cameras[k].initialized)
+      {
+	cameras[k].bb->fini();
+	cameras[k].initialized = false;
+      }
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Several Bumblebee2 stereo heads driven together. The bus is
+ * enumerated once for all cameras; each camera then runs capture() and
+ * stereo on a worker thread of its own, optionally pinned to a core,
+ * and the consumer gets sets of one frame per camera whose camera
+ * timestamps are within a given skew of each other.
+ *
+ * Each camera keeps its own BumbleBee (Triclops context and buffers),
+ * so the workers share nothing. Cameras can also be replay sources,
+ * to run the same code on recorded logs.
+ */
+
+#ifndef _BUMBLEBEE_MANAGER_HH_
+#define _BUMBLEBEE_MANAGER_HH_
+
+#include <pthread.h>
+
+#include "bb2.h"
+
+// most cameras of a manager
+#define MANAGER_MAX_CAMERAS 8
+
+// the frames of a set, one per camera
+typedef struct _FrameSet
+{
+  int numCameras;
+
+  // camera timestamp and frameId of the frame of each camera
+  uint64_t timestamp[MANAGER_MAX_CAMERAS];
+  uint64_t frameId[MANAGER_MAX_CAMERAS];
+
+  // difference between the oldest and newest timestamp [us]
+  uint64_t skew;
+} FrameSet;
+
+// counters of a manager
+typedef struct _ManagerStats
+{
+  // frame sets handed out
+  uint64_t sets;
+
+  // frames of each camera dropped to align it with the others
+  uint64_t skipped[MANAGER_MAX_CAMERAS];
+
+  // failed captures of each camera
+  uint64_t failures[MANAGER_MAX_CAMERAS];
+} ManagerStats;
+
+class BumbleBeeManager;
+
+// a camera and its worker
+typedef struct _ManagedCamera
+{
+  BumbleBeeManager* manager;
+  BumbleBee* bb;
+
+  // live cameras are found on the bus; the others replay a source
+  bool live;
+  int bumblebeeId;
+
+  // core the worker is pinned to, -1 for none
+  int core;
+
+  bool initialized;
+  pthread_t thread;
+  bool started;
+
+  // the worker has captured a frame that is not released yet
+  bool ready;
+
+  // a replayed camera ran out of frames
+  bool finished;
+
+  uint64_t skipped;
+  uint64_t failures;
+} ManagedCamera;
+
+
+class BumbleBeeManager
+{
+ public:
+  BumbleBeeManager();
+
+  // deletes the cameras; call fini() first
+  ~BumbleBeeManager();
+
+  // Add a live camera or a camera replaying frameSource (which the
+  // caller keeps); returns its index, -1 if there are too many. bbId
+  // selects the calibration file (and the live camera).
+  int addCamera(int bbId, int downscale=2, bool enable_color=false,
+		StereoEngine engine=STEREO_TRICLOPS);
+  int addSource(FrameSource* frameSource, int bbId, int downscale=2, bool enable_color=false,
+		StereoEngine engine=STEREO_TRICLOPS);
+
+  // pin the worker of camera k to a core; before start()
+  int setCore(int k, int core);
+
+  // enumerate the bus once and initialize all cameras
+  int init(float shutter=0.0105);
+
+  int getNumCameras();
+
+  // the camera to set up after init() (remap, ROI, timing ...) and to
+  // read the images of a frame set from
+  BumbleBee* getCamera(int k);
+
+  // start a worker per camera, each capturing its next frame as soon as
+  // the last one is released
+  int start();
+
+  // Wait for a frame set: one frame of every camera, with timestamps at
+  // most maxSkew [us] apart. A frame older than the newest one by more
+  // than that is dropped for the next frame of its camera, so with
+  // free-running cameras maxSkew should be at least half a frame period.
+  // The images stay in the cameras until releaseFrameSet(). Returns -1
+  // once a replayed camera runs out of frames or the workers stop.
+  int captureFrameSet(FrameSet* set, uint64_t maxSkew);
+
+  // let the workers capture the next frames
+  void releaseFrameSet();
+
+  void getStats(ManagerStats* stats);
+
+  // stop the workers
+  void stop();
+
+  // stop and finish up all cameras
+  int fini();
+
+ private:
+  static void* workerThread(void* arg);
+  void work(ManagedCamera* cam);
+
+  int numCameras;
+  ManagedCamera cameras[MANAGER_MAX_CAMERAS];
+
+  pthread_mutex_t mutex;
+
+  // a worker has captured a frame or finished
+  pthread_cond_t frameReady;
+
+  // the consumer has released frames
+  pthread_cond_t frameReleased;
+
+  bool running;
+  uint64_t sets;
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Timing histograms of the capture path.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "CaptureTiming.h"
+
+static const char* stageNames[TIMING_STAGES] = {
+  "wait", "dequeue", "deinterlace", "debayer", "rectify", "color_rectify", "stereo", "total", "latency"
+};
+
+void initCaptureTiming(CaptureTiming* timing)
+{
+  memset(timing, 0, sizeof(CaptureTiming));
+}
+
+uint64_t readTimingClock()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+void recordTiming(CaptureTiming* timing, TimingStage stage, uint64_t start)
+{
+  if(timing==NULL)
+    return;
+  uint64_t now = readTimingClock();
+
+  // a camera timestamp may be slightly ahead of the host clock
+  addTiming(&timing->stage[stage], now>start ? now - start : 0);
+}
+
+// bucket of a duration: the value itself below 4, then the octave and
+// the two bits below its leading one
+static int getTimingBucket(uint64_t us)
+{
+  if(us<4)
+    return (int)us;
+  int msb = 63 - __builtin_clzll(us);
+  int bucket = 4 * (msb - 1) + (int)((us >> (msb - 2)) & 3);
+  return bucket<TIMING_BUCKETS ? bucket : TIMING_BUCKETS-1;
+}
+
+uint64_t getTimingBucketLower(int bucket)
+{
+  if(bucket<4)
+    return bucket;
+  int msb = bucket/4 + 1;
+  return (uint64_t)(4 + bucket%4) << (msb - 2);
+}
+
+uint64_t getTimingBucketUpper(int bucket)
+{
+  return getTimingBucketLower(bucket + 1);
+}
+
+void addTiming(TimingHistogram* histogram, uint64_t us)
+{
+  if(histogram->count==0 || us<histogram->min)
+    histogram->min = us;
+  if(us>histogram->max)
+    histogram->max = us;
+  histogram->count++;
+  histogram->sum += us;
+  histogram->buckets[getTimingBucket(us)]++;
+}
+
+uint64_t getTimingPercentile(const TimingHistogram* histogram, double fraction)
+{
+  if(histogram->count==0)
+    return 0;
+  uint64_t target = (uint64_t)(fraction * histogram->count + 0.5);
+  if(target<1)
+    target = 1;
+  uint64_t seen = 0;
+  for(int b=0; b<TIMING_BUCKETS; b++)
+    {
+      seen += histogram->buckets[b];
+      if(seen>=target)
+	{
+	  uint64_t upper = getTimingBucketUpper(b);
+	  return upper<histogram->max ? upper : histogram->max;
+	}
+    }
+  return histogram->max;
+}
+
+const char* getTimingStageName(TimingStage stage)
+{
+  if(stage<0 || stage>=TIMING_STAGES)
+    return "unknown";
+  return stageNames[stage];
+}
+
+int writeCaptureTimingCSV(const CaptureTiming* timing, const char* filename)
+{
+  FILE* f = fopen(filename, "w");
+  if(f==NULL)
+    {
+      fprintf( stderr, "Cannot write timing to %s: %s\n", filename, strerror(errno) );
+      return -1;
+    }
+
+  fprintf(f, "stage,lower_us,upper_us,count\n");
+  for(int s=0; s<TIMING_STAGES; s++)
+    for(int b=0; b<TIMING_BUCKETS; b++)
+      if(timing->stage[s].buckets[b]>0)
+	fprintf(f, "%s,%llu,%llu,%u\n", stageNames[s],
+		(unsigned long long)getTimingBucketLower(b),
+		(unsigned long long)getTimingBucketUpper(b),
+		timing->stage[s].buckets[b]);
+
+  if(fclose(f)!=0)
+    {
+      fprintf( stderr, "Cannot write timing to %s: %s\n", filename, strerror(errno) );
+      return -1;
+    }
+  return 0;
+}
+
+int writeCaptureTimingJSON(const CaptureTiming* timing, const char* filename)
+{
+  FILE* f = fopen(filename, "w");
+  if(f==NULL)
+    {
+      fprintf( stderr, "Cannot write timing to %s: %s\n", filename, strerror(errno) );
+      return -1;
+    }
+
+  fprintf(f, "{\n  \"dequeued\": %llu,\n  \"discarded\": %llu,\n  \"no_frame\": %llu,\n  \"stages\": {",
+	  (unsigned long long)timing->dequeued, (unsigned long long)timing->discarded,
+	  (unsigned long long)timing->noFrame);
+  for(int s=0; s<TIMING_STAGES; s++)
+    {
+      const TimingHistogram* h = &timing->stage[s];
+      fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"errors\": %llu, \"mean_us\": %.1f, \"min_us\": %llu, "
+	      "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu, \"buckets\": [",
+	      s ? "," : "", stageNames[s],
+	      (unsigned long long)h->count, (unsigned long long)timing->errors[s],
+	      h->count ? (double)h->sum / h->count : 0.0, (unsigned long long)h->min,
+	      (unsigned long long)getTimingPercentile(h, 0.5),
+	      (unsigned long long)getTimingPercentile(h, 0.9),
+	      (unsigned long long)getTimingPercentile(h, 0.99),
+	      (unsigned long long)h->max);
+      bool first = true;
+      for(int b=0; b<TIMING_BUCKETS; b++)
+	if(h->buckets[b]>0)
+	  {
+	    fprintf(f, "%s[%llu, %llu, %u]", first ? "" : ", ",
+		    (unsigned long long)getTimingBucketLower(b),
+		    (unsigned long long)getTimingBucketUpper(b), h->buckets[b]);
+	    first = false;
+	  }
+      fprintf(f, "]}");
+    }
+  fprintf(f, "\n  }\n}\n");
+
+  if(fclose(f)!=0)
+    {
+      fprintf( stderr, "Cannot write timing to %s: %s\n", filename, strerror(errno) );
+      return -1;
+    }
+  return 0;
+}
+
+void printCaptureTiming(const CaptureTiming* timing, FILE* out)
+{
+  for(int s=0; s<TIMING_STAGES; s++)
+    {
+      const TimingHistogram* h = &timing->stage[s];
+      if(h->count==0 && timing->errors[s]==0)
+	continue;
+      fprintf(out, "%-13s %7llu  mean %8.3f ms  p50 %8.3f  p99 %8.3f  max %8.3f ms  %llu errors\n",
+	      stageNames[s], (unsigned long long)h->count,
+	      h->count ? h->sum * 1e-3 / h->count : 0.0,
+	      getTimingPercentile(h, 0.5) * 1e-3, getTimingPercentile(h, 0.99) * 1e-3,
+	      h->max * 1e-3, (unsigned long long)timing->errors[s]);
+    }
+  fprintf(out, "dequeued %llu frames, discarded %llu, %llu captures without a new frame\n",
+	  (unsigned long long)timing->dequeued, (unsigned long long)timing->discarded,
+	  (unsigned long long)timing->noFrame);
+}
@@ -0,0 +1,106 @@
+/*
+ * Timing of the capture path of the Bumblebee2 driver: a histogram of
+ * the time spent in each stage of capture() (see TimingStage), the
+ * latency from the camera timestamp to the end of capture(), and
+ * counters of the frames the camera poll loop dequeued and threw away.
+ *
+ * Recording is off unless a CaptureTiming is passed in: startTiming()
+ * does not read the clock and recordTiming() does nothing for NULL, so
+ * the disabled cost is a pointer test per stage.
+ */
+
+#ifndef _CAPTURE_TIMING_HH_
+#define _CAPTURE_TIMING_HH_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// timed stages of a capture
+enum TimingStage{
+  TIMING_WAIT = 0,        // sleeping until the camera has a frame
+  TIMING_DEQUEUE,         // polling the camera, or reading a replayed frame
+  TIMING_DEINTERLACE,     // de-interlacing (separate from demosaicing only
+                          // for the methods demosaicStereo() lacks)
+  TIMING_DEBAYER,         // demosaicing, or extracting the green planes
+  TIMING_RECTIFY,         // grayscale rectification
+  TIMING_COLOR_RECTIFY,   // color rectification
+  TIMING_STEREO,          // disparity computation
+  TIMING_TOTAL,           // the whole capture() of a new frame, after the
+                          // wait
+  TIMING_LATENCY,         // camera timestamp to the end of capture()
+  TIMING_STAGES,
+};
+
+// buckets of a histogram: 1us wide up to 4us, then 4 per octave, up to
+// 2^25 us (33 s); longer times go into the last bucket
+#define TIMING_BUCKETS 96
+
+typedef struct _TimingHistogram
+{
+  uint64_t count;
+
+  // [us]
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+
+  uint32_t buckets[TIMING_BUCKETS];
+} TimingHistogram;
+
+typedef struct _CaptureTiming
+{
+  TimingHistogram stage[TIMING_STAGES];
+
+  // frames taken from the camera by the poll loop, and those of them
+  // skipped for a newer one dequeued in the same loop
+  uint64_t dequeued;
+  uint64_t discarded;
+
+  // captures that found no frame newer than the last one
+  uint64_t noFrame;
+
+  // failures in each stage
+  uint64_t errors[TIMING_STAGES];
+} CaptureTiming;
+
+// clear all histograms and counters
+void initCaptureTiming(CaptureTiming* timing);
+
+// wall clock time [us] to pass to recordTiming() at the end of a stage;
+// 0 without reading the clock if timing is NULL
+uint64_t readTimingClock();
+inline uint64_t startTiming(const CaptureTiming* timing)
+{
+  return timing!=NULL ? readTimingClock() : 0;
+}
+
+// record the time from start (a startTiming() or a camera timestamp)
+// to now for a stage
+void recordTiming(CaptureTiming* timing, TimingStage stage, uint64_t start);
+
+// add a duration [us] to a histogram
+void addTiming(TimingHistogram* histogram, uint64_t us);
+
+// bounds of a bucket [us]: [lower, upper)
+uint64_t getTimingBucketLower(int bucket);
+uint64_t getTimingBucketUpper(int bucket);
+
+// upper bound of the bucket holding the given fraction (0..1) of the
+// durations, clamped to the largest one [us]
+uint64_t getTimingPercentile(const TimingHistogram* histogram, double fraction);
+
+// short name of a stage, as used in the exported files
+const char* getTimingStageName(TimingStage stage);
+
+// Export to a file: CSV holds the histograms, a row per non-empty
+// bucket (stage,lower_us,upper_us,count); JSON the counters and, per
+// stage, its summary (count, mean, min, percentiles, max) and non-empty
+// buckets. Return -1 if the file cannot be written.
+int writeCaptureTimingCSV(const CaptureTiming* timing, const char* filename);
+int writeCaptureTimingJSON(const CaptureTiming* timing, const char* filename);
+
+// print the summary of each stage that has timings
+void printCaptureTiming(const CaptureTiming* timing, FILE* out);
+
+#endif
@@ -0,0 +1,772 @@
+/*
+ * Color conversion kernels. The SIMD versions are compiled with
+ * per-function target attributes so the file builds without special
+ * flags; which one runs is decided at run time from the CPU features.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ColorConvert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+//=============================================================================
+// scalar
+//=============================================================================
+
+static void packRowScalar(const uint8_t* r, const uint8_t* g, const uint8_t* b, int n, uint8_t* dst)
+{
+  for(int j=0; j<n; j++)
+    {
+      dst[0] = r[j];
+      dst[1] = g[j];
+      dst[2] = b[j];
+      dst += 3;
+    }
+}
+
+#ifdef CONVERT_X86
+
+//=============================================================================
+// shuffle masks
+//=============================================================================
+
+// packRowMask[o][c] moves the bytes of channel c that belong into the
+// o-th 16 byte block of 16 packed pixels to their place (0x80 = zero)
+static uint8_t packRowMask[3][3][16] __attribute__((aligned(16)));
+static bool packRowMaskReady = false;
+
+static void buildPackMasks()
+{
+  if(packRowMaskReady)
+    return;
+  for(int o=0; o<3; o++)
+    for(int c=0; c<3; c++)
+      for(int k=0; k<16; k++)
+	{
+	  int m = 16*o + k;
+	  packRowMask[o][c][k] = (m%3==c) ? (uint8_t)(m/3) : 0x80;
+	}
+  packRowMaskReady = true;
+}
+
+//=============================================================================
+// SSSE3: 16 pixels per iteration
+//=============================================================================
+
+__attribute__((target("ssse3")))
+static void packRowSSSE3(const uint8_t* r, const uint8_t* g, const uint8_t* b, int n, uint8_t* dst)
+{
+  __m128i mask[3][3];
+  for(int o=0; o<3; o++)
+    for(int c=0; c<3; c++)
+      mask[o][c] = _mm_load_si128((const __m128i*)packRowMask[o][c]);
+
+  int j = 0;
+  for(; j+16<=n; j+=16)
+    {
+      __m128i vr = _mm_loadu_si128((const __m128i*)(r + j));
+      __m128i vg = _mm_loadu_si128((const __m128i*)(g + j));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+      for(int o=0; o<3; o++)
+	{
+	  __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, mask[o][0]),
+						_mm_shuffle_epi8(vg, mask[o][1])),
+				   _mm_shuffle_epi8(vb, mask[o][2]));
+	  _mm_storeu_si128((__m128i*)(dst + 3*j + 16*o), v);
+	}
+    }
+  packRowScalar(r + j, g + j, b + j, n - j, dst + 3*j);
+}
+
+//=============================================================================
+// AVX2: 32 pixels per iteration
+//=============================================================================
+
+// vpshufb shuffles within 128 bit lanes, so the low lane packs pixels
+// 0..15 and the high lane pixels 16..31 with the same masks; the lanes
+// of the three results are then put back in order
+__attribute__((target("avx2")))
+static void packRowAVX2(const uint8_t* r, const uint8_t* g, const uint8_t* b, int n, uint8_t* dst)
+{
+  __m256i mask[3][3];
+  for(int o=0; o<3; o++)
+    for(int c=0; c<3; c++)
+      mask[o][c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)packRowMask[o][c]));
+
+  int j = 0;
+  for(; j+32<=n; j+=32)
+    {
+      __m256i vr = _mm256_loadu_si256((const __m256i*)(r + j));
+      __m256i vg = _mm256_loadu_si256((const __m256i*)(g + j));
+      __m256i vb = _mm256_loadu_si256((const __m256i*)(b + j));
+      __m256i v[3];
+      for(int o=0; o<3; o++)
+	v[o] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(vr, mask[o][0]),
+					       _mm256_shuffle_epi8(vg, mask[o][1])),
+			       _mm256_shuffle_epi8(vb, mask[o][2]));
+
+      // v[0] = [out0 | out3], v[1] = [out1 | out4], v[2] = [out2 | out5]
+      _mm256_storeu_si256((__m256i*)(dst + 3*j),      _mm256_permute2x128_si256(v[0], v[1], 0x20));
+      _mm256_storeu_si256((__m256i*)(dst + 3*j + 32), _mm256_permute2x128_si256(v[2], v[0], 0x30));
+      _mm256_storeu_si256((__m256i*)(dst + 3*j + 64), _mm256_permute2x128_si256(v[1], v[2], 0x31));
+    }
+  packRowScalar(r + j, g + j, b + j, n - j, dst + 3*j);
+}
+
+#endif
+
+//=============================================================================
+// demosaicing: scalar
+//=============================================================================
+
+// The rows of one camera around output row i: up, cur and down are rows
+// i-1, i and i+1 (reflected at the image borders, which keeps the Bayer
+// pattern) with one reflected pixel before and after. On row i the
+// non-green color x is at the columns of parity q, the other non-green
+// color y is on the rows above and below, at the other columns.
+typedef struct _DemosaicRow
+{
+  const uint8_t* up;
+  const uint8_t* cur;
+  const uint8_t* down;
+  int q;
+  DemosaicMethod method;
+} DemosaicRow;
+
+// rounding average, as pavgb computes it
+static inline int avg8(int a, int b)
+{
+  return (a + b + 1) >> 1;
+}
+
+static void demosaicRowScalar(const DemosaicRow* row, int j0, int n, uint8_t* x, uint8_t* g, uint8_t* y)
+{
+  const uint8_t* u = row->up;
+  const uint8_t* c = row->cur;
+  const uint8_t* d = row->down;
+  for(int j=j0; j<n; j++)
+    {
+      if(row->method==DEMOSAIC_NEAREST)
+	{
+	  // the 2x2 block from pixel j of this row, as dc1394 picks it
+	  if((j & 1)==row->q)
+	    {
+	      x[j] = c[j];
+	      g[j] = c[j+1];
+	      y[j] = d[j+1];
+	    }
+	  else
+	    {
+	      x[j] = c[j+1];
+	      g[j] = d[j+1];
+	      y[j] = d[j];
+	    }
+	  continue;
+	}
+
+      int gh = avg8(c[j-1], c[j+1]);
+      int gv = avg8(u[j], d[j]);
+      if((j & 1)==row->q)
+	{
+	  int green = avg8(gh, gv);
+	  if(row->method==DEMOSAIC_EDGESENSE)
+	    {
+	      int dh = abs(c[j-1] - c[j+1]);
+	      int dv = abs(u[j] - d[j]);
+	      if(dh<dv)
+		green = gh;
+	      else if(dv<dh)
+		green = gv;
+	    }
+	  x[j] = c[j];
+	  g[j] = green;
+	  y[j] = avg8(avg8(u[j-1], d[j+1]), avg8(u[j+1], d[j-1]));
+	}
+      else
+	{
+	  x[j] = gh;
+	  g[j] = c[j];
+	  y[j] = gv;
+	}
+    }
+}
+
+static void deinterleaveRowScalar(const uint8_t* raw, int j0, int n, uint8_t* right, uint8_t* left)
+{
+  for(int j=j0; j<n; j++)
+    {
+      right[j] = raw[2*j];
+      left[j] = raw[2*j + 1];
+    }
+}
+
+// bilinear green only
+static void greenRowScalar(const DemosaicRow* row, int j0, int n, uint8_t* g)
+{
+  const uint8_t* u = row->up;
+  const uint8_t* c = row->cur;
+  const uint8_t* d = row->down;
+  for(int j=j0; j<n; j++)
+    g[j] = ((j & 1)==row->q) ? avg8(avg8(c[j-1], c[j+1]), avg8(u[j], d[j])) : c[j];
+}
+
+// green of the 2x2 tiles of raw rows 2i and 2i+1: the rounded mean of
+// their two green pixels, the first at column parity g0
+static void greenTileRowScalar(const uint8_t* raw0, const uint8_t* raw1, int g0, int j0, int n,
+			       uint8_t* right, uint8_t* left)
+{
+  for(int j=j0; j<n; j++)
+    {
+      const uint8_t* p0 = raw0 + 2 * (2*j + g0);
+      const uint8_t* p1 = raw1 + 2 * (2*j + 1 - g0);
+      right[j] = avg8(p0[0], p1[0]);
+      left[j] = avg8(p0[1], p1[1]);
+    }
+}
+
+// mean of the green pixels of scale x scale blocks (scale even) from
+// raw row scale*i on
+static void greenBlockRowScalar(const uint8_t* raw, int ncols, int g0, int scale, int n,
+				uint8_t* right, uint8_t* left)
+{
+  int count = scale * scale / 2;
+  for(int j=0; j<n; j++)
+    {
+      int sum[2] = {0, 0};
+      for(int a=0; a<scale; a++)
+	{
+	  const uint8_t* p = raw + 2 * (a * ncols + scale * j);
+	  for(int b=(g0 + a) & 1; b<scale; b+=2)
+	    {
+	      sum[0] += p[2*b];
+	      sum[1] += p[2*b + 1];
+	    }
+	}
+      right[j] = (sum[0] + count/2) / count;
+      left[j] = (sum[1] + count/2) / count;
+    }
+}
+
+// rounded mean of the 2x2 blocks of two rows
+static void halveRowScalar(const uint8_t* r0, const uint8_t* r1, int j0, int n, uint8_t* dst)
+{
+  for(int j=j0; j<n; j++)
+    dst[j] = (r0[2*j] + r0[2*j+1] + r1[2*j] + r1[2*j+1] + 2) >> 2;
+}
+
+#ifdef CONVERT_X86
+
+//=============================================================================
+// demosaicing: SSE2, 16 pixels per iteration
+//=============================================================================
+
+__attribute__((target("sse2")))
+static void deinterleaveRowSSE2(const uint8_t* raw, int n, uint8_t* right, uint8_t* left)
+{
+  const __m128i low = _mm_set1_epi16(0x00FF);
+  int j = 0;
+  for(; j+16<=n; j+=16)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(raw + 2*j));
+      __m128i b = _mm_loadu_si128((const __m128i*)(raw + 2*j + 16));
+      _mm_storeu_si128((__m128i*)(right + j), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+      _mm_storeu_si128((__m128i*)(left + j), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+  deinterleaveRowScalar(raw, j, n, right, left);
+}
+
+// lanes of m from a, the others from b
+__attribute__((target("sse2")))
+static inline __m128i selectBytes(__m128i m, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+// j steps by 16 from 0, so lane k of a vector is at a column of parity k%2
+__attribute__((target("sse2")))
+static void demosaicRowSSE2(const DemosaicRow* row, int n, uint8_t* x, uint8_t* g, uint8_t* y)
+{
+  const __m128i mq = _mm_set1_epi16(row->q ? (short)0xFF00 : 0x00FF);
+  const __m128i ones = _mm_set1_epi8(-1);
+  const uint8_t* u = row->up;
+  const uint8_t* c = row->cur;
+  const uint8_t* d = row->down;
+
+  int j = 0;
+  for(; j+16<=n; j+=16)
+    {
+      __m128i vc = _mm_loadu_si128((const __m128i*)(c + j));
+      if(row->method==DEMOSAIC_NEAREST)
+	{
+	  __m128i vc1 = _mm_loadu_si128((const __m128i*)(c + j + 1));
+	  __m128i vd = _mm_loadu_si128((const __m128i*)(d + j));
+	  __m128i vd1 = _mm_loadu_si128((const __m128i*)(d + j + 1));
+	  _mm_storeu_si128((__m128i*)(x + j), selectBytes(mq, vc, vc1));
+	  _mm_storeu_si128((__m128i*)(g + j), selectBytes(mq, vc1, vd1));
+	  _mm_storeu_si128((__m128i*)(y + j), selectBytes(mq, vd1, vd));
+	  continue;
+	}
+
+      __m128i vl = _mm_loadu_si128((const __m128i*)(c + j - 1));
+      __m128i vr = _mm_loadu_si128((const __m128i*)(c + j + 1));
+      __m128i vu = _mm_loadu_si128((const __m128i*)(u + j));
+      __m128i vd = _mm_loadu_si128((const __m128i*)(d + j));
+      __m128i gh = _mm_avg_epu8(vl, vr);
+      __m128i gv = _mm_avg_epu8(vu, vd);
+      __m128i green = _mm_avg_epu8(gh, gv);
+      if(row->method==DEMOSAIC_EDGESENSE)
+	{
+	  __m128i dh = _mm_or_si128(_mm_subs_epu8(vl, vr), _mm_subs_epu8(vr, vl));
+	  __m128i dv = _mm_or_si128(_mm_subs_epu8(vu, vd), _mm_subs_epu8(vd, vu));
+	  __m128i dmax = _mm_max_epu8(dh, dv);
+	  __m128i hLess = _mm_andnot_si128(_mm_cmpeq_epi8(dmax, dh), ones);
+	  __m128i vLess = _mm_andnot_si128(_mm_cmpeq_epi8(dmax, dv), ones);
+	  green = selectBytes(hLess, gh, selectBytes(vLess, gv, green));
+	}
+      __m128i diag = _mm_avg_epu8(_mm_avg_epu8(_mm_loadu_si128((const __m128i*)(u + j - 1)),
+					       _mm_loadu_si128((const __m128i*)(d + j + 1))),
+				  _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(u + j + 1)),
+					       _mm_loadu_si128((const __m128i*)(d + j - 1))));
+
+      _mm_storeu_si128((__m128i*)(x + j), selectBytes(mq, vc, gh));
+      _mm_storeu_si128((__m128i*)(g + j), selectBytes(mq, green, vc));
+      _mm_storeu_si128((__m128i*)(y + j), selectBytes(mq, diag, gv));
+    }
+  demosaicRowScalar(row, j, n, x, g, y);
+}
+
+__attribute__((target("sse2")))
+static void greenRowSSE2(const DemosaicRow* row, int n, uint8_t* g)
+{
+  const __m128i mq = _mm_set1_epi16(row->q ? (short)0xFF00 : 0x00FF);
+  const uint8_t* u = row->up;
+  const uint8_t* c = row->cur;
+  const uint8_t* d = row->down;
+
+  int j = 0;
+  for(; j+16<=n; j+=16)
+    {
+      __m128i gh = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(c + j - 1)),
+				_mm_loadu_si128((const __m128i*)(c + j + 1)));
+      __m128i gv = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(u + j)),
+				_mm_loadu_si128((const __m128i*)(d + j)));
+      __m128i vc = _mm_loadu_si128((const __m128i*)(c + j));
+      _mm_storeu_si128((__m128i*)(g + j), selectBytes(mq, _mm_avg_epu8(gh, gv), vc));
+    }
+  greenRowScalar(row, j, n, g);
+}
+
+// the 16 bit raw pixels of parity g (0 low, 1 high half of each 32 bit
+// lane) of 8 tiles, as 8 words; sign extension keeps packs_epi32 exact
+__attribute__((target("sse2")))
+static inline __m128i tileWords(const uint8_t* raw, int g)
+{
+  __m128i a = _mm_loadu_si128((const __m128i*)raw);
+  __m128i b = _mm_loadu_si128((const __m128i*)(raw + 16));
+  if(g==0)
+    {
+      a = _mm_slli_epi32(a, 16);
+      b = _mm_slli_epi32(b, 16);
+    }
+  return _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+}
+
+// 16 tiles per iteration
+__attribute__((target("sse2")))
+static void greenTileRowSSE2(const uint8_t* raw0, const uint8_t* raw1, int g0, int n,
+			     uint8_t* right, uint8_t* left)
+{
+  const __m128i low = _mm_set1_epi16(0x00FF);
+  int j = 0;
+  for(; j+16<=n; j+=16)
+    {
+      // bytes: right and left green of each tile
+      __m128i w0 = _mm_avg_epu8(tileWords(raw0 + 4*j, g0), tileWords(raw1 + 4*j, 1 - g0));
+      __m128i w1 = _mm_avg_epu8(tileWords(raw0 + 4*j + 32, g0), tileWords(raw1 + 4*j + 32, 1 - g0));
+      _mm_storeu_si128((__m128i*)(right + j), _mm_packus_epi16(_mm_and_si128(w0, low), _mm_and_si128(w1, low)));
+      _mm_storeu_si128((__m128i*)(left + j), _mm_packus_epi16(_mm_srli_epi16(w0, 8), _mm_srli_epi16(w1, 8)));
+    }
+  greenTileRowScalar(raw0, raw1, g0, j, n, right, left);
+}
+
+// 16 output pixels per iteration
+__attribute__((target("sse2")))
+static void halveRowSSE2(const uint8_t* r0, const uint8_t* r1, int n, uint8_t* dst)
+{
+  const __m128i low = _mm_set1_epi16(0x00FF);
+  const __m128i two = _mm_set1_epi16(2);
+  int j = 0;
+  for(; j+16<=n; j+=16)
+    {
+      __m128i out[2];
+      for(int k=0; k<2; k++)
+	{
+	  __m128i a = _mm_loadu_si128((const __m128i*)(r0 + 2*j + 16*k));
+	  __m128i b = _mm_loadu_si128((const __m128i*)(r1 + 2*j + 16*k));
+	  __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8)),
+				      _mm_add_epi16(_mm_and_si128(b, low), _mm_srli_epi16(b, 8)));
+	  out[k] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+	}
+      _mm_storeu_si128((__m128i*)(dst + j), _mm_packus_epi16(out[0], out[1]));
+    }
+  halveRowScalar(r0, r1, j, n, dst);
+}
+
+#endif
+
+//=============================================================================
+// dispatch
+//=============================================================================
+
+typedef void (*PackRowFunction)(const uint8_t*, const uint8_t*, const uint8_t*, int, uint8_t*);
+
+static PackRowFunction selectPackRow(ConvertKernel kernel)
+{
+#ifdef CONVERT_X86
+  buildPackMasks();
+  if(kernel==KERNEL_SSSE3)
+    return packRowSSSE3;
+  else if(kernel==KERNEL_AVX2)
+    return packRowAVX2;
+#endif
+  return packRowScalar;
+}
+
+bool isKernelSupported(ConvertKernel kernel)
+{
+  switch(kernel)
+    {
+    case KERNEL_AUTO:
+    case KERNEL_SCALAR:
+      return true;
+#ifdef CONVERT_X86
+    case KERNEL_SSSE3:
+      return __builtin_cpu_supports("ssse3");
+    case KERNEL_AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+    }
+}
+
+ConvertKernel getBestKernel()
+{
+  static ConvertKernel best = KERNEL_AUTO;
+  if(best==KERNEL_AUTO)
+    {
+      if(isKernelSupported(KERNEL_AVX2))
+	best = KERNEL_AVX2;
+      else if(isKernelSupported(KERNEL_SSSE3))
+	best = KERNEL_SSSE3;
+      else
+	best = KERNEL_SCALAR;
+    }
+  return best;
+}
+
+int packPlanarRGB(const uint8_t* red, const uint8_t* green, const uint8_t* blue,
+		  int nrows, int ncols, int srcRowinc,
+		  uint8_t* dst, int dstRowinc,
+		  PixelOrder order, ConvertKernel kernel)
+{
+  if(kernel==KERNEL_AUTO)
+    kernel = getBestKernel();
+  if(!isKernelSupported(kernel))
+    {
+      fprintf( stderr, "packPlanarRGB: kernel %d not supported by this CPU\n", kernel );
+      return -1;
+    }
+
+  PackRowFunction packRow = selectPackRow(kernel);
+
+  // BGR is RGB with the outer planes swapped
+  if(order==PIXEL_ORDER_BGR)
+    {
+      const uint8_t* tmp = red;
+      red = blue;
+      blue = tmp;
+    }
+
+  for(int i=0; i<nrows; i++)
+    packRow(red + i*srcRowinc, green + i*srcRowinc, blue + i*srcRowinc, ncols, dst + i*dstRowinc);
+
+  return 0;
+}
+
+// colors of a Bayer tile by row and column parity: 0 red, 1 green, 2 blue
+static const int bayerColors[4][2][2] = {
+  { {0, 1}, {1, 2} },   // RGGB
+  { {1, 2}, {0, 1} },   // GBRG
+  { {1, 0}, {2, 1} },   // GRBG
+  { {2, 1}, {1, 0} },   // BGGR
+};
+
+// row r of an n row image, reflected at the borders
+static int reflectRow(int r, int n)
+{
+  return r<0 ? -r : (r>=n ? 2*n-2-r : r);
+}
+
+// De-interlaced rows of both cameras around an output row: row r is kept
+// in slot r%3, which never holds another one of rows i-1..i+1; each row
+// has a 16 byte margin
+typedef struct _DemosaicWindow
+{
+  // getDemosaicWindowSize() bytes, allocated here if the caller gave none
+  uint8_t* buffer;
+  bool allocated;
+  uint8_t* slots[2][3];
+  int slotRow[3];
+} DemosaicWindow;
+
+static void initDemosaicWindow(DemosaicWindow* window, int ncols, uint8_t* buffer)
+{
+  int stride = ncols + 32;
+  window->allocated = (buffer==NULL);
+  window->buffer = buffer!=NULL ? buffer : new uint8_t[getDemosaicWindowSize(ncols)];
+  for(int c=0; c<2; c++)
+    for(int s=0; s<3; s++)
+      window->slots[c][s] = window->buffer + (3*c + s) * stride + 16;
+  for(int s=0; s<3; s++)
+    window->slotRow[s] = -1;
+}
+
+static void freeDemosaicWindow(DemosaicWindow* window)
+{
+  if(window->allocated)
+    delete[] window->buffer;
+}
+
+// de-interlace the rows output row i needs, and describe them for camera c
+static void moveDemosaicWindow(DemosaicWindow* window, const uint8_t* raw, int nrows, int ncols,
+			       BayerTile tile, DemosaicMethod method, int i, bool simd,
+			       DemosaicRow row[2], int* xColor)
+{
+  int rows[3] = { reflectRow(i-1, nrows), i, reflectRow(i+1, nrows) };
+  for(int k=0; k<3; k++)
+    {
+      int r = rows[k];
+      int s = r % 3;
+      if(window->slotRow[s]==r)
+	continue;
+      const uint8_t* src = raw + 2 * r * ncols;
+#ifdef CONVERT_X86
+      if(simd)
+	deinterleaveRowSSE2(src, ncols, window->slots[0][s], window->slots[1][s]);
+      else
+#endif
+	deinterleaveRowScalar(src, 0, ncols, window->slots[0][s], window->slots[1][s]);
+      for(int c=0; c<2; c++)
+	{
+	  window->slots[c][s][-1] = window->slots[c][s][1];
+	  window->slots[c][s][ncols] = window->slots[c][s][ncols-2];
+	}
+      window->slotRow[s] = r;
+    }
+
+  // the non-green color of this row and the column parity it is at
+  const int* colors = bayerColors[tile][i & 1];
+  int q = (colors[0]==1) ? 1 : 0;
+  *xColor = colors[q];
+
+  for(int c=0; c<2; c++)
+    {
+      row[c].up = window->slots[c][rows[0] % 3];
+      row[c].cur = window->slots[c][rows[1] % 3];
+      row[c].down = window->slots[c][rows[2] % 3];
+      row[c].q = q;
+      row[c].method = method;
+    }
+}
+
+static bool checkDemosaicArgs(const char* name, int nrows, int ncols, ConvertKernel* kernel)
+{
+  if(*kernel==KERNEL_AUTO)
+    *kernel = getBestKernel();
+  if(!isKernelSupported(*kernel))
+    {
+      fprintf( stderr, "%s: kernel %d not supported by this CPU\n", name, *kernel );
+      return false;
+    }
+  if(nrows<2 || ncols<2)
+    {
+      fprintf( stderr, "%s: %d x %d image too small\n", name, ncols, nrows );
+      return false;
+    }
+  return true;
+}
+
+int demosaicStereo(const uint8_t* raw, int nrows, int ncols,
+		   BayerTile tile, DemosaicMethod method,
+		   uint8_t* planar, uint8_t* packed,
+		   ConvertKernel kernel, uint8_t* windowBuffer)
+{
+  if(!checkDemosaicArgs("demosaicStereo", nrows, ncols, &kernel))
+    return -1;
+  PackRowFunction packRow = selectPackRow(kernel);
+  bool simd = (kernel!=KERNEL_SCALAR);
+
+  DemosaicWindow window;
+  initDemosaicWindow(&window, ncols, windowBuffer);
+
+  int n = nrows * ncols;
+  for(int i=0; i<nrows; i++)
+    {
+      DemosaicRow row[2];
+      int xColor;
+      moveDemosaicWindow(&window, raw, nrows, ncols, tile, method, i, simd, row, &xColor);
+      int yColor = 2 - xColor;
+
+      for(int c=0; c<2; c++)
+	{
+	  uint8_t* plane[3];
+	  for(int k=0; k<3; k++)
+	    plane[k] = planar + (2*k + c) * n + i * ncols;
+#ifdef CONVERT_X86
+	  if(simd)
+	    demosaicRowSSE2(&row[c], ncols, plane[xColor], plane[1], plane[yColor]);
+	  else
+#endif
+	    demosaicRowScalar(&row[c], 0, ncols, plane[xColor], plane[1], plane[yColor]);
+
+	  // pack while the planes of the row are in cache
+	  if(packed!=NULL)
+	    packRow(plane[0], plane[1], plane[2], ncols, packed + 3 * (c * n + i * ncols));
+	}
+    }
+
+  freeDemosaicWindow(&window);
+  return 0;
+}
+
+int extractStereoGreen(const uint8_t* raw, int nrows, int ncols,
+		       BayerTile tile, int scale, uint8_t* green,
+		       ConvertKernel kernel, uint8_t* windowBuffer)
+{
+  if(!checkDemosaicArgs("extractStereoGreen", nrows, ncols, &kernel))
+    return -1;
+  bool simd = (kernel!=KERNEL_SCALAR);
+  scale = getGreenScale(scale);
+
+  // full size: bilinear green
+  if(scale==1)
+    {
+      DemosaicWindow window;
+      initDemosaicWindow(&window, ncols, windowBuffer);
+      for(int i=0; i<nrows; i++)
+	{
+	  DemosaicRow row[2];
+	  int xColor;
+	  moveDemosaicWindow(&window, raw, nrows, ncols, tile, DEMOSAIC_BILINEAR, i, simd, row, &xColor);
+	  for(int c=0; c<2; c++)
+	    {
+	      uint8_t* g = green + c * nrows * ncols + i * ncols;
+#ifdef CONVERT_X86
+	      if(simd)
+		greenRowSSE2(&row[c], ncols, g);
+	      else
+#endif
+		greenRowScalar(&row[c], 0, ncols, g);
+	    }
+	}
+      freeDemosaicWindow(&window);
+      return 0;
+    }
+
+  // the green pixels of each 2x2 tile, or each scale x scale block
+  int outRows = nrows / scale;
+  int outCols = ncols / scale;
+  int n = outRows * outCols;
+  int g0 = (bayerColors[tile][0][0]==1) ? 0 : 1;
+  for(int i=0; i<outRows; i++)
+    {
+      uint8_t* right = green + i * outCols;
+      uint8_t* left = green + n + i * outCols;
+      if(scale==2)
+	{
+	  const uint8_t* raw0 = raw + 2 * (2*i) * ncols;
+	  const uint8_t* raw1 = raw0 + 2 * ncols;
+#ifdef CONVERT_X86
+	  if(simd)
+	    greenTileRowSSE2(raw0, raw1, g0, outCols, right, left);
+	  else
+#endif
+	    greenTileRowScalar(raw0, raw1, g0, 0, outCols, right, left);
+	}
+      else
+	greenBlockRowScalar(raw + 2 * (scale*i) * ncols, ncols, g0, scale, outCols, right, left);
+    }
+  return 0;
+}
+
+void downscalePlane(const uint8_t* src, int nrows, int ncols, int srcRowinc, int pixelStride,
+		    int scale, uint8_t* dst, int dstRowinc)
+{
+  int outRows = nrows / scale;
+  int outCols = ncols / scale;
+  int count = scale * scale;
+  for(int i=0; i<outRows; i++)
+    for(int j=0; j<outCols; j++)
+      {
+	int sum = 0;
+	for(int a=0; a<scale; a++)
+	  {
+	    const uint8_t* p = src + (scale*i + a) * srcRowinc + scale * j * pixelStride;
+	    for(int b=0; b<scale; b++)
+	      sum += p[b * pixelStride];
+	  }
+	dst[i * dstRowinc + j] = (sum + count/2) / count;
+      }
+}
+
+int buildPyramid(const uint8_t* src, int nrows, int ncols, int srcRowinc,
+		 int nLevels, uint8_t* const* levels,
+		 ConvertKernel kernel)
+{
+  if(kernel==KERNEL_AUTO)
+    kernel = getBestKernel();
+  if(!isKernelSupported(kernel))
+    {
+      fprintf( stderr, "buildPyramid: kernel %d not supported by this CPU\n", kernel );
+      return -1;
+    }
+  if(nLevels<1 || nLevels>PYRAMID_MAX_LEVELS || (nrows>>(nLevels-1))<1 || (ncols>>(nLevels-1))<1)
+    {
+      fprintf( stderr, "buildPyramid: %d levels of a %d x %d image\n", nLevels, ncols, nrows );
+      return -1;
+    }
+  bool simd = (kernel!=KERNEL_SCALAR);
+
+  // source row i completes row i>>1 of level 1 when it is odd, which
+  // completes row i>>2 of level 2 when that is odd, and so on
+  for(int i=0; i<nrows; i++)
+    {
+      int r = i;
+      for(int l=1; l<nLevels && (r & 1); l++)
+	{
+	  r >>= 1;
+	  if(r>=(nrows >> l))
+	    break;
+	  // rows 2r and 2r+1 of level l-1 (the source for level 1)
+	  int rowinc = (l==1) ? srcRowinc : (ncols >> (l-1));
+	  const uint8_t* r0 = (l==1 ? src : levels[l-2]) + 2*r * rowinc;
+	  const uint8_t* r1 = r0 + rowinc;
+	  uint8_t* dst = levels[l-1] + r * (ncols >> l);
+#ifdef CONVERT_X86
+	  if(simd)
+	    halveRowSSE2(r0, r1, ncols >> l, dst);
+	  else
+#endif
+	    halveRowScalar(r0, r1, 0, ncols >> l, dst);
+	}
+    }
+
+  return 0;
+}
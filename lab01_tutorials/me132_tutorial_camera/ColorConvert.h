@@ -0,0 +1,122 @@
+/*
+ * Color conversion kernels for the Bumblebee2 driver. Triclops hands
+ * out color images as separate red/green/blue planes while OpenCV and
+ * most consumers want packed pixels; these kernels do the conversion
+ * with SSSE3/AVX2 where the CPU has it and a scalar loop otherwise.
+ *
+ * demosaicStereo() turns the raw frame of the camera into those planes
+ * in the first place, fusing de-interlacing and Bayer demosaicing.
+ */
+
+#ifndef _COLOR_CONVERT_HH_
+#define _COLOR_CONVERT_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// byte order of packed pixels
+enum PixelOrder{
+  PIXEL_ORDER_RGB = 0,
+  PIXEL_ORDER_BGR,        // as used by OpenCV's IplImage
+};
+
+// implementation of a kernel; AUTO picks the best the CPU supports
+enum ConvertKernel{
+  KERNEL_AUTO = 0,
+  KERNEL_SCALAR,
+  KERNEL_SSSE3,
+  KERNEL_AVX2,
+};
+
+// Pack nrows x ncols pixels from three planes (srcRowinc bytes per
+// row) into dst (dstRowinc bytes per row, >= 3*ncols). Returns -1 if
+// the requested kernel is not supported by this CPU.
+int packPlanarRGB(const uint8_t* red, const uint8_t* green, const uint8_t* blue,
+		  int nrows, int ncols, int srcRowinc,
+		  uint8_t* dst, int dstRowinc,
+		  PixelOrder order=PIXEL_ORDER_RGB,
+		  ConvertKernel kernel=KERNEL_AUTO);
+
+// color filter of the top left 2x2 pixels of a raw image
+enum BayerTile{
+  BAYER_TILE_RGGB = 0,
+  BAYER_TILE_GBRG,
+  BAYER_TILE_GRBG,
+  BAYER_TILE_BGGR,
+};
+
+// demosaicing methods of demosaicStereo()
+enum DemosaicMethod{
+  DEMOSAIC_NEAREST = 0,   // copy each color from the 2x2 block right and below
+  DEMOSAIC_BILINEAR,      // average the nearest pixels of each color
+  DEMOSAIC_EDGESENSE,     // bilinear, with green interpolated along edges
+};
+
+// De-interlace a raw nrows x ncols Bumblebee2 stereo frame (16 bit
+// pixels, the right image in the first byte and the left one in the
+// second) and demosaic both images, in one pass over rows of the frame.
+// planar receives the layout of dc1394_deinterlace_rgb(): right red,
+// left red, right green, left green, right blue and left blue planes of
+// nrows x ncols; packed, unless NULL, the right then the left image
+// with 3 byte RGB pixels. KERNEL_SCALAR runs the plain C version, the
+// other kernels SSE2 (and their own packing).
+// NEAREST and BILINEAR match dc1394_bayer_decoding_8bit() of each image
+// inside a one pixel border, which dc1394 blacks out and demosaicStereo()
+// reflects; BILINEAR rounds the means of four pixels in two steps, so
+// those can be one higher. EDGESENSE is not dc1394's method of that name.
+// window is scratch space of getDemosaicWindowSize(ncols) bytes for the
+// de-interlaced rows; callers that run on every frame keep one, NULL
+// allocates one for the call.
+int demosaicStereo(const uint8_t* raw, int nrows, int ncols,
+		   BayerTile tile, DemosaicMethod method,
+		   uint8_t* planar, uint8_t* packed=NULL,
+		   ConvertKernel kernel=KERNEL_AUTO, uint8_t* window=NULL);
+
+// bytes of the window of demosaicStereo() and extractStereoGreen() for
+// frames ncols pixels wide
+inline size_t getDemosaicWindowSize(int ncols)
+{
+  return 6 * ((size_t)ncols + 32);
+}
+
+// the factor extractStereoGreen() reduces images by for a requested
+// scale: even scales as requested, full size otherwise
+inline int getGreenScale(int scale)
+{
+  return (scale>=2 && scale%2==0) ? scale : 1;
+}
+
+// Only the green planes of a raw stereo frame (as in demosaicStereo()),
+// reduced by getGreenScale(scale): the rounded mean of the green pixels
+// of each 2x2 tile (or scale x scale block), or at full size the
+// bilinear green. green receives the right then the left plane, of
+// nrows/s x ncols/s pixels each; window is as for demosaicStereo() (only
+// used at full size).
+int extractStereoGreen(const uint8_t* raw, int nrows, int ncols,
+		       BayerTile tile, int scale, uint8_t* green,
+		       ConvertKernel kernel=KERNEL_AUTO, uint8_t* window=NULL);
+
+// the rounded mean of each scale x scale block of a plane, whose pixels
+// are pixelStride bytes apart (e.g. 3 for a channel of packed RGB)
+void downscalePlane(const uint8_t* src, int nrows, int ncols, int srcRowinc, int pixelStride,
+		    int scale, uint8_t* dst, int dstRowinc);
+
+// most levels of buildPyramid(), the image included
+#define PYRAMID_MAX_LEVELS 5
+
+// Halve a plane nLevels-1 times in one pass over its rows: level l
+// (1..nLevels-1) holds the rounded mean of the 2x2 blocks of level l-1,
+// nrows>>l x ncols>>l packed pixels in levels[l-1]. Each row of a level
+// is made as soon as the two rows above it are, while they are in cache.
+// KERNEL_SCALAR runs the plain C version, the other kernels SSE2.
+int buildPyramid(const uint8_t* src, int nrows, int ncols, int srcRowinc,
+		 int nLevels, uint8_t* const* levels,
+		 ConvertKernel kernel=KERNEL_AUTO);
+
+// true if the given kernel can run on this CPU
+bool isKernelSupported(ConvertKernel kernel);
+
+// the kernel KERNEL_AUTO resolves to
+ConvertKernel getBestKernel();
+
+#endif
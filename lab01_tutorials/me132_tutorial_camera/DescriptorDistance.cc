@@ -0,0 +1,165 @@
+/*
+ * Distance kernels for byte descriptors, compiled with per-function
+ * target attributes like the color conversion kernels.
+ */
+
+#include <stdio.h>
+
+#include "DescriptorDistance.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DESCRIPTOR_X86 1
+#include <immintrin.h>
+#endif
+
+void quantizeDescriptors(const float* src, int n, uint8_t* dst)
+{
+  for(int i=0; i<n * DESCRIPTOR_BYTES; i++)
+    {
+      float v = src[i] + 0.5f;
+      dst[i] = v<0 ? 0 : v>=255 ? 255 : (uint8_t)v;
+    }
+}
+
+//=============================================================================
+// scalar
+//=============================================================================
+
+static uint32_t distSqScalar(const uint8_t* a, const uint8_t* b)
+{
+  uint32_t sum = 0;
+  for(int i=0; i<DESCRIPTOR_BYTES; i++)
+    {
+      int d = a[i] - b[i];
+      sum += d*d;
+    }
+  return sum;
+}
+
+static uint32_t sadScalar(const uint8_t* a, const uint8_t* b)
+{
+  uint32_t sum = 0;
+  for(int i=0; i<DESCRIPTOR_BYTES; i++)
+    {
+      int d = a[i] - b[i];
+      sum += d<0 ? -d : d;
+    }
+  return sum;
+}
+
+#ifdef DESCRIPTOR_X86
+
+//=============================================================================
+// SSE2: absolute differences of 16 bytes, squared and summed in pairs
+// by pmaddwd
+//=============================================================================
+
+__attribute__((target("sse2")))
+static uint32_t distSqSSE2(const uint8_t* a, const uint8_t* b)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  for(int i=0; i<DESCRIPTOR_BYTES; i+=16)
+    {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+      __m128i lo = _mm_unpacklo_epi8(d, zero);
+      __m128i hi = _mm_unpackhi_epi8(d, zero);
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("sse2")))
+static uint32_t sadSSE2(const uint8_t* a, const uint8_t* b)
+{
+  __m128i acc = _mm_setzero_si128();
+  for(int i=0; i<DESCRIPTOR_BYTES; i+=16)
+    {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+  acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+  return (uint32_t)_mm_cvtsi128_si32(acc);
+}
+
+//=============================================================================
+// AVX2: the same on 32 bytes at a time
+//=============================================================================
+
+__attribute__((target("avx2")))
+static uint32_t distSqAVX2(const uint8_t* a, const uint8_t* b)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  for(int i=0; i<DESCRIPTOR_BYTES; i+=32)
+    {
+      __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+      __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+      __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+      __m256i lo = _mm256_unpacklo_epi8(d, zero);
+      __m256i hi = _mm256_unpackhi_epi8(d, zero);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+    }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static uint32_t sadAVX2(const uint8_t* a, const uint8_t* b)
+{
+  __m256i acc = _mm256_setzero_si256();
+  for(int i=0; i<DESCRIPTOR_BYTES; i+=32)
+    {
+      __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+      __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+      acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+    }
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+  return (uint32_t)_mm_cvtsi128_si32(s);
+}
+
+#endif
+
+//=============================================================================
+// dispatch
+//=============================================================================
+
+DescriptorDistance getDescriptorDistSq(ConvertKernel kernel)
+{
+  if(kernel==KERNEL_AUTO)
+    kernel = getBestKernel();
+  if(!isKernelSupported(kernel))
+    return NULL;
+#ifdef DESCRIPTOR_X86
+  if(kernel==KERNEL_SSSE3)
+    return distSqSSE2;
+  else if(kernel==KERNEL_AVX2)
+    return distSqAVX2;
+#endif
+  return distSqScalar;
+}
+
+DescriptorDistance getDescriptorSAD(ConvertKernel kernel)
+{
+  if(kernel==KERNEL_AUTO)
+    kernel = getBestKernel();
+  if(!isKernelSupported(kernel))
+    return NULL;
+#ifdef DESCRIPTOR_X86
+  if(kernel==KERNEL_SSSE3)
+    return sadSSE2;
+  else if(kernel==KERNEL_AVX2)
+    return sadAVX2;
+#endif
+  return sadScalar;
+}
@@ -0,0 +1,33 @@
+/*
+ * Distance kernels for SIFT descriptors stored as 128 bytes. libfeat
+ * makes descriptors of whole numbers from 0 to 255 (held in doubles), so
+ * bytes keep them exactly at an eighth of the size, and the distances
+ * are integer arithmetic that vectorizes: SSE2 or AVX2 where the CPU has
+ * it and a scalar loop otherwise, picked at run time as for the color
+ * conversion kernels (see ColorConvert.h).
+ */
+
+#ifndef _DESCRIPTOR_DISTANCE_HH_
+#define _DESCRIPTOR_DISTANCE_HH_
+
+#include <stdint.h>
+
+#include "ColorConvert.h"
+
+// bytes of a descriptor
+#define DESCRIPTOR_BYTES 128
+
+// Round n descriptors of DESCRIPTOR_BYTES floats to bytes, clamped to
+// 0..255
+void quantizeDescriptors(const float* src, int n, uint8_t* dst);
+
+// a distance of two descriptors
+typedef uint32_t (*DescriptorDistance)(const uint8_t* a, const uint8_t* b);
+
+// The squared euclidean distance (as descr_dist_sq()) and the sum of
+// absolute differences, with the given kernel (KERNEL_SSSE3 runs SSE2);
+// NULL if the kernel is not supported by this CPU
+DescriptorDistance getDescriptorDistSq(ConvertKernel kernel=KERNEL_AUTO);
+DescriptorDistance getDescriptorSAD(ConvertKernel kernel=KERNEL_AUTO);
+
+#endif
@@ -0,0 +1,950 @@
+/*
+ * Persistent SIFT feature database of many reference images with a
+ * forest of flattened kd-trees over byte (or float) descriptors, read
+ * back through mmap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FeatureDB.h"
+
+// round up to the section alignment
+#define FEATURE_DB_ROUND(n) (((n) + FEATURE_DB_ALIGN - 1) & ~((uint64_t)FEATURE_DB_ALIGN - 1))
+
+// branches a search queue holds at first
+#define FEATURE_SEARCH_QUEUE 256
+
+// features sampled to find the variance of a node in each dimension
+#define FEATURE_DB_SAMPLES 128
+
+// features a builder holds at first
+#define FEATURE_DB_CAPACITY 4096
+
+void getFeatureDescriptor(const struct feature* f, float* descr)
+{
+  // libfeat descriptors are whole numbers up to 255, so floats hold them
+  // exactly
+  for(int i=0; i<FEATURE_DB_DIMS; i++)
+    descr[i] = i<f->d ? (float)f->descr[i] : 0.0f;
+}
+
+static inline float distSq(const float* a, const float* b)
+{
+  float sum = 0;
+  for(int i=0; i<FEATURE_DB_DIMS; i++)
+    {
+      float d = a[i] - b[i];
+      sum += d*d;
+    }
+  return sum;
+}
+
+
+// -------------------------------
+// building
+// -------------------------------
+
+// a kd-tree under construction over the features order[]
+typedef struct _TreeBuilder
+{
+  const float* descr;
+  int* order;
+  FeatureDBNode* nodes;
+  int numNodes;
+
+  // randomized: split in one of the dimensions of largest variance
+  bool randomized;
+  unsigned int seed;
+} TreeBuilder;
+
+// The dimension to split the features order[first..first+count) in, from
+// the variances of a sample of them; its variance goes to variance
+static int splitDimension(TreeBuilder* b, int first, int count, double* variance)
+{
+  double var[FEATURE_DB_DIMS];
+  int step = count > FEATURE_DB_SAMPLES ? count / FEATURE_DB_SAMPLES : 1;
+  int samples = 0;
+  double sum[FEATURE_DB_DIMS], sumSq[FEATURE_DB_DIMS];
+  memset(sum, 0, sizeof(sum));
+  memset(sumSq, 0, sizeof(sumSq));
+  for(int i=first; i<first+count; i+=step)
+    {
+      const float* v = b->descr + (size_t)b->order[i] * FEATURE_DB_DIMS;
+      for(int d=0; d<FEATURE_DB_DIMS; d++)
+	{
+	  sum[d] += v[d];
+	  sumSq[d] += (double)v[d] * v[d];
+	}
+      samples++;
+    }
+  for(int d=0; d<FEATURE_DB_DIMS; d++)
+    var[d] = sumSq[d] / samples - (sum[d] / samples) * (sum[d] / samples);
+
+  // the widest few dimensions, widest first
+  int top[FEATURE_DB_RANDOM_DIMS];
+  int numTop = 0;
+  for(int d=0; d<FEATURE_DB_DIMS; d++)
+    {
+      if(numTop==FEATURE_DB_RANDOM_DIMS && var[d] <= var[top[numTop-1]])
+	continue;
+      int j = numTop<FEATURE_DB_RANDOM_DIMS ? numTop++ : numTop-1;
+      while(j > 0 && var[top[j-1]] < var[d])
+	{
+	  top[j] = top[j-1];
+	  j--;
+	}
+      top[j] = d;
+    }
+
+  // only dimensions that vary; no split if none does
+  int pick = b->randomized ? rand_r(&b->seed) % numTop : 0;
+  while(pick > 0 && var[top[pick]] <= 0)
+    pick--;
+  *variance = var[top[pick]];
+  return top[pick];
+}
+
+// Partition order[first..end) in dimension d so that order[k] holds the
+// k-th smallest value, smaller or equal ones before it and larger or
+// equal ones after it (quickselect)
+static void selectFeature(const TreeBuilder* b, int first, int end, int k, int d)
+{
+  int* order = b->order;
+  int lo = first, hi = end - 1;
+  while(lo < hi)
+    {
+      float pivot = b->descr[(size_t)order[(lo + hi) / 2] * FEATURE_DB_DIMS + d];
+      int i = lo, j = hi;
+      while(i <= j)
+	{
+	  while(b->descr[(size_t)order[i] * FEATURE_DB_DIMS + d] < pivot)
+	    i++;
+	  while(b->descr[(size_t)order[j] * FEATURE_DB_DIMS + d] > pivot)
+	    j--;
+	  if(i <= j)
+	    {
+	      int t = order[i];
+	      order[i] = order[j];
+	      order[j] = t;
+	      i++;
+	      j--;
+	    }
+	}
+      if(k <= j)
+	hi = j;
+      else if(k >= i)
+	lo = i;
+      else
+	break;
+    }
+}
+
+// build the subtree over order[first..first+count); returns its node
+static int buildNode(TreeBuilder* b, int first, int count)
+{
+  int k = b->numNodes++;
+  FeatureDBNode* node = &b->nodes[k];
+  node->first = first;
+  node->count = count;
+  node->left = node->right = -1;
+  node->dim = -1;
+  node->split = 0;
+
+  double variance = 0;
+  int d = count > FEATURE_DB_LEAF_SIZE ? splitDimension(b, first, count, &variance) : 0;
+  if(count <= FEATURE_DB_LEAF_SIZE || variance <= 0)
+    return k;
+
+  // split at the median; the left half is below or at it
+  int mid = first + count / 2;
+  selectFeature(b, first, first + count, mid, d);
+  node->dim = d;
+  node->split = b->descr[(size_t)b->order[mid] * FEATURE_DB_DIMS + d];
+  node->left = buildNode(b, first, mid - first);
+  node->right = buildNode(b, mid, first + count - mid);
+  return k;
+}
+
+// write bytes at offset, padding from pos (the end of the last write)
+static int writeAt(FILE* f, uint64_t* pos, uint64_t offset, const void* p, uint64_t bytes)
+{
+  static const uint8_t zeros[FEATURE_DB_ALIGN] = { 0 };
+  uint64_t padding = offset - *pos;
+  if((padding>0 && fwrite(zeros, 1, padding, f)!=padding) ||
+     (bytes>0 && fwrite(p, bytes, 1, f)!=1))
+    return -1;
+  *pos = offset + bytes;
+  return 0;
+}
+
+FeatureDBBuilder::FeatureDBBuilder()
+{
+  keypoints = NULL;
+  descriptors = NULL;
+  imageIds = NULL;
+  numFeatures = 0;
+  capacity = 0;
+  images = NULL;
+  numImages = 0;
+  sourceHash = 0;
+}
+
+FeatureDBBuilder::~FeatureDBBuilder()
+{
+  free(keypoints);
+  free(descriptors);
+  free(imageIds);
+  free(images);
+}
+
+// make room for n more features
+void FeatureDBBuilder::reserve(int n)
+{
+  if(numFeatures + n <= capacity)
+    return;
+  int grown = capacity>0 ? capacity : FEATURE_DB_CAPACITY;
+  while(grown < numFeatures + n)
+    grown *= 2;
+  keypoints = (FeatureKeypoint*)realloc(keypoints, grown * sizeof(FeatureKeypoint));
+  descriptors = (float*)realloc(descriptors, (size_t)grown * FEATURE_DB_DIMS * sizeof(float));
+  imageIds = (int32_t*)realloc(imageIds, grown * sizeof(int32_t));
+  capacity = grown;
+}
+
+// add the image of the last n features
+int FeatureDBBuilder::addImageEntry(const char* name, int n, int width, int height)
+{
+  for(int i=numFeatures-n; i<numFeatures; i++)
+    imageIds[i] = numImages;
+
+  images = (FeatureDBImage*)realloc(images, (numImages + 1) * sizeof(FeatureDBImage));
+  FeatureDBImage* image = &images[numImages];
+  memset(image, 0, sizeof(FeatureDBImage));
+  image->width = width;
+  image->height = height;
+  image->numFeatures = n;
+  if(name!=NULL)
+    {
+      // the file name is enough to tell images apart
+      const char* base = strrchr(name, '/');
+      strncpy(image->name, base!=NULL ? base+1 : name, FEATURE_DB_NAME-1);
+    }
+  return numImages++;
+}
+
+int FeatureDBBuilder::addImage(const char* name, const FeatureKeypoint* kps, const float* descr, int n,
+			       int width, int height)
+{
+  if(n<0)
+    return -1;
+  this->reserve(n);
+  memcpy(keypoints + numFeatures, kps, n * sizeof(FeatureKeypoint));
+  memcpy(descriptors + (size_t)numFeatures * FEATURE_DB_DIMS, descr, (size_t)n * FEATURE_DB_DIMS * sizeof(float));
+  numFeatures += n;
+  return this->addImageEntry(name, n, width, height);
+}
+
+int FeatureDBBuilder::addImage(const char* name, const struct feature* features, int n,
+			       int width, int height)
+{
+  if(n<0)
+    return -1;
+  this->reserve(n);
+  for(int i=0; i<n; i++)
+    {
+      FeatureKeypoint* kp = &keypoints[numFeatures];
+      kp->x = (float)features[i].img_pt.x;
+      kp->y = (float)features[i].img_pt.y;
+      kp->scale = (float)features[i].scl;
+      kp->orientation = (float)features[i].ori;
+      getFeatureDescriptor(&features[i], descriptors + (size_t)numFeatures * FEATURE_DB_DIMS);
+      numFeatures++;
+    }
+  return this->addImageEntry(name, n, width, height);
+}
+
+int FeatureDBBuilder::getFeatureCount()
+{
+  return numFeatures;
+}
+
+int FeatureDBBuilder::getImageCount()
+{
+  return numImages;
+}
+
+void FeatureDBBuilder::setSourceHash(uint32_t hash)
+{
+  sourceHash = hash;
+}
+
+int FeatureDBBuilder::write(const char* fname, int numTrees, FeatureDescriptorType type)
+{
+  int n = numFeatures;
+  if(numTrees<1 || numTrees>FEATURE_DB_MAX_TREES)
+    {
+      fprintf( stderr, "Invalid number of kd-trees %d\n", numTrees );
+      return -1;
+    }
+  if(type!=DESCRIPTOR_FLOAT && type!=DESCRIPTOR_UINT8)
+    {
+      fprintf( stderr, "Invalid descriptor type %d\n", type );
+      return -1;
+    }
+  uint64_t descrBytes = type==DESCRIPTOR_UINT8 ? DESCRIPTOR_BYTES : FEATURE_DB_DIMS * sizeof(float);
+
+  // leaves hold at least one feature, so a tree has fewer than 2n nodes;
+  // the first tree is the order the features are stored in
+  int** orders = new int*[numTrees];
+  FeatureDBNode* nodes = new FeatureDBNode[(size_t)numTrees * (n>0 ? 2*n : 1)];
+  FeatureDBTree trees[FEATURE_DB_MAX_TREES];
+  TreeBuilder b;
+  b.descr = descriptors;
+  b.nodes = nodes;
+  b.numNodes = 0;
+  for(int t=0; t<numTrees; t++)
+    {
+      orders[t] = new int[n>0 ? n : 1];
+      for(int i=0; i<n; i++)
+	orders[t][i] = i;
+      b.order = orders[t];
+      b.randomized = t>0;
+      b.seed = t;
+      memset(&trees[t], 0, sizeof(FeatureDBTree));
+      trees[t].root = n>0 ? buildNode(&b, 0, n) : -1;
+    }
+
+  // the other trees list the features by where they are stored
+  int* stored = new int[n>0 ? n : 1];
+  for(int i=0; i<n; i++)
+    stored[orders[0][i]] = i;
+  for(int t=1; t<numTrees; t++)
+    for(int i=0; i<n; i++)
+      orders[t][i] = stored[orders[t][i]];
+
+  FeatureDBHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = FEATURE_DB_MAGIC;
+  header.version = FEATURE_DB_VERSION;
+  header.numFeatures = n;
+  header.dims = FEATURE_DB_DIMS;
+  header.numNodes = b.numNodes;
+  header.imageWidth = numImages>0 ? images[0].width : 0;
+  header.imageHeight = numImages>0 ? images[0].height : 0;
+  header.descriptorType = type;
+  header.sourceHash = sourceHash;
+  header.numImages = numImages;
+  header.numTrees = numTrees;
+  uint64_t off = FEATURE_DB_ROUND(sizeof(FeatureDBHeader));
+  header.keypointOffset = off;
+  off = FEATURE_DB_ROUND(off + (uint64_t)n * sizeof(FeatureKeypoint));
+  header.descriptorOffset = off;
+  off = FEATURE_DB_ROUND(off + (uint64_t)n * descrBytes);
+  header.nodeOffset = off;
+  off = FEATURE_DB_ROUND(off + (uint64_t)b.numNodes * sizeof(FeatureDBNode));
+  header.imageOffset = off;
+  off = FEATURE_DB_ROUND(off + (uint64_t)numImages * sizeof(FeatureDBImage));
+  header.imageIdOffset = off;
+  off = FEATURE_DB_ROUND(off + (uint64_t)n * sizeof(int32_t));
+  header.treeOffset = off;
+  off = FEATURE_DB_ROUND(off + (uint64_t)numTrees * sizeof(FeatureDBTree));
+  for(int t=1; t<numTrees; t++)
+    {
+      trees[t].indexOffset = off;
+      off = FEATURE_DB_ROUND(off + (uint64_t)n * sizeof(int32_t));
+    }
+
+  // write a new file and rename it over the old one, so processes that
+  // have the old one mapped keep reading it
+  char tmpname[512];
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+  FILE* f = fopen(tmpname, "wb");
+  int ret = 0;
+  if(f==NULL)
+    {
+      fprintf( stderr, "Cannot create feature database %s: %s\n", tmpname, strerror(errno) );
+      ret = -1;
+    }
+  else
+    {
+      // the sections in order, the features in the order of the first tree
+      uint64_t pos = 0;
+      ret = writeAt(f, &pos, 0, &header, sizeof(header));
+      for(int i=0; i<n && ret==0; i++)
+	ret = writeAt(f, &pos, header.keypointOffset + (uint64_t)i * sizeof(FeatureKeypoint),
+		      &keypoints[orders[0][i]], sizeof(FeatureKeypoint));
+      uint8_t bytes[DESCRIPTOR_BYTES];
+      for(int i=0; i<n && ret==0; i++)
+	{
+	  const float* descr = descriptors + (size_t)orders[0][i] * FEATURE_DB_DIMS;
+	  if(type==DESCRIPTOR_UINT8)
+	    quantizeDescriptors(descr, 1, bytes);
+	  ret = writeAt(f, &pos, header.descriptorOffset + (uint64_t)i * descrBytes,
+			type==DESCRIPTOR_UINT8 ? (const void*)bytes : (const void*)descr, descrBytes);
+	}
+      if(ret==0)
+	ret = writeAt(f, &pos, header.nodeOffset, nodes, (uint64_t)b.numNodes * sizeof(FeatureDBNode));
+      if(ret==0)
+	ret = writeAt(f, &pos, header.imageOffset, images, (uint64_t)numImages * sizeof(FeatureDBImage));
+      for(int i=0; i<n && ret==0; i++)
+	ret = writeAt(f, &pos, header.imageIdOffset + (uint64_t)i * sizeof(int32_t),
+		      &imageIds[orders[0][i]], sizeof(int32_t));
+      if(ret==0)
+	ret = writeAt(f, &pos, header.treeOffset, trees, (uint64_t)numTrees * sizeof(FeatureDBTree));
+      for(int t=1; t<numTrees && ret==0; t++)
+	ret = writeAt(f, &pos, trees[t].indexOffset, orders[t], (uint64_t)n * sizeof(int32_t));
+
+      if(fclose(f)!=0)
+	ret = -1;
+      if(ret<0)
+	fprintf( stderr, "Cannot write feature database %s: %s\n", tmpname, strerror(errno) );
+      else if(rename(tmpname, fname)<0)
+	{
+	  fprintf( stderr, "Cannot rename %s to %s: %s\n", tmpname, fname, strerror(errno) );
+	  ret = -1;
+	}
+      if(ret<0)
+	unlink(tmpname);
+    }
+
+  for(int t=0; t<numTrees; t++)
+    delete[] orders[t];
+  delete[] orders;
+  delete[] stored;
+  delete[] nodes;
+  return ret;
+}
+
+int writeFeatureDB(const char* fname, const struct feature* features, int n,
+		   int imageWidth, int imageHeight, uint32_t sourceHash)
+{
+  FeatureDBBuilder builder;
+  if(builder.addImage(NULL, features, n, imageWidth, imageHeight)<0)
+    return -1;
+  builder.setSourceHash(sourceHash);
+  return builder.write(fname);
+}
+
+uint32_t hashFeatureSource(const char* fname)
+{
+  FILE* f = fopen(fname, "rb");
+  if(f==NULL)
+    return 0;
+  uint32_t hash = 2166136261u;
+  uint8_t buf[65536];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f))>0)
+    for(size_t i=0; i<n; i++)
+      hash = (hash ^ buf[i]) * 16777619u;
+  bool failed = ferror(f)!=0;
+  fclose(f);
+  if(failed)
+    return 0;
+  // 0 is "not known"
+  return hash!=0 ? hash : 1;
+}
+
+
+// -------------------------------
+// searching
+// -------------------------------
+
+FeatureSearch::FeatureSearch()
+{
+  queue = NULL;
+  capacity = 0;
+  seen = NULL;
+  numSeen = 0;
+  stamp = 0;
+  votes = NULL;
+  numVotes = 0;
+}
+
+FeatureSearch::~FeatureSearch()
+{
+  delete[] queue;
+  delete[] seen;
+  delete[] votes;
+}
+
+// make room for n branches
+void FeatureSearch::reserve(int n)
+{
+  if(n <= capacity)
+    return;
+  int grown = capacity>0 ? capacity : FEATURE_SEARCH_QUEUE;
+  while(grown < n)
+    grown *= 2;
+  FeatureBranch* q = new FeatureBranch[grown];
+  if(queue!=NULL)
+    memcpy(q, queue, capacity * sizeof(FeatureBranch));
+  delete[] queue;
+  queue = q;
+  capacity = grown;
+}
+
+// make room for the marks of n features
+void FeatureSearch::reserveFeatures(int n)
+{
+  if(n <= numSeen)
+    return;
+  delete[] seen;
+  seen = new uint32_t[n];
+  memset(seen, 0, n * sizeof(uint32_t));
+  numSeen = n;
+  stamp = 0;
+}
+
+// make room for the votes of m images
+void FeatureSearch::reserveImages(int m)
+{
+  if(m <= numVotes)
+    return;
+  delete[] votes;
+  votes = new int[m];
+  memset(votes, 0, m * sizeof(int));
+  numVotes = m;
+}
+
+FeatureDB::FeatureDB()
+{
+  fd = -1;
+  data = NULL;
+  size = 0;
+  header = NULL;
+  keypoints = NULL;
+  descriptors = NULL;
+  descriptorBytes = NULL;
+  distSqBytes = NULL;
+  nodes = NULL;
+  images = NULL;
+  imageIds = NULL;
+  trees = NULL;
+  numTrees = 0;
+}
+
+FeatureDB::~FeatureDB()
+{
+  this->close();
+}
+
+// true if the file starts with a database header (of the features of
+// the image file of that hash)
+bool FeatureDB::isDB(const char* fname, uint32_t sourceHash)
+{
+  FILE* f = fopen(fname, "rb");
+  if(f==NULL)
+    return false;
+  FeatureDBHeader h;
+  bool ret = fread(&h, sizeof(h), 1, f)==1 && h.magic==FEATURE_DB_MAGIC &&
+    (sourceHash==0 || h.sourceHash==sourceHash);
+  fclose(f);
+  return ret;
+}
+
+// map the database
+int FeatureDB::open(const char* fname)
+{
+  this->close();
+
+  fd = ::open(fname, O_RDONLY);
+  if(fd<0)
+    {
+      fprintf( stderr, "Cannot open feature database %s: %s\n", fname, strerror(errno) );
+      return -1;
+    }
+
+  struct stat st;
+  fstat(fd, &st);
+  size = st.st_size;
+  if(size < sizeof(FeatureDBHeader))
+    {
+      fprintf( stderr, "%s is not a feature database\n", fname );
+      this->close();
+      return -1;
+    }
+
+  data = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if(data==MAP_FAILED)
+    {
+      fprintf( stderr, "Cannot map feature database %s: %s\n", fname, strerror(errno) );
+      data = NULL;
+      this->close();
+      return -1;
+    }
+
+  header = (const FeatureDBHeader*)data;
+  if(header->magic!=FEATURE_DB_MAGIC || header->version<1 || header->version>FEATURE_DB_VERSION ||
+     header->dims!=FEATURE_DB_DIMS)
+    {
+      fprintf( stderr, "%s is not a version 1 to %d feature database\n", fname, FEATURE_DB_VERSION );
+      this->close();
+      return -1;
+    }
+
+  // byte descriptors from version 3; older databases have a 0 there
+  bool bytes = header->descriptorType==DESCRIPTOR_UINT8;
+  if(!bytes && header->descriptorType!=DESCRIPTOR_FLOAT)
+    {
+      fprintf( stderr, "Feature database %s has descriptors of unknown type %d\n", fname, header->descriptorType );
+      this->close();
+      return -1;
+    }
+  uint64_t descrBytes = bytes ? DESCRIPTOR_BYTES : FEATURE_DB_DIMS * sizeof(float);
+
+  // a version 1 database is one image with one tree
+  v1Tree.root = 0;
+  v1Tree.reserved = 0;
+  v1Tree.indexOffset = 0;
+  trees = &v1Tree;
+  numTrees = 1;
+  bool v2 = header->version>=2;
+  if(v2)
+    {
+      trees = (const FeatureDBTree*)(data + header->treeOffset);
+      numTrees = header->numTrees;
+    }
+
+  // the sections must be in the file
+  uint64_t n = header->numFeatures;
+  bool valid = header->numFeatures>=0 && header->numNodes>=0 && (n==0 || header->numNodes>0) &&
+    header->keypointOffset + n * sizeof(FeatureKeypoint) <= size &&
+    header->descriptorOffset + n * descrBytes <= size &&
+    header->nodeOffset + (uint64_t)header->numNodes * sizeof(FeatureDBNode) <= size;
+  if(valid && v2)
+    valid = header->numImages>=0 && numTrees>=1 && numTrees<=FEATURE_DB_MAX_TREES &&
+      header->imageOffset + (uint64_t)header->numImages * sizeof(FeatureDBImage) <= size &&
+      header->imageIdOffset + n * sizeof(int32_t) <= size &&
+      header->treeOffset + (uint64_t)numTrees * sizeof(FeatureDBTree) <= size;
+  for(int t=0; valid && t<numTrees; t++)
+    valid = trees[t].indexOffset + n * sizeof(int32_t) <= size;
+  if(!valid)
+    {
+      fprintf( stderr, "Feature database %s is truncated\n", fname );
+      this->close();
+      return -1;
+    }
+  keypoints = (const FeatureKeypoint*)(data + header->keypointOffset);
+  if(bytes)
+    {
+      descriptorBytes = data + header->descriptorOffset;
+      distSqBytes = getDescriptorDistSq();
+    }
+  else
+    descriptors = (const float*)(data + header->descriptorOffset);
+  nodes = (const FeatureDBNode*)(data + header->nodeOffset);
+  if(v2)
+    {
+      images = (const FeatureDBImage*)(data + header->imageOffset);
+      imageIds = (const int32_t*)(data + header->imageIdOffset);
+    }
+  for(int t=0; t<numTrees; t++)
+    treeIndex[t] = trees[t].indexOffset>0 ? (const int32_t*)(data + trees[t].indexOffset) : NULL;
+
+  // searches walk the whole tree
+  madvise(data, size, MADV_WILLNEED);
+  return 0;
+}
+
+int FeatureDB::getFeatureCount()
+{
+  return header!=NULL ? header->numFeatures : 0;
+}
+
+int FeatureDB::getImageCount()
+{
+  if(header==NULL)
+    return 0;
+  return images!=NULL ? header->numImages : 1;
+}
+
+int FeatureDB::getTreeCount()
+{
+  return header!=NULL ? numTrees : 0;
+}
+
+FeatureDescriptorType FeatureDB::getDescriptorType()
+{
+  return descriptorBytes!=NULL ? DESCRIPTOR_UINT8 : DESCRIPTOR_FLOAT;
+}
+
+int FeatureDB::getImageWidth()
+{
+  return header!=NULL ? header->imageWidth : 0;
+}
+
+int FeatureDB::getImageHeight()
+{
+  return header!=NULL ? header->imageHeight : 0;
+}
+
+uint32_t FeatureDB::getSourceHash()
+{
+  return header!=NULL ? header->sourceHash : 0;
+}
+
+const FeatureKeypoint* FeatureDB::getKeypoint(int k)
+{
+  return &keypoints[k];
+}
+
+void FeatureDB::getDescriptor(int k, float* descr)
+{
+  if(descriptorBytes!=NULL)
+    {
+      const uint8_t* v = descriptorBytes + (size_t)k * DESCRIPTOR_BYTES;
+      for(int i=0; i<FEATURE_DB_DIMS; i++)
+	descr[i] = v[i];
+    }
+  else
+    memcpy(descr, descriptors + (size_t)k * FEATURE_DB_DIMS, FEATURE_DB_DIMS * sizeof(float));
+}
+
+const uint8_t* FeatureDB::getDescriptorBytes(int k)
+{
+  return descriptorBytes!=NULL ? descriptorBytes + (size_t)k * DESCRIPTOR_BYTES : NULL;
+}
+
+int FeatureDB::getImageId(int k)
+{
+  return imageIds!=NULL ? imageIds[k] : 0;
+}
+
+const FeatureDBImage* FeatureDB::getImage(int k)
+{
+  return images!=NULL ? &images[k] : NULL;
+}
+
+// add a branch to the min-heap of a search
+static inline void pushBranch(FeatureBranch* queue, int* n, int tree, int node, float bound)
+{
+  int i = (*n)++;
+  while(i > 0)
+    {
+      int parent = (i - 1) / 2;
+      if(queue[parent].bound <= bound)
+	break;
+      queue[i] = queue[parent];
+      i = parent;
+    }
+  queue[i].tree = tree;
+  queue[i].node = node;
+  queue[i].bound = bound;
+}
+
+// take the closest branch off the min-heap
+static inline FeatureBranch popBranch(FeatureBranch* queue, int* n)
+{
+  FeatureBranch top = queue[0];
+  FeatureBranch last = queue[--(*n)];
+  int i = 0;
+  for(;;)
+    {
+      int c = 2*i + 1;
+      if(c >= *n)
+	break;
+      if(c+1 < *n && queue[c+1].bound < queue[c].bound)
+	c++;
+      if(last.bound <= queue[c].bound)
+	break;
+      queue[i] = queue[c];
+      i = c;
+    }
+  queue[i] = last;
+  return top;
+}
+
+// keep feature f among the k closest found, sorted
+static inline void keepNeighbor(FeatureNeighbor* nbrs, int* found, int k, int f, float dist)
+{
+  if(*found==k && dist >= nbrs[k-1].distSq)
+    return;
+  int j = *found<k ? (*found)++ : k-1;
+  while(j > 0 && nbrs[j-1].distSq > dist)
+    {
+      nbrs[j] = nbrs[j-1];
+      j--;
+    }
+  nbrs[j].index = f;
+  nbrs[j].distSq = dist;
+}
+
+// squared distance of the query to feature f
+inline float FeatureDB::distanceTo(const float* query, const uint8_t* queryBytes, int f)
+{
+  if(descriptorBytes!=NULL)
+    return (float)distSqBytes(queryBytes, descriptorBytes + (size_t)f * DESCRIPTOR_BYTES);
+  return distSq(query, descriptors + (size_t)f * FEATURE_DB_DIMS);
+}
+
+int FeatureDB::findNearestExact(const float* query, int k,
+				FeatureNeighbor* nbrs, FeatureSearch* search)
+{
+  if(header==NULL || header->numFeatures==0 || k<1)
+    return 0;
+  if(descriptorBytes!=NULL)
+    quantizeDescriptors(query, 1, search->queryBytes);
+
+  int found = 0;
+  for(int f=0; f<header->numFeatures; f++)
+    keepNeighbor(nbrs, &found, k, f, this->distanceTo(query, search->queryBytes, f));
+  return found;
+}
+
+int FeatureDB::findNearest(const float* query, int k, int maxChecks,
+			   FeatureNeighbor* nbrs, FeatureSearch* search)
+{
+  if(header==NULL || header->numFeatures==0 || k<1)
+    return 0;
+
+  // a scan of a small database costs no more than the trees and is exact
+  if(header->numFeatures <= FEATURE_DB_EXACT_FEATURES || header->numFeatures <= maxChecks)
+    return this->findNearestExact(query, k, nbrs, search);
+  if(descriptorBytes!=NULL)
+    quantizeDescriptors(query, 1, search->queryBytes);
+
+  // the trees of a forest share features; look at each only once
+  if(numTrees > 1)
+    {
+      search->reserveFeatures(header->numFeatures);
+      if(++search->stamp==0)
+	{
+	  memset(search->seen, 0, search->numSeen * sizeof(uint32_t));
+	  search->stamp = 1;
+	}
+    }
+
+  int found = 0;
+  int checks = 0;
+  int queued = 0;
+  search->reserve(FEATURE_SEARCH_QUEUE);
+  for(int t=0; t<numTrees; t++)
+    pushBranch(search->queue, &queued, t, trees[t].root, 0);
+  while(queued > 0 && checks < maxChecks)
+    {
+      FeatureBranch branch = popBranch(search->queue, &queued);
+
+      // nothing in the branch can be closer than the k found
+      if(found==k && branch.bound >= nbrs[k-1].distSq)
+	break;
+
+      // descend to the leaf on the side of the query, leaving the other
+      // sides for later
+      const FeatureDBNode* node = &nodes[branch.node];
+      while(node->dim >= 0)
+	{
+	  if(queued + 1 > search->capacity)
+	    search->reserve(queued + 1);
+	  float d = query[node->dim] - node->split;
+	  float bound = d*d > branch.bound ? d*d : branch.bound;
+	  if(d < 0)
+	    {
+	      pushBranch(search->queue, &queued, branch.tree, node->right, bound);
+	      node = &nodes[node->left];
+	    }
+	  else
+	    {
+	      pushBranch(search->queue, &queued, branch.tree, node->left, bound);
+	      node = &nodes[node->right];
+	    }
+	}
+
+      // keep the k closest, sorted
+      const int32_t* index = treeIndex[branch.tree];
+      for(int i=node->first; i<node->first+node->count; i++)
+	{
+	  int f = index!=NULL ? index[i] : i;
+	  if(numTrees > 1)
+	    {
+	      if(search->seen[f]==search->stamp)
+		continue;
+	      search->seen[f] = search->stamp;
+	    }
+	  keepNeighbor(nbrs, &found, k, f, this->distanceTo(query, search->queryBytes, f));
+	  checks++;
+	}
+    }
+
+  return found;
+}
+
+int FeatureDB::matchImages(const float* descr, int n, int maxChecks, float ratioSq,
+			   FeatureDBVote* votes, int maxVotes, FeatureSearch* search)
+{
+  int numImages = this->getImageCount();
+  if(numImages==0)
+    return 0;
+  search->reserveImages(numImages);
+  int* count = search->votes;
+
+  FeatureNeighbor nbrs[FEATURE_DB_VOTE_NN];
+  for(int q=0; q<n; q++)
+    {
+      int found = this->findNearest(descr + (size_t)q * FEATURE_DB_DIMS, FEATURE_DB_VOTE_NN,
+				    maxChecks, nbrs, search);
+      if(found==0)
+	continue;
+
+      // the nearest feature of another image must be well behind; if
+      // there is none among the neighbours, so much the better
+      int image = this->getImageId(nbrs[0].index);
+      int j = 1;
+      while(j < found && this->getImageId(nbrs[j].index)==image)
+	j++;
+      if(j==found || nbrs[0].distSq < nbrs[j].distSq * ratioSq)
+	count[image]++;
+    }
+
+  // the images with most votes, most first; the counts are cleared for
+  // the next frame
+  int numVotes = 0;
+  for(int i=0; i<numImages; i++)
+    {
+      if(count[i]==0)
+	continue;
+      if(numVotes==maxVotes && count[i] <= votes[maxVotes-1].votes)
+	{
+	  count[i] = 0;
+	  continue;
+	}
+      int j = numVotes<maxVotes ? numVotes++ : maxVotes-1;
+      while(j > 0 && votes[j-1].votes < count[i])
+	{
+	  votes[j] = votes[j-1];
+	  j--;
+	}
+      votes[j].image = i;
+      votes[j].votes = count[i];
+      count[i] = 0;
+    }
+  return numVotes;
+}
+
+void FeatureDB::close()
+{
+  if(data!=NULL)
+    munmap(data, size);
+  data = NULL;
+  size = 0;
+  header = NULL;
+  keypoints = NULL;
+  descriptors = NULL;
+  descriptorBytes = NULL;
+  distSqBytes = NULL;
+  nodes = NULL;
+  images = NULL;
+  imageIds = NULL;
+  trees = NULL;
+  numTrees = 0;
+
+  if(fd>=0)
+    ::close(fd);
+  fd = -1;
+}
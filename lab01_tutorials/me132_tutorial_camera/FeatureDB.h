@@ -0,0 +1,373 @@
+/*
+ * Persistent database of the SIFT features of reference images, built
+ * once offline and read back through mmap, so a matcher is ready as soon
+ * as the file is mapped and several processes share the same pages.
+ *
+ * A database file is a FeatureDBHeader followed by sections, each
+ * starting on a FEATURE_DB_ALIGN byte boundary: the keypoints (one
+ * FeatureKeypoint per feature), the descriptors (numFeatures x dims
+ * values, one contiguous array) and the nodes of the kd-trees over the
+ * descriptors. From version 2 a database holds the features of many
+ * images (a FeatureDBImage each, and the image of every feature) and one
+ * index over all of them: a forest of numTrees randomized kd-trees (a
+ * FeatureDBTree each). The features are stored in the order of the
+ * leaves of the first tree, so its leaves are contiguous ranges of
+ * descriptors; the leaves of the other trees are ranges of their own
+ * list of features. From version 3 the descriptors are bytes rather
+ * than floats: libfeat descriptors are whole numbers up to 255, so that
+ * loses nothing, takes a quarter of the pages (an eighth of the doubles
+ * of struct feature) and lets the distances run on the integer kernels
+ * of DescriptorDistance.h. Version 1 and 2 databases (float descriptors)
+ * are read as well.
+ *
+ * Searches are best bin first (BBF) like kdtree_bbf_knn() of libfeat,
+ * but on the flattened trees, all trees with one priority queue, and
+ * with the queue in a FeatureSearch the caller keeps between queries,
+ * so a search allocates nothing. Small databases are searched
+ * exhaustively instead, which is exact and, at that size, as fast.
+ * matchImages() turns the neighbours of
+ * the features of a frame into votes for the reference images.
+ */
+
+#ifndef _FEATURE_DB_HH_
+#define _FEATURE_DB_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sift/imgfeatures.h>
+
+#include "DescriptorDistance.h"
+
+// "FTDB" in little endian
+#define FEATURE_DB_MAGIC 0x42445446
+
+// database format version number; version 1 databases hold one image
+// and one tree, version 2 ones float descriptors, and both are read as
+// well
+#define FEATURE_DB_VERSION 0x03
+
+// alignment of the sections of a database [bytes]
+#define FEATURE_DB_ALIGN 64
+
+// dimension of the descriptors
+#define FEATURE_DB_DIMS FEATURE_MAX_D
+
+// most features in a leaf of the kd-tree
+#define FEATURE_DB_LEAF_SIZE 8
+
+// most trees of a forest
+#define FEATURE_DB_MAX_TREES 16
+
+// a randomized tree splits in one of this many dimensions of largest
+// variance, picked at random
+#define FEATURE_DB_RANDOM_DIMS 5
+
+// bytes of an image name, with the terminating 0
+#define FEATURE_DB_NAME 112
+
+// findNearest() compares the query with every feature of databases of
+// at most this many features
+#define FEATURE_DB_EXACT_FEATURES 2048
+
+// neighbours matchImages() looks at for the nearest feature of another
+// image
+#define FEATURE_DB_VOTE_NN 8
+
+// how a database stores its descriptors
+enum FeatureDescriptorType
+{
+  // floats, as version 1 and 2 databases do
+  DESCRIPTOR_FLOAT = 0,
+  // bytes, rounded and clamped to 0..255
+  DESCRIPTOR_UINT8
+};
+
+// file header
+typedef struct _FeatureDBHeader
+{
+  uint32_t magic;
+  uint32_t version;
+
+  int32_t numFeatures;
+  int32_t dims;
+  int32_t numNodes;
+
+  // size of the (first) image the features were extracted from
+  int32_t imageWidth;
+  int32_t imageHeight;
+
+  // a FeatureDescriptorType; 0 (float) before version 3
+  int32_t descriptorType;
+
+  // file offsets of the sections
+  uint64_t keypointOffset;
+  uint64_t descriptorOffset;
+  uint64_t nodeOffset;
+
+  // from version 2: the images, the trees, and the sections of numImages
+  // FeatureDBImage, numFeatures image ids (int32_t) and numTrees
+  // FeatureDBTree
+  int32_t numImages;
+  int32_t numTrees;
+  uint64_t imageOffset;
+  uint64_t imageIdOffset;
+  uint64_t treeOffset;
+
+  // hashFeatureSource() of the (first) image file, to tell when the
+  // database is older than the image; 0 if not known
+  uint32_t sourceHash;
+
+  // zero; keeps the header a multiple of 8 bytes
+  uint32_t reserved;
+} FeatureDBHeader;
+
+// a reference image
+typedef struct _FeatureDBImage
+{
+  int32_t width;
+  int32_t height;
+  int32_t numFeatures;
+  int32_t reserved;
+
+  char name[FEATURE_DB_NAME];
+} FeatureDBImage;
+
+// a tree of the forest; its leaves are ranges of the numFeatures
+// features (int32_t) at indexOffset, or of the stored features for an
+// indexOffset of 0 (the first tree)
+typedef struct _FeatureDBTree
+{
+  int32_t root;
+  int32_t reserved;
+  uint64_t indexOffset;
+} FeatureDBTree;
+
+// where a feature is in its image
+typedef struct _FeatureKeypoint
+{
+  float x, y;
+  float scale;
+  float orientation;
+} FeatureKeypoint;
+
+// a node of a kd-tree, over the count features from feature first (of
+// the list of the tree); an inner node splits them at split in
+// dimension dim into the nodes left (< split) and right, a leaf has
+// dim -1
+typedef struct _FeatureDBNode
+{
+  int32_t dim;
+  float split;
+  int32_t left, right;
+  int32_t first, count;
+} FeatureDBNode;
+
+// a neighbour found by a search: the feature and its squared distance
+// to the query (as descr_dist_sq())
+typedef struct _FeatureNeighbor
+{
+  int index;
+  float distSq;
+} FeatureNeighbor;
+
+// votes of matchImages() for an image
+typedef struct _FeatureDBVote
+{
+  int image;
+  int votes;
+} FeatureDBVote;
+
+// a branch of a tree left for later by a search
+typedef struct _FeatureBranch
+{
+  int tree;
+  int node;
+  float bound;
+} FeatureBranch;
+
+// Scratch space of searches: the BBF priority queue, the features a
+// search of a forest has seen and the votes of matchImages(). Searches
+// through the same FeatureSearch must not overlap, so keep one per
+// thread.
+class FeatureSearch
+{
+ public:
+  FeatureSearch();
+  ~FeatureSearch();
+
+ private:
+  friend class FeatureDB;
+
+  // make room for n branches
+  void reserve(int n);
+
+  // make room for the marks of n features and the votes of m images
+  void reserveFeatures(int n);
+  void reserveImages(int m);
+
+  FeatureBranch* queue;
+  int capacity;
+
+  // a feature was seen by the current search if its mark is the stamp
+  uint32_t* seen;
+  int numSeen;
+  uint32_t stamp;
+
+  int* votes;
+  int numVotes;
+
+  // the query as bytes, for databases of byte descriptors
+  uint8_t queryBytes[DESCRIPTOR_BYTES];
+};
+
+
+// Collects the features of reference images and writes them as a
+// database
+class FeatureDBBuilder
+{
+ public:
+  FeatureDBBuilder();
+  ~FeatureDBBuilder();
+
+  // add the features of an image; returns the id of the image
+  int addImage(const char* name, const struct feature* features, int n,
+	       int width, int height);
+
+  // add an image by its keypoints and descriptors (n x FEATURE_DB_DIMS)
+  int addImage(const char* name, const FeatureKeypoint* keypoints, const float* descr, int n,
+	       int width, int height);
+
+  int getFeatureCount();
+  int getImageCount();
+
+  // record the hashFeatureSource() of the first image in the header
+  void setSourceHash(uint32_t hash);
+
+  // Build numTrees kd-trees over all features and write the database
+  // with descriptors of the given type; the first tree splits in the
+  // dimension of largest variance, the others are randomized. Bytes hold
+  // libfeat descriptors exactly; descriptors that are not whole numbers
+  // up to 255 need DESCRIPTOR_FLOAT
+  int write(const char* fname, int numTrees=1, FeatureDescriptorType type=DESCRIPTOR_UINT8);
+
+ private:
+  // make room for n more features
+  void reserve(int n);
+
+  // add the image of the last n features
+  int addImageEntry(const char* name, int n, int width, int height);
+
+  FeatureKeypoint* keypoints;
+  float* descriptors;
+  int32_t* imageIds;
+  int numFeatures;
+  int capacity;
+
+  FeatureDBImage* images;
+  int numImages;
+  uint32_t sourceHash;
+};
+
+// Write the features of one image to the database file fname, with the
+// hashFeatureSource() of the image file if not 0
+int writeFeatureDB(const char* fname, const struct feature* features, int n,
+		   int imageWidth, int imageHeight, uint32_t sourceHash=0);
+
+// a hash (FNV-1a) of the contents of the image file fname, never 0; 0 if
+// it cannot be read
+uint32_t hashFeatureSource(const char* fname);
+
+// the descriptor of a feature as the database stores it
+void getFeatureDescriptor(const struct feature* f, float* descr);
+
+
+// Reads a database through mmap
+class FeatureDB
+{
+ public:
+  FeatureDB();
+  ~FeatureDB();
+
+  // true if the file starts with a database header, and if sourceHash
+  // is not 0, of the features of the image file of that hash
+  static bool isDB(const char* fname, uint32_t sourceHash=0);
+
+  // map the database
+  int open(const char* fname);
+
+  int getFeatureCount();
+  int getImageCount();
+  int getTreeCount();
+  FeatureDescriptorType getDescriptorType();
+
+  // size of the first image, and the hash of its file (0 if not known)
+  int getImageWidth();
+  int getImageHeight();
+  uint32_t getSourceHash();
+
+  // the keypoint, descriptor (copied to descr, FEATURE_DB_DIMS floats)
+  // and image of feature k
+  const FeatureKeypoint* getKeypoint(int k);
+  void getDescriptor(int k, float* descr);
+  int getImageId(int k);
+
+  // the descriptor of feature k as stored by a database of byte
+  // descriptors, NULL for float ones
+  const uint8_t* getDescriptorBytes(int k);
+
+  // reference image k
+  const FeatureDBImage* getImage(int k);
+
+  // Find up to k nearest features of the descriptor query, examining at
+  // most maxChecks features in all trees together (as kdtree_bbf_knn()).
+  // The neighbours are sorted by distance; returns how many were found.
+  // Databases of at most FEATURE_DB_EXACT_FEATURES features, or no more
+  // than maxChecks, are searched exhaustively
+  int findNearest(const float* query, int k, int maxChecks,
+		  FeatureNeighbor* nbrs, FeatureSearch* search);
+
+  // Find the k nearest features of query by comparing it with all of
+  // them (brute force); exact, whatever the size of the database
+  int findNearestExact(const float* query, int k,
+		       FeatureNeighbor* nbrs, FeatureSearch* search);
+
+  // Match the n descriptors of a frame (n x FEATURE_DB_DIMS) to the
+  // reference images: a descriptor votes for the image of its nearest
+  // feature if that is closer than ratioSq times the squared distance to
+  // the nearest feature of any other image (of the FEATURE_DB_VOTE_NN
+  // nearest). Fills in up to maxVotes images, most votes first; returns
+  // how many
+  int matchImages(const float* descr, int n, int maxChecks, float ratioSq,
+		  FeatureDBVote* votes, int maxVotes, FeatureSearch* search);
+
+  void close();
+
+ private:
+  // squared distance of the query (queryBytes for byte descriptors) to
+  // feature f
+  inline float distanceTo(const float* query, const uint8_t* queryBytes, int f);
+
+  int fd;
+  uint8_t* data;
+  size_t size;
+
+  const FeatureDBHeader* header;
+  const FeatureKeypoint* keypoints;
+  // one of the two is set, by the type of the descriptors
+  const float* descriptors;
+  const uint8_t* descriptorBytes;
+  DescriptorDistance distSqBytes;
+  const FeatureDBNode* nodes;
+  const FeatureDBImage* images;
+  const int32_t* imageIds;
+
+  // the trees, and the feature lists of their leaves (NULL for the
+  // stored order); a version 1 database has the one tree of v1Tree
+  const FeatureDBTree* trees;
+  const int32_t* treeIndex[FEATURE_DB_MAX_TREES];
+  int numTrees;
+  FeatureDBTree v1Tree;
+};
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * Batched feature matching on a pool of threads.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "FeatureMatcher.h"
+
+int filterMatches(FeatureMatch* matches, int n, float ratioSq)
+{
+  int kept = 0;
+  for(int i=0; i<n; i++)
+    if(matches[i].second>=0 && matches[i].distSq < matches[i].secondDistSq * ratioSq)
+      matches[kept++] = matches[i];
+  return kept;
+}
+
+FeatureMatcher::FeatureMatcher()
+{
+  db = NULL;
+  threads = NULL;
+  numThreads = 0;
+  batchDescr = NULL;
+  batchFeatures = NULL;
+  batchSize = 0;
+  batchChecks = 0;
+  batchMatches = NULL;
+  nextQuery = 0;
+  generation = 0;
+  busy = 0;
+  stopping = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&batchReady, NULL);
+  pthread_cond_init(&batchDone, NULL);
+}
+
+FeatureMatcher::~FeatureMatcher()
+{
+  this->fini();
+  pthread_cond_destroy(&batchDone);
+  pthread_cond_destroy(&batchReady);
+  pthread_mutex_destroy(&mutex);
+}
+
+int FeatureMatcher::init(FeatureDB* featureDB, int nThreads)
+{
+  this->fini();
+  if(nThreads<1 || nThreads>MATCHER_MAX_THREADS)
+    {
+      fprintf( stderr, "Invalid number of matcher threads %d\n", nThreads );
+      return -1;
+    }
+
+  db = featureDB;
+  stopping = false;
+  generation = 0;
+  threads = new MatcherThread[nThreads];
+  for(int k=0; k<nThreads; k++)
+    {
+      threads[k].matcher = this;
+      threads[k].started = false;
+      threads[k].generation = 0;
+      threads[k].search = new FeatureSearch;
+    }
+  numThreads = nThreads;
+
+  // the calling thread is the first one
+  for(int k=1; k<nThreads; k++)
+    {
+      if(pthread_create(&threads[k].thread, NULL, FeatureMatcher::workerThread, &threads[k])!=0)
+	{
+	  fprintf( stderr, "Cannot start matcher thread %d\n", k );
+	  this->fini();
+	  return -1;
+	}
+      threads[k].started = true;
+    }
+  return 0;
+}
+
+int FeatureMatcher::getThreadCount()
+{
+  return numThreads;
+}
+
+void* FeatureMatcher::workerThread(void* arg)
+{
+  MatcherThread* self = (MatcherThread*)arg;
+  self->matcher->work(self);
+  return NULL;
+}
+
+// wait for batches and work on them
+void FeatureMatcher::work(MatcherThread* self)
+{
+  for(;;)
+    {
+      pthread_mutex_lock(&mutex);
+      while(self->generation==generation && !stopping)
+	pthread_cond_wait(&batchReady, &mutex);
+      if(stopping)
+	{
+	  pthread_mutex_unlock(&mutex);
+	  return;
+	}
+      self->generation = generation;
+      pthread_mutex_unlock(&mutex);
+
+      this->runBatch(self);
+
+      pthread_mutex_lock(&mutex);
+      if(--busy==0)
+	pthread_cond_signal(&batchDone);
+      pthread_mutex_unlock(&mutex);
+    }
+}
+
+// take chunks of the current batch until there are none left
+void FeatureMatcher::runBatch(MatcherThread* self)
+{
+  FeatureNeighbor nbrs[2];
+  for(;;)
+    {
+      int first = __sync_fetch_and_add(&nextQuery, MATCHER_CHUNK);
+      if(first >= batchSize)
+	return;
+      int end = first + MATCHER_CHUNK < batchSize ? first + MATCHER_CHUNK : batchSize;
+      for(int i=first; i<end; i++)
+	{
+	  const float* q;
+	  if(batchDescr!=NULL)
+	    q = batchDescr + (size_t)i * FEATURE_DB_DIMS;
+	  else
+	    {
+	      getFeatureDescriptor(&batchFeatures[i], self->descr);
+	      q = self->descr;
+	    }
+
+	  int found = db->findNearest(q, 2, batchChecks, nbrs, self->search);
+	  FeatureMatch* m = &batchMatches[i];
+	  m->query = i;
+	  m->index = found>0 ? nbrs[0].index : -1;
+	  m->distSq = found>0 ? nbrs[0].distSq : 0;
+	  m->second = found>1 ? nbrs[1].index : -1;
+	  m->secondDistSq = found>1 ? nbrs[1].distSq : 0;
+	}
+    }
+}
+
+// run a batch of descriptors or of libfeat features
+int FeatureMatcher::runMatch(const float* descr, const struct feature* features, int n,
+			     int maxChecks, FeatureMatch* matches)
+{
+  if(threads==NULL)
+    {
+      fprintf( stderr, "Feature matcher not initialized\n" );
+      return -1;
+    }
+
+  // hand the batch to the pool and take chunks of it here as well
+  pthread_mutex_lock(&mutex);
+  batchDescr = descr;
+  batchFeatures = features;
+  batchSize = n;
+  batchChecks = maxChecks;
+  batchMatches = matches;
+  nextQuery = 0;
+  busy = numThreads - 1;
+  generation++;
+  pthread_cond_broadcast(&batchReady);
+  pthread_mutex_unlock(&mutex);
+
+  this->runBatch(&threads[0]);
+
+  pthread_mutex_lock(&mutex);
+  while(busy > 0)
+    pthread_cond_wait(&batchDone, &mutex);
+  pthread_mutex_unlock(&mutex);
+  return 0;
+}
+
+int FeatureMatcher::match(const float* descr, int n, int maxChecks, FeatureMatch* matches)
+{
+  return this->runMatch(descr, NULL, n, maxChecks, matches);
+}
+
+int FeatureMatcher::match(const struct feature* features, int n, int maxChecks, FeatureMatch* matches)
+{
+  return this->runMatch(NULL, features, n, maxChecks, matches);
+}
+
+// stop the threads
+void FeatureMatcher::fini()
+{
+  if(threads==NULL)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&batchReady);
+  pthread_mutex_unlock(&mutex);
+
+  for(int k=0; k<numThreads; k++)
+    {
+      if(threads[k].started)
+	pthread_join(threads[k].thread, NULL);
+      delete threads[k].search;
+    }
+  delete[] threads;
+  threads = NULL;
+  numThreads = 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Batched matching of the features of a frame against a feature
+ * database (see FeatureDB.h) on a pool of threads.
+ *
+ * A batch is all descriptors of a frame: the threads take them a chunk
+ * at a time and search the database for the two nearest features of
+ * each, every thread with its own FeatureSearch, so a batch allocates
+ * nothing after the first. The result is one compact FeatureMatch per
+ * descriptor (indices and squared distances, no copies of struct
+ * feature), ready for the ratio test of filterMatches().
+ */
+
+#ifndef _FEATURE_MATCHER_HH_
+#define _FEATURE_MATCHER_HH_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "FeatureDB.h"
+
+// most threads of a matcher
+#define MATCHER_MAX_THREADS 64
+
+// descriptors a thread takes at a time
+#define MATCHER_CHUNK 16
+
+// a descriptor of a frame and its two nearest database features
+typedef struct _FeatureMatch
+{
+  // the descriptor
+  int query;
+
+  // nearest database feature (-1 if none) and the second nearest (-1 if
+  // none), and their squared distances
+  int index;
+  int second;
+  float distSq;
+  float secondDistSq;
+} FeatureMatch;
+
+// Keep the matches whose nearest feature is closer than ratioSq times the
+// squared distance of the second (as NN_SQ_DIST_RATIO_THR in
+// me132_tutorial_2), in order at the front; returns how many
+int filterMatches(FeatureMatch* matches, int n, float ratioSq);
+
+class FeatureMatcher;
+
+// a thread of the pool and its scratch space
+typedef struct _MatcherThread
+{
+  FeatureMatcher* matcher;
+  pthread_t thread;
+  bool started;
+
+  // batches taken
+  uint64_t generation;
+
+  FeatureSearch* search;
+  float descr[FEATURE_DB_DIMS];
+} MatcherThread;
+
+
+class FeatureMatcher
+{
+ public:
+  FeatureMatcher();
+  ~FeatureMatcher();
+
+  // search db on nThreads threads, the calling one included
+  int init(FeatureDB* db, int nThreads);
+
+  // Find the two nearest database features of n descriptors (n x
+  // FEATURE_DB_DIMS), examining at most maxChecks features for each;
+  // matches[i] is for descriptor i. Blocks until the batch is done
+  int match(const float* descr, int n, int maxChecks, FeatureMatch* matches);
+
+  // the same for n libfeat features
+  int match(const struct feature* features, int n, int maxChecks, FeatureMatch* matches);
+
+  int getThreadCount();
+
+  // stop the threads
+  void fini();
+
+ private:
+  static void* workerThread(void* arg);
+  void work(MatcherThread* self);
+
+  // run a batch of descriptors or of libfeat features
+  int runMatch(const float* descr, const struct feature* features, int n,
+	       int maxChecks, FeatureMatch* matches);
+
+  // take chunks of the current batch until there are none left
+  void runBatch(MatcherThread* self);
+
+  FeatureDB* db;
+  MatcherThread* threads;
+  int numThreads;
+
+  // the current batch; one of descr and features is set
+  const float* batchDescr;
+  const struct feature* batchFeatures;
+  int batchSize;
+  int batchChecks;
+  FeatureMatch* batchMatches;
+
+  // next descriptor to take
+  volatile int nextQuery;
+
+  // batches started, and pool threads still working on the current one
+  pthread_mutex_t mutex;
+  pthread_cond_t batchReady;
+  pthread_cond_t batchDone;
+  uint64_t generation;
+  int busy;
+  bool stopping;
+};
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Pool of aligned, huge page backed, reference counted frame buffers.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "FramePool.h"
+
+// size of a huge page on x86 [bytes]
+#define HUGE_PAGE_SIZE (2 << 20)
+
+void getFrameLayout(const PGRStereoCamera_t* format, FrameLayout* layout)
+{
+  size_t nBufferSize = (size_t)format->nRows * format->nCols * format->nBytesPerPixel;
+
+  memset(layout, 0, sizeof(FrameLayout));
+  layout->deInterlaced = 0;
+  layout->size = alignFrameSize(nBufferSize);
+  if(format->bColor)
+    {
+      layout->rgb = layout->size;
+      layout->size += alignFrameSize(3 * nBufferSize);
+      layout->green = layout->size;
+      layout->size += alignFrameSize(nBufferSize);
+      layout->redGreenBlue = layout->size;
+      layout->size += alignFrameSize(3 * nBufferSize);
+    }
+}
+
+FramePool::FramePool()
+{
+  memory = NULL;
+  mappedSize = 0;
+  hugePages = false;
+  bufferSize = 0;
+  numBuffers = 0;
+  buffers = NULL;
+  freeList = NULL;
+  numFree = 0;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+FramePool::~FramePool()
+{
+  this->fini();
+  pthread_mutex_destroy(&mutex);
+}
+
+int FramePool::init(size_t size, int nBuffers)
+{
+  this->fini();
+  if(nBuffers<1)
+    return -1;
+
+  bufferSize = alignFrameSize(size);
+  size_t total = bufferSize * nBuffers;
+
+  // reserved huge pages first, as they need no fault per 4k page, then
+  // ordinary pages the kernel may back with transparent huge pages
+  mappedSize = (total + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+  void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  p = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  hugePages = (p!=MAP_FAILED);
+  if(p==MAP_FAILED)
+    {
+      p = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(p==MAP_FAILED)
+	{
+	  fprintf( stderr, "Cannot map %lu bytes of frame buffers: %s\n",
+		   (unsigned long)mappedSize, strerror(errno) );
+	  mappedSize = 0;
+	  return -1;
+	}
+#ifdef MADV_HUGEPAGE
+      madvise(p, mappedSize, MADV_HUGEPAGE);
+#endif
+    }
+  memory = (uint8_t*)p;
+
+  numBuffers = nBuffers;
+  buffers = new FrameBuffer[numBuffers];
+  freeList = NULL;
+  for(int k=numBuffers-1; k>=0; k--)
+    {
+      buffers[k].data = memory + k * bufferSize;
+      buffers[k].size = bufferSize;
+      buffers[k].refs = 0;
+      buffers[k].pool = this;
+      buffers[k].nextFree = freeList;
+      freeList = &buffers[k];
+    }
+  numFree = numBuffers;
+  return 0;
+}
+
+void FramePool::fini()
+{
+  if(memory==NULL)
+    return;
+  if(numFree!=numBuffers)
+    fprintf( stderr, "Frame pool freed with %d buffers in use\n", numBuffers - numFree );
+  munmap(memory, mappedSize);
+  memory = NULL;
+  mappedSize = 0;
+  delete[] buffers;
+  buffers = NULL;
+  freeList = NULL;
+  numBuffers = 0;
+  numFree = 0;
+}
+
+FrameBuffer* FramePool::acquire()
+{
+  pthread_mutex_lock(&mutex);
+  FrameBuffer* buffer = freeList;
+  if(buffer!=NULL)
+    {
+      freeList = buffer->nextFree;
+      buffer->nextFree = NULL;
+      buffer->refs = 1;
+      numFree--;
+    }
+  pthread_mutex_unlock(&mutex);
+  return buffer;
+}
+
+void FramePool::addRef(FrameBuffer* buffer)
+{
+  __sync_add_and_fetch(&buffer->refs, 1);
+}
+
+void FramePool::release(FrameBuffer* buffer)
+{
+  if(buffer==NULL || __sync_sub_and_fetch(&buffer->refs, 1)>0)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  buffer->nextFree = freeList;
+  freeList = buffer;
+  numFree++;
+  pthread_mutex_unlock(&mutex);
+}
+
+size_t FramePool::getBufferSize()
+{
+  return bufferSize;
+}
+
+int FramePool::getNumBuffers()
+{
+  return numBuffers;
+}
+
+int FramePool::getNumFree()
+{
+  pthread_mutex_lock(&mutex);
+  int n = numFree;
+  pthread_mutex_unlock(&mutex);
+  return n;
+}
+
+bool FramePool::isHugePages()
+{
+  return hugePages;
+}
@@ -0,0 +1,114 @@
+/*
+ * Pool of frame buffers for the Bumblebee2 driver. All buffers of a
+ * pool are carved out of one mapping, backed by huge pages when the
+ * system has them reserved (and marked for transparent huge pages
+ * otherwise), and start on FRAME_ALIGN byte boundaries, so SIMD kernels
+ * can use aligned loads on row starts of aligned widths.
+ *
+ * The pool is sized once from the stream format and buffers are reused
+ * frame after frame: steady state capture allocates nothing. A buffer
+ * is reference counted, so it can be handed from one pipeline stage or
+ * thread to the next and goes back to the pool with its last release.
+ */
+
+#ifndef _FRAME_POOL_HH_
+#define _FRAME_POOL_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <dc1394/control.h>
+#include <pgrlibdcstereo/pgr_stereocam.h>
+
+// alignment of the buffers and of the parts of a FrameLayout [bytes]
+#define FRAME_ALIGN 64
+
+// round a size up to FRAME_ALIGN
+inline size_t alignFrameSize(size_t size)
+{
+  return (size + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1);
+}
+
+// Where the input buffers of one frame (see BumbleBee::init_stereo())
+// are in a frame buffer, for a stream format. Color cameras only have
+// rgb, green and redGreenBlue; their offsets are 0 for mono cameras.
+typedef struct _FrameLayout
+{
+  // offsets of the parts [bytes]
+  size_t deInterlaced;
+  size_t rgb;
+  size_t green;
+  size_t redGreenBlue;
+
+  // size of the parts together [bytes]
+  size_t size;
+} FrameLayout;
+
+// the layout of the input buffers for the given stream format
+void getFrameLayout(const PGRStereoCamera_t* format, FrameLayout* layout);
+
+class FramePool;
+
+// a buffer of a pool
+typedef struct _FrameBuffer
+{
+  uint8_t* data;
+  size_t size;
+
+  // references held; the buffer is free at 0
+  volatile int refs;
+
+  FramePool* pool;
+  struct _FrameBuffer* nextFree;
+} FrameBuffer;
+
+
+class FramePool
+{
+ public:
+  FramePool();
+
+  // unmaps the buffers; they must all be released
+  ~FramePool();
+
+  // Map nBuffers buffers of bufferSize bytes (rounded up to
+  // FRAME_ALIGN). Returns -1 if the memory cannot be mapped.
+  int init(size_t bufferSize, int nBuffers);
+
+  // unmap the buffers
+  void fini();
+
+  // a free buffer with one reference, NULL if all are in use
+  FrameBuffer* acquire();
+
+  // take another reference to a buffer
+  void addRef(FrameBuffer* buffer);
+
+  // drop a reference; the last one returns the buffer to its pool
+  void release(FrameBuffer* buffer);
+
+  // buffer size [bytes], number of buffers and of free buffers
+  size_t getBufferSize();
+  int getNumBuffers();
+  int getNumFree();
+
+  // true if the buffers are on reserved huge pages
+  bool isHugePages();
+
+ private:
+  uint8_t* memory;
+  size_t mappedSize;
+  bool hugePages;
+
+  size_t bufferSize;
+  int numBuffers;
+  FrameBuffer* buffers;
+
+  // free buffers, linked by nextFree
+  pthread_mutex_t mutex;
+  FrameBuffer* freeList;
+  int numFree;
+};
+
+#endif
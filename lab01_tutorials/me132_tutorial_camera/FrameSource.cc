@@ -0,0 +1,601 @@
+/*
+ * Frame sources for the Bumblebee2 driver: live libdc1394 frames and
+ * replay of recorded StereoImageBlob frames.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "FrameSource.h"
+#include "bb2.h"
+
+// wall clock time in microseconds
+uint64_t getWallclockTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+
+// -------------------------------
+// live camera
+// -------------------------------
+
+DC1394FrameSource::DC1394FrameSource(PGRStereoCamera_t* stereoCam)
+{
+  stereoCamera = stereoCam;
+  rawFrame = NULL;
+  // the camera format is already known
+  window = new uint8_t[getDemosaicWindowSize(stereoCamera->nCols)];
+}
+
+DC1394FrameSource::~DC1394FrameSource()
+{
+  delete[] window;
+}
+
+// the camera is already queried and transmitting; just copy the format
+int DC1394FrameSource::open(PGRStereoCamera_t* stereoCam)
+{
+  if(stereoCam != stereoCamera)
+    memcpy(stereoCam, stereoCamera, sizeof(PGRStereoCamera_t));
+  return 0;
+}
+
+int DC1394FrameSource::waitFrame(int timeoutMs)
+{
+  return waitForFrame(stereoCamera, timeoutMs);
+}
+
+int DC1394FrameSource::grabColor(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+				 unsigned char* pucRGB, unsigned char* pucGreen,
+				 unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+				 TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  return grabColorImages(stereoCamera, bayerMethod, pucDeInterleaved, pucRGB, pucGreen,
+			 ppucRightRGB, ppucLeftRGB, ppucCenterRGB, pTriclopsInput, timestamp, timing);
+}
+
+int DC1394FrameSource::grabColorRGB(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+				    unsigned char* pucRGB, unsigned char** ppucRedGreenBlue,
+				    unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+				    TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  return grabColorImages_RGB(stereoCamera, bayerMethod, pucDeInterleaved, pucRGB, *ppucRedGreenBlue,
+			     ppucRightRGB, ppucLeftRGB, ppucCenterRGB, pTriclopsInput, timestamp, timing, window);
+}
+
+int DC1394FrameSource::grabGreen(int scale, unsigned char* pucGreen, TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  return grabGreenImages(stereoCamera, scale, pucGreen, pTriclopsInput, timestamp, timing, window);
+}
+
+int DC1394FrameSource::grabMono(unsigned char* pucDeInterleaved,
+				unsigned char** ppucRightMono8, unsigned char** ppucLeftMono8, unsigned char** ppucCenterMono8,
+				TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  return grabMonoImages(stereoCamera, pucDeInterleaved,
+			ppucRightMono8, ppucLeftMono8, ppucCenterMono8, pTriclopsInput, timestamp, timing);
+}
+
+int DC1394FrameSource::grabRaw(unsigned char** ppucRaw, uint64_t* timestamp)
+{
+  this->releaseRaw();
+  return grabRawFrame(stereoCamera, ppucRaw, &rawFrame, timestamp, timing);
+}
+
+void DC1394FrameSource::releaseRaw()
+{
+  releaseRawFrame(stereoCamera, rawFrame);
+  rawFrame = NULL;
+}
+
+int DC1394FrameSource::getShutter(float* shutter)
+{
+  if(dc1394_feature_get_absolute_value(stereoCamera->camera, DC1394_FEATURE_SHUTTER, shutter) != DC1394_SUCCESS)
+    return -1;
+  return 0;
+}
+
+int DC1394FrameSource::getGain(float* gain)
+{
+  if(dc1394_feature_get_absolute_value(stereoCamera->camera, DC1394_FEATURE_GAIN, gain) != DC1394_SUCCESS)
+    return -1;
+  return 0;
+}
+
+// the camera itself is stopped and freed by BumbleBee::fini()
+void DC1394FrameSource::close()
+{
+  this->releaseRaw();
+}
+
+
+// -------------------------------
+// replay
+// -------------------------------
+
+ReplayFrameSource::ReplayFrameSource(ReplayMode replayMode)
+{
+  mode = replayMode;
+  memset(&current, 0, sizeof(current));
+  pending = false;
+  due = 0;
+  cols = rows = channels = 0;
+  firstTimestamp = 0;
+  firstWallclock = 0;
+  frameCount = 0;
+  strideFirst = 0;
+  strideStep = 1;
+  window = NULL;
+}
+
+ReplayFrameSource::~ReplayFrameSource()
+{
+  delete[] window;
+}
+
+// peek at the first frame to find the stream format
+int ReplayFrameSource::open(PGRStereoCamera_t* stereoCamera)
+{
+  ReplayFrame first;
+  if(this->rewind()<0 || this->readFrame(&first)<0)
+    {
+      fprintf( stderr, "Replay source is empty!\n" );
+      return -1;
+    }
+  if(first.channels!=1 && first.channels!=3)
+    {
+      fprintf( stderr, "Replay source has %d channels; only 1 or 3 supported\n", first.channels );
+      return -1;
+    }
+  this->rewind();
+
+  cols = first.cols;
+  rows = first.rows;
+  channels = first.channels;
+  delete[] window;
+  window = new uint8_t[getDemosaicWindowSize(cols)];
+
+  memset(stereoCamera, 0, sizeof(PGRStereoCamera_t));
+  stereoCamera->camera = NULL;
+  stereoCamera->model = BUMBLEBEE2;
+  stereoCamera->bayerTile = DC1394_COLOR_FILTER_GBRG;
+  stereoCamera->bColor = (channels==3);
+  stereoCamera->nRows = rows;
+  stereoCamera->nCols = cols;
+  stereoCamera->nBytesPerPixel = 2;
+
+  frameCount = 0;
+  pending = false;
+  return 0;
+}
+
+// replay every step-th frame from frame first
+int ReplayFrameSource::setStride(int first, int step)
+{
+  if(first<0 || step<1)
+    {
+      fprintf( stderr, "Invalid replay stride %d from frame %d\n", step, first );
+      return -1;
+    }
+  strideFirst = first;
+  strideStep = step;
+  return 0;
+}
+
+// read a frame and drop it, for recordings that cannot seek
+int ReplayFrameSource::skipFrame()
+{
+  ReplayFrame frame;
+  return this->readFrame(&frame);
+}
+
+// read the next frame and find when it is due
+int ReplayFrameSource::readAhead()
+{
+  if(pending)
+    return 0;
+
+  // pass over the frames of the other strides
+  uint64_t start = startTiming(timing);
+  int nSkip = frameCount==0 ? strideFirst : strideStep - 1;
+  for(int k=0; k<nSkip; k++)
+    if(this->skipFrame()<0)
+      return -1;
+  if(this->readFrame(&current)<0)
+    return -1;
+  recordTiming(timing, TIMING_DEQUEUE, start);
+
+  if(current.cols!=cols || current.rows!=rows || current.channels!=channels)
+    {
+      fprintf( stderr, "Replay frame %d changes the image format. Abort.\n", current.frameId );
+      return -1;
+    }
+
+  due = 0;
+  if(mode==REPLAY_REALTIME)
+    {
+      if(frameCount==0)
+	{
+	  firstTimestamp = current.timestamp;
+	  firstWallclock = getWallclockTime();
+	}
+      else if(current.timestamp > firstTimestamp)
+	due = firstWallclock + (current.timestamp - firstTimestamp);
+    }
+
+  pending = true;
+  return 0;
+}
+
+int ReplayFrameSource::waitFrame(int timeoutMs)
+{
+  if(this->readAhead()<0)
+    return -1;
+
+  uint64_t now = getWallclockTime();
+  if(due <= now)
+    return 0;
+  if(timeoutMs!=FRAME_WAIT_FOREVER && due - now > (uint64_t)timeoutMs * 1000)
+    {
+      usleep((useconds_t)timeoutMs * 1000);
+      return GRAB_NO_FRAME;
+    }
+  usleep((useconds_t)(due - now));
+  return 0;
+}
+
+// take the next frame once it is due
+int ReplayFrameSource::nextFrame()
+{
+  if(this->waitFrame(FRAME_WAIT_FOREVER)<0)
+    return -1;
+
+  pending = false;
+  frameCount++;
+  return 0;
+}
+
+int ReplayFrameSource::convertCurrent(TimingStage stage)
+{
+  if(current.raw==NULL)
+    return 0;
+  if(this->convertFrame(&current)<0)
+    {
+      if(timing!=NULL)
+	timing->errors[stage]++;
+      return -1;
+    }
+  current.raw = NULL;
+  return 0;
+}
+
+int ReplayFrameSource::grabColor(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+				 unsigned char* pucRGB, unsigned char* pucGreen,
+				 unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+				 TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(channels!=3 || this->nextFrame()<0)
+    return -1;
+
+  // the recorded images are already debayered; pull out the green planes
+  uint64_t start = startTiming(timing);
+  if(this->convertCurrent(TIMING_DEBAYER)<0)
+    return -1;
+  unsigned int n = rows * cols;
+  for(unsigned int k=0; k<n; k++)
+    {
+      pucGreen[k]     = current.right[3*k + 1];
+      pucGreen[n + k] = current.left[3*k + 1];
+    }
+  recordTiming(timing, TIMING_DEBAYER, start);
+
+  *ppucRightRGB  = current.right;
+  *ppucLeftRGB   = current.left;
+  *ppucCenterRGB = current.left;
+  *timestamp = current.timestamp;
+
+  pTriclopsInput->inputType   = TriInp_RGB;
+  pTriclopsInput->nrows       = rows;
+  pTriclopsInput->ncols       = cols;
+  pTriclopsInput->rowinc      = cols;
+  pTriclopsInput->u.rgb.red   = pucGreen;
+  pTriclopsInput->u.rgb.green = pucGreen + n;
+  pTriclopsInput->u.rgb.blue  = pTriclopsInput->u.rgb.green;
+
+  return 0;
+}
+
+int ReplayFrameSource::grabColorRGB(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+				    unsigned char* pucRGB, unsigned char** ppucRedGreenBlue,
+				    unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+				    TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(channels!=3 || this->nextFrame()<0)
+    return -1;
+
+  // same planar layout as dc1394_deinterlace_rgb produces:
+  // right red, left red, right green, left green, right blue, left blue
+  uint64_t start = startTiming(timing);
+  if(this->convertCurrent(TIMING_DEBAYER)<0)
+    return -1;
+  unsigned char* pucRedGreenBlue = *ppucRedGreenBlue;
+  unsigned int n = rows * cols;
+  for(unsigned int k=0; k<n; k++)
+    {
+      pucRedGreenBlue[k]         = current.right[3*k + 0];
+      pucRedGreenBlue[n + k]     = current.left[3*k + 0];
+      pucRedGreenBlue[2*n + k]   = current.right[3*k + 1];
+      pucRedGreenBlue[3*n + k]   = current.left[3*k + 1];
+      pucRedGreenBlue[4*n + k]   = current.right[3*k + 2];
+      pucRedGreenBlue[5*n + k]   = current.left[3*k + 2];
+    }
+  recordTiming(timing, TIMING_DEBAYER, start);
+
+  *ppucRightRGB  = current.right;
+  *ppucLeftRGB   = current.left;
+  *ppucCenterRGB = current.left;
+  *timestamp = current.timestamp;
+
+  pTriclopsInput->inputType   = TriInp_RGB;
+  pTriclopsInput->nrows       = rows;
+  pTriclopsInput->ncols       = cols;
+  pTriclopsInput->rowinc      = cols;
+  pTriclopsInput->u.rgb.red   = pucRedGreenBlue + 2 * n; // right green
+  pTriclopsInput->u.rgb.green = pucRedGreenBlue + 3 * n; // left green
+  pTriclopsInput->u.rgb.blue  = pTriclopsInput->u.rgb.green;
+
+  return 0;
+}
+
+int ReplayFrameSource::grabGreen(int scale, unsigned char* pucGreen, TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(channels!=3 || this->nextFrame()<0)
+    return -1;
+
+  // the green planes straight from a raw record, as from the camera, or
+  // the green channel of the recorded RGB images reduced like them
+  uint64_t start = startTiming(timing);
+  int r = rows / getGreenScale(scale);
+  int c = cols / getGreenScale(scale);
+  if(current.raw!=NULL)
+    {
+      if(extractStereoGreen(current.raw, rows, cols, current.bayerTile, scale, pucGreen,
+			    KERNEL_AUTO, window)<0)
+	{
+	  if(timing!=NULL)
+	    timing->errors[TIMING_DEBAYER]++;
+	  return -1;
+	}
+    }
+  else
+    {
+      scale = getGreenScale(scale);
+      downscalePlane(current.right + 1, rows, cols, 3*cols, 3, scale, pucGreen, c);
+      downscalePlane(current.left + 1, rows, cols, 3*cols, 3, scale, pucGreen + r*c, c);
+    }
+  recordTiming(timing, TIMING_DEBAYER, start);
+  *timestamp = current.timestamp;
+
+  pTriclopsInput->inputType   = TriInp_RGB;
+  pTriclopsInput->nrows       = r;
+  pTriclopsInput->ncols       = c;
+  pTriclopsInput->rowinc      = c;
+  pTriclopsInput->u.rgb.red   = pucGreen;
+  pTriclopsInput->u.rgb.green = pucGreen + r*c;
+  pTriclopsInput->u.rgb.blue  = pTriclopsInput->u.rgb.green;
+
+  return 0;
+}
+
+int ReplayFrameSource::grabMono(unsigned char* pucDeInterleaved,
+				unsigned char** ppucRightMono8, unsigned char** ppucLeftMono8, unsigned char** ppucCenterMono8,
+				TriclopsInput* pTriclopsInput, uint64_t* timestamp)
+{
+  if(channels!=1 || this->nextFrame()<0)
+    return -1;
+
+  uint64_t start = startTiming(timing);
+  if(this->convertCurrent(TIMING_DEINTERLACE)<0)
+    return -1;
+  recordTiming(timing, TIMING_DEINTERLACE, start);
+
+  // mono frames are handed out straight from the recording
+  *ppucRightMono8  = current.right;
+  *ppucLeftMono8   = current.left;
+  *ppucCenterMono8 = current.left;
+  *timestamp = current.timestamp;
+
+  pTriclopsInput->inputType   = TriInp_RGB;
+  pTriclopsInput->nrows       = rows;
+  pTriclopsInput->ncols       = cols;
+  pTriclopsInput->rowinc      = cols;
+  pTriclopsInput->u.rgb.red   = current.right;
+  pTriclopsInput->u.rgb.green = current.left;
+  pTriclopsInput->u.rgb.blue  = current.left;
+
+  return 0;
+}
+
+int ReplayFrameSource::getShutter(float* shutter)
+{
+  *shutter = current.shutter;
+  return 0;
+}
+
+int ReplayFrameSource::getGain(float* gain)
+{
+  *gain = current.gain;
+  return 0;
+}
+
+// number of frames returned so far
+int ReplayFrameSource::getFrameCount()
+{
+  return frameCount;
+}
+
+// frames before the stride, and the ones of the other strides in between
+int ReplayFrameSource::getFrameIndex()
+{
+  return strideFirst + frameCount * strideStep;
+}
+
+int ReplayFrameSource::restart()
+{
+  if(this->rewind()<0)
+    return -1;
+  frameCount = 0;
+  pending = false;
+  return 0;
+}
+
+
+// -------------------------------
+// StereoImageBlob file replay
+// -------------------------------
+
+// bytes of a blob up to the images, the same in every version
+#define BLOB_HEADER_SIZE offsetof(StereoImageBlob, left_buffer)
+
+// bytes of a record of the given version after the header
+static long blobRecordRest(uint32_t version)
+{
+  if(version==0)
+    return 2 * STEREO_IMAGE_BLOB_V4_BUFFER + 2 * sizeof(float);
+  return sizeof(StereoImageBlob) - BLOB_HEADER_SIZE;
+}
+
+int readStereoImageBlob(FILE* file, StereoImageBlob* blob, bool legacyMono)
+{
+  if(fread(blob, BLOB_HEADER_SIZE, 1, file)!=1)
+    return -1;
+  if(blob->version!=0 && blob->version!=STEREO_IMAGE_BLOB_VERSION)
+    {
+      fprintf( stderr, "Blob frame %d has unknown version %u\n", blob->frameId, blob->version );
+      return -1;
+    }
+  if(blob->version==STEREO_IMAGE_BLOB_VERSION)
+    return fread(blob->left_buffer, blobRecordRest(blob->version), 1, file)==1 ? 0 : -1;
+
+  // the images, then the shutter and gain of an older record
+  if(fread(blob->left_buffer, STEREO_IMAGE_BLOB_V4_BUFFER, 1, file)!=1 ||
+     fread(blob->right_buffer, STEREO_IMAGE_BLOB_V4_BUFFER, 1, file)!=1 ||
+     fread(&blob->shutter, 2 * sizeof(float), 1, file)!=1)
+    return -1;
+  if(blob->channels==0 && legacyMono)
+    blob->channels = 1;
+  if(blob->channels==0)
+    {
+      fprintf( stderr, "Blob frame %d predates version %d and does not say whether it is color\n",
+	       blob->frameId, STEREO_IMAGE_BLOB_VERSION );
+      return -1;
+    }
+  if(blob->channels!=1)
+    {
+      fprintf( stderr, "Blob frame %d is a color frame from before version %d, cut short when recorded\n",
+	       blob->frameId, STEREO_IMAGE_BLOB_VERSION );
+      return -1;
+    }
+  return 0;
+}
+
+int skipStereoImageBlob(FILE* file)
+{
+  // just the header; a whole blob is megabytes
+  uint8_t header[BLOB_HEADER_SIZE];
+  uint32_t version;
+  if(fread(header, BLOB_HEADER_SIZE, 1, file)!=1)
+    return -1;
+  memcpy(&version, header + offsetof(StereoImageBlob, version), sizeof(version));
+  if(fseek(file, blobRecordRest(version), SEEK_CUR)!=0)
+    return -1;
+  return 0;
+}
+
+BlobFileFrameSource::BlobFileFrameSource(const char* fname, ReplayMode replayMode, bool mono)
+  : ReplayFrameSource(replayMode)
+{
+  strncpy(filename, fname, sizeof(filename)-1);
+  filename[sizeof(filename)-1] = '\0';
+  file = NULL;
+  blob = new StereoImageBlob;
+  legacyMono = mono;
+}
+
+BlobFileFrameSource::~BlobFileFrameSource()
+{
+  this->close();
+  delete blob;
+}
+
+// a blob cut short at the end of the file ends the recording as well
+bool BlobFileFrameSource::atEnd()
+{
+  return file!=NULL && feof(file);
+}
+
+void BlobFileFrameSource::close()
+{
+  if(file!=NULL)
+    fclose(file);
+  file = NULL;
+}
+
+int BlobFileFrameSource::rewind()
+{
+  if(file==NULL)
+    {
+      file = fopen(filename, "rb");
+      if(file==NULL)
+	{
+	  fprintf( stderr, "Cannot open blob file %s: %s\n", filename, strerror(errno) );
+	  return -1;
+	}
+    }
+  fseek(file, 0, SEEK_SET);
+  return 0;
+}
+
+// only the header of a blob is read
+int BlobFileFrameSource::skipFrame()
+{
+  if(file==NULL)
+    return -1;
+  return skipStereoImageBlob(file);
+}
+
+int BlobFileFrameSource::readFrame(ReplayFrame* frame)
+{
+  if(file==NULL || readStereoImageBlob(file, blob, legacyMono)<0)
+    return -1;
+
+  // the images of an older blob fill its smaller buffers
+  int32_t nChannels = blob->channels;
+  size_t capacity = blob->version==0 ? STEREO_IMAGE_BLOB_V4_BUFFER : sizeof(blob->left_buffer);
+  if(blob->cols<=0 || blob->rows<=0 || (nChannels!=1 && nChannels!=3) ||
+     (size_t)blob->cols * blob->rows * nChannels > capacity)
+    {
+      fprintf( stderr, "Blob frame %d has invalid size %dx%dx%d\n",
+	       blob->frameId, blob->cols, blob->rows, nChannels );
+      return -1;
+    }
+
+  frame->frameId   = blob->frameId;
+  frame->timestamp = blob->timestamp;
+  frame->cols      = blob->cols;
+  frame->rows      = blob->rows;
+  frame->channels  = nChannels;
+  frame->left      = blob->left_buffer;
+  frame->right     = blob->right_buffer;
+  frame->raw       = NULL;
+  frame->shutter   = blob->shutter;
+  frame->gain      = blob->gain;
+
+  return 0;
+}
@@ -0,0 +1,331 @@
+/*
+ * Frame sources for the Bumblebee2 driver. A frame source hands the
+ * driver de-interlaced left/right images and a TriclopsInput, either
+ * from a live camera (libdc1394) or from recorded StereoImageBlob
+ * frames, so the rectify/stereo path can run without the camera.
+ */
+
+#ifndef _FRAME_SOURCE_HH_
+#define _FRAME_SOURCE_HH_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <dc1394/conversions.h>
+#include <dc1394/control.h>
+
+#include <pgrlibdcstereo/pgr_conversions.h>
+#include <pgrlibdcstereo/pgr_stereocam.h>
+
+#include "StereoImageBlob.h"
+#include "ColorConvert.h"
+#include "CaptureTiming.h"
+
+// playback speed of a replay source
+enum ReplayMode{
+  REPLAY_REALTIME = 0,   // honour the recorded timestamps
+  REPLAY_FAST,           // return frames as fast as they can be read
+};
+
+
+// returned by the grab functions of a live camera when it has no frame
+// newer than the last one; the buffers then still hold that frame
+#define GRAB_NO_FRAME 1
+
+// timeouts of waitFrame() [ms], besides a number of milliseconds
+#define FRAME_WAIT_NONE 0
+#define FRAME_WAIT_FOREVER (-1)
+
+// Abstract source of stereo frames. The grab functions have the same
+// semantics as the grabColorImages/grabColorImages_RGB/grabMonoImages
+// functions in bb2.h; the returned pointers stay valid until the next grab.
+class FrameSource
+{
+ public:
+  FrameSource() : timing(NULL) {}
+  virtual ~FrameSource() {}
+
+  // record the time of the acquisition stages (dequeue, de-interlacing,
+  // demosaicing) of the following grabs into timing, NULL for none; the
+  // caller keeps it
+  virtual void setTiming(CaptureTiming* captureTiming) { timing = captureTiming; }
+
+  // open the source and describe the stream format (nRows, nCols,
+  // nBytesPerPixel, bColor, bayerTile) in stereoCamera
+  virtual int open(PGRStereoCamera_t* stereoCamera) = 0;
+
+  // Sleep until a frame can be grabbed, for at most timeoutMs (or
+  // FRAME_WAIT_FOREVER). Returns 0 if a frame is ready, GRAB_NO_FRAME on
+  // timeout and -1 on failure or at the end of a recording. The grab
+  // functions themselves never wait for a live camera.
+  virtual int waitFrame(int timeoutMs) = 0;
+
+  // grab color images and the green planes for stereo
+  virtual int grabColor(dc1394bayer_method_t bayerMethod,
+			unsigned char* pucDeInterleaved,
+			unsigned char* pucRGB,
+			unsigned char* pucGreen,
+			unsigned char** ppucRightRGB,
+			unsigned char** ppucLeftRGB,
+			unsigned char** ppucCenterRGB,
+			TriclopsInput* pTriclopsInput,
+			uint64_t* timestamp) = 0;
+
+  // grab color images and the planar red/green/blue buffer; on input
+  // *ppucRedGreenBlue is the buffer to fill, on output the buffer that
+  // holds the frame (a source may hand out its own)
+  virtual int grabColorRGB(dc1394bayer_method_t bayerMethod,
+			   unsigned char* pucDeInterleaved,
+			   unsigned char* pucRGB,
+			   unsigned char** ppucRedGreenBlue,
+			   unsigned char** ppucRightRGB,
+			   unsigned char** ppucLeftRGB,
+			   unsigned char** ppucCenterRGB,
+			   TriclopsInput* pTriclopsInput,
+			   uint64_t* timestamp) = 0;
+
+  // grab only the green planes of a color camera, for stereo without
+  // color output: right then left into pucGreen, both reduced by
+  // getGreenScale(scale) (see ColorConvert.h); the TriclopsInput has the
+  // reduced size
+  virtual int grabGreen(int scale,
+			unsigned char* pucGreen,
+			TriclopsInput* pTriclopsInput,
+			uint64_t* timestamp) = 0;
+
+  // grab mono images
+  virtual int grabMono(unsigned char* pucDeInterleaved,
+		       unsigned char** ppucRightMono8,
+		       unsigned char** ppucLeftMono8,
+		       unsigned char** ppucCenterMono8,
+		       TriclopsInput* pTriclopsInput,
+		       uint64_t* timestamp) = 0;
+
+  // Grab the raw frame of the camera, not de-interlaced (see
+  // demosaicStereo()), for recording; it stays valid, and the camera
+  // does not refill its buffer, until releaseRaw() or the next grab.
+  // Sources other than a live camera have none and return -1.
+  virtual int grabRaw(unsigned char** ppucRaw, uint64_t* timestamp) { return -1; }
+
+  // give the frame of grabRaw() back once it is copied
+  virtual void releaseRaw() { }
+
+  // shutter and gain of the last frame
+  virtual int getShutter(float* shutter) = 0;
+  virtual int getGain(float* gain) = 0;
+
+  // close the source
+  virtual void close() = 0;
+
+ protected:
+  CaptureTiming* timing;
+};
+
+
+// Live frames from a Bumblebee2 on the FireWire bus. The camera is
+// opened and configured by BumbleBee::init(); this only wraps the grab
+// functions around the already started camera.
+class DC1394FrameSource : public FrameSource
+{
+ public:
+  DC1394FrameSource(PGRStereoCamera_t* stereoCam);
+  ~DC1394FrameSource();
+
+  int open(PGRStereoCamera_t* stereoCamera);
+  int waitFrame(int timeoutMs);
+  int grabColor(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+		unsigned char* pucRGB, unsigned char* pucGreen,
+		unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+		TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabColorRGB(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+		   unsigned char* pucRGB, unsigned char** ppucRedGreenBlue,
+		   unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+		   TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabGreen(int scale, unsigned char* pucGreen, TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabMono(unsigned char* pucDeInterleaved,
+	       unsigned char** ppucRightMono8, unsigned char** ppucLeftMono8, unsigned char** ppucCenterMono8,
+	       TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabRaw(unsigned char** ppucRaw, uint64_t* timestamp);
+  void releaseRaw();
+  int getShutter(float* shutter);
+  int getGain(float* gain);
+  void close();
+
+ private:
+  // stereo camera set up by BumbleBee::init()
+  PGRStereoCamera_t* stereoCamera;
+
+  // the frame of grabRaw(), held until releaseRaw()
+  dc1394video_frame_t* rawFrame;
+
+  // row window of the demosaic kernels, so they don't allocate per frame
+  uint8_t* window;
+};
+
+
+// One recorded frame as seen by a replay source
+typedef struct _ReplayFrame
+{
+  int32_t frameId;
+  uint64_t timestamp;
+  int32_t cols, rows;
+
+  // 1 = mono, 3 = interleaved RGB
+  int32_t channels;
+
+  unsigned char* left;
+  unsigned char* right;
+
+  // a raw record instead of the images: the 16 bit stereo frame, in the
+  // Bayer tile given for color, until convertFrame() fills in left and
+  // right; NULL otherwise
+  const uint8_t* raw;
+  BayerTile bayerTile;
+
+  float shutter;
+  float gain;
+} ReplayFrame;
+
+
+// Base class for sources replaying recorded frames. Subclasses only
+// implement reading; pacing and conversion to Triclops input live here.
+// In REPLAY_REALTIME mode the grab functions sleep until a frame is due;
+// waitFrame() returns GRAB_NO_FRAME if it is not due within the timeout,
+// as for a camera that has not delivered it yet.
+class ReplayFrameSource : public FrameSource
+{
+ public:
+  ReplayFrameSource(ReplayMode replayMode);
+  virtual ~ReplayFrameSource();
+
+  int open(PGRStereoCamera_t* stereoCamera);
+  int waitFrame(int timeoutMs);
+  int grabColor(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+		unsigned char* pucRGB, unsigned char* pucGreen,
+		unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+		TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabColorRGB(dc1394bayer_method_t bayerMethod, unsigned char* pucDeInterleaved,
+		   unsigned char* pucRGB, unsigned char** ppucRedGreenBlue,
+		   unsigned char** ppucRightRGB, unsigned char** ppucLeftRGB, unsigned char** ppucCenterRGB,
+		   TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabGreen(int scale, unsigned char* pucGreen, TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int grabMono(unsigned char* pucDeInterleaved,
+	       unsigned char** ppucRightMono8, unsigned char** ppucLeftMono8, unsigned char** ppucCenterMono8,
+	       TriclopsInput* pTriclopsInput, uint64_t* timestamp);
+  int getShutter(float* shutter);
+  int getGain(float* gain);
+
+  // number of frames returned so far
+  int getFrameCount();
+
+  // position in the recording (from 0) of the frame the next grab returns
+  int getFrameIndex();
+
+  // Replay from the start of the recording again, e.g. the frames
+  // BumbleBee::init() took to set up
+  int restart();
+
+  // true once every frame of the recording was read, so a grab that
+  // failed hit the end rather than a broken frame
+  virtual bool atEnd() = 0;
+
+  // Replay only every step-th frame, starting with frame first, e.g. to
+  // split a recording between workers (see StereoBatch.h); call before
+  // open()
+  int setStride(int first, int step);
+
+ protected:
+  // read the next frame; returns -1 at the end of the recording
+  virtual int readFrame(ReplayFrame* frame) = 0;
+
+  // pass over the next frame without reading its images where the
+  // recording allows it; -1 at the end of the recording
+  virtual int skipFrame();
+
+  // go back to the first frame
+  virtual int rewind() = 0;
+
+  // de-interlace (and demosaic) the raw record of a frame into its
+  // images; for sources whose readFrame() returns raw records
+  virtual int convertFrame(ReplayFrame* frame) { return -1; }
+
+ private:
+  // read the next frame unless it is already pending
+  int readAhead();
+
+  // take the pending frame, waiting until it is due
+  int nextFrame();
+
+  // the images of the current frame, converted if it is a raw record;
+  // failures count as errors of the timing stage
+  int convertCurrent(TimingStage stage);
+
+  ReplayMode mode;
+
+  // the current frame, pending until a grab takes it
+  ReplayFrame current;
+  bool pending;
+
+  // wall clock time the pending frame is due at [us]
+  uint64_t due;
+
+  // format reported by open()
+  int32_t cols, rows, channels;
+
+  // row window of extractStereoGreen() for raw records
+  uint8_t* window;
+
+  // timestamp of the first frame and wall clock time it was returned at [us]
+  uint64_t firstTimestamp;
+  uint64_t firstWallclock;
+
+  int frameCount;
+
+  // frames replayed (see setStride())
+  int strideFirst;
+  int strideStep;
+};
+
+
+// Read the next StereoImageBlob record of a file into blob. Records from
+// before version 5 are smaller and do not say whether they are color:
+// they are read as mono if they say so, or if legacyMono is set and they
+// leave channels 0; color ones held only a third of each image and are
+// refused. Returns -1 at the end of the file or for a record that cannot
+// be read
+int readStereoImageBlob(FILE* file, StereoImageBlob* blob, bool legacyMono=false);
+
+// pass over the next record of a file; -1 at the end of the file
+int skipStereoImageBlob(FILE* file);
+
+// Replays a file of consecutive StereoImageBlob records, as written
+// by fwrite() of the blobs filled in by BumbleBee::captureBlob();
+// legacyMono as for readStereoImageBlob()
+class BlobFileFrameSource : public ReplayFrameSource
+{
+ public:
+  BlobFileFrameSource(const char* fname, ReplayMode replayMode=REPLAY_REALTIME, bool legacyMono=false);
+  ~BlobFileFrameSource();
+
+  bool atEnd();
+  void close();
+
+ protected:
+  int readFrame(ReplayFrame* frame);
+  int skipFrame();
+  int rewind();
+
+ private:
+  char filename[256];
+  FILE* file;
+
+  // blob the frames are read into
+  StereoImageBlob* blob;
+  bool legacyMono;
+};
+
+// wall clock time in microseconds
+uint64_t getWallclockTime();
+
+#endif
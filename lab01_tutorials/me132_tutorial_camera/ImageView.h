@@ -0,0 +1,82 @@
+/*
+ * Read-only views of images held by the driver. A view points into the
+ * driver's (or a pipeline bundle's) buffers instead of copying them, so
+ * it is only valid until the next capture, or until the bundle it was
+ * made from is released.
+ *
+ * Views of Triclops images are made with the functions of
+ * TriclopsImageView.h, so the kernels that take views (PointCloud.h,
+ * BlockStereo.h) build without the camera libraries.
+ */
+
+#ifndef _IMAGE_VIEW_HH_
+#define _IMAGE_VIEW_HH_
+
+#include <stdint.h>
+
+// layout of the pixels of a view
+enum ImageFormat{
+  IMAGE_MONO8 = 0,        // 1 byte per pixel
+  IMAGE_MONO16,           // 1 unsigned short per pixel (disparity)
+  IMAGE_RGB8,             // 3 bytes per pixel, R G B
+  IMAGE_PLANAR_RGB8,      // separate red, green and blue planes
+  IMAGE_FLOAT32,          // 1 float per pixel (depth)
+};
+
+typedef struct _ImageView
+{
+  // first pixel (the red plane for planar images)
+  const unsigned char* data;
+
+  // red, green and blue planes for planar images; data otherwise
+  const unsigned char* planes[3];
+
+  int width;
+  int height;
+
+  // bytes from one row to the next (of each plane)
+  int stride;
+
+  ImageFormat format;
+
+  // capture the view belongs to, and its camera timestamp
+  uint64_t frameId;
+  uint64_t timestamp;
+} ImageView;
+
+// view of a buffer
+inline void makeImageView(ImageView* view, const unsigned char* data, int width, int height, int stride,
+			  ImageFormat format, uint64_t frameId, uint64_t timestamp)
+{
+  view->data = data;
+  view->planes[0] = view->planes[1] = view->planes[2] = data;
+  view->width = width;
+  view->height = height;
+  view->stride = stride;
+  view->format = format;
+  view->frameId = frameId;
+  view->timestamp = timestamp;
+}
+
+// restrict a view to rows [row, row+nrows)
+inline void selectImageViewRows(ImageView* view, int row, int nrows)
+{
+  view->data += row * view->stride;
+  for(int c=0; c<3; c++)
+    view->planes[c] += row * view->stride;
+  view->height = nrows;
+}
+
+// first byte of row i (of plane c for planar images)
+inline const unsigned char* imageViewRow(const ImageView* view, int i, int c=0)
+{
+  return view->planes[c] + i * view->stride;
+}
+
+// 16 bit pixel (i,j) of an IMAGE_MONO16 view
+inline unsigned short imageViewPixel16(const ImageView* view, int i, int j)
+{
+  return ((const unsigned short*)imageViewRow(view, i))[j];
+}
+
+#endif
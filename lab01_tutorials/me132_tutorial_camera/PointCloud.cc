@@ -0,0 +1,309 @@
+/*
+ * Bulk disparity to point conversion, with SSE2/AVX2 row kernels picked
+ * at run time and optional row band threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "PointCloud.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define POINTS_X86 1
+#include <immintrin.h>
+#endif
+
+// constants of one conversion
+typedef struct _PointRowParams
+{
+  float centerRow;
+  float centerCol;
+  float focalLength;
+
+  // baseline / disparityScale, so that Z / f = bd / disparity
+  float bd;
+} PointRowParams;
+
+//=============================================================================
+// scalar
+//=============================================================================
+
+static int pointRowScalar(const PointRowParams* p, const unsigned short* disp, int row, int j0, int n,
+			  float* x, float* y, float* z)
+{
+  int valid = 0;
+  float dy = row - p->centerRow;
+  for(int j=j0; j<n; j++)
+    {
+      unsigned short d = disp[j];
+      if(d==0 || d>=DISPARITY_INVALID_MIN)
+	{
+	  x[j] = y[j] = z[j] = NAN;
+	  continue;
+	}
+      float q = p->bd / d;
+      x[j] = (j - p->centerCol) * q;
+      y[j] = dy * q;
+      z[j] = p->focalLength * q;
+      valid++;
+    }
+  return valid;
+}
+
+#ifdef POINTS_X86
+
+//=============================================================================
+// SSE2: 8 pixels per iteration
+//=============================================================================
+
+__attribute__((target("sse2")))
+static int pointRowSSE2(const PointRowParams* p, const unsigned short* disp, int row, int n,
+			float* x, float* y, float* z)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i invalidHigh = _mm_set1_epi16(0xFF);
+  const __m128 nan = _mm_set1_ps(NAN);
+  const __m128 bd = _mm_set1_ps(p->bd);
+  const __m128 f = _mm_set1_ps(p->focalLength);
+  const __m128 dy = _mm_set1_ps(row - p->centerRow);
+  const __m128 step = _mm_set_ps(3, 2, 1, 0);
+
+  int valid = 0;
+  int j = 0;
+  for(; j+8<=n; j+=8)
+    {
+      __m128i d16 = _mm_loadu_si128((const __m128i*)(disp + j));
+      __m128i bad16 = _mm_or_si128(_mm_cmpeq_epi16(d16, zero),
+				   _mm_cmpeq_epi16(_mm_srli_epi16(d16, 8), invalidHigh));
+      valid += 8 - __builtin_popcount(_mm_movemask_epi8(bad16)) / 2;
+
+      for(int h=0; h<2; h++)
+	{
+	  __m128i d32 = h ? _mm_unpackhi_epi16(d16, zero) : _mm_unpacklo_epi16(d16, zero);
+	  __m128 bad = _mm_castsi128_ps(h ? _mm_unpackhi_epi16(bad16, bad16) : _mm_unpacklo_epi16(bad16, bad16));
+	  __m128 q = _mm_div_ps(bd, _mm_cvtepi32_ps(d32));
+	  __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_set1_ps((float)(j + 4*h)), step), _mm_set1_ps(p->centerCol));
+
+	  __m128 vx = _mm_mul_ps(dx, q);
+	  __m128 vy = _mm_mul_ps(dy, q);
+	  __m128 vz = _mm_mul_ps(f, q);
+	  _mm_storeu_ps(x + j + 4*h, _mm_or_ps(_mm_andnot_ps(bad, vx), _mm_and_ps(bad, nan)));
+	  _mm_storeu_ps(y + j + 4*h, _mm_or_ps(_mm_andnot_ps(bad, vy), _mm_and_ps(bad, nan)));
+	  _mm_storeu_ps(z + j + 4*h, _mm_or_ps(_mm_andnot_ps(bad, vz), _mm_and_ps(bad, nan)));
+	}
+    }
+  return valid + pointRowScalar(p, disp, row, j, n, x, y, z);
+}
+
+//=============================================================================
+// AVX2: 8 pixels per iteration
+//=============================================================================
+
+__attribute__((target("avx2")))
+static int pointRowAVX2(const PointRowParams* p, const unsigned short* disp, int row, int n,
+			float* x, float* y, float* z)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i invalidMin = _mm256_set1_epi32(DISPARITY_INVALID_MIN - 1);
+  const __m256 nan = _mm256_set1_ps(NAN);
+  const __m256 bd = _mm256_set1_ps(p->bd);
+  const __m256 f = _mm256_set1_ps(p->focalLength);
+  const __m256 dy = _mm256_set1_ps(row - p->centerRow);
+  const __m256 step = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+
+  int valid = 0;
+  int j = 0;
+  for(; j+8<=n; j+=8)
+    {
+      __m256i d32 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(disp + j)));
+      __m256 bad = _mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(d32, zero),
+						       _mm256_cmpgt_epi32(d32, invalidMin)));
+      valid += 8 - __builtin_popcount(_mm256_movemask_ps(bad));
+
+      __m256 q = _mm256_div_ps(bd, _mm256_cvtepi32_ps(d32));
+      __m256 dx = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps((float)j), step), _mm256_set1_ps(p->centerCol));
+      _mm256_storeu_ps(x + j, _mm256_blendv_ps(_mm256_mul_ps(dx, q), nan, bad));
+      _mm256_storeu_ps(y + j, _mm256_blendv_ps(_mm256_mul_ps(dy, q), nan, bad));
+      _mm256_storeu_ps(z + j, _mm256_blendv_ps(_mm256_mul_ps(f, q), nan, bad));
+    }
+  return valid + pointRowScalar(p, disp, row, j, n, x, y, z);
+}
+
+#endif
+
+//=============================================================================
+// row bands
+//=============================================================================
+
+typedef struct _PointBand
+{
+  const PointRowParams* params;
+  const ImageView* disparity;
+  PointCloud* cloud;
+  ConvertKernel kernel;
+  int row0;
+  int row1;
+  int valid;
+  pthread_t thread;
+} PointBand;
+
+static void convertBand(PointBand* band)
+{
+  const ImageView* disparity = band->disparity;
+  PointCloud* cloud = band->cloud;
+  int n = disparity->width;
+
+  band->valid = 0;
+  for(int i=band->row0; i<band->row1; i++)
+    {
+      const unsigned short* disp = (const unsigned short*)imageViewRow(disparity, i);
+      float* x = cloud->x + i*n;
+      float* y = cloud->y + i*n;
+      float* z = cloud->z + i*n;
+#ifdef POINTS_X86
+      if(band->kernel==KERNEL_AVX2)
+	band->valid += pointRowAVX2(band->params, disp, i, n, x, y, z);
+      else if(band->kernel==KERNEL_SSSE3)
+	band->valid += pointRowSSE2(band->params, disp, i, n, x, y, z);
+      else
+#endif
+	band->valid += pointRowScalar(band->params, disp, i, 0, n, x, y, z);
+    }
+}
+
+static void* pointBandThread(void* arg)
+{
+  convertBand((PointBand*)arg);
+  return NULL;
+}
+
+//=============================================================================
+// cloud
+//=============================================================================
+
+void initPointCloud(PointCloud* cloud)
+{
+  memset(cloud, 0, sizeof(PointCloud));
+}
+
+void freePointCloud(PointCloud* cloud)
+{
+  free(cloud->x);
+  initPointCloud(cloud);
+}
+
+int disparityToPointCloud(const StereoGeometry* geometry, const ImageView* disparity,
+			  PointCloud* cloud, int nThreads, ConvertKernel kernel)
+{
+  if(disparity->format!=IMAGE_MONO16)
+    {
+      fprintf( stderr, "disparityToPointCloud: not a 16 bit disparity image\n" );
+      return -1;
+    }
+
+  if(kernel==KERNEL_AUTO)
+    kernel = getBestKernel();
+  if(!isKernelSupported(kernel))
+    {
+      fprintf( stderr, "disparityToPointCloud: kernel %d not supported by this CPU\n", kernel );
+      return -1;
+    }
+
+  // one block holding x, y and z, each 32 byte aligned
+  if(cloud->x==NULL || cloud->nrows!=disparity->height || cloud->ncols!=disparity->width)
+    {
+      freePointCloud(cloud);
+      size_t n = ((size_t)disparity->height * disparity->width + 7) & ~(size_t)7;
+      void* points;
+      if(posix_memalign(&points, 32, 3 * n * sizeof(float))!=0)
+	{
+	  fprintf( stderr, "disparityToPointCloud: cannot allocate %d x %d points\n",
+		   disparity->width, disparity->height );
+	  return -1;
+	}
+      cloud->x = (float*)points;
+      cloud->y = cloud->x + n;
+      cloud->z = cloud->y + n;
+      cloud->nrows = disparity->height;
+      cloud->ncols = disparity->width;
+    }
+
+  PointRowParams params;
+  params.centerRow = geometry->centerRow;
+  params.centerCol = geometry->centerCol;
+  params.focalLength = geometry->focalLength;
+  params.bd = geometry->baseline / geometry->disparityScale;
+
+  if(nThreads<1)
+    nThreads = 1;
+  if(nThreads>disparity->height)
+    nThreads = disparity->height;
+
+  PointBand* bands = new PointBand[nThreads];
+  for(int k=0; k<nThreads; k++)
+    {
+      bands[k].params = &params;
+      bands[k].disparity = disparity;
+      bands[k].cloud = cloud;
+      bands[k].kernel = kernel;
+      bands[k].row0 = disparity->height * k / nThreads;
+      bands[k].row1 = disparity->height * (k+1) / nThreads;
+    }
+
+  // the calling thread does the first band itself
+  int started = 1;
+  for(; started<nThreads; started++)
+    if(pthread_create(&bands[started].thread, NULL, pointBandThread, &bands[started])!=0)
+      break;
+  convertBand(&bands[0]);
+
+  // bands no thread could be started for are done here too
+  cloud->numValid = bands[0].valid;
+  for(int k=1; k<nThreads; k++)
+    {
+      if(k<started)
+	pthread_join(bands[k].thread, NULL);
+      else
+	convertBand(&bands[k]);
+      cloud->numValid += bands[k].valid;
+    }
+
+  delete[] bands;
+  return 0;
+}
+
+//=============================================================================
+// depth table
+//=============================================================================
+
+void buildDepthTable(const StereoGeometry* geometry, float* table)
+{
+  float fbd = geometry->focalLength * geometry->baseline / geometry->disparityScale;
+  table[0] = NAN;
+  for(int d=1; d<DISPARITY_INVALID_MIN; d++)
+    table[d] = fbd / d;
+  for(int d=DISPARITY_INVALID_MIN; d<DEPTH_TABLE_SIZE; d++)
+    table[d] = NAN;
+}
+
+int disparityToDepth(const float* table, const ImageView* disparity,
+		     float* depth, int depthStride)
+{
+  if(disparity->format!=IMAGE_MONO16)
+    {
+      fprintf( stderr, "disparityToDepth: not a 16 bit disparity image\n" );
+      return -1;
+    }
+
+  for(int i=0; i<disparity->height; i++)
+    {
+      const unsigned short* disp = (const unsigned short*)imageViewRow(disparity, i);
+      float* row = (float*)((unsigned char*)depth + i * depthStride);
+      for(int j=0; j<disparity->width; j++)
+	row[j] = table[disp[j]];
+    }
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Bulk conversion of a disparity image to 3D points. Instead of asking
+ * Triclops for one pixel at a time, the whole image is converted with
+ * the pinhole model of the rectified camera:
+ *
+ *   Z = f * B / d,  X = (col - centerCol) * Z / f,  Y = (row - centerRow) * Z / f
+ *
+ * in the frame of the reference (right) camera, in the units of the
+ * baseline.
+ */
+
+#ifndef _POINT_CLOUD_HH_
+#define _POINT_CLOUD_HH_
+
+#include "ImageView.h"
+#include "ColorConvert.h"
+
+// disparities from this value up are Triclops' invalid pixel codes
+#define DISPARITY_INVALID_MIN 0xFF00
+
+// entries of a depth table: one per 16 bit disparity value
+#define DEPTH_TABLE_SIZE 65536
+
+// camera geometry of the rectified images (at the stereo resolution)
+typedef struct _StereoGeometry
+{
+  float focalLength;
+  float centerRow;
+  float centerCol;
+  float baseline;
+
+  // disparity in pixels per unit of the 16 bit disparity image
+  // (1/256 with subpixel interpolation, 1 without)
+  float disparityScale;
+} StereoGeometry;
+
+// points of a disparity image, one per pixel in row major order, as
+// separate x, y and z arrays; invalid pixels are NaN
+typedef struct _PointCloud
+{
+  int nrows;
+  int ncols;
+
+  float* x;
+  float* y;
+  float* z;
+
+  // number of pixels with a valid disparity
+  int numValid;
+} PointCloud;
+
+// an empty cloud; it is allocated by the first conversion
+void initPointCloud(PointCloud* cloud);
+
+// free the points of a cloud
+void freePointCloud(PointCloud* cloud);
+
+// convert an IMAGE_MONO16 disparity view to points, (re)allocating the
+// cloud if its size differs; the rows are split into nThreads bands
+int disparityToPointCloud(const StereoGeometry* geometry, const ImageView* disparity,
+			  PointCloud* cloud, int nThreads=1,
+			  ConvertKernel kernel=KERNEL_AUTO);
+
+// fill table (DEPTH_TABLE_SIZE entries) with the depth Z of each 16 bit
+// disparity value, NaN for zero and invalid disparities
+void buildDepthTable(const StereoGeometry* geometry, float* table);
+
+// look up the depth of each pixel of an IMAGE_MONO16 disparity view;
+// depthStride is the row increment of depth in bytes
+int disparityToDepth(const float* table, const ImageView* disparity,
+		     float* depth, int depthStride);
+
+#endif
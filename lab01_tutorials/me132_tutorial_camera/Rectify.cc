@@ -0,0 +1,497 @@
+/*
+ * Calibration file parsing, remap table construction and the remap
+ * kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Rectify.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define REMAP_X86 1
+#include <immintrin.h>
+#endif
+
+// output rows rectified for every image before moving on to the next
+// block, so a block's table entries and source rows stay in cache
+#define REMAP_BLOCK_ROWS 16
+
+//=============================================================================
+// calibration file
+//=============================================================================
+
+static void skipLine(FILE* f)
+{
+  int c;
+  while((c = fgetc(f))!=EOF && c!='\n')
+    ;
+}
+
+static int readFloats(FILE* f, float* v, int n)
+{
+  for(int k=0; k<n; k++)
+    if(fscanf(f, "%f", &v[k])!=1)
+      return -1;
+  return 0;
+}
+
+int loadCalibration(const char* filename, Calibration* cal)
+{
+  FILE* f = fopen(filename, "r");
+  if(f==NULL)
+    {
+      fprintf( stderr, "loadCalibration: cannot open %s\n", filename );
+      return -1;
+    }
+
+  memset(cal, 0, sizeof(Calibration));
+  CalibrationCamera* camera = NULL;
+  CalibrationWarp* warp = NULL;
+  const char* error = NULL;
+  char key[64];
+
+  while(error==NULL && fscanf(f, "%63s", key)==1)
+    {
+      if(key[0]=='#')
+	skipLine(f);
+      else if(!strcmp(key, "SerialNumber"))
+	{
+	  if(fscanf(f, "%d", &cal->serialNumber)!=1)
+	    error = "bad SerialNumber";
+	}
+      else if(!strcmp(key, "FocalLength"))
+	{
+	  if(readFloats(f, cal->focalLength, 2)<0)
+	    error = "bad FocalLength";
+	}
+      else if(!strcmp(key, "ImageCenter"))
+	{
+	  if(readFloats(f, cal->imageCenter, 2)<0)
+	    error = "bad ImageCenter";
+	}
+      else if(!strcmp(key, "BaseLine"))
+	{
+	  if(readFloats(f, &cal->baseline, 1)<0)
+	    error = "bad BaseLine";
+	}
+      else if(!strcmp(key, "BeginCamera"))
+	{
+	  if(cal->numCameras==CALIBRATION_MAX_CAMERAS)
+	    error = "too many cameras";
+	  else
+	    camera = &cal->cameras[cal->numCameras++];
+	}
+      else if(!strcmp(key, "EndCamera"))
+	camera = NULL;
+      else if(!strcmp(key, "BeginWarp"))
+	{
+	  if(cal->numWarps==CALIBRATION_MAX_WARPS)
+	    error = "too many warps";
+	  else
+	    warp = &cal->warps[cal->numWarps++];
+	}
+      else if(!strcmp(key, "EndWarp"))
+	warp = NULL;
+      else if(!strcmp(key, "Id") && (camera || warp))
+	{
+	  if(fscanf(f, "%d", camera ? &camera->id : &warp->id)!=1)
+	    error = "bad Id";
+	}
+      else if(!strcmp(key, "Channel") && camera)
+	{
+	  if(fscanf(f, "%15s", camera->channel)!=1)
+	    error = "bad Channel";
+	}
+      else if(!strcmp(key, "Warp") && camera)
+	{
+	  if(fscanf(f, "%d %d", &camera->warp[0], &camera->warp[1])!=2)
+	    error = "bad Warp";
+	}
+      else if(!strcmp(key, "IWarp") && camera)
+	{
+	  if(fscanf(f, "%d %d", &camera->iwarp[0], &camera->iwarp[1])!=2)
+	    error = "bad IWarp";
+	}
+      else if(!strcmp(key, "NumberKnots") && warp)
+	{
+	  if(fscanf(f, "%d", &warp->numKnots)!=1 || warp->numKnots<8 ||
+	     warp->numKnots>CALIBRATION_MAX_KNOTS)
+	    error = "bad NumberKnots";
+	}
+      else if(!strcmp(key, "KnotsX") && warp)
+	{
+	  if(readFloats(f, warp->knotsX, warp->numKnots)<0)
+	    error = "bad KnotsX";
+	}
+      else if(!strcmp(key, "KnotsY") && warp)
+	{
+	  if(readFloats(f, warp->knotsY, warp->numKnots)<0)
+	    error = "bad KnotsY";
+	}
+      else if(!strcmp(key, "NumberCoefs") && warp)
+	{
+	  // clamped cubic splines: 4 knots more than coefficients
+	  if(fscanf(f, "%d %d", &warp->numCoefsX, &warp->numCoefsY)!=2 ||
+	     warp->numCoefsX!=warp->numKnots-4 || warp->numCoefsY!=warp->numKnots-4)
+	    error = "bad NumberCoefs";
+	}
+      else if(!strcmp(key, "Coefs") && warp)
+	{
+	  if(readFloats(f, warp->coefs, warp->numCoefsX * warp->numCoefsY)<0)
+	    error = "bad Coefs";
+	}
+      else
+	skipLine(f);
+    }
+  fclose(f);
+
+  if(error!=NULL)
+    {
+      fprintf( stderr, "loadCalibration: %s in %s\n", error, filename );
+      return -1;
+    }
+  return 0;
+}
+
+int findCalibrationCamera(const Calibration* cal, const char* channel)
+{
+  for(int k=0; k<cal->numCameras; k++)
+    if(!strcmp(cal->cameras[k].channel, channel))
+      return k;
+  return -1;
+}
+
+static const CalibrationWarp* findCalibrationWarp(const Calibration* cal, int id)
+{
+  for(int k=0; k<cal->numWarps; k++)
+    if(cal->warps[k].id==id)
+      return &cal->warps[k];
+  return NULL;
+}
+
+// knot span of x and the 4 cubic B-spline basis functions non-zero on it
+static int splineBasis(const float* knots, int numCoefs, float x, float* basis)
+{
+  int k = 3;
+  while(k<numCoefs-1 && x>=knots[k+1])
+    k++;
+
+  float left[4], right[4];
+  basis[0] = 1;
+  for(int j=1; j<=3; j++)
+    {
+      left[j] = x - knots[k+1-j];
+      right[j] = knots[k+j] - x;
+      float saved = 0;
+      for(int r=0; r<j; r++)
+	{
+	  float t = basis[r] / (right[r+1] + left[j-r]);
+	  basis[r] = saved + right[r+1] * t;
+	  saved = left[j-r] * t;
+	}
+      basis[j] = saved;
+    }
+  return k - 3;
+}
+
+float evalCalibrationWarp(const CalibrationWarp* warp, float x, float y)
+{
+  float bx[4], by[4];
+  int kx = splineBasis(warp->knotsX, warp->numCoefsX, x, bx);
+  int ky = splineBasis(warp->knotsY, warp->numCoefsY, y, by);
+
+  float v = 0;
+  for(int a=0; a<4; a++)
+    {
+      const float* c = warp->coefs + (kx+a) * warp->numCoefsY + ky;
+      v += bx[a] * (by[0]*c[0] + by[1]*c[1] + by[2]*c[2] + by[3]*c[3]);
+    }
+  return v;
+}
+
+//=============================================================================
+// tables
+//=============================================================================
+
+void initRemapTable(RemapTable* table)
+{
+  memset(table, 0, sizeof(RemapTable));
+}
+
+void freeRemapTable(RemapTable* table)
+{
+  free(table->offset);
+  free(table->fx);
+  free(table->fy);
+  delete[] table->begin;
+  delete[] table->end;
+  initRemapTable(table);
+}
+
+void selectRemapRows(const RemapTable* table, int row, int nrows, RemapTable* rows)
+{
+  *rows = *table;
+  rows->nrows = nrows;
+  rows->offset += row * table->ncols;
+  rows->fx += row * table->ncols;
+  rows->fy += row * table->ncols;
+  rows->begin += row;
+  rows->end += row;
+}
+
+// integer and 1/256 fractional part of a source coordinate in [0,n-1]
+static void splitCoordinate(float s, int n, int* s0, uint8_t* frac)
+{
+  int i = (int)s;
+  int f = (int)((s - i) * 256 + 0.5f);
+  if(f==256)
+    {
+      i++;
+      f = 0;
+    }
+  // keep the 2x2 neighbourhood inside the image
+  if(i>n-2)
+    {
+      i = n-2;
+      f = 255;
+    }
+  *s0 = i;
+  *frac = f;
+}
+
+int buildRemapTable(const Calibration* cal, int camera,
+		    int srcRows, int srcCols, int srcRowinc,
+		    int nrows, int ncols, RemapTable* table)
+{
+  if(camera<0 || camera>=cal->numCameras)
+    {
+      fprintf( stderr, "buildRemapTable: no camera %d in the calibration\n", camera );
+      return -1;
+    }
+  const CalibrationWarp* warpX = findCalibrationWarp(cal, cal->cameras[camera].iwarp[0]);
+  const CalibrationWarp* warpY = findCalibrationWarp(cal, cal->cameras[camera].iwarp[1]);
+  if(warpX==NULL || warpY==NULL)
+    {
+      fprintf( stderr, "buildRemapTable: missing inverse warp of camera %d\n", camera );
+      return -1;
+    }
+  if(srcRows<2 || srcCols<2)
+    {
+      fprintf( stderr, "buildRemapTable: source image too small\n" );
+      return -1;
+    }
+
+  freeRemapTable(table);
+  size_t n = (size_t)nrows * ncols + 16;
+  void* offset;
+  void* fx;
+  void* fy;
+  if(posix_memalign(&offset, 16, n * sizeof(int32_t))!=0)
+    offset = NULL;
+  if(posix_memalign(&fx, 16, n)!=0)
+    fx = NULL;
+  if(posix_memalign(&fy, 16, n)!=0)
+    fy = NULL;
+  table->offset = (int32_t*)offset;
+  table->fx = (uint8_t*)fx;
+  table->fy = (uint8_t*)fy;
+  if(offset==NULL || fx==NULL || fy==NULL)
+    {
+      fprintf( stderr, "buildRemapTable: cannot allocate a %d x %d table\n", ncols, nrows );
+      freeRemapTable(table);
+      return -1;
+    }
+  table->begin = new int[nrows];
+  table->end = new int[nrows];
+  table->nrows = nrows;
+  table->ncols = ncols;
+  table->srcRows = srcRows;
+  table->srcCols = srcCols;
+  table->srcRowinc = srcRowinc;
+
+  for(int i=0; i<nrows; i++)
+    {
+      table->begin[i] = ncols;
+      table->end[i] = 0;
+      for(int j=0; j<ncols; j++)
+	{
+	  // pixel centers in normalized coordinates, and back
+	  float x = (j + 0.5f) / ncols;
+	  float y = (i + 0.5f) / nrows;
+	  float sx = evalCalibrationWarp(warpX, x, y) * srcCols - 0.5f;
+	  float sy = evalCalibrationWarp(warpY, x, y) * srcRows - 0.5f;
+
+	  if(sx>=0 && sy>=0 && sx<=srcCols-1 && sy<=srcRows-1)
+	    {
+	      if(table->begin[i]==ncols)
+		table->begin[i] = j;
+	      table->end[i] = j+1;
+	    }
+
+	  // pixels outside between inside ones get the nearest border pixel
+	  sx = sx<0 ? 0 : (sx>srcCols-1 ? srcCols-1 : sx);
+	  sy = sy<0 ? 0 : (sy>srcRows-1 ? srcRows-1 : sy);
+
+	  int k = i*ncols + j;
+	  int x0, y0;
+	  splitCoordinate(sx, srcCols, &x0, &table->fx[k]);
+	  splitCoordinate(sy, srcRows, &y0, &table->fy[k]);
+	  table->offset[k] = y0 * srcRowinc + x0;
+	}
+      if(table->begin[i]==ncols)
+	table->begin[i] = table->end[i] = 0;
+    }
+  return 0;
+}
+
+//=============================================================================
+// scalar
+//=============================================================================
+
+static inline uint8_t remapPixel(const uint8_t* s, int rowinc, int wx, int wy)
+{
+  int top = (s[0] * (256-wx) + s[1] * wx + 128) >> 8;
+  int bottom = (s[rowinc] * (256-wx) + s[rowinc+1] * wx + 128) >> 8;
+  return (top * (256-wy) + bottom * wy + 128) >> 8;
+}
+
+static void remapRowScalar(const RemapImage* image, int i, int j0, int j1)
+{
+  const RemapTable* t = image->table;
+  for(int j=j0; j<j1; j++)
+    {
+      int k = i * t->ncols + j;
+      for(int p=0; p<image->nPlanes; p++)
+	image->dst[p][i * image->dstRowinc + j] =
+	  remapPixel(image->src[p] + t->offset[k], t->srcRowinc, t->fx[k], t->fy[k]);
+    }
+}
+
+#ifdef REMAP_X86
+
+//=============================================================================
+// SSE2: 8 pixels of every plane per iteration, sharing the table entries
+//=============================================================================
+
+static inline uint16_t loadPair(const uint8_t* s)
+{
+  return s[0] | (s[1] << 8);
+}
+
+#define GATHER_PAIRS(v, s, o)						\
+  v = _mm_insert_epi16(v, loadPair(s + o[0]), 0);			\
+  v = _mm_insert_epi16(v, loadPair(s + o[1]), 1);			\
+  v = _mm_insert_epi16(v, loadPair(s + o[2]), 2);			\
+  v = _mm_insert_epi16(v, loadPair(s + o[3]), 3);			\
+  v = _mm_insert_epi16(v, loadPair(s + o[4]), 4);			\
+  v = _mm_insert_epi16(v, loadPair(s + o[5]), 5);			\
+  v = _mm_insert_epi16(v, loadPair(s + o[6]), 6);			\
+  v = _mm_insert_epi16(v, loadPair(s + o[7]), 7);
+
+// (a * (256-w) + b * w + 128) >> 8 of the low and high bytes of 8 pairs;
+// all intermediate values fit in 16 bits
+__attribute__((target("sse2")))
+static inline __m128i lerpPairs(__m128i pairs, __m128i w, __m128i iw, __m128i round)
+{
+  __m128i a = _mm_and_si128(pairs, _mm_set1_epi16(0xFF));
+  __m128i b = _mm_srli_epi16(pairs, 8);
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, iw), _mm_mullo_epi16(b, w)), round), 8);
+}
+
+__attribute__((target("sse2")))
+static void remapRowSSE2(const RemapImage* image, int i, int j0, int j1)
+{
+  const RemapTable* t = image->table;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c256 = _mm_set1_epi16(256);
+  const __m128i round = _mm_set1_epi16(128);
+  int rowinc = t->srcRowinc;
+
+  int j = j0;
+  for(; j+8<=j1; j+=8)
+    {
+      int k = i * t->ncols + j;
+      const int32_t* o = t->offset + k;
+      __m128i wx = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(t->fx + k)), zero);
+      __m128i wy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(t->fy + k)), zero);
+      __m128i iwx = _mm_sub_epi16(c256, wx);
+      __m128i iwy = _mm_sub_epi16(c256, wy);
+
+      for(int p=0; p<image->nPlanes; p++)
+	{
+	  const uint8_t* s = image->src[p];
+	  const uint8_t* s1 = s + rowinc;
+	  __m128i top = zero;
+	  __m128i bottom = zero;
+	  GATHER_PAIRS(top, s, o);
+	  GATHER_PAIRS(bottom, s1, o);
+	  top = lerpPairs(top, wx, iwx, round);
+	  bottom = lerpPairs(bottom, wx, iwx, round);
+
+	  // top and bottom are at most 255, so the vertical step fits too
+	  __m128i v = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(top, iwy), _mm_mullo_epi16(bottom, wy)), round);
+	  v = _mm_srli_epi16(v, 8);
+	  _mm_storel_epi64((__m128i*)(image->dst[p] + i * image->dstRowinc + j), _mm_packus_epi16(v, v));
+	}
+    }
+  remapRowScalar(image, i, j, j1);
+}
+
+#endif
+
+//=============================================================================
+// images
+//=============================================================================
+
+int remapImages(const RemapImage* images, int nImages, ConvertKernel kernel)
+{
+  if(kernel==KERNEL_AUTO)
+    kernel = getBestKernel();
+  if(!isKernelSupported(kernel))
+    {
+      fprintf( stderr, "remapImages: kernel %d not supported by this CPU\n", kernel );
+      return -1;
+    }
+
+  void (*remapRow)(const RemapImage*, int, int, int) = remapRowScalar;
+#ifdef REMAP_X86
+  if(kernel!=KERNEL_SCALAR)
+    remapRow = remapRowSSE2;
+#endif
+
+  int nrows = 0;
+  for(int m=0; m<nImages; m++)
+    {
+      if(images[m].table->offset==NULL || images[m].nPlanes<1 || images[m].nPlanes>3)
+	{
+	  fprintf( stderr, "remapImages: bad image %d\n", m );
+	  return -1;
+	}
+      if(images[m].table->nrows>nrows)
+	nrows = images[m].table->nrows;
+    }
+
+  for(int r0=0; r0<nrows; r0+=REMAP_BLOCK_ROWS)
+    for(int m=0; m<nImages; m++)
+      {
+	const RemapImage* image = &images[m];
+	const RemapTable* t = image->table;
+	int r1 = r0+REMAP_BLOCK_ROWS < t->nrows ? r0+REMAP_BLOCK_ROWS : t->nrows;
+	for(int i=r0; i<r1; i++)
+	  {
+	    int begin = t->begin[i];
+	    int end = t->end[i];
+	    for(int p=0; p<image->nPlanes; p++)
+	      {
+		uint8_t* row = image->dst[p] + i * image->dstRowinc;
+		memset(row, 0, begin);
+		memset(row + end, 0, t->ncols - end);
+	      }
+	    remapRow(image, i, begin, end);
+	  }
+      }
+  return 0;
+}
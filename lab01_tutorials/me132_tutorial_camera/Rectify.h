@@ -0,0 +1,138 @@
+/*
+ * Rectification with precomputed remap tables, as an alternative to
+ * triclopsRectify() and triclopsRectifyColorImage(), which resample the
+ * grayscale images and then each color channel of both cameras again on
+ * every frame.
+ *
+ * The calibration file (e.g. 5020066.cal) is parsed once. Its inverse
+ * warps (IWarp) are bicubic B-splines mapping normalized rectified
+ * coordinates to normalized raw image coordinates; they are evaluated
+ * once per rectified pixel into a table of source offsets and 8 bit
+ * bilinear weights. remapImages() then applies the tables of both
+ * cameras to all their planes in one pass over the output, in blocks of
+ * rows, with SSE2 interpolation.
+ */
+
+#ifndef _RECTIFY_HH_
+#define _RECTIFY_HH_
+
+#include <stdint.h>
+
+#include "ColorConvert.h"
+
+// limits of the calibration file contents
+#define CALIBRATION_MAX_KNOTS   32
+#define CALIBRATION_MAX_WARPS   16
+#define CALIBRATION_MAX_CAMERAS 4
+
+// a 2D spline of a calibration file: BeginWarp ... EndWarp
+typedef struct _CalibrationWarp
+{
+  int id;
+  int numKnots;
+  float knotsX[CALIBRATION_MAX_KNOTS];
+  float knotsY[CALIBRATION_MAX_KNOTS];
+
+  // numCoefsX x numCoefsY coefficients, y varying fastest
+  int numCoefsX;
+  int numCoefsY;
+  float coefs[(CALIBRATION_MAX_KNOTS-4)*(CALIBRATION_MAX_KNOTS-4)];
+} CalibrationWarp;
+
+// a camera of a calibration file: BeginCamera ... EndCamera
+typedef struct _CalibrationCamera
+{
+  int id;
+
+  // input channel of the camera: "red" (right) or "green" (left)
+  char channel[16];
+
+  // ids of the forward and inverse x and y warps
+  int warp[2];
+  int iwarp[2];
+} CalibrationCamera;
+
+typedef struct _Calibration
+{
+  int serialNumber;
+
+  // normalized focal length and image center of the rectified images,
+  // as in the file
+  float focalLength[2];
+  float imageCenter[2];
+  float baseline;
+
+  int numCameras;
+  CalibrationCamera cameras[CALIBRATION_MAX_CAMERAS];
+
+  int numWarps;
+  CalibrationWarp warps[CALIBRATION_MAX_WARPS];
+} Calibration;
+
+// parse a Triclops calibration file
+int loadCalibration(const char* filename, Calibration* cal);
+
+// index of the camera on the given input channel, -1 if there is none
+int findCalibrationCamera(const Calibration* cal, const char* channel);
+
+// evaluate a warp at normalized coordinates (x,y)
+float evalCalibrationWarp(const CalibrationWarp* warp, float x, float y);
+
+// source of each pixel of a rectified image
+typedef struct _RemapTable
+{
+  // rectified image size
+  int nrows;
+  int ncols;
+
+  // source image size and row increment in bytes
+  int srcRows;
+  int srcCols;
+  int srcRowinc;
+
+  // per pixel: offset of the top left of the 2x2 source neighbourhood,
+  // and the horizontal and vertical weight of its right/bottom pixels
+  // in 1/256
+  int32_t* offset;
+  uint8_t* fx;
+  uint8_t* fy;
+
+  // per row: columns [begin,end) whose source lies inside the source
+  // image; the others are black
+  int* begin;
+  int* end;
+} RemapTable;
+
+// an empty table
+void initRemapTable(RemapTable* table);
+
+// free the arrays of a table
+void freeRemapTable(RemapTable* table);
+
+// build the table rectifying the images of the given camera (index in
+// cal->cameras) of size srcRows x srcCols to nrows x ncols
+int buildRemapTable(const Calibration* cal, int camera,
+		    int srcRows, int srcCols, int srcRowinc,
+		    int nrows, int ncols, RemapTable* table);
+
+// rows [row, row+nrows) of a table, as a table sharing its arrays (not
+// to be freed); remapping with it fills the rows from the first one of
+// the destination on
+void selectRemapRows(const RemapTable* table, int row, int nrows, RemapTable* rows);
+
+// planes of one camera to rectify with a table (e.g. red, green and blue,
+// or a single grayscale plane)
+typedef struct _RemapImage
+{
+  const RemapTable* table;
+  int nPlanes;
+  const unsigned char* src[3];
+  unsigned char* dst[3];
+  int dstRowinc;
+} RemapImage;
+
+// rectify the planes of nImages images in one pass; KERNEL_SCALAR for
+// the plain C version, any other kernel for SSE2
+int remapImages(const RemapImage* images, int nImages, ConvertKernel kernel=KERNEL_AUTO);
+
+#endif
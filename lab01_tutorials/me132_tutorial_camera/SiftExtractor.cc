@@ -0,0 +1,1080 @@
+/*
+ * SIFT feature extraction on a pool of threads, following sift_features()
+ * of libfeat step by step.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "SiftExtractor.h"
+
+// rows of a band of a blur, resampling or extrema job
+#define SIFT_BAND_ROWS 16
+
+// keypoints or features of an orientation or descriptor job
+#define SIFT_CHUNK 8
+
+// keypoints a list holds at first
+#define SIFT_KEYPOINTS 1024
+
+// the constants of libfeat: pixels at the border of a level without
+// keypoints, steps of the interpolation of an extremum and the blur of
+// the image as it comes from the camera
+#define SIFT_BORDER 5
+#define SIFT_INTERP_STEPS 5
+#define SIFT_INIT_BLUR 0.5
+
+// orientation histograms: bins, blur of the window (times the scale of
+// the keypoint) and its radius, smoothing passes and the least peak for
+// another orientation (relative to the highest one)
+#define SIFT_ORI_BINS 36
+#define SIFT_ORI_SIGMA 1.5
+#define SIFT_ORI_WINDOW (3.0 * SIFT_ORI_SIGMA)
+#define SIFT_ORI_SMOOTHING 2
+#define SIFT_ORI_PEAK 0.8
+
+// descriptors: a grid of SIFT_DESCR_GRID x SIFT_DESCR_GRID histograms of
+// SIFT_DESCR_BINS orientations, cells of SIFT_DESCR_CELL times the scale
+// of the keypoint, entries clipped at SIFT_DESCR_CLIP and scaled by
+// SIFT_DESCR_INT to whole numbers
+#define SIFT_DESCR_GRID 4
+#define SIFT_DESCR_BINS 8
+#define SIFT_DESCR_CELL 3.0
+#define SIFT_DESCR_CLIP 0.2
+#define SIFT_DESCR_INT 512.0
+
+void initSiftParams(SiftParams* params)
+{
+  params->intervals = 3;
+  params->sigma = 1.6;
+  params->contrastThreshold = 0.04;
+  params->curvatureThreshold = 10;
+  params->doubleImage = true;
+}
+
+static inline int getBands(int rows)
+{
+  return rows>0 ? (rows + SIFT_BAND_ROWS - 1) / SIFT_BAND_ROWS : 0;
+}
+
+// index i of a row of n mirrored at the ends without repeating them, as
+// OpenCV blurs
+static inline int reflectIndex(int i, int n)
+{
+  if(n==1)
+    return 0;
+  while(i<0 || i>=n)
+    i = i<0 ? -i : 2*n - 2 - i;
+  return i;
+}
+
+// the taps of bicubic doubling (OpenCV's, A = -0.75) for a pixel a
+// quarter (fraction 0.25) or three quarters (0.75) past a source pixel
+static void getCubicTaps(double fraction, float* taps)
+{
+  const double A = -0.75;
+  double x = fraction;
+  taps[0] = (float)(((A*(x + 1) - 5*A)*(x + 1) + 8*A)*(x + 1) - 4*A);
+  taps[1] = (float)(((A + 2)*x - (A + 3))*x*x + 1);
+  taps[2] = (float)(((A + 2)*(1 - x) - (A + 3))*(1 - x)*(1 - x) + 1);
+  taps[3] = 1.0f - taps[0] - taps[1] - taps[2];
+}
+
+static inline double roundHalfUp(double x)
+{
+  return floor(x + 0.5);
+}
+
+// gradient of a level at r, c; false at its border
+static inline bool getGradient(const float* img, int width, int height, int r, int c,
+			       double* mag, double* ori)
+{
+  if(r<=0 || r>=height-1 || c<=0 || c>=width-1)
+    return false;
+  const float* p = img + (size_t)r * width + c;
+  double dx = p[1] - p[-1];
+  double dy = p[-width] - p[width];
+  *mag = sqrt(dx*dx + dy*dy);
+  *ori = atan2(dy, dx);
+  return true;
+}
+
+// keypoints in the order of the pyramid
+static int compareKeypoints(const void* a, const void* b)
+{
+  const SiftKeypoint* ka = (const SiftKeypoint*)a;
+  const SiftKeypoint* kb = (const SiftKeypoint*)b;
+  if(ka->octave!=kb->octave)
+    return ka->octave - kb->octave;
+  if(ka->interval!=kb->interval)
+    return ka->interval - kb->interval;
+  if(ka->row!=kb->row)
+    return ka->row - kb->row;
+  return ka->col - kb->col;
+}
+
+// features by decreasing scale, as sift_features() sorts them
+static int compareOriented(const void* a, const void* b)
+{
+  const SiftOrientedKeypoint* oa = (const SiftOrientedKeypoint*)a;
+  const SiftOrientedKeypoint* ob = (const SiftOrientedKeypoint*)b;
+  if(oa->scale!=ob->scale)
+    return oa->scale > ob->scale ? -1 : 1;
+  if(oa->keypoint!=ob->keypoint)
+    return oa->keypoint - ob->keypoint;
+  return oa->ori - ob->ori;
+}
+
+SiftExtractor::SiftExtractor()
+{
+  initSiftParams(&params);
+  threads = NULL;
+  numThreads = 0;
+  buffer = NULL;
+  bufferSize = 0;
+  tmp = NULL;
+  numOctaves = 0;
+  for(int l=0; l<SIFT_MAX_INTERVALS+3; l++)
+    {
+      kernels[l] = NULL;
+      kernelRadius[l] = 0;
+    }
+  image = NULL;
+  imageWidth = imageHeight = imageStride = 0;
+  gray = NULL;
+  graySize = 0;
+  stageSrc = NULL;
+  stageDst = NULL;
+  stageDog = NULL;
+  stageOctave = stageLevel = 0;
+  keypoints = NULL;
+  numKeypoints = 0;
+  keypointCapacity = 0;
+  oriented = NULL;
+  orientedCapacity = 0;
+  features = NULL;
+  stage = STAGE_CONVERT;
+  nextJob = 0;
+  numJobs = 0;
+  generation = 0;
+  busy = 0;
+  stopping = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&stageReady, NULL);
+  pthread_cond_init(&stageDone, NULL);
+}
+
+SiftExtractor::~SiftExtractor()
+{
+  this->fini();
+  pthread_cond_destroy(&stageDone);
+  pthread_cond_destroy(&stageReady);
+  pthread_mutex_destroy(&mutex);
+}
+
+int SiftExtractor::init(int nThreads, const SiftParams* siftParams)
+{
+  this->fini();
+  if(nThreads<1 || nThreads>SIFT_MAX_THREADS)
+    {
+      fprintf( stderr, "Invalid number of SIFT threads %d\n", nThreads );
+      return -1;
+    }
+  if(siftParams!=NULL)
+    params = *siftParams;
+  else
+    initSiftParams(&params);
+  if(params.intervals<1 || params.intervals>SIFT_MAX_INTERVALS || params.sigma<=SIFT_INIT_BLUR * 2)
+    {
+      fprintf( stderr, "Invalid SIFT parameters: %d intervals, sigma %g\n", params.intervals, params.sigma );
+      return -1;
+    }
+
+  // the blur from the camera image to the first level, then the blur
+  // from each level to the next (as sift_features())
+  int levels = params.intervals + 3;
+  double sigmas[SIFT_MAX_INTERVALS+3];
+  double initBlur = params.doubleImage ? SIFT_INIT_BLUR * 2 : SIFT_INIT_BLUR;
+  sigmas[0] = sqrt(params.sigma * params.sigma - initBlur * initBlur);
+  double k = pow(2.0, 1.0 / params.intervals);
+  for(int l=1; l<levels; l++)
+    {
+      double prev = pow(k, l - 1) * params.sigma;
+      double total = prev * k;
+      sigmas[l] = sqrt(total * total - prev * prev);
+    }
+  for(int l=0; l<levels; l++)
+    {
+      // the size of the kernels of cvSmooth() for float images
+      int radius = ((int)roundHalfUp(sigmas[l] * 8 + 1) | 1) / 2;
+      kernels[l] = new float[radius + 1];
+      kernelRadius[l] = radius;
+      double sum = 0;
+      for(int i=0; i<=radius; i++)
+	{
+	  kernels[l][i] = (float)exp(-i * i / (2 * sigmas[l] * sigmas[l]));
+	  sum += i==0 ? kernels[l][i] : 2 * kernels[l][i];
+	}
+      for(int i=0; i<=radius; i++)
+	kernels[l][i] = (float)(kernels[l][i] / sum);
+    }
+
+  stopping = false;
+  generation = 0;
+  threads = new SiftThread[nThreads];
+  for(int t=0; t<nThreads; t++)
+    {
+      threads[t].extractor = this;
+      threads[t].started = false;
+      threads[t].generation = 0;
+      threads[t].row = NULL;
+      threads[t].rowSize = 0;
+      threads[t].keypoints = NULL;
+      threads[t].numKeypoints = 0;
+      threads[t].keypointCapacity = 0;
+    }
+  numThreads = nThreads;
+
+  // the calling thread is the first one
+  for(int t=1; t<nThreads; t++)
+    {
+      if(pthread_create(&threads[t].thread, NULL, SiftExtractor::workerThread, &threads[t])!=0)
+	{
+	  fprintf( stderr, "Cannot start SIFT thread %d\n", t );
+	  this->fini();
+	  return -1;
+	}
+      threads[t].started = true;
+    }
+  return 0;
+}
+
+int SiftExtractor::getThreadCount()
+{
+  return numThreads;
+}
+
+void* SiftExtractor::workerThread(void* arg)
+{
+  SiftThread* self = (SiftThread*)arg;
+  self->extractor->work(self);
+  return NULL;
+}
+
+// wait for stages and work on them
+void SiftExtractor::work(SiftThread* self)
+{
+  for(;;)
+    {
+      pthread_mutex_lock(&mutex);
+      while(self->generation==generation && !stopping)
+	pthread_cond_wait(&stageReady, &mutex);
+      if(stopping)
+	{
+	  pthread_mutex_unlock(&mutex);
+	  return;
+	}
+      self->generation = generation;
+      pthread_mutex_unlock(&mutex);
+
+      this->runJobs(self);
+
+      pthread_mutex_lock(&mutex);
+      if(--busy==0)
+	pthread_cond_signal(&stageDone);
+      pthread_mutex_unlock(&mutex);
+    }
+}
+
+// run the jobs of a stage on all threads
+void SiftExtractor::runStage(Stage s, int n)
+{
+  stage = s;
+  numJobs = n;
+  nextJob = 0;
+  if(numThreads==1 || n==1)
+    {
+      this->runJobs(&threads[0]);
+      return;
+    }
+
+  pthread_mutex_lock(&mutex);
+  busy = numThreads - 1;
+  generation++;
+  pthread_cond_broadcast(&stageReady);
+  pthread_mutex_unlock(&mutex);
+
+  this->runJobs(&threads[0]);
+
+  pthread_mutex_lock(&mutex);
+  while(busy > 0)
+    pthread_cond_wait(&stageDone, &mutex);
+  pthread_mutex_unlock(&mutex);
+}
+
+// take jobs of the current stage until there are none left
+void SiftExtractor::runJobs(SiftThread* self)
+{
+  for(;;)
+    {
+      int job = __sync_fetch_and_add(&nextJob, 1);
+      if(job >= numJobs)
+	return;
+      this->runJob(self, job);
+    }
+}
+
+void SiftExtractor::runJob(SiftThread* self, int job)
+{
+  int first = job * SIFT_BAND_ROWS;
+  switch(stage)
+    {
+    case STAGE_UPSAMPLE_ROWS:
+      {
+	// double the rows of the camera image into tmp
+	int end = first + SIFT_BAND_ROWS < imageHeight ? first + SIFT_BAND_ROWS : imageHeight;
+	int width = imageWidth * 2;
+	float taps[2][4];
+	getCubicTaps(0.75, taps[0]);
+	getCubicTaps(0.25, taps[1]);
+	for(int y=first; y<end; y++)
+	  {
+	    const uint8_t* src = image + (size_t)y * imageStride;
+	    float* dst = tmp + (size_t)y * width;
+	    for(int x=0; x<width; x++)
+	      {
+		const float* t = taps[x & 1];
+		int sx = (x >> 1) - 1 + (x & 1);
+		float sum = 0;
+		for(int i=0; i<4; i++)
+		  {
+		    int xi = sx - 1 + i;
+		    xi = xi<0 ? 0 : xi>=imageWidth ? imageWidth-1 : xi;
+		    sum += t[i] * src[xi];
+		  }
+		dst[x] = sum * (1.0f / 255);
+	      }
+	  }
+	break;
+      }
+
+    case STAGE_UPSAMPLE_COLS:
+      {
+	// then the columns into the first level (stageDst)
+	int width = octaveWidth[0];
+	int height = octaveHeight[0];
+	int end = first + SIFT_BAND_ROWS < height ? first + SIFT_BAND_ROWS : height;
+	float taps[2][4];
+	getCubicTaps(0.75, taps[0]);
+	getCubicTaps(0.25, taps[1]);
+	for(int y=first; y<end; y++)
+	  {
+	    const float* t = taps[y & 1];
+	    int sy = (y >> 1) - 1 + (y & 1);
+	    float* dst = stageDst + (size_t)y * width;
+	    for(int x=0; x<width; x++)
+	      dst[x] = 0;
+	    for(int i=0; i<4; i++)
+	      {
+		int yi = sy - 1 + i;
+		yi = yi<0 ? 0 : yi>=imageHeight ? imageHeight-1 : yi;
+		const float* src = tmp + (size_t)yi * width;
+		for(int x=0; x<width; x++)
+		  dst[x] += t[i] * src[x];
+	      }
+	  }
+	break;
+      }
+
+    case STAGE_CONVERT:
+      {
+	int end = first + SIFT_BAND_ROWS < imageHeight ? first + SIFT_BAND_ROWS : imageHeight;
+	for(int y=first; y<end; y++)
+	  {
+	    const uint8_t* src = image + (size_t)y * imageStride;
+	    float* dst = stageDst + (size_t)y * imageWidth;
+	    for(int x=0; x<imageWidth; x++)
+	      dst[x] = src[x] * (1.0f / 255);
+	  }
+	break;
+      }
+
+    case STAGE_BLUR_ROWS:
+      {
+	int height = octaveHeight[stageOctave];
+	this->blurRows(self, first, first + SIFT_BAND_ROWS < height ? first + SIFT_BAND_ROWS : height);
+	break;
+      }
+
+    case STAGE_BLUR_COLS:
+      {
+	int height = octaveHeight[stageOctave];
+	this->blurCols(first, first + SIFT_BAND_ROWS < height ? first + SIFT_BAND_ROWS : height);
+	break;
+      }
+
+    case STAGE_DOWNSAMPLE:
+      {
+	// every other pixel of the level before, as cvResize(CV_INTER_NN)
+	int o = stageOctave;
+	int end = first + SIFT_BAND_ROWS < octaveHeight[o] ? first + SIFT_BAND_ROWS : octaveHeight[o];
+	for(int r=first; r<end; r++)
+	  {
+	    const float* src = stageSrc + (size_t)(2*r) * octaveWidth[o-1];
+	    float* dst = stageDst + (size_t)r * octaveWidth[o];
+	    for(int c=0; c<octaveWidth[o]; c++)
+	      dst[c] = src[2*c];
+	  }
+	break;
+      }
+
+    case STAGE_EXTREMA:
+      this->findExtrema(self, job);
+      break;
+
+    case STAGE_ORIENT:
+      {
+	int end = (job + 1) * SIFT_CHUNK < numKeypoints ? (job + 1) * SIFT_CHUNK : numKeypoints;
+	for(int k=job * SIFT_CHUNK; k<end; k++)
+	  this->orientKeypoint(&keypoints[k]);
+	break;
+      }
+
+    case STAGE_DESCRIBE:
+      {
+	// the last chunk is padded with keypoint -1
+	for(int f=job * SIFT_CHUNK; f<(job + 1) * SIFT_CHUNK; f++)
+	  {
+	    const SiftOrientedKeypoint* o = &oriented[f];
+	    if(o->keypoint < 0)
+	      break;
+	    const SiftKeypoint* kp = &keypoints[o->keypoint];
+	    this->describeFeature(kp, kp->ori[o->ori], &features[f]);
+	  }
+	break;
+      }
+    }
+}
+
+// make room for the pyramid of a width x height image
+int SiftExtractor::reserve(int width, int height)
+{
+  int w = params.doubleImage ? width * 2 : width;
+  int h = params.doubleImage ? height * 2 : height;
+
+  // as many octaves as sift_features(), down to about 8 pixels
+  int smallest = w < h ? w : h;
+  numOctaves = (int)(log((double)smallest) / log(2.0) - 2);
+  if(numOctaves > SIFT_MAX_OCTAVES)
+    numOctaves = SIFT_MAX_OCTAVES;
+  if(numOctaves < 1)
+    {
+      numOctaves = 0;
+      return 0;
+    }
+
+  // each level starts on a 64 byte boundary
+  size_t size = 0;
+  int levels = params.intervals + 3;
+  for(int o=0; o<numOctaves; o++)
+    {
+      octaveWidth[o] = w >> o;
+      octaveHeight[o] = h >> o;
+      size_t level = ((size_t)octaveWidth[o] * octaveHeight[o] + 15) & ~(size_t)15;
+      size += level * (2 * levels - 1);
+    }
+  size += (size_t)w * h;
+  if(size > bufferSize)
+    {
+      free(buffer);
+      if(posix_memalign((void**)&buffer, 64, size * sizeof(float))!=0)
+	{
+	  fprintf( stderr, "Cannot allocate a SIFT pyramid of %dx%d\n", w, h );
+	  buffer = NULL;
+	  bufferSize = 0;
+	  return -1;
+	}
+      bufferSize = size;
+    }
+
+  float* p = buffer;
+  for(int o=0; o<numOctaves; o++)
+    {
+      size_t level = ((size_t)octaveWidth[o] * octaveHeight[o] + 15) & ~(size_t)15;
+      for(int l=0; l<levels; l++, p+=level)
+	gauss[o][l] = p;
+      for(int l=0; l<levels-1; l++, p+=level)
+	dog[o][l] = p;
+    }
+  tmp = p;
+
+  // a row of the widest level and the widest blur on either side
+  int radius = 0;
+  for(int l=0; l<levels; l++)
+    radius = kernelRadius[l] > radius ? kernelRadius[l] : radius;
+  int rowSize = w + 2 * radius;
+  for(int t=0; t<numThreads; t++)
+    if(threads[t].rowSize < rowSize)
+      {
+	delete[] threads[t].row;
+	threads[t].row = new float[rowSize];
+	threads[t].rowSize = rowSize;
+      }
+  return 0;
+}
+
+// blur src into dst by the kernel of level l, in two passes through tmp
+void SiftExtractor::blur(int o, int l, const float* src, float* dst, float* dogLevel)
+{
+  stageOctave = o;
+  stageLevel = l;
+  stageSrc = src;
+  stageDst = dst;
+  stageDog = dogLevel;
+  this->runStage(STAGE_BLUR_ROWS, getBands(octaveHeight[o]));
+  this->runStage(STAGE_BLUR_COLS, getBands(octaveHeight[o]));
+}
+
+// the rows first..end of stageSrc blurred along the rows into tmp
+void SiftExtractor::blurRows(SiftThread* self, int first, int end)
+{
+  int width = octaveWidth[stageOctave];
+  int radius = kernelRadius[stageLevel];
+  const float* k = kernels[stageLevel];
+  float* row = self->row + radius;
+  for(int r=first; r<end; r++)
+    {
+      // the row with mirrored ends, so the kernel never leaves it
+      const float* src = stageSrc + (size_t)r * width;
+      memcpy(row, src, width * sizeof(float));
+      for(int i=1; i<=radius; i++)
+	{
+	  row[-i] = src[reflectIndex(-i, width)];
+	  row[width - 1 + i] = src[reflectIndex(width - 1 + i, width)];
+	}
+
+      float* dst = tmp + (size_t)r * width;
+      for(int c=0; c<width; c++)
+	{
+	  float sum = k[0] * row[c];
+	  for(int i=1; i<=radius; i++)
+	    sum += k[i] * (row[c-i] + row[c+i]);
+	  dst[c] = sum;
+	}
+    }
+}
+
+// the rows first..end of tmp blurred along the columns into stageDst,
+// and stageDst - stageSrc into stageDog
+void SiftExtractor::blurCols(int first, int end)
+{
+  int width = octaveWidth[stageOctave];
+  int height = octaveHeight[stageOctave];
+  int radius = kernelRadius[stageLevel];
+  const float* k = kernels[stageLevel];
+  for(int r=first; r<end; r++)
+    {
+      float* dst = stageDst + (size_t)r * width;
+      const float* center = tmp + (size_t)r * width;
+      for(int c=0; c<width; c++)
+	dst[c] = k[0] * center[c];
+      for(int i=1; i<=radius; i++)
+	{
+	  const float* above = tmp + (size_t)reflectIndex(r - i, height) * width;
+	  const float* below = tmp + (size_t)reflectIndex(r + i, height) * width;
+	  for(int c=0; c<width; c++)
+	    dst[c] += k[i] * (above[c] + below[c]);
+	}
+
+      if(stageDog!=NULL)
+	{
+	  const float* src = stageSrc + (size_t)r * width;
+	  float* d = stageDog + (size_t)r * width;
+	  for(int c=0; c<width; c++)
+	    d[c] = dst[c] - src[c];
+	}
+    }
+}
+
+// a DoG extremum over its 26 neighbours, ties included (as libfeat)
+static inline bool isExtremum(float* const* dogs, int interval, int width, int r, int c, float v)
+{
+  for(int l=interval-1; l<=interval+1; l++)
+    {
+      const float* p = dogs[l] + (size_t)(r - 1) * width + c;
+      for(int i=0; i<3; i++, p+=width)
+	{
+	  if(v > 0 ? (p[-1] > v || p[0] > v || p[1] > v) : (p[-1] < v || p[0] < v || p[1] < v))
+	    return false;
+	}
+    }
+  return true;
+}
+
+// job of the extrema stage: a band of rows of an interval of an octave
+void SiftExtractor::findExtrema(SiftThread* self, int job)
+{
+  int o = 0;
+  int bands = 0;
+  for(; o<numOctaves; o++)
+    {
+      bands = getBands(octaveHeight[o] - 2 * SIFT_BORDER);
+      if(job < bands * params.intervals)
+	break;
+      job -= bands * params.intervals;
+    }
+  int interval = 1 + job / bands;
+  int width = octaveWidth[o];
+  int height = octaveHeight[o];
+  int first = SIFT_BORDER + (job % bands) * SIFT_BAND_ROWS;
+  int end = first + SIFT_BAND_ROWS < height - SIFT_BORDER ? first + SIFT_BAND_ROWS : height - SIFT_BORDER;
+
+  float threshold = (float)(0.5 * params.contrastThreshold / params.intervals);
+  for(int r=first; r<end; r++)
+    {
+      const float* row = dog[o][interval] + (size_t)r * width;
+      for(int c=SIFT_BORDER; c<width-SIFT_BORDER; c++)
+	{
+	  float v = row[c];
+	  if(fabsf(v) <= threshold || !isExtremum(dog[o], interval, width, r, c, v))
+	    continue;
+
+	  SiftKeypoint kp;
+	  if(!this->interpolateExtremum(o, interval, r, c, &kp) ||
+	     this->isEdgeLike(dog[o][kp.interval], width, kp.row, kp.col))
+	    continue;
+	  if(self->numKeypoints==self->keypointCapacity)
+	    {
+	      self->keypointCapacity = self->keypointCapacity>0 ? 2 * self->keypointCapacity : SIFT_KEYPOINTS;
+	      self->keypoints = (SiftKeypoint*)realloc(self->keypoints, self->keypointCapacity * sizeof(SiftKeypoint));
+	    }
+	  self->keypoints[self->numKeypoints++] = kp;
+	}
+    }
+}
+
+// Interpolate an extremum to sub-pixel and sub-interval accuracy,
+// moving to the neighbouring sample while it is off by more than half
+// (interp_extremum() of libfeat); false if it leaves the octave, does
+// not settle or has too little contrast
+bool SiftExtractor::interpolateExtremum(int o, int interval, int r, int c, SiftKeypoint* kp)
+{
+  int width = octaveWidth[o];
+  int height = octaveHeight[o];
+  double xi = 0, xr = 0, xc = 0;
+  double dx = 0, dy = 0, ds = 0;
+  int step = 0;
+  for(; step<SIFT_INTERP_STEPS; step++)
+    {
+      const float* prev = dog[o][interval-1] + (size_t)r * width + c;
+      const float* cur = dog[o][interval] + (size_t)r * width + c;
+      const float* next = dog[o][interval+1] + (size_t)r * width + c;
+      double v = cur[0];
+      dx = (cur[1] - cur[-1]) * 0.5;
+      dy = (cur[width] - cur[-width]) * 0.5;
+      ds = (next[0] - prev[0]) * 0.5;
+      double dxx = cur[1] + cur[-1] - 2 * v;
+      double dyy = cur[width] + cur[-width] - 2 * v;
+      double dss = next[0] + prev[0] - 2 * v;
+      double dxy = (cur[width+1] - cur[width-1] - cur[-width+1] + cur[-width-1]) * 0.25;
+      double dxs = (next[1] - next[-1] - prev[1] + prev[-1]) * 0.25;
+      double dys = (next[width] - next[-width] - prev[width] + prev[-width]) * 0.25;
+
+      // the offset is -H^-1 * gradient
+      double a00 = dyy * dss - dys * dys;
+      double a01 = dxs * dys - dxy * dss;
+      double a02 = dxy * dys - dxs * dyy;
+      double a11 = dxx * dss - dxs * dxs;
+      double a12 = dxs * dxy - dxx * dys;
+      double a22 = dxx * dyy - dxy * dxy;
+      double det = dxx * a00 + dxy * a01 + dxs * a02;
+      if(det==0)
+	return false;
+      xc = -(a00 * dx + a01 * dy + a02 * ds) / det;
+      xr = -(a01 * dx + a11 * dy + a12 * ds) / det;
+      xi = -(a02 * dx + a12 * dy + a22 * ds) / det;
+      if(fabs(xi) < 0.5 && fabs(xr) < 0.5 && fabs(xc) < 0.5)
+	break;
+      if(fabs(xi) > height || fabs(xr) > height || fabs(xc) > width)
+	return false;
+
+      c += (int)roundHalfUp(xc);
+      r += (int)roundHalfUp(xr);
+      interval += (int)roundHalfUp(xi);
+      if(interval < 1 || interval > params.intervals ||
+	 c < SIFT_BORDER || r < SIFT_BORDER || c >= width - SIFT_BORDER || r >= height - SIFT_BORDER)
+	return false;
+    }
+  if(step >= SIFT_INTERP_STEPS)
+    return false;
+
+  double contrast = dog[o][interval][(size_t)r * width + c] + 0.5 * (dx * xc + dy * xr + ds * xi);
+  if(fabs(contrast) < params.contrastThreshold / params.intervals)
+    return false;
+
+  // scale and position in the image (calc_feature_scales() and
+  // adjust_for_img_dbl())
+  double position = params.doubleImage ? 0.5 : 1.0;
+  double octaveScale = params.sigma * pow(2.0, (interval + xi) / params.intervals);
+  kp->octave = o;
+  kp->interval = interval;
+  kp->row = r;
+  kp->col = c;
+  kp->subInterval = (float)xi;
+  kp->x = (float)((c + xc) * (1 << o) * position);
+  kp->y = (float)((r + xr) * (1 << o) * position);
+  kp->scale = (float)(octaveScale * (1 << o) * position);
+  kp->octaveScale = (float)octaveScale;
+  kp->numOris = 0;
+  return true;
+}
+
+// true if the ratio of the principal curvatures at r, c is above the
+// threshold (an edge rather than a corner)
+bool SiftExtractor::isEdgeLike(const float* dogLevel, int width, int r, int c)
+{
+  const float* p = dogLevel + (size_t)r * width + c;
+  double d = p[0];
+  double dxx = p[1] + p[-1] - 2 * d;
+  double dyy = p[width] + p[-width] - 2 * d;
+  double dxy = (p[width+1] - p[width-1] - p[-width+1] + p[-width-1]) * 0.25;
+  double tr = dxx + dyy;
+  double det = dxx * dyy - dxy * dxy;
+  if(det <= 0)
+    return true;
+  double curv = params.curvatureThreshold;
+  return tr * tr / det >= (curv + 1) * (curv + 1) / curv;
+}
+
+// the orientations of a keypoint: peaks of the histogram of the
+// gradients around it, as calc_feature_oris()
+void SiftExtractor::orientKeypoint(SiftKeypoint* kp)
+{
+  const float* img = gauss[kp->octave][kp->interval];
+  int width = octaveWidth[kp->octave];
+  int height = octaveHeight[kp->octave];
+  int radius = (int)roundHalfUp(SIFT_ORI_WINDOW * kp->octaveScale);
+  double sigma = SIFT_ORI_SIGMA * kp->octaveScale;
+  double expDenom = 2 * sigma * sigma;
+
+  double hist[SIFT_ORI_BINS];
+  memset(hist, 0, sizeof(hist));
+  for(int i=-radius; i<=radius; i++)
+    for(int j=-radius; j<=radius; j++)
+      {
+	double mag, ori;
+	if(!getGradient(img, width, height, kp->row + i, kp->col + j, &mag, &ori))
+	  continue;
+	double w = exp(-(i*i + j*j) / expDenom);
+	int bin = (int)roundHalfUp(SIFT_ORI_BINS * (ori + M_PI) / (2 * M_PI));
+	hist[bin < SIFT_ORI_BINS ? bin : 0] += w * mag;
+      }
+
+  for(int pass=0; pass<SIFT_ORI_SMOOTHING; pass++)
+    {
+      double first = hist[0];
+      double prev = hist[SIFT_ORI_BINS-1];
+      for(int i=0; i<SIFT_ORI_BINS; i++)
+	{
+	  double cur = hist[i];
+	  hist[i] = 0.25 * prev + 0.5 * hist[i] + 0.25 * (i+1==SIFT_ORI_BINS ? first : hist[i+1]);
+	  prev = cur;
+	}
+    }
+
+  double highest = hist[0];
+  for(int i=1; i<SIFT_ORI_BINS; i++)
+    if(hist[i] > highest)
+      highest = hist[i];
+
+  // every peak close to the highest, interpolated between its neighbours
+  kp->numOris = 0;
+  for(int i=0; i<SIFT_ORI_BINS && kp->numOris<SIFT_MAX_ORIS; i++)
+    {
+      double l = hist[i==0 ? SIFT_ORI_BINS-1 : i-1];
+      double r = hist[(i+1) % SIFT_ORI_BINS];
+      if(hist[i] <= l || hist[i] <= r || hist[i] < highest * SIFT_ORI_PEAK)
+	continue;
+      double bin = i + 0.5 * (l - r) / (l - 2 * hist[i] + r);
+      bin = bin < 0 ? SIFT_ORI_BINS + bin : bin >= SIFT_ORI_BINS ? bin - SIFT_ORI_BINS : bin;
+      kp->ori[kp->numOris++] = (float)(2 * M_PI * bin / SIFT_ORI_BINS - M_PI);
+    }
+}
+
+// the descriptor of a keypoint at one of its orientations, as
+// compute_descriptors()
+void SiftExtractor::describeFeature(const SiftKeypoint* kp, float orientation, struct feature* feat)
+{
+  const float* img = gauss[kp->octave][kp->interval];
+  int width = octaveWidth[kp->octave];
+  int height = octaveHeight[kp->octave];
+  const int d = SIFT_DESCR_GRID;
+  const int n = SIFT_DESCR_BINS;
+  double ori = orientation;
+  double cosT = cos(ori);
+  double sinT = sin(ori);
+  double binsPerRad = n / (2 * M_PI);
+  double expDenom = d * d * 0.5;
+  double histWidth = SIFT_DESCR_CELL * kp->octaveScale;
+  int radius = (int)(histWidth * sqrt(2.0) * (d + 1.0) * 0.5 + 0.5);
+
+  double hist[SIFT_DESCR_GRID][SIFT_DESCR_GRID][SIFT_DESCR_BINS];
+  memset(hist, 0, sizeof(hist));
+  for(int i=-radius; i<=radius; i++)
+    for(int j=-radius; j<=radius; j++)
+      {
+	// the sample in the frame of the keypoint, in cells
+	double cRot = (j * cosT - i * sinT) / histWidth;
+	double rRot = (j * sinT + i * cosT) / histWidth;
+	double rbin = rRot + d / 2 - 0.5;
+	double cbin = cRot + d / 2 - 0.5;
+	double mag, gradOri;
+	if(rbin <= -1 || rbin >= d || cbin <= -1 || cbin >= d ||
+	   !getGradient(img, width, height, kp->row + i, kp->col + j, &mag, &gradOri))
+	  continue;
+	gradOri -= ori;
+	while(gradOri < 0)
+	  gradOri += 2 * M_PI;
+	while(gradOri >= 2 * M_PI)
+	  gradOri -= 2 * M_PI;
+	double obin = gradOri * binsPerRad;
+	double w = exp(-(cRot * cRot + rRot * rRot) / expDenom) * mag;
+
+	// trilinear interpolation into the neighbouring bins
+	int r0 = (int)floor(rbin);
+	int c0 = (int)floor(cbin);
+	int o0 = (int)floor(obin);
+	double dr = rbin - r0;
+	double dc = cbin - c0;
+	double dor = obin - o0;
+	for(int a=0; a<=1; a++)
+	  {
+	    int rb = r0 + a;
+	    if(rb < 0 || rb >= d)
+	      continue;
+	    double vr = w * (a==0 ? 1 - dr : dr);
+	    for(int b=0; b<=1; b++)
+	      {
+		int cb = c0 + b;
+		if(cb < 0 || cb >= d)
+		  continue;
+		double vc = vr * (b==0 ? 1 - dc : dc);
+		for(int e=0; e<=1; e++)
+		  hist[rb][cb][(o0 + e) % n] += vc * (e==0 ? 1 - dor : dor);
+	      }
+	  }
+      }
+
+  // normalized, clipped against lighting changes and normalized again,
+  // then whole numbers
+  double* descr = &hist[0][0][0];
+  const int length = d * d * n;
+  for(int pass=0; pass<2; pass++)
+    {
+      double lenSq = 0;
+      for(int i=0; i<length; i++)
+	lenSq += descr[i] * descr[i];
+      double inv = lenSq > 0 ? 1 / sqrt(lenSq) : 0;
+      for(int i=0; i<length; i++)
+	{
+	  descr[i] *= inv;
+	  if(pass==0 && descr[i] > SIFT_DESCR_CLIP)
+	    descr[i] = SIFT_DESCR_CLIP;
+	}
+    }
+
+  memset(feat, 0, sizeof(struct feature));
+  feat->x = feat->img_pt.x = kp->x;
+  feat->y = feat->img_pt.y = kp->y;
+  feat->scl = kp->scale;
+  feat->ori = ori;
+  feat->type = FEATURE_LOWE;
+  feat->d = length;
+  for(int i=0; i<length; i++)
+    {
+      int v = (int)(SIFT_DESCR_INT * descr[i]);
+      feat->descr[i] = v < 255 ? v : 255;
+    }
+}
+
+int SiftExtractor::extract(const uint8_t* img, int width, int height, int stride, struct feature** feat)
+{
+  *feat = NULL;
+  if(threads==NULL)
+    {
+      fprintf( stderr, "SIFT extractor not initialized\n" );
+      return -1;
+    }
+  if(this->reserve(width, height)<0)
+    return -1;
+  if(numOctaves==0)
+    {
+      *feat = (struct feature*)calloc(1, sizeof(struct feature));
+      return 0;
+    }
+
+  // the first level: the image (doubled) and blurred to sigma; the
+  // image goes through the first DoG level, which is free until then
+  image = img;
+  imageWidth = width;
+  imageHeight = height;
+  imageStride = stride;
+  stageDst = dog[0][0];
+  if(params.doubleImage)
+    {
+      this->runStage(STAGE_UPSAMPLE_ROWS, getBands(height));
+      this->runStage(STAGE_UPSAMPLE_COLS, getBands(octaveHeight[0]));
+    }
+  else
+    this->runStage(STAGE_CONVERT, getBands(height));
+  this->blur(0, 0, dog[0][0], gauss[0][0], NULL);
+
+  // the octaves, each from the one before
+  int levels = params.intervals + 3;
+  for(int o=0; o<numOctaves; o++)
+    {
+      if(o > 0)
+	{
+	  stageOctave = o;
+	  stageSrc = gauss[o-1][params.intervals];
+	  stageDst = gauss[o][0];
+	  this->runStage(STAGE_DOWNSAMPLE, getBands(octaveHeight[o]));
+	}
+      for(int l=1; l<levels; l++)
+	this->blur(o, l, gauss[o][l-1], gauss[o][l], dog[o][l-1]);
+    }
+
+  // the keypoints of all threads, in the order of the pyramid
+  int jobs = 0;
+  for(int o=0; o<numOctaves; o++)
+    jobs += getBands(octaveHeight[o] - 2 * SIFT_BORDER) * params.intervals;
+  for(int t=0; t<numThreads; t++)
+    threads[t].numKeypoints = 0;
+  this->runStage(STAGE_EXTREMA, jobs);
+
+  numKeypoints = 0;
+  for(int t=0; t<numThreads; t++)
+    numKeypoints += threads[t].numKeypoints;
+  if(numKeypoints > keypointCapacity)
+    {
+      keypointCapacity = numKeypoints;
+      keypoints = (SiftKeypoint*)realloc(keypoints, keypointCapacity * sizeof(SiftKeypoint));
+    }
+  int k = 0;
+  for(int t=0; t<numThreads; t++)
+    {
+      memcpy(keypoints + k, threads[t].keypoints, threads[t].numKeypoints * sizeof(SiftKeypoint));
+      k += threads[t].numKeypoints;
+    }
+  qsort(keypoints, numKeypoints, sizeof(SiftKeypoint), compareKeypoints);
+
+  this->runStage(STAGE_ORIENT, (numKeypoints + SIFT_CHUNK - 1) / SIFT_CHUNK);
+
+  // a feature for every orientation, largest first
+  int numFeatures = 0;
+  for(k=0; k<numKeypoints; k++)
+    numFeatures += keypoints[k].numOris;
+  int chunks = (numFeatures + SIFT_CHUNK - 1) / SIFT_CHUNK;
+  if(chunks * SIFT_CHUNK > orientedCapacity)
+    {
+      orientedCapacity = chunks * SIFT_CHUNK;
+      oriented = (SiftOrientedKeypoint*)realloc(oriented, orientedCapacity * sizeof(SiftOrientedKeypoint));
+    }
+  int f = 0;
+  for(k=0; k<numKeypoints; k++)
+    for(int i=0; i<keypoints[k].numOris; i++, f++)
+      {
+	oriented[f].keypoint = k;
+	oriented[f].ori = i;
+	oriented[f].scale = keypoints[k].scale;
+      }
+  qsort(oriented, numFeatures, sizeof(SiftOrientedKeypoint), compareOriented);
+  for(; f<chunks * SIFT_CHUNK; f++)
+    oriented[f].keypoint = -1;
+
+  features = (struct feature*)calloc(numFeatures>0 ? numFeatures : 1, sizeof(struct feature));
+  if(features==NULL)
+    {
+      fprintf( stderr, "Cannot allocate %d SIFT features\n", numFeatures );
+      return -1;
+    }
+  this->runStage(STAGE_DESCRIBE, chunks);
+  *feat = features;
+  features = NULL;
+  image = NULL;
+  return numFeatures;
+}
+
+int SiftExtractor::extract(const IplImage* img, struct feature** feat)
+{
+  *feat = NULL;
+  if(img->depth!=IPL_DEPTH_8U || (img->nChannels!=1 && img->nChannels!=3))
+    {
+      fprintf( stderr, "SIFT extraction needs an 8 bit gray or BGR image\n" );
+      return -1;
+    }
+  if(img->nChannels==1)
+    return this->extract((const uint8_t*)img->imageData, img->width, img->height, img->widthStep, feat);
+
+  // gray as cvCvtColor(CV_BGR2GRAY)
+  if(graySize < img->width * img->height)
+    {
+      delete[] gray;
+      graySize = img->width * img->height;
+      gray = new uint8_t[graySize];
+    }
+  for(int y=0; y<img->height; y++)
+    {
+      const uint8_t* src = (const uint8_t*)img->imageData + (size_t)y * img->widthStep;
+      uint8_t* dst = gray + (size_t)y * img->width;
+      for(int x=0; x<img->width; x++, src+=3)
+	dst[x] = (uint8_t)((src[0] * 1868 + src[1] * 9617 + src[2] * 4899 + (1 << 13)) >> 14);
+    }
+  return this->extract(gray, img->width, img->height, img->width, feat);
+}
+
+// stop the threads and free the pyramid
+void SiftExtractor::fini()
+{
+  if(threads!=NULL)
+    {
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_broadcast(&stageReady);
+      pthread_mutex_unlock(&mutex);
+
+      for(int t=0; t<numThreads; t++)
+	{
+	  if(threads[t].started)
+	    pthread_join(threads[t].thread, NULL);
+	  delete[] threads[t].row;
+	  free(threads[t].keypoints);
+	}
+      delete[] threads;
+      threads = NULL;
+      numThreads = 0;
+    }
+
+  for(int l=0; l<SIFT_MAX_INTERVALS+3; l++)
+    {
+      delete[] kernels[l];
+      kernels[l] = NULL;
+      kernelRadius[l] = 0;
+    }
+  free(buffer);
+  buffer = NULL;
+  bufferSize = 0;
+  numOctaves = 0;
+  delete[] gray;
+  gray = NULL;
+  graySize = 0;
+  free(keypoints);
+  keypoints = NULL;
+  numKeypoints = 0;
+  keypointCapacity = 0;
+  free(oriented);
+  oriented = NULL;
+  orientedCapacity = 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * SIFT feature extraction on a pool of threads, in place of
+ * sift_features() of libfeat.
+ *
+ * The steps are those of libfeat (Lowe's SIFT with its defaults): the
+ * image is doubled and blurred into a Gaussian pyramid of octaves, the
+ * differences of its levels (DoG) are searched for extrema, which are
+ * interpolated to sub-pixel keypoints, and every keypoint gets an
+ * orientation (or several) and a 4x4x8 descriptor. Each step is split
+ * across the threads: the pyramid and the DoG in bands of rows of each
+ * level (all threads read the whole level before, so bands need no
+ * overlap), the extrema in bands of rows of every interval of every
+ * octave, orientations by keypoint and descriptors by feature. Keypoints
+ * are put back in a fixed order before orientations are assigned, so the
+ * features do not depend on the number of threads.
+ *
+ * The pyramid, the keypoints and the scratch space of the threads stay
+ * allocated from one image to the next and are only reallocated when the
+ * image grows, so extracting the features of a stream of frames
+ * allocates nothing but the returned array.
+ *
+ * The result is an array of struct feature as sift_features() returns
+ * it (image coordinates, scale, orientation and a 128 byte descriptor
+ * of whole numbers up to 255, sorted by decreasing scale), so it goes
+ * to FeatureDB, FeatureMatcher and the libfeat functions unchanged.
+ */
+
+#ifndef _SIFT_EXTRACTOR_HH_
+#define _SIFT_EXTRACTOR_HH_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <opencv/cv.h>
+#include <sift/imgfeatures.h>
+
+// most threads of an extractor
+#define SIFT_MAX_THREADS 64
+
+// most octaves of a pyramid
+#define SIFT_MAX_OCTAVES 16
+
+// most intervals of an octave
+#define SIFT_MAX_INTERVALS 8
+
+// most orientations of a keypoint (peaks of the orientation histogram)
+#define SIFT_MAX_ORIS 18
+
+// what to extract
+typedef struct _SiftParams
+{
+  // intervals of an octave
+  int intervals;
+
+  // blur of the first level of an octave
+  double sigma;
+
+  // least DoG contrast of a keypoint, for pixels from 0 to 1
+  double contrastThreshold;
+
+  // most ratio of the principal curvatures of a keypoint
+  int curvatureThreshold;
+
+  // double the image first (finds about four times as many features, at
+  // four times the cost)
+  bool doubleImage;
+} SiftParams;
+
+// the defaults of sift_features() (SIFT_INTVLS, SIFT_SIGMA,
+// SIFT_CONTR_THR, SIFT_CURV_THR and SIFT_IMG_DBL)
+void initSiftParams(SiftParams* params);
+
+// an extremum of the DoG, interpolated
+typedef struct _SiftKeypoint
+{
+  // where it was found
+  int octave;
+  int interval;
+  int row, col;
+
+  // offset of the interpolated extremum from the interval
+  float subInterval;
+
+  // position in the image, and scale in the image and in the octave
+  float x, y;
+  float scale;
+  float octaveScale;
+
+  // its orientations
+  int numOris;
+  float ori[SIFT_MAX_ORIS];
+} SiftKeypoint;
+
+// a feature to describe: a keypoint, one of its orientations and its
+// scale (to sort by)
+typedef struct _SiftOrientedKeypoint
+{
+  int keypoint;
+  int ori;
+  float scale;
+} SiftOrientedKeypoint;
+
+class SiftExtractor;
+
+// a thread of the pool and its scratch space
+typedef struct _SiftThread
+{
+  SiftExtractor* extractor;
+  pthread_t thread;
+  bool started;
+
+  // batches of jobs taken
+  uint64_t generation;
+
+  // a padded row of the level being blurred
+  float* row;
+  int rowSize;
+
+  // the keypoints it found
+  SiftKeypoint* keypoints;
+  int numKeypoints;
+  int keypointCapacity;
+} SiftThread;
+
+
+class SiftExtractor
+{
+ public:
+  SiftExtractor();
+  ~SiftExtractor();
+
+  // extract on nThreads threads, the calling one included
+  int init(int nThreads, const SiftParams* params=NULL);
+
+  // Find the SIFT features of an 8 bit gray image of width x height
+  // pixels, rows stride bytes apart. *features is a new array (free() it
+  // as the one of sift_features()); returns how many, -1 on error
+  int extract(const uint8_t* gray, int width, int height, int stride, struct feature** features);
+
+  // the same for an 8 bit gray or BGR image
+  int extract(const IplImage* img, struct feature** features);
+
+  int getThreadCount();
+
+  // stop the threads and free the pyramid
+  void fini();
+
+ private:
+  // a step of the extraction; its jobs are bands of rows, keypoints or
+  // features
+  enum Stage
+  {
+    STAGE_UPSAMPLE_ROWS = 0,
+    STAGE_UPSAMPLE_COLS,
+    STAGE_CONVERT,
+    STAGE_BLUR_ROWS,
+    STAGE_BLUR_COLS,
+    STAGE_DOWNSAMPLE,
+    STAGE_EXTREMA,
+    STAGE_ORIENT,
+    STAGE_DESCRIBE
+  };
+
+  static void* workerThread(void* arg);
+  void work(SiftThread* self);
+
+  // run numJobs jobs of a stage on all threads; blocks until they are
+  // done
+  void runStage(Stage stage, int numJobs);
+
+  // take jobs of the current stage until there are none left
+  void runJobs(SiftThread* self);
+  void runJob(SiftThread* self, int job);
+
+  // make room for the pyramid of a width x height image
+  int reserve(int width, int height);
+
+  // blur src into dst (both of the size of octave o) by the kernel of
+  // level l, and the difference of the two into dog if not NULL
+  void blur(int o, int l, const float* src, float* dst, float* dog);
+
+  // the jobs of the stages
+  void blurRows(SiftThread* self, int first, int end);
+  void blurCols(int first, int end);
+  void findExtrema(SiftThread* self, int job);
+  bool interpolateExtremum(int o, int interval, int r, int c, SiftKeypoint* kp);
+  bool isEdgeLike(const float* dog, int width, int r, int c);
+  void orientKeypoint(SiftKeypoint* kp);
+  void describeFeature(const SiftKeypoint* kp, float ori, struct feature* feat);
+
+  SiftParams params;
+
+  SiftThread* threads;
+  int numThreads;
+
+  // the pyramid: gaussian levels (intervals+3) and their differences
+  // (intervals+2) of each octave, and a level to blur through
+  float* buffer;
+  size_t bufferSize;
+  float* gauss[SIFT_MAX_OCTAVES][SIFT_MAX_INTERVALS+3];
+  float* dog[SIFT_MAX_OCTAVES][SIFT_MAX_INTERVALS+2];
+  float* tmp;
+  int octaveWidth[SIFT_MAX_OCTAVES];
+  int octaveHeight[SIFT_MAX_OCTAVES];
+  int numOctaves;
+
+  // the blur kernels of the levels (half of each, from the center)
+  float* kernels[SIFT_MAX_INTERVALS+3];
+  int kernelRadius[SIFT_MAX_INTERVALS+3];
+
+  // the image being extracted; gray is the converted one of extract(IplImage*)
+  const uint8_t* image;
+  int imageWidth;
+  int imageHeight;
+  int imageStride;
+  uint8_t* gray;
+  int graySize;
+
+  // arguments of the blur, resampling and extrema stages
+  const float* stageSrc;
+  float* stageDst;
+  float* stageDog;
+  int stageOctave;
+  int stageLevel;
+
+  // the keypoints of all threads in order, and the features to describe
+  SiftKeypoint* keypoints;
+  int numKeypoints;
+  int keypointCapacity;
+  SiftOrientedKeypoint* oriented;
+  int orientedCapacity;
+  struct feature* features;
+
+  // current stage, next job to take and jobs of the stage
+  Stage stage;
+  volatile int nextJob;
+  int numJobs;
+
+  // stages started, and pool threads still working on the current one
+  pthread_mutex_t mutex;
+  pthread_cond_t stageReady;
+  pthread_cond_t stageDone;
+  uint64_t generation;
+  int busy;
+  bool stopping;
+};
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Bounded lock-free queue for exactly one producer thread and one
+ * consumer thread, used to connect the stages of the stereo pipeline.
+ */
+
+#ifndef _SPSC_QUEUE_HH_
+#define _SPSC_QUEUE_HH_
+
+template <class T>
+class SpscQueue
+{
+ public:
+  // queue holding up to capacity items
+  SpscQueue(int capacity)
+  {
+    size = capacity + 1;
+    items = new T[size];
+    head = 0;
+    tail = 0;
+  }
+
+  ~SpscQueue()
+  {
+    delete[] items;
+  }
+
+  // add an item (producer only); false if the queue is full
+  bool push(const T& item)
+  {
+    int next = (tail + 1) % size;
+    if(next == head)
+      return false;
+    items[tail] = item;
+    // publish the item before the new tail
+    __sync_synchronize();
+    tail = next;
+    return true;
+  }
+
+  // remove an item (consumer only); false if the queue is empty
+  bool pop(T* item)
+  {
+    if(head == tail)
+      return false;
+    __sync_synchronize();
+    *item = items[head];
+    // read the item before handing the slot back
+    __sync_synchronize();
+    head = (head + 1) % size;
+    return true;
+  }
+
+  // true if there is nothing to pop (a hint only when called by the producer)
+  bool empty()
+  {
+    return head == tail;
+  }
+
+ private:
+  T* items;
+  int size;
+
+  // next item to pop (written by the consumer only)
+  volatile int head;
+
+  // next free slot (written by the producer only)
+  volatile int tail;
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * Offline stereo processing of recordings on a pool of workers, each
+ * with its own BumbleBee, written out in frame order.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "StereoBatch.h"
+#include "StereoLog.h"
+
+void initStereoBatchParams(StereoBatchParams* params, int bbId)
+{
+  memset(params, 0, sizeof(StereoBatchParams));
+  params->bbId = bbId;
+  params->scale = 2;
+  params->minDisparity = 0;
+  params->maxDisparity = 240;
+  params->engine = STEREO_TRICLOPS;
+  params->remap = false;
+  params->depth = false;
+  params->maxFrames = 0;
+}
+
+StereoBatch::StereoBatch()
+{
+  workers = NULL;
+  numWorkers = 0;
+  out = NULL;
+  stopping = false;
+  memset(&stats, 0, sizeof(stats));
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&slotFilled, NULL);
+  pthread_cond_init(&slotFreed, NULL);
+}
+
+StereoBatch::~StereoBatch()
+{
+  this->fini();
+  pthread_cond_destroy(&slotFreed);
+  pthread_cond_destroy(&slotFilled);
+  pthread_mutex_destroy(&mutex);
+}
+
+// set up the BumbleBee of a worker
+int StereoBatch::initWorker(BatchWorker* worker, const char* fname)
+{
+  if(StereoLogReader::isLog(fname))
+    worker->source = new LogFrameSource(fname, REPLAY_FAST);
+  else
+    worker->source = new BlobFileFrameSource(fname, REPLAY_FAST);
+  if(worker->source->setStride(worker->index, numWorkers)<0)
+    return -1;
+
+  // color output is not needed for disparities
+  worker->bb = new BumbleBee(worker->source, params.bbId, params.scale, false, params.engine);
+  if(worker->bb->init()<0)
+    {
+      delete worker->bb;
+      worker->bb = NULL;
+      return -1;
+    }
+  if(worker->bb->setDisparity(params.minDisparity, params.maxDisparity)<0 ||
+     (params.remap && worker->bb->setRemapRectify(true)<0) ||
+     worker->bb->setFrameWait(FRAME_WAIT_FOREVER)<0)
+    return -1;
+
+  // init() took the first frame of the stride to set up; start over
+  if(worker->source->restart()<0)
+    return -1;
+
+  size_t n = (size_t)worker->bb->getDisparityWidth() * worker->bb->getDisparityHeight();
+  for(int k=0; k<BATCH_SLOTS; k++)
+    {
+      worker->slots[k].disparity = new unsigned short[n];
+      worker->slots[k].depth = params.depth ? new float[n] : NULL;
+    }
+  return 0;
+}
+
+int StereoBatch::run(const char* fname, const char* output, int nThreads, const StereoBatchParams* batchParams)
+{
+  this->fini();
+  if(nThreads<1 || nThreads>BATCH_MAX_THREADS)
+    {
+      fprintf( stderr, "Invalid number of batch threads %d\n", nThreads );
+      return -1;
+    }
+  params = *batchParams;
+  memset(&stats, 0, sizeof(stats));
+  stats.threads = nThreads;
+  stopping = false;
+
+  if(output!=NULL)
+    {
+      out = fopen(output, "wb");
+      if(out==NULL)
+	{
+	  fprintf( stderr, "Cannot open %s: %s\n", output, strerror(errno) );
+	  return -1;
+	}
+    }
+
+  uint64_t start = getWallclockTime();
+  numWorkers = nThreads;
+  workers = new BatchWorker[numWorkers];
+  for(int w=0; w<numWorkers; w++)
+    {
+      BatchWorker* worker = &workers[w];
+      memset(worker, 0, sizeof(BatchWorker));
+      worker->batch = this;
+      worker->index = w;
+    }
+  for(int w=0; w<numWorkers; w++)
+    if(this->initWorker(&workers[w], fname)<0)
+      {
+	fprintf( stderr, "Cannot set up batch worker %d\n", w );
+	this->fini();
+	return -1;
+      }
+  stats.setup = (getWallclockTime() - start) * 1e-6;
+
+  start = getWallclockTime();
+  for(int w=0; w<numWorkers; w++)
+    {
+      if(pthread_create(&workers[w].thread, NULL, StereoBatch::workerThread, &workers[w])!=0)
+	{
+	  fprintf( stderr, "Cannot start batch worker %d\n", w );
+	  this->fini();
+	  return -1;
+	}
+      workers[w].started = true;
+    }
+
+  // frame i is frame i / nThreads of worker i % nThreads; the first worker
+  // out of frames marks the end of the recording
+  int ret = 0;
+  for(int i=0; ; i++)
+    {
+      BatchWorker* worker = &workers[i % numWorkers];
+      pthread_mutex_lock(&mutex);
+      while(worker->consumed==worker->produced && !worker->done)
+	pthread_cond_wait(&slotFilled, &mutex);
+      bool more = worker->consumed < worker->produced;
+      pthread_mutex_unlock(&mutex);
+      if(!more)
+	break;
+
+      if(out!=NULL && this->writeSlot(&worker->slots[worker->consumed % BATCH_SLOTS])<0)
+	{
+	  ret = -1;
+	  break;
+	}
+      stats.frames++;
+
+      pthread_mutex_lock(&mutex);
+      worker->consumed++;
+      pthread_cond_broadcast(&slotFreed);
+      pthread_mutex_unlock(&mutex);
+    }
+
+  // a worker that failed ended the batch early
+  pthread_mutex_lock(&mutex);
+  for(int w=0; w<numWorkers; w++)
+    if(workers[w].failed)
+      ret = -1;
+  pthread_mutex_unlock(&mutex);
+
+  stats.elapsed = (getWallclockTime() - start) * 1e-6;
+  stats.framesPerSec = stats.elapsed>0 ? stats.frames / stats.elapsed : 0;
+  this->fini();
+  return ret;
+}
+
+void* StereoBatch::workerThread(void* arg)
+{
+  BatchWorker* worker = (BatchWorker*)arg;
+  worker->batch->work(worker);
+  return NULL;
+}
+
+// process the frames of a worker into its slots
+void StereoBatch::work(BatchWorker* worker)
+{
+  BumbleBee* bb = worker->bb;
+  bool failed = false;
+  for(;;)
+    {
+      int frame = worker->source->getFrameIndex();
+      if(params.maxFrames>0 && frame >= params.maxFrames)
+	break;
+
+      pthread_mutex_lock(&mutex);
+      while(worker->produced - worker->consumed >= BATCH_SLOTS && !stopping)
+	pthread_cond_wait(&slotFreed, &mutex);
+      bool stop = stopping;
+      pthread_mutex_unlock(&mutex);
+      if(stop)
+	break;
+
+      // the end of the recording, or a frame that failed
+      ImageView disparity, depth;
+      if(bb->capture()<0)
+	{
+	  if(!worker->source->atEnd())
+	    {
+	      fprintf( stderr, "Batch worker %d cannot process frame %d\n", worker->index, frame );
+	      failed = true;
+	    }
+	  break;
+	}
+      if(bb->getDisparityView(&disparity)<0 ||
+	 (params.depth && bb->getDepthView(&depth)<0))
+	{
+	  fprintf( stderr, "Batch worker %d has no disparities of frame %d\n", worker->index, frame );
+	  failed = true;
+	  break;
+	}
+
+      BatchSlot* slot = &worker->slots[worker->produced % BATCH_SLOTS];
+      StereoBatchRecord* h = &slot->header;
+      memset(h, 0, sizeof(StereoBatchRecord));
+      h->magic = STEREO_BATCH_MAGIC;
+      h->frameId = frame;
+      h->timestamp = disparity.timestamp;
+      h->cols = disparity.width;
+      h->rows = disparity.height;
+      h->minDisparity = params.minDisparity;
+      h->maxDisparity = params.maxDisparity;
+      h->scale = params.scale;
+      h->hasDepth = params.depth ? 1 : 0;
+
+      // the rows are packed in the slot
+      for(int i=0; i<disparity.height; i++)
+	memcpy(slot->disparity + (size_t)i * disparity.width, disparity.data + (size_t)i * disparity.stride,
+	       disparity.width * sizeof(unsigned short));
+      if(params.depth)
+	for(int i=0; i<depth.height; i++)
+	  memcpy(slot->depth + (size_t)i * depth.width, depth.data + (size_t)i * depth.stride,
+		 depth.width * sizeof(float));
+
+      pthread_mutex_lock(&mutex);
+      worker->produced++;
+      pthread_cond_broadcast(&slotFilled);
+      pthread_mutex_unlock(&mutex);
+    }
+
+  pthread_mutex_lock(&mutex);
+  worker->done = true;
+  worker->failed = failed;
+  pthread_cond_broadcast(&slotFilled);
+  pthread_mutex_unlock(&mutex);
+}
+
+// write a slot to the output
+int StereoBatch::writeSlot(const BatchSlot* slot)
+{
+  size_t n = (size_t)slot->header.rows * slot->header.cols;
+  if(fwrite(&slot->header, sizeof(StereoBatchRecord), 1, out)!=1 ||
+     fwrite(slot->disparity, sizeof(unsigned short), n, out)!=n ||
+     (slot->header.hasDepth && fwrite(slot->depth, sizeof(float), n, out)!=n))
+    {
+      fprintf( stderr, "Cannot write frame %d of the batch output: %s\n",
+	       slot->header.frameId, strerror(errno) );
+      return -1;
+    }
+  stats.bytesWritten += sizeof(StereoBatchRecord) + n * sizeof(unsigned short);
+  if(slot->header.hasDepth)
+    stats.bytesWritten += n * sizeof(float);
+  return 0;
+}
+
+void StereoBatch::getStats(StereoBatchStats* batchStats)
+{
+  *batchStats = stats;
+}
+
+// stop the workers and free them
+void StereoBatch::fini()
+{
+  if(workers!=NULL)
+    {
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_broadcast(&slotFreed);
+      pthread_mutex_unlock(&mutex);
+
+      for(int w=0; w<numWorkers; w++)
+	{
+	  BatchWorker* worker = &workers[w];
+	  if(worker->started)
+	    pthread_join(worker->thread, NULL);
+	  if(worker->bb!=NULL)
+	    {
+	      worker->bb->fini();
+	      delete worker->bb;
+	    }
+	  delete worker->source;
+	  for(int k=0; k<BATCH_SLOTS; k++)
+	    {
+	      delete[] worker->slots[k].disparity;
+	      delete[] worker->slots[k].depth;
+	    }
+	}
+      delete[] workers;
+      workers = NULL;
+      numWorkers = 0;
+    }
+
+  if(out!=NULL)
+    fclose(out);
+  out = NULL;
+}
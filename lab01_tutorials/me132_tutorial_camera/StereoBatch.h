@@ -0,0 +1,176 @@
+/*
+ * Offline stereo processing of recordings (stereo logs or StereoImageBlob
+ * files) on all cores. Each worker thread owns a BumbleBee with its own
+ * Triclops context (and block matcher), fed by its own replay source
+ * that takes every n-th frame of the recording (see
+ * ReplayFrameSource::setStride()), so workers share nothing but the
+ * mapped log. Their disparity (and depth) images are written to the
+ * output in frame order, through a few slots per worker.
+ *
+ * An output file is a sequence of records: a StereoBatchRecord, the
+ * rows x cols disparities (16 bit, DISPARITY_INVALID_MIN and above
+ * invalid) and, if depth was asked for, rows x cols float depths [m]
+ * (NaN where invalid).
+ */
+
+#ifndef _STEREO_BATCH_HH_
+#define _STEREO_BATCH_HH_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "bb2.h"
+
+// "SBAT" in little endian
+#define STEREO_BATCH_MAGIC 0x54414253
+
+// most workers of a batch
+#define BATCH_MAX_THREADS 64
+
+// processed frames each worker may hold for the writer
+#define BATCH_SLOTS 2
+
+// what to compute
+typedef struct _StereoBatchParams
+{
+  // calibration file <bbId>.cal
+  int bbId;
+
+  // downscale of the rectified and disparity images (see BumbleBee)
+  int scale;
+
+  // disparity range (see BumbleBee::setDisparity())
+  int minDisparity;
+  int maxDisparity;
+
+  StereoEngine engine;
+
+  // rectify with remap tables (see BumbleBee::setRemapRectify())
+  bool remap;
+
+  // also write depth images
+  bool depth;
+
+  // stop after this many frames, 0 for all of them
+  int maxFrames;
+} StereoBatchParams;
+
+// the defaults of BumbleBee: scale 2, disparities 0 to 240, Triclops
+void initStereoBatchParams(StereoBatchParams* params, int bbId);
+
+// header of a frame of an output file
+typedef struct _StereoBatchRecord
+{
+  uint32_t magic;
+
+  // number of the frame in the recording, and its timestamp
+  int32_t frameId;
+  uint64_t timestamp;
+
+  // size of the disparity (and depth) image
+  int32_t cols, rows;
+
+  int32_t minDisparity;
+  int32_t maxDisparity;
+  int32_t scale;
+
+  // depths follow the disparities
+  uint32_t hasDepth;
+
+  // zero; pads the header to 64 bytes
+  uint32_t reserved[6];
+} StereoBatchRecord;
+
+// a processed frame held for the writer
+typedef struct _BatchSlot
+{
+  StereoBatchRecord header;
+  unsigned short* disparity;
+  float* depth;
+} BatchSlot;
+
+class StereoBatch;
+
+// a worker and the frames it holds
+typedef struct _BatchWorker
+{
+  StereoBatch* batch;
+  int index;
+
+  ReplayFrameSource* source;
+  BumbleBee* bb;
+  pthread_t thread;
+  bool started;
+
+  // frames put in the slots and taken by the writer; slot k % BATCH_SLOTS
+  // holds frame k of the worker (frame index + k * nThreads overall)
+  BatchSlot slots[BATCH_SLOTS];
+  int produced;
+  int consumed;
+
+  // no frames left or a frame failed, and which of the two
+  bool done;
+  bool failed;
+} BatchWorker;
+
+// rates of a batch
+typedef struct _StereoBatchStats
+{
+  int frames;
+  int threads;
+
+  // time to set up the workers, and to process the frames [s]
+  double setup;
+  double elapsed;
+
+  double framesPerSec;
+
+  // bytes written to the output
+  uint64_t bytesWritten;
+} StereoBatchStats;
+
+
+class StereoBatch
+{
+ public:
+  StereoBatch();
+  ~StereoBatch();
+
+  // Process the recording fname on nThreads workers and write the
+  // results to output in frame order (NULL to only time the processing).
+  // Blocks until the recording is done; -1 if it could not be set up, a
+  // frame could not be processed or the output could not be written
+  int run(const char* fname, const char* output, int nThreads, const StereoBatchParams* params);
+
+  void getStats(StereoBatchStats* stats);
+
+ private:
+  static void* workerThread(void* arg);
+  void work(BatchWorker* worker);
+
+  // set up the BumbleBee of a worker
+  int initWorker(BatchWorker* worker, const char* fname);
+
+  // write a slot to the output
+  int writeSlot(const BatchSlot* slot);
+
+  // stop the workers and free them
+  void fini();
+
+  StereoBatchParams params;
+  BatchWorker* workers;
+  int numWorkers;
+  FILE* out;
+
+  // the writer gives up; workers stop at their next frame
+  bool stopping;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t slotFilled;
+  pthread_cond_t slotFreed;
+
+  StereoBatchStats stats;
+};
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * Lossless predictive image coding for stereo logs.
+ */
+
+#include <string.h>
+
+#include "StereoCodec.h"
+
+// residuals of at least CODEC_ESCAPE << k are stored as 8 bits after
+// CODEC_ESCAPE ones, so no sample takes more than 16 bits
+#define CODEC_ESCAPE 8
+
+// bits of the Rice parameter of a block
+#define CODEC_K_BITS 3
+#define CODEC_K_MAX  7
+
+// median edge detector: a is left, b up and c up-left of the sample;
+// the median of a, b and a+b-c, without branches
+static inline int predictSample(int a, int b, int c)
+{
+  int lo = a<b ? a : b;
+  int hi = a<b ? b : a;
+  int p = a + b - c;
+  p = p<hi ? p : hi;
+  return p>lo ? p : lo;
+}
+
+// signed byte differences to 0, 1, 2, ... for -0, -1, +1, -2, ...
+static inline uint8_t zigzag(int d)
+{
+  int8_t s = (int8_t)d;
+  return (uint8_t)((s << 1) ^ (s >> 7));
+}
+
+static inline uint8_t unzigzag(uint8_t z)
+{
+  return (uint8_t)((z >> 1) ^ -(z & 1));
+}
+
+// the residuals of a row; up is the row dy rows up, NULL in the first ones
+static void residualRow(const uint8_t* row, const uint8_t* up, int n, int dx, uint8_t* res)
+{
+  int x = 0;
+  if(up==NULL)
+    {
+      for(; x<dx && x<n; x++)
+	res[x] = zigzag(row[x]);
+      for(; x<n; x++)
+	res[x] = zigzag(row[x] - row[x-dx]);
+    }
+  else
+    {
+      for(; x<dx && x<n; x++)
+	res[x] = zigzag(row[x] - up[x]);
+      for(; x<n; x++)
+	res[x] = zigzag(row[x] - predictSample(row[x-dx], up[x], up[x-dx]));
+    }
+}
+
+// undo residualRow() in place
+static void reconstructRow(uint8_t* row, const uint8_t* up, int n, int dx)
+{
+  int x = 0;
+  if(up==NULL)
+    {
+      for(; x<dx && x<n; x++)
+	row[x] = unzigzag(row[x]);
+      for(; x<n; x++)
+	row[x] = row[x-dx] + unzigzag(row[x]);
+    }
+  else
+    {
+      for(; x<dx && x<n; x++)
+	row[x] = up[x] + unzigzag(row[x]);
+      for(; x<n; x++)
+	row[x] = predictSample(row[x-dx], up[x], up[x-dx]) + unzigzag(row[x]);
+    }
+}
+
+
+// -------------------------------
+// Rice coding, least significant bit first
+// -------------------------------
+
+typedef struct _BitWriter
+{
+  uint8_t* p;
+  uint8_t* end;
+  uint64_t acc;
+  int n;
+  bool overflow;
+} BitWriter;
+
+static inline void putBits(BitWriter* w, uint32_t v, int n)
+{
+  w->acc |= (uint64_t)v << w->n;
+  w->n += n;
+  if(w->n < 32)
+    return;
+  if(w->end - w->p < 4)
+    w->overflow = true;
+  else
+    {
+      uint32_t word = (uint32_t)w->acc;
+      w->p[0] = word;
+      w->p[1] = word >> 8;
+      w->p[2] = word >> 16;
+      w->p[3] = word >> 24;
+      w->p += 4;
+    }
+  w->acc >>= 32;
+  w->n -= 32;
+}
+
+static void flushBits(BitWriter* w)
+{
+  while(w->n > 0)
+    {
+      if(w->p==w->end)
+	{
+	  w->overflow = true;
+	  return;
+	}
+      *w->p++ = (uint8_t)w->acc;
+      w->acc >>= 8;
+      w->n -= 8;
+    }
+}
+
+typedef struct _BitReader
+{
+  const uint8_t* src;
+  size_t size;
+
+  // next byte to load; loads past the end give zeros
+  size_t pos;
+  uint64_t acc;
+  int n;
+} BitReader;
+
+static inline void refill(BitReader* r)
+{
+  // a whole word while there is one, on little endian x86
+  if(r->pos + 8 <= r->size)
+    {
+      uint64_t word;
+      memcpy(&word, r->src + r->pos, 8);
+      r->acc |= word << r->n;
+      r->pos += (63 - r->n) >> 3;
+      r->n |= 56;
+      return;
+    }
+  while(r->n <= 56)
+    {
+      uint64_t b = r->pos < r->size ? r->src[r->pos] : 0;
+      r->acc |= b << r->n;
+      r->n += 8;
+      r->pos++;
+    }
+}
+
+static inline void consume(BitReader* r, int n)
+{
+  r->acc >>= n;
+  r->n -= n;
+}
+
+// code the residuals of a row in blocks
+static void encodeRow(BitWriter* w, const uint8_t* res, int n)
+{
+  for(int b=0; b<n; b+=CODEC_BLOCK)
+    {
+      int m = n - b < CODEC_BLOCK ? n - b : CODEC_BLOCK;
+      unsigned sum = 0;
+      for(int i=0; i<m; i++)
+	sum += res[b+i];
+
+      // about log2 of the mean residual
+      int k = 0;
+      while(k<CODEC_K_MAX && ((unsigned)m << (k+1)) <= sum)
+	k++;
+      putBits(w, k, CODEC_K_BITS);
+
+      uint32_t mask = (1u << k) - 1;
+      for(int i=0; i<m; i++)
+	{
+	  uint32_t v = res[b+i];
+	  uint32_t q = v >> k;
+	  if(q < CODEC_ESCAPE)
+	    putBits(w, ((1u << q) - 1) | ((v & mask) << (q+1)), q + 1 + k);
+	  else
+	    putBits(w, ((1u << CODEC_ESCAPE) - 1) | (v << CODEC_ESCAPE), CODEC_ESCAPE + 8);
+	}
+    }
+}
+
+// decode the residuals of a row into it
+static void decodeRow(BitReader* r, uint8_t* res, int n)
+{
+  for(int b=0; b<n; b+=CODEC_BLOCK)
+    {
+      int m = n - b < CODEC_BLOCK ? n - b : CODEC_BLOCK;
+      refill(r);
+      int k = r->acc & ((1 << CODEC_K_BITS) - 1);
+      consume(r, CODEC_K_BITS);
+
+      uint32_t mask = (1u << k) - 1;
+      for(int i=0; i<m; i++)
+	{
+	  if(r->n < 16)
+	    refill(r);
+	  uint64_t peek = r->acc;
+	  int q = __builtin_ctzll(~peek | (1ull << CODEC_ESCAPE));
+	  if(q < CODEC_ESCAPE)
+	    {
+	      res[b+i] = (uint8_t)((q << k) | ((uint32_t)(peek >> (q+1)) & mask));
+	      consume(r, q + 1 + k);
+	    }
+	  else
+	    {
+	      res[b+i] = (uint8_t)(peek >> CODEC_ESCAPE);
+	      consume(r, CODEC_ESCAPE + 8);
+	    }
+	}
+    }
+}
+
+
+size_t encodeImage(const uint8_t* src, const CodecLayout* layout,
+		   uint8_t* dst, size_t capacity)
+{
+  int n = layout->rowBytes;
+  if(layout->rows<=0 || n<=0 || layout->dx<1 || layout->dy<1)
+    return 0;
+
+  BitWriter w;
+  w.p = dst;
+  w.end = dst + capacity;
+  w.acc = 0;
+  w.n = 0;
+  w.overflow = false;
+
+  uint8_t* res = new uint8_t[n];
+  for(int y=0; y<layout->rows && !w.overflow; y++)
+    {
+      const uint8_t* row = src + (size_t)y * n;
+      const uint8_t* up = y>=layout->dy ? row - (size_t)layout->dy * n : NULL;
+      residualRow(row, up, n, layout->dx, res);
+      encodeRow(&w, res, n);
+    }
+  delete[] res;
+
+  flushBits(&w);
+  if(w.overflow)
+    return 0;
+  return w.p - dst;
+}
+
+int decodeImage(const uint8_t* src, size_t size, const CodecLayout* layout,
+		uint8_t* dst)
+{
+  int n = layout->rowBytes;
+  if(layout->rows<=0 || n<=0 || layout->dx<1 || layout->dy<1)
+    return -1;
+
+  BitReader r;
+  r.src = src;
+  r.size = size;
+  r.pos = 0;
+  r.acc = 0;
+  r.n = 0;
+
+  for(int y=0; y<layout->rows; y++)
+    {
+      uint8_t* row = dst + (size_t)y * n;
+      const uint8_t* up = y>=layout->dy ? row - (size_t)layout->dy * n : NULL;
+      decodeRow(&r, row, n);
+      reconstructRow(row, up, n, layout->dx);
+    }
+
+  // the bits taken must have been in the data
+  if(r.pos * 8 - r.n > size * 8)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Lossless compression of the images of stereo log frames (see
+ * StereoLog.h). Each sample is predicted from its neighbours of the same
+ * color with the median edge detector of LOCO-I / JPEG-LS, and the
+ * residuals are Rice coded in blocks of CODEC_BLOCK samples with a
+ * parameter chosen per block. Camera images typically shrink to half
+ * their size or less; noise does not compress, so an image that would
+ * not get smaller is stored as is.
+ *
+ * Every image is coded on its own, so frames of a log stay independent
+ * and can be decoded in any order.
+ */
+
+#ifndef _STEREO_CODEC_HH_
+#define _STEREO_CODEC_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// how the images of a log record are stored
+enum StereoCodec{
+  CODEC_NONE = 0,          // as they are
+  CODEC_PREDICTIVE,        // compressed by encodeImage()
+};
+
+// samples per Rice coded block
+#define CODEC_BLOCK 16
+
+// Layout of an image for the predictor: rows of rowBytes bytes, each
+// sample predicted from the one dx bytes to its left and the ones dy
+// rows up (the same color: dx is 3 for packed RGB pixels)
+typedef struct _CodecLayout
+{
+  int rows;
+  int rowBytes;
+  int dx;
+  int dy;
+} CodecLayout;
+
+// the layout of an image of rows x cols pixels of channels bytes
+inline void getCodecLayout(int rows, int cols, int channels, CodecLayout* layout)
+{
+  layout->rows = rows;
+  layout->rowBytes = cols * channels;
+  layout->dx = channels;
+  layout->dy = 1;
+}
+
+// the layout of either half of a raw frame of rows x cols 16 bit pixels
+// (see StereoLogFormat): rows/2 rows of the two images interleaved, each
+// sample predicted from the same image, and for the Bayer mosaic of a
+// color camera (channels 3) the same color, two pixels left and two rows
+// up
+inline void getRawCodecLayout(int rows, int cols, int channels, CodecLayout* layout)
+{
+  layout->rows = rows / 2;
+  layout->rowBytes = 2 * cols;
+  layout->dx = channels==3 ? 4 : 2;
+  layout->dy = channels==3 ? 2 : 1;
+}
+
+// Compress an image into at most capacity bytes of dst. Returns the
+// compressed size, or 0 if it does not fit (store the image as is then)
+size_t encodeImage(const uint8_t* src, const CodecLayout* layout,
+		   uint8_t* dst, size_t capacity);
+
+// Decompress size bytes of src into the image dst; -1 if they are
+// corrupt
+int decodeImage(const uint8_t* src, size_t size, const CodecLayout* layout,
+		uint8_t* dst);
+
+#endif
@@ -15,14 +15,21 @@ extern "C"
   
 #include <stdint.h>
   
-  // blob version number
-#define STEREO_IMAGE_BLOB_VERSION 0x04
+  // blob version number; blobs record it from version 5, which holds
+  // color images whole
+#define STEREO_IMAGE_BLOB_VERSION 0x05
   
   // maximum image dimensions
 #define STEREO_IMAGE_BLOB_MAX_COLS 1024
   
   // maximum image dimensions
 #define STEREO_IMAGE_BLOB_MAX_ROWS 768
+
+  // maximum number of channels
+#define STEREO_IMAGE_BLOB_MAX_CHANNELS 3
+
+  // size of an image buffer before version 5 (one byte per pixel)
+#define STEREO_IMAGE_BLOB_V4_BUFFER (STEREO_IMAGE_BLOB_MAX_COLS * STEREO_IMAGE_BLOB_MAX_ROWS)
   
   // Contains a rectified left/right stereo image pair and (optionally)
   // the left disparity image.  Disparity values are scaled up and
@@ -34,9 +41,12 @@ extern "C"
     
     // Image timestamp
     uint64_t timestamp;
+
+    // Blob version number (STEREO_IMAGE_BLOB_VERSION); 0 before version 5
+    uint32_t version;
     
     // Reserved for future use; must be all zero.
-    uint32_t reserved[16];
+    uint32_t reserved[15];
     
     // Image dimensions 
     int32_t cols, rows;
@@ -51,10 +61,10 @@ extern "C"
     uint8_t padding[408];
 
     // Input buffer for the red channel 
-    uint8_t left_buffer[STEREO_IMAGE_BLOB_MAX_COLS * STEREO_IMAGE_BLOB_MAX_ROWS];
+    uint8_t left_buffer[STEREO_IMAGE_BLOB_MAX_COLS * STEREO_IMAGE_BLOB_MAX_ROWS * STEREO_IMAGE_BLOB_MAX_CHANNELS];
     
     // Input buffer for the green channel
-    uint8_t right_buffer[STEREO_IMAGE_BLOB_MAX_COLS * STEREO_IMAGE_BLOB_MAX_ROWS];
+    uint8_t right_buffer[STEREO_IMAGE_BLOB_MAX_COLS * STEREO_IMAGE_BLOB_MAX_ROWS * STEREO_IMAGE_BLOB_MAX_CHANNELS];
     
     float shutter;
     float gain;
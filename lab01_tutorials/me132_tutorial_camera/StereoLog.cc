@@ -0,0 +1,1038 @@
+/*
+ * Append-only log of stereo frames with a sidecar frame index,
+ * read back through mmap, optionally compressed on a pool of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "StereoLog.h"
+
+// write the whole buffer, retrying on short writes
+static int writeFully(int fd, const void* buf, size_t n)
+{
+  const uint8_t* p = (const uint8_t*)buf;
+  while(n>0)
+    {
+      ssize_t w = write(fd, p, n);
+      if(w<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+	  return -1;
+	}
+      p += w;
+      n -= w;
+    }
+  return 0;
+}
+
+// name of the sidecar index of a log
+static void indexName(const char* fname, char* idxname, size_t len)
+{
+  snprintf(idxname, len, "%s.idx", fname);
+}
+
+// bytes of the images of a record as stored
+static uint64_t recordImageBytes(const StereoLogFrameHeader* h)
+{
+  if(h->codec!=CODEC_NONE)
+    return (uint64_t)h->packedSize[0] + h->packedSize[1];
+  return 2 * (uint64_t)h->imageSize;
+}
+
+// the codec layout of the images of a record; -1 if the record has no
+// valid format and size or the layout does not cover imageSize bytes
+static int getRecordLayout(const StereoLogFrameHeader* h, CodecLayout* layout)
+{
+  if(h->cols<=0 || h->rows<=0 || h->rowinc<h->cols || (h->channels!=1 && h->channels!=3))
+    return -1;
+  if(h->format==STEREO_LOG_RAW)
+    getRawCodecLayout(h->rows, h->cols, h->channels, layout);
+  else if(h->format==STEREO_LOG_IMAGES)
+    getCodecLayout(h->rows, h->rowinc, h->channels, layout);
+  else
+    return -1;
+  if((uint64_t)layout->rows * layout->rowBytes != h->imageSize)
+    return -1;
+  return 0;
+}
+
+
+// -------------------------------
+// writer
+// -------------------------------
+
+StereoLogWriter::StereoLogWriter()
+{
+  fd = -1;
+  indexFd = -1;
+  offset = 0;
+  frameCount = 0;
+  bytesWritten = 0;
+  jobs = NULL;
+  numJobs = 0;
+  threads = NULL;
+  numThreads = 0;
+  queued = 0;
+  taken = 0;
+  committed = 0;
+  writing = false;
+  stopping = false;
+  failed = false;
+  dropWhenFull = false;
+  dropped = 0;
+  imageBytes = 0;
+  packBuffer = NULL;
+  packBufferSize = 0;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&jobQueued, NULL);
+  pthread_cond_init(&jobWritten, NULL);
+}
+
+StereoLogWriter::~StereoLogWriter()
+{
+  this->close();
+  delete[] packBuffer;
+  pthread_cond_destroy(&jobWritten);
+  pthread_cond_destroy(&jobQueued);
+  pthread_mutex_destroy(&mutex);
+}
+
+// create a new log (or append to an existing one, unless truncate)
+int StereoLogWriter::open(const char* fname, bool truncate)
+{
+  char idxname[512];
+  indexName(fname, idxname, sizeof(idxname));
+
+  int mode = truncate ? O_TRUNC : 0;
+  fd = ::open(fname, O_RDWR | O_CREAT | O_APPEND | mode, 0644);
+  if(fd<0)
+    {
+      fprintf( stderr, "Cannot open log %s: %s\n", fname, strerror(errno) );
+      return -1;
+    }
+
+  struct stat st;
+  fstat(fd, &st);
+  if(st.st_size==0)
+    {
+      StereoLogHeader header;
+      memset(&header, 0, sizeof(header));
+      header.magic = STEREO_LOG_MAGIC;
+      header.version = STEREO_LOG_VERSION;
+      if(writeFully(fd, &header, sizeof(header))<0)
+	{
+	  fprintf( stderr, "Cannot write log header: %s\n", strerror(errno) );
+	  this->close();
+	  return -1;
+	}
+      offset = sizeof(header);
+    }
+  else
+    {
+      StereoLogHeader header;
+      if(pread(fd, &header, sizeof(header), 0)!=(ssize_t)sizeof(header) ||
+	 header.magic!=STEREO_LOG_MAGIC)
+	{
+	  fprintf( stderr, "%s exists and is not a stereo log\n", fname );
+	  this->close();
+	  return -1;
+	}
+      bool reserved = false;
+      for(size_t k=0; k<sizeof(header.reserved)/sizeof(header.reserved[0]); k++)
+	reserved |= (header.reserved[k]!=0);
+      if(header.version<1 || header.version>STEREO_LOG_VERSION || reserved)
+	{
+	  fprintf( stderr, "%s is a stereo log of unknown version %u; cannot append\n", fname, header.version );
+	  this->close();
+	  return -1;
+	}
+
+      // the new records may be raw or compressed, which an older log
+      // cannot hold; every older record is a valid record of the current
+      // version. pwrite() would append on this descriptor
+      if(header.version<STEREO_LOG_VERSION)
+	{
+	  header.version = STEREO_LOG_VERSION;
+	  int hfd = ::open(fname, O_WRONLY);
+	  bool ok = (hfd>=0 && pwrite(hfd, &header, sizeof(header), 0)==(ssize_t)sizeof(header));
+	  if(hfd>=0)
+	    ::close(hfd);
+	  if(!ok)
+	    {
+	      fprintf( stderr, "Cannot update the header of log %s: %s\n", fname, strerror(errno) );
+	      this->close();
+	      return -1;
+	    }
+	}
+      offset = STEREO_LOG_ALIGN((uint64_t)st.st_size);
+    }
+
+  indexFd = ::open(idxname, O_WRONLY | O_CREAT | O_APPEND | mode, 0644);
+  if(indexFd<0)
+    {
+      fprintf( stderr, "Cannot open log index %s: %s\n", idxname, strerror(errno) );
+      this->close();
+      return -1;
+    }
+
+  frameCount = 0;
+  bytesWritten = 0;
+  dropped = 0;
+  imageBytes = 0;
+  failed = false;
+  return 0;
+}
+
+// append a frame; images are rows*rowinc*channels bytes, and their
+// rows are stored without the padding past cols
+int StereoLogWriter::append(int32_t frameId, uint64_t timestamp,
+			    int32_t cols, int32_t rows, int32_t rowinc, int32_t channels,
+			    const uint8_t* left, const uint8_t* right,
+			    float shutter, float gain)
+{
+  if(fd<0)
+    return -1;
+  if(cols<=0 || rows<=0 || rowinc<cols || (channels!=1 && channels!=3))
+    {
+      fprintf( stderr, "Frame %d has invalid size %dx%dx%d (row width %d)\n",
+	       frameId, cols, rows, channels, rowinc );
+      return -1;
+    }
+
+  // replay takes images with rows of cols pixels only
+  if(rowinc!=cols)
+    {
+      size_t rowBytes = (size_t)cols * channels;
+      size_t n = rows * rowBytes;
+      if(2 * n > packBufferSize)
+	{
+	  delete[] packBuffer;
+	  packBuffer = new uint8_t[2 * n];
+	  packBufferSize = 2 * n;
+	}
+      for(int32_t i=0; i<rows; i++)
+	{
+	  memcpy(packBuffer + i * rowBytes, left + (size_t)i * rowinc * channels, rowBytes);
+	  memcpy(packBuffer + n + i * rowBytes, right + (size_t)i * rowinc * channels, rowBytes);
+	}
+      left = packBuffer;
+      right = packBuffer + n;
+      rowinc = cols;
+    }
+
+  StereoLogFrameHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = STEREO_LOG_FRAME_MAGIC;
+  header.frameId = frameId;
+  header.timestamp = timestamp;
+  header.cols = cols;
+  header.rows = rows;
+  header.rowinc = rowinc;
+  header.channels = channels;
+  header.shutter = shutter;
+  header.gain = gain;
+  header.imageSize = rows * rowinc * channels;
+  return this->queueRecord(&header, left, right);
+}
+
+// append a raw frame; its halves are stored as the two images
+int StereoLogWriter::appendRaw(int32_t frameId, uint64_t timestamp, int32_t cols, int32_t rows,
+			       int32_t channels, BayerTile tile, const uint8_t* raw,
+			       float shutter, float gain)
+{
+  if(fd<0)
+    return -1;
+
+  StereoLogFrameHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = STEREO_LOG_FRAME_MAGIC;
+  header.frameId = frameId;
+  header.timestamp = timestamp;
+  header.cols = cols;
+  header.rows = rows;
+  header.rowinc = cols;
+  header.channels = channels;
+  header.shutter = shutter;
+  header.gain = gain;
+  header.imageSize = rows * cols;
+  header.format = STEREO_LOG_RAW;
+  header.bayerTile = channels==3 ? tile : 0;
+  return this->queueRecord(&header, raw, raw + header.imageSize);
+}
+
+// write the images of a frame, or queue them for compression
+int StereoLogWriter::queueRecord(const StereoLogFrameHeader* header,
+				 const uint8_t* left, const uint8_t* right)
+{
+  if(numThreads==0)
+    {
+      imageBytes += 2 * (uint64_t)header->imageSize;
+      return this->writeRecord(header, left, right);
+    }
+
+  // wait for the oldest queued frame to be written if the queue is full
+  pthread_mutex_lock(&mutex);
+  if(dropWhenFull && queued - committed >= (uint64_t)numJobs)
+    {
+      dropped++;
+      pthread_mutex_unlock(&mutex);
+      return -1;
+    }
+  while(queued - committed >= (uint64_t)numJobs)
+    pthread_cond_wait(&jobWritten, &mutex);
+  bool ok = !failed;
+  pthread_mutex_unlock(&mutex);
+  if(!ok)
+    return -1;
+
+  // the job is free, and only this thread fills jobs
+  StereoLogJob* job = &jobs[queued % numJobs];
+  size_t n = header->imageSize;
+  if(2 * n > job->capacity)
+    {
+      delete[] job->images;
+      delete[] job->packed;
+      job->images = new uint8_t[2 * n];
+      job->packed = new uint8_t[2 * n];
+      job->capacity = 2 * n;
+    }
+  job->header = *header;
+  memcpy(job->images, left, n);
+  memcpy(job->images + n, right, n);
+  imageBytes += 2 * (uint64_t)n;
+
+  pthread_mutex_lock(&mutex);
+  job->done = false;
+  queued++;
+  pthread_cond_signal(&jobQueued);
+  pthread_mutex_unlock(&mutex);
+  return 0;
+}
+
+// write a record whose images are stored as the header says
+int StereoLogWriter::writeRecord(const StereoLogFrameHeader* header,
+				 const uint8_t* left, const uint8_t* right)
+{
+  // pad the previous record if the file was not aligned
+  struct stat st;
+  fstat(fd, &st);
+  static const uint8_t zeros[8] = {0,0,0,0,0,0,0,0};
+  if((uint64_t)st.st_size < offset)
+    writeFully(fd, zeros, offset - st.st_size);
+
+  size_t leftSize = header->codec!=CODEC_NONE ? header->packedSize[0] : header->imageSize;
+  size_t rightSize = header->codec!=CODEC_NONE ? header->packedSize[1] : header->imageSize;
+  uint64_t recordSize = sizeof(StereoLogFrameHeader) + leftSize + rightSize;
+  if(writeFully(fd, header, sizeof(StereoLogFrameHeader))<0 ||
+     writeFully(fd, left, leftSize)<0 ||
+     writeFully(fd, right, rightSize)<0 ||
+     writeFully(fd, zeros, STEREO_LOG_ALIGN(recordSize) - recordSize)<0)
+    {
+      fprintf( stderr, "Cannot write frame %d to log: %s\n", header->frameId, strerror(errno) );
+      return -1;
+    }
+
+  // the index entry goes last so that it never points past the log
+  StereoLogIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.frameId = header->frameId;
+  entry.timestamp = header->timestamp;
+  entry.offset = offset;
+  if(writeFully(indexFd, &entry, sizeof(entry))<0)
+    {
+      fprintf( stderr, "Cannot write frame %d to log index: %s\n", header->frameId, strerror(errno) );
+      return -1;
+    }
+
+  offset += STEREO_LOG_ALIGN(recordSize);
+  bytesWritten += STEREO_LOG_ALIGN(recordSize);
+  frameCount++;
+  return 0;
+}
+
+// append the used part of a blob filled in by BumbleBee::captureBlob()
+int StereoLogWriter::append(const StereoImageBlob* blob)
+{
+  // the images must lie within the buffers, which are smaller before
+  // version 5 (see readStereoImageBlob())
+  int32_t channels = blob->channels;
+  int32_t rowinc = blob->rowinc>0 ? blob->rowinc : blob->cols;
+  size_t capacity = blob->version==0 ? STEREO_IMAGE_BLOB_V4_BUFFER : sizeof(blob->left_buffer);
+  if(blob->cols<=0 || blob->rows<=0 || rowinc<blob->cols || (channels!=1 && channels!=3) ||
+     (size_t)blob->rows * rowinc * channels > capacity)
+    {
+      fprintf( stderr, "Blob frame %d has invalid size %dx%dx%d (row width %d)\n",
+	       blob->frameId, blob->cols, blob->rows, channels, rowinc );
+      return -1;
+    }
+  return this->append(blob->frameId, blob->timestamp,
+		      blob->cols, blob->rows, rowinc, channels,
+		      blob->left_buffer, blob->right_buffer,
+		      blob->shutter, blob->gain);
+}
+
+// compress frames on nThreads threads before writing them
+int StereoLogWriter::enableCompression(int nThreads, int nJobs, bool dropFull)
+{
+  if(fd<0 || nThreads<1)
+    return -1;
+  if(numThreads>0)
+    return 0;
+
+  dropWhenFull = dropFull;
+  numJobs = nJobs>nThreads ? nJobs : nThreads;
+  jobs = new StereoLogJob[numJobs];
+  for(int k=0; k<numJobs; k++)
+    {
+      jobs[k].images = NULL;
+      jobs[k].packed = NULL;
+      jobs[k].capacity = 0;
+      jobs[k].done = false;
+    }
+  queued = 0;
+  taken = 0;
+  committed = 0;
+  writing = false;
+  stopping = false;
+
+  threads = new pthread_t[nThreads];
+  for(numThreads=0; numThreads<nThreads; numThreads++)
+    if(pthread_create(&threads[numThreads], NULL, StereoLogWriter::compressThread, this)!=0)
+      {
+	fprintf( stderr, "Cannot start log compression thread %d\n", numThreads );
+	this->stopCompression();
+	return -1;
+      }
+  return 0;
+}
+
+void* StereoLogWriter::compressThread(void* arg)
+{
+  ((StereoLogWriter*)arg)->compress();
+  return NULL;
+}
+
+// compress queued frames in any order, and write the ones done in order;
+// whichever thread finds the next frame to write done writes it
+void StereoLogWriter::compress()
+{
+  pthread_mutex_lock(&mutex);
+  while(true)
+    {
+      while(taken==queued && !stopping)
+	pthread_cond_wait(&jobQueued, &mutex);
+      if(taken==queued)
+	break;
+      StereoLogJob* job = &jobs[taken % numJobs];
+      taken++;
+      pthread_mutex_unlock(&mutex);
+
+      // both images compressed, or both stored as they are
+      StereoLogFrameHeader* h = &job->header;
+      size_t n = h->imageSize;
+      CodecLayout layout;
+      size_t leftSize = 0, rightSize = 0;
+      if(getRecordLayout(h, &layout)==0)
+	{
+	  leftSize = encodeImage(job->images, &layout, job->packed, n);
+	  rightSize = leftSize>0 ? encodeImage(job->images + n, &layout, job->packed + leftSize, n) : 0;
+	}
+      if(leftSize>0 && rightSize>0)
+	{
+	  h->codec = CODEC_PREDICTIVE;
+	  h->packedSize[0] = leftSize;
+	  h->packedSize[1] = rightSize;
+	}
+
+      pthread_mutex_lock(&mutex);
+      job->done = true;
+      if(writing)
+	continue;
+      writing = true;
+      while(committed < taken && jobs[committed % numJobs].done)
+	{
+	  StereoLogJob* next = &jobs[committed % numJobs];
+	  const StereoLogFrameHeader* nh = &next->header;
+	  const uint8_t* left = nh->codec!=CODEC_NONE ? next->packed : next->images;
+	  const uint8_t* right = nh->codec!=CODEC_NONE ? next->packed + nh->packedSize[0] : next->images + nh->imageSize;
+	  bool skip = failed;
+	  pthread_mutex_unlock(&mutex);
+
+	  // after a failure frames are only dropped
+	  int ret = skip ? -1 : this->writeRecord(nh, left, right);
+
+	  pthread_mutex_lock(&mutex);
+	  if(ret<0)
+	    failed = true;
+	  next->done = false;
+	  committed++;
+	  pthread_cond_broadcast(&jobWritten);
+	}
+      writing = false;
+    }
+  pthread_mutex_unlock(&mutex);
+}
+
+// wait for the queue to drain and stop the threads
+void StereoLogWriter::stopCompression()
+{
+  if(threads==NULL)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&jobQueued);
+  pthread_mutex_unlock(&mutex);
+  for(int k=0; k<numThreads; k++)
+    pthread_join(threads[k], NULL);
+  delete[] threads;
+  threads = NULL;
+  numThreads = 0;
+
+  for(int k=0; k<numJobs; k++)
+    {
+      delete[] jobs[k].images;
+      delete[] jobs[k].packed;
+    }
+  delete[] jobs;
+  jobs = NULL;
+  numJobs = 0;
+  stopping = false;
+}
+
+// frames written since open()
+int StereoLogWriter::getFrameCount()
+{
+  return frameCount;
+}
+
+// frames appended and dropped since open(), and the ones not written yet
+void StereoLogWriter::getQueueCounts(uint64_t* appendedFrames, uint64_t* droppedFrames, int* waitingFrames)
+{
+  pthread_mutex_lock(&mutex);
+  *appendedFrames = numThreads>0 ? queued : frameCount;
+  *droppedFrames = dropped;
+  *waitingFrames = numThreads>0 ? (int)(queued - committed) : 0;
+  pthread_mutex_unlock(&mutex);
+}
+
+// bytes written to the log since open()
+uint64_t StereoLogWriter::getBytesWritten()
+{
+  return bytesWritten;
+}
+
+// bytes of the images appended since open(), before compression
+uint64_t StereoLogWriter::getImageBytes()
+{
+  return imageBytes;
+}
+
+int StereoLogWriter::close()
+{
+  this->stopCompression();
+
+  if(fd>=0)
+    ::close(fd);
+  if(indexFd>=0)
+    ::close(indexFd);
+  fd = -1;
+  indexFd = -1;
+  return failed ? -1 : 0;
+}
+
+
+// -------------------------------
+// reader
+// -------------------------------
+
+StereoLogReader::StereoLogReader()
+{
+  fd = -1;
+  data = NULL;
+  size = 0;
+  index = NULL;
+  indexMapSize = 0;
+  indexMapped = false;
+  frameCount = 0;
+  unpackRunning = false;
+  unpackStopping = false;
+  unpackJob = NULL;
+  pthread_mutex_init(&unpackMutex, NULL);
+  pthread_cond_init(&unpackQueued, NULL);
+  pthread_cond_init(&unpackDone, NULL);
+}
+
+StereoLogReader::~StereoLogReader()
+{
+  this->close();
+  pthread_cond_destroy(&unpackDone);
+  pthread_cond_destroy(&unpackQueued);
+  pthread_mutex_destroy(&unpackMutex);
+}
+
+// true if the file starts with a log header
+bool StereoLogReader::isLog(const char* fname)
+{
+  FILE* f = fopen(fname, "rb");
+  if(f==NULL)
+    return false;
+  StereoLogHeader header;
+  bool ret = fread(&header, sizeof(header), 1, f)==1 && header.magic==STEREO_LOG_MAGIC;
+  fclose(f);
+  return ret;
+}
+
+// map the log and its index
+int StereoLogReader::open(const char* fname)
+{
+  this->close();
+
+  fd = ::open(fname, O_RDONLY);
+  if(fd<0)
+    {
+      fprintf( stderr, "Cannot open log %s: %s\n", fname, strerror(errno) );
+      return -1;
+    }
+
+  struct stat st;
+  fstat(fd, &st);
+  size = st.st_size;
+  if(size < sizeof(StereoLogHeader))
+    {
+      fprintf( stderr, "%s is not a stereo log\n", fname );
+      this->close();
+      return -1;
+    }
+
+  data = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if(data==MAP_FAILED)
+    {
+      fprintf( stderr, "Cannot map log %s: %s\n", fname, strerror(errno) );
+      data = NULL;
+      this->close();
+      return -1;
+    }
+
+  const StereoLogHeader* header = (const StereoLogHeader*)data;
+  if(header->magic!=STEREO_LOG_MAGIC || header->version<1 || header->version>STEREO_LOG_VERSION)
+    {
+      fprintf( stderr, "%s is not a version 1 to %d stereo log\n", fname, STEREO_LOG_VERSION );
+      this->close();
+      return -1;
+    }
+
+  // map the sidecar index
+  char idxname[512];
+  indexName(fname, idxname, sizeof(idxname));
+  int idxfd = ::open(idxname, O_RDONLY);
+  if(idxfd>=0)
+    {
+      fstat(idxfd, &st);
+      frameCount = st.st_size / sizeof(StereoLogIndexEntry);
+      if(frameCount>0)
+	{
+	  indexMapSize = frameCount * sizeof(StereoLogIndexEntry);
+	  void* p = mmap(NULL, indexMapSize, PROT_READ, MAP_SHARED, idxfd, 0);
+	  if(p!=MAP_FAILED)
+	    {
+	      index = (StereoLogIndexEntry*)p;
+	      indexMapped = true;
+	    }
+	}
+      ::close(idxfd);
+    }
+
+  // make sure the last indexed frame is really in the log
+  StereoLogFrame last;
+  if(index==NULL || this->getFrame(frameCount-1, &last)<0)
+    {
+      fprintf( stderr, "Index of %s missing or stale; rebuilding\n", fname );
+      if(this->buildIndex()<0)
+	{
+	  this->close();
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+// scan the log and rebuild the index in memory
+int StereoLogReader::buildIndex()
+{
+  if(indexMapped)
+    munmap(index, indexMapSize);
+  index = NULL;
+  indexMapped = false;
+  frameCount = 0;
+
+  int capacity = 0;
+  uint64_t off = sizeof(StereoLogHeader);
+  while(off + sizeof(StereoLogFrameHeader) <= size)
+    {
+      const StereoLogFrameHeader* h = (const StereoLogFrameHeader*)(data + off);
+      uint64_t recordSize = sizeof(StereoLogFrameHeader) + recordImageBytes(h);
+      if(h->magic!=STEREO_LOG_FRAME_MAGIC || off + recordSize > size)
+	break;
+
+      if(frameCount==capacity)
+	{
+	  capacity = capacity>0 ? 2*capacity : 1024;
+	  StereoLogIndexEntry* grown = (StereoLogIndexEntry*)realloc(index, capacity * sizeof(StereoLogIndexEntry));
+	  if(grown==NULL)
+	    {
+	      fprintf( stderr, "Out of memory rebuilding the log index\n" );
+	      return -1;
+	    }
+	  index = grown;
+	}
+      index[frameCount].frameId = h->frameId;
+      index[frameCount].reserved = 0;
+      index[frameCount].timestamp = h->timestamp;
+      index[frameCount].offset = off;
+      frameCount++;
+
+      off += STEREO_LOG_ALIGN(recordSize);
+    }
+
+  return 0;
+}
+
+// number of frames in the log
+int StereoLogReader::getFrameCount()
+{
+  return frameCount;
+}
+
+// get the k-th frame
+int StereoLogReader::getFrame(int k, StereoLogFrame* frame)
+{
+  if(k<0 || k>=frameCount)
+    return -1;
+
+  uint64_t off = index[k].offset;
+  if(off + sizeof(StereoLogFrameHeader) > size)
+    return -1;
+
+  const StereoLogFrameHeader* h = (const StereoLogFrameHeader*)(data + off);
+  if(h->magic!=STEREO_LOG_FRAME_MAGIC ||
+     off + sizeof(StereoLogFrameHeader) + recordImageBytes(h) > size)
+    return -1;
+
+  // the images must be as large as the header says, compressed or not
+  CodecLayout layout;
+  if(getRecordLayout(h, &layout)<0)
+    {
+      fprintf( stderr, "Log frame %d has invalid size %dx%dx%d (row width %d, %u bytes)\n",
+	       h->frameId, h->cols, h->rows, h->channels, h->rowinc, h->imageSize );
+      return -1;
+    }
+
+  frame->header = h;
+  frame->left = data + off + sizeof(StereoLogFrameHeader);
+  frame->right = frame->left + (h->codec!=CODEC_NONE ? h->packedSize[0] : h->imageSize);
+  return 0;
+}
+
+// an image to decompress on the worker of unpackFrame()
+typedef struct _UnpackImage
+{
+  const uint8_t* src;
+  size_t size;
+  const CodecLayout* layout;
+  uint8_t* dst;
+  int ret;
+} UnpackImage;
+
+void* StereoLogReader::unpackThread(void* arg)
+{
+  ((StereoLogReader*)arg)->unpack();
+  return NULL;
+}
+
+void StereoLogReader::unpack()
+{
+  pthread_mutex_lock(&unpackMutex);
+  while(true)
+    {
+      while(unpackJob==NULL && !unpackStopping)
+	pthread_cond_wait(&unpackQueued, &unpackMutex);
+      if(unpackJob==NULL)
+	break;
+      UnpackImage* image = unpackJob;
+      pthread_mutex_unlock(&unpackMutex);
+
+      image->ret = decodeImage(image->src, image->size, image->layout, image->dst);
+
+      pthread_mutex_lock(&unpackMutex);
+      unpackJob = NULL;
+      pthread_cond_signal(&unpackDone);
+    }
+  pthread_mutex_unlock(&unpackMutex);
+}
+
+void StereoLogReader::stopUnpacking()
+{
+  if(!unpackRunning)
+    return;
+  pthread_mutex_lock(&unpackMutex);
+  unpackStopping = true;
+  pthread_cond_signal(&unpackQueued);
+  pthread_mutex_unlock(&unpackMutex);
+  pthread_join(unpackWorker, NULL);
+  unpackRunning = false;
+}
+
+// decompress the images of a frame, the right one on the worker
+int StereoLogReader::unpackFrame(const StereoLogFrame* frame, uint8_t* left, uint8_t* right)
+{
+  const StereoLogFrameHeader* h = frame->header;
+  CodecLayout layout;
+  if(h->codec!=CODEC_PREDICTIVE || getRecordLayout(h, &layout)<0)
+    return -1;
+
+  UnpackImage image;
+  image.src = frame->right;
+  image.size = h->packedSize[1];
+  image.layout = &layout;
+  image.dst = right;
+  image.ret = -1;
+  // the worker is started with the first compressed frame
+  if(!unpackRunning)
+    {
+      unpackStopping = false;
+      unpackRunning = (pthread_create(&unpackWorker, NULL, StereoLogReader::unpackThread, this)==0);
+    }
+  if(unpackRunning)
+    {
+      pthread_mutex_lock(&unpackMutex);
+      unpackJob = &image;
+      pthread_cond_signal(&unpackQueued);
+      pthread_mutex_unlock(&unpackMutex);
+    }
+  else
+    image.ret = decodeImage(image.src, image.size, image.layout, image.dst);
+
+  int ret = decodeImage(frame->left, h->packedSize[0], &layout, left);
+  if(unpackRunning)
+    {
+      pthread_mutex_lock(&unpackMutex);
+      while(unpackJob!=NULL)
+	pthread_cond_wait(&unpackDone, &unpackMutex);
+      pthread_mutex_unlock(&unpackMutex);
+    }
+  return (ret<0 || image.ret<0) ? -1 : 0;
+}
+
+// number of the last frame with timestamp <= the given one (or 0)
+int StereoLogReader::findFrame(uint64_t timestamp)
+{
+  int lo = 0, hi = frameCount;
+  while(lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if(index[mid].timestamp <= timestamp)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo>0 ? lo-1 : 0;
+}
+
+void StereoLogReader::close()
+{
+  this->stopUnpacking();
+
+  if(index!=NULL)
+    {
+      if(indexMapped)
+	munmap(index, indexMapSize);
+      else
+	free(index);
+    }
+  index = NULL;
+  indexMapped = false;
+  frameCount = 0;
+
+  if(data!=NULL)
+    munmap(data, size);
+  data = NULL;
+  size = 0;
+
+  if(fd>=0)
+    ::close(fd);
+  fd = -1;
+}
+
+
+// -------------------------------
+// replay
+// -------------------------------
+
+LogFrameSource::LogFrameSource(const char* fname, ReplayMode replayMode)
+  : ReplayFrameSource(replayMode)
+{
+  strncpy(filename, fname, sizeof(filename)-1);
+  filename[sizeof(filename)-1] = '\0';
+  opened = false;
+  next = 0;
+  rawBuffer = NULL;
+  rawBufferSize = 0;
+  unpackBuffer = NULL;
+  unpackBufferSize = 0;
+}
+
+LogFrameSource::~LogFrameSource()
+{
+  this->close();
+}
+
+int LogFrameSource::rewind()
+{
+  if(!opened)
+    {
+      if(reader.open(filename)<0)
+	return -1;
+      opened = true;
+    }
+  next = 0;
+  return 0;
+}
+
+bool LogFrameSource::atEnd()
+{
+  return opened && next>=reader.getFrameCount();
+}
+
+// continue replay from the last frame at or before the timestamp
+int LogFrameSource::seek(uint64_t timestamp)
+{
+  if(!opened)
+    return -1;
+  next = reader.findFrame(timestamp);
+  return 0;
+}
+
+// frames are found through the index; nothing needs to be read
+int LogFrameSource::skipFrame()
+{
+  if(!opened || next>=reader.getFrameCount())
+    return -1;
+  next++;
+  return 0;
+}
+
+int LogFrameSource::readFrame(ReplayFrame* frame)
+{
+  StereoLogFrame f;
+  if(!opened || reader.getFrame(next, &f)<0)
+    return -1;
+
+  const StereoLogFrameHeader* h = f.header;
+  if(h->rowinc!=h->cols)
+    {
+      fprintf( stderr, "Log frame %d has padded rows; cannot replay\n", h->frameId );
+      return -1;
+    }
+  next++;
+
+  frame->frameId   = h->frameId;
+  frame->timestamp = h->timestamp;
+  frame->cols      = h->cols;
+  frame->rows      = h->rows;
+  frame->channels  = h->channels;
+  // the mapping is read-only; the replay source never writes to the images
+  frame->left      = (unsigned char*)f.left;
+  frame->right     = (unsigned char*)f.right;
+  frame->raw       = NULL;
+  frame->shutter   = h->shutter;
+  frame->gain      = h->gain;
+
+  if(h->codec!=CODEC_NONE)
+    {
+      size_t size = 2 * (size_t)h->imageSize;
+      if(size > unpackBufferSize)
+	{
+	  delete[] unpackBuffer;
+	  unpackBuffer = new uint8_t[size];
+	  unpackBufferSize = size;
+	}
+      if(reader.unpackFrame(&f, unpackBuffer, unpackBuffer + h->imageSize)<0)
+	{
+	  fprintf( stderr, "Cannot decompress log frame %d\n", h->frameId );
+	  return -1;
+	}
+      frame->left  = unpackBuffer;
+      frame->right = unpackBuffer + h->imageSize;
+    }
+
+  // raw records are converted once it is known what the grab needs
+  if(h->format==STEREO_LOG_RAW)
+    {
+      frame->raw       = frame->left;
+      frame->bayerTile = (BayerTile)h->bayerTile;
+      frame->left      = NULL;
+      frame->right     = NULL;
+    }
+  return 0;
+}
+
+// de-interlace (and demosaic) a raw record into the images of a frame
+int LogFrameSource::convertFrame(ReplayFrame* frame)
+{
+  const uint8_t* raw = frame->raw;
+  size_t n = (size_t)frame->rows * frame->cols;
+  size_t size = frame->channels==3 ? 12 * n + getDemosaicWindowSize(frame->cols) : 2 * n;
+  if(size > rawBufferSize)
+    {
+      delete[] rawBuffer;
+      rawBuffer = new uint8_t[size];
+      rawBufferSize = size;
+    }
+
+  if(frame->channels==3)
+    {
+      // the planes are not used; the packed images and the row window
+      // follow them
+      if(demosaicStereo(raw, frame->rows, frame->cols, frame->bayerTile, DEMOSAIC_NEAREST,
+			rawBuffer, rawBuffer + 6 * n, KERNEL_AUTO, rawBuffer + 12 * n)<0)
+	{
+	  fprintf( stderr, "Cannot demosaic log frame %d\n", frame->frameId );
+	  return -1;
+	}
+      frame->right = rawBuffer + 6 * n;
+      frame->left  = rawBuffer + 9 * n;
+    }
+  else
+    {
+      for(size_t k=0; k<n; k++)
+	{
+	  rawBuffer[k]     = raw[2*k];
+	  rawBuffer[n + k] = raw[2*k + 1];
+	}
+      frame->right = rawBuffer;
+      frame->left  = rawBuffer + n;
+    }
+  return 0;
+}
+
+void LogFrameSource::close()
+{
+  reader.close();
+  opened = false;
+  delete[] rawBuffer;
+  rawBuffer = NULL;
+  rawBufferSize = 0;
+  delete[] unpackBuffer;
+  unpackBuffer = NULL;
+  unpackBufferSize = 0;
+}
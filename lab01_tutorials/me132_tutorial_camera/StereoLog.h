@@ -0,0 +1,339 @@
+/*
+ * Append-only log of stereo frames.
+ *
+ * A log is a file header followed by one record per frame; a record is
+ * a StereoLogFrameHeader and the left then right image, each only
+ * rows*rowinc*channels bytes (not the fixed StereoImageBlob size).
+ * Records start on 8 byte boundaries. A raw record (version 2) holds
+ * the raw interleaved frame of the camera instead, Bayer mosaic and all,
+ * for recording at the full camera rate (see StereoRecorder.h); replay
+ * de-interlaces and demosaics it. From version 3 the images of a record
+ * may be compressed losslessly (see StereoCodec.h), each on its own, so
+ * any frame can still be read without the others; the writer compresses
+ * on a pool of threads. The sidecar file <log>.idx holds
+ * one StereoLogIndexEntry per frame so that frames can be found by
+ * number or timestamp without scanning. Reading maps both files with
+ * mmap so the returned images point straight into the page cache.
+ */
+
+#ifndef STEREO_LOG_H
+#define STEREO_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+#include "StereoImageBlob.h"
+#include "FrameSource.h"
+#include "StereoCodec.h"
+
+// "SLOG" and "SFRM" in little endian
+#define STEREO_LOG_MAGIC       0x474f4c53
+#define STEREO_LOG_FRAME_MAGIC 0x4d524653
+
+// log format version number; version 1 logs have no raw records and
+// version 2 logs no compressed ones, and both are read as well
+#define STEREO_LOG_VERSION 0x03
+
+// frames queued for compression by default
+#define STEREO_LOG_JOBS 16
+
+// contents of a frame record
+enum StereoLogFormat{
+  STEREO_LOG_IMAGES = 0,   // the left then the right image
+  STEREO_LOG_RAW,          // the raw frame of the camera: rows x cols 16 bit
+                           // pixels, the right image in the first byte;
+                           // imageSize is half its size, and with a codec
+                           // each half is compressed on its own
+};
+
+// file header
+typedef struct _StereoLogHeader
+{
+  uint32_t magic;
+  uint32_t version;
+
+  // Reserved for future use; must be all zero.
+  uint32_t reserved[14];
+} StereoLogHeader;
+
+// header of one frame record
+typedef struct _StereoLogFrameHeader
+{
+  uint32_t magic;
+
+  // Unique frame id (increased monotonically)
+  int32_t frameId;
+
+  // Image timestamp
+  uint64_t timestamp;
+
+  // Image dimensions
+  int32_t cols, rows;
+
+  // Image row width
+  int32_t rowinc;
+
+  // Number of channels (1 = grayscale, 3 = RGB)
+  int32_t channels;
+
+  float shutter;
+  float gain;
+
+  // bytes per image (rows * rowinc * channels)
+  uint32_t imageSize;
+
+  // StereoLogFormat, and for raw records of a color camera (channels 3)
+  // the BayerTile of the mosaic
+  uint32_t format;
+  uint32_t bayerTile;
+
+  // StereoCodec of the images, and with a codec the bytes they were
+  // compressed to, left and right
+  uint32_t codec;
+  uint32_t packedSize[2];
+
+  // Reserved for future use; must be all zero.
+  uint32_t reserved[2];
+} StereoLogFrameHeader;
+
+// entry of the sidecar index
+typedef struct _StereoLogIndexEntry
+{
+  int32_t frameId;
+  uint32_t reserved;
+  uint64_t timestamp;
+
+  // file offset of the frame header
+  uint64_t offset;
+} StereoLogIndexEntry;
+
+// a frame as returned by the reader; images point into the mapped log,
+// and are compressed if header->codec says so (see unpackFrame())
+typedef struct _StereoLogFrame
+{
+  const StereoLogFrameHeader* header;
+  const uint8_t* left;
+  const uint8_t* right;
+} StereoLogFrame;
+
+// a frame queued for compression
+typedef struct _StereoLogJob
+{
+  StereoLogFrameHeader header;
+
+  // the images, then their compressed copies
+  uint8_t* images;
+  uint8_t* packed;
+  size_t capacity;
+
+  // compressed and waiting to be written in order
+  bool done;
+} StereoLogJob;
+
+
+// Appends frames to a log and its index
+class StereoLogWriter
+{
+ public:
+  StereoLogWriter();
+  ~StereoLogWriter();
+
+  // create a new log (or append to an existing one, unless truncate)
+  int open(const char* fname, bool truncate=false);
+
+  // append a frame; images are rows*rowinc*channels bytes, and their
+  // rows are stored without the padding past cols
+  int append(int32_t frameId, uint64_t timestamp,
+	     int32_t cols, int32_t rows, int32_t rowinc, int32_t channels,
+	     const uint8_t* left, const uint8_t* right,
+	     float shutter, float gain);
+
+  // append the used part of a blob filled in by BumbleBee::captureBlob()
+  int append(const StereoImageBlob* blob);
+
+  // append a raw frame of rows x cols 16 bit pixels (see StereoLogFormat);
+  // channels is 3 for the Bayer mosaic of a color camera, 1 otherwise
+  int appendRaw(int32_t frameId, uint64_t timestamp, int32_t cols, int32_t rows,
+		int32_t channels, BayerTile tile, const uint8_t* raw,
+		float shutter, float gain);
+
+  // Compress the images of each frame (see StereoCodec.h) on nThreads
+  // threads before writing them. append() then only copies the frame,
+  // waiting while nJobs frames are queued, or with dropWhenFull dropping
+  // the frame and returning -1 (for a live camera); frames still reach
+  // the log in order. Call after open()
+  int enableCompression(int nThreads, int nJobs=STEREO_LOG_JOBS, bool dropWhenFull=false);
+
+  // frames written since open()
+  int getFrameCount();
+
+  // frames appended and dropped since open(), and frames appended but
+  // not written yet
+  void getQueueCounts(uint64_t* appendedFrames, uint64_t* droppedFrames, int* waitingFrames);
+
+  // bytes written to the log since open()
+  uint64_t getBytesWritten();
+
+  // bytes of the images appended since open(), before compression
+  uint64_t getImageBytes();
+
+  // write the queued frames and close the log; -1 if a compressed frame
+  // could not be written
+  int close();
+
+ private:
+  // write the images of a frame, or queue them for compression
+  int queueRecord(const StereoLogFrameHeader* header, const uint8_t* left, const uint8_t* right);
+
+  // write a record whose images are stored as the header says
+  int writeRecord(const StereoLogFrameHeader* header, const uint8_t* left, const uint8_t* right);
+
+  // compression threads: compress queued frames, then write the ones
+  // done in order
+  static void* compressThread(void* arg);
+  void compress();
+
+  // wait for the queue to drain and stop the threads
+  void stopCompression();
+
+  int fd;
+  int indexFd;
+
+  // compression queue: frames appended, taken by a thread and written
+  // since enableCompression(); job seq is jobs[seq % numJobs]
+  StereoLogJob* jobs;
+  int numJobs;
+  pthread_t* threads;
+  int numThreads;
+  pthread_mutex_t mutex;
+  pthread_cond_t jobQueued;
+  pthread_cond_t jobWritten;
+  uint64_t queued;
+  uint64_t taken;
+  uint64_t committed;
+  bool writing;
+  bool stopping;
+  bool failed;
+  bool dropWhenFull;
+  uint64_t dropped;
+  uint64_t imageBytes;
+
+  // both images of a frame with padded rows, packed by append()
+  uint8_t* packBuffer;
+  size_t packBufferSize;
+
+  // offset of the next record
+  uint64_t offset;
+
+  int frameCount;
+  uint64_t bytesWritten;
+};
+
+
+// Reads a log through mmap
+class StereoLogReader
+{
+ public:
+  StereoLogReader();
+  ~StereoLogReader();
+
+  // true if the file starts with a log header
+  static bool isLog(const char* fname);
+
+  // map the log and its index; the index is rebuilt in memory by
+  // scanning the log if it is missing or does not match
+  int open(const char* fname);
+
+  // number of frames in the log
+  int getFrameCount();
+
+  // get the k-th frame
+  int getFrame(int k, StereoLogFrame* frame);
+
+  // number of the last frame with timestamp <= the given one (or 0)
+  int findFrame(uint64_t timestamp);
+
+  // Decompress the images of a frame into left and right (imageSize
+  // bytes each; the two halves of a raw frame), the right one on a
+  // worker thread kept until close(); -1 if the frame is not compressed
+  // or corrupt
+  int unpackFrame(const StereoLogFrame* frame, uint8_t* left, uint8_t* right);
+
+  void close();
+
+ private:
+  // scan the log and rebuild the index in memory
+  int buildIndex();
+
+  // unpackFrame() worker: decompress each image queued to it
+  static void* unpackThread(void* arg);
+  void unpack();
+
+  // stop the worker, if it runs
+  void stopUnpacking();
+
+  int fd;
+  uint8_t* data;
+  size_t size;
+
+  // mapped sidecar index, or one built by buildIndex()
+  StereoLogIndexEntry* index;
+  size_t indexMapSize;
+  bool indexMapped;
+  int frameCount;
+
+  // unpackFrame() worker and the image queued to it, NULL once done
+  pthread_t unpackWorker;
+  bool unpackRunning;
+  bool unpackStopping;
+  struct _UnpackImage* unpackJob;
+  pthread_mutex_t unpackMutex;
+  pthread_cond_t unpackQueued;
+  pthread_cond_t unpackDone;
+};
+
+
+// Replays a stereo log; frames are read in place from the mapping
+class LogFrameSource : public ReplayFrameSource
+{
+ public:
+  LogFrameSource(const char* fname, ReplayMode replayMode=REPLAY_REALTIME);
+  ~LogFrameSource();
+
+  // continue replay from the last frame at or before the timestamp
+  int seek(uint64_t timestamp);
+
+  bool atEnd();
+  void close();
+
+ protected:
+  int readFrame(ReplayFrame* frame);
+  int skipFrame();
+  int rewind();
+  int convertFrame(ReplayFrame* frame);
+
+ private:
+
+  char filename[256];
+  StereoLogReader reader;
+  bool opened;
+
+  // next frame to return
+  int next;
+
+  // raw records de-interlaced and demosaiced: the planes, then the right
+  // and left images and the row window (see demosaicStereo())
+  uint8_t* rawBuffer;
+  size_t rawBufferSize;
+
+  // the images of compressed records, left then right
+  uint8_t* unpackBuffer;
+  size_t unpackBufferSize;
+};
+
+// round up to the 8 byte record alignment
+#define STEREO_LOG_ALIGN(n) (((n) + 7) & ~((uint64_t)7))
+
+#endif
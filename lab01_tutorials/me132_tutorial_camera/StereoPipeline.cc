@@ -0,0 +1,487 @@
+/*
+ * Pipelined stereo processing: acquire -> rectify (color) -> stereo,
+ * one thread per stage.
+ */
+
+#include <string.h>
+
+#include "StereoPipeline.h"
+
+// copy a triclops image into a compact buffer of the same size
+static void copyImage(const TriclopsImage* src, TriclopsImage* dst)
+{
+  dst->nrows = src->nrows;
+  dst->ncols = src->ncols;
+  for(int i=0; i<src->nrows; i++)
+    memcpy(dst->data + i*dst->rowinc, src->data + i*src->rowinc, src->ncols);
+}
+
+// copy a 16 bit triclops image (rowinc in bytes)
+static void copyImage16(const TriclopsImage16* src, TriclopsImage16* dst)
+{
+  dst->nrows = src->nrows;
+  dst->ncols = src->ncols;
+  for(int i=0; i<src->nrows; i++)
+    memcpy((unsigned char*)dst->data + i*dst->rowinc,
+	   (unsigned char*)src->data + i*src->rowinc,
+	   src->ncols * sizeof(unsigned short));
+}
+
+// copy the three planes of a triclops color image
+static void copyColorImage(const TriclopsColorImage* src, TriclopsColorImage* dst)
+{
+  dst->nrows = src->nrows;
+  dst->ncols = src->ncols;
+  for(int i=0; i<src->nrows; i++)
+    {
+      memcpy(dst->red   + i*dst->rowinc, src->red   + i*src->rowinc, src->ncols);
+      memcpy(dst->green + i*dst->rowinc, src->green + i*src->rowinc, src->ncols);
+      memcpy(dst->blue  + i*dst->rowinc, src->blue  + i*src->rowinc, src->ncols);
+    }
+}
+
+
+StereoPipeline::StereoPipeline(FrameSource* frameSource, PGRStereoCamera_t* format,
+			       TriclopsContext rectifyContext, TriclopsContext stereoContext,
+			       bool enable_color, int depth)
+{
+  source = frameSource;
+  memcpy(&stereoCamera, format, sizeof(PGRStereoCamera_t));
+  rectifyTriclops = rectifyContext;
+  stereoTriclops = stereoContext;
+  color = enable_color && stereoCamera.bColor;
+  blockStereo = NULL;
+  numBundles = depth<PIPELINE_STAGES ? PIPELINE_STAGES : depth;
+  running = false;
+  started = false;
+  memset(&stats, 0, sizeof(stats));
+  for(int k=0; k<PIPELINE_STAGES; k++)
+    stageDone[k] = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&bundleQueued, NULL);
+  pthread_cond_init(&bundleTaken, NULL);
+
+  freeQueue    = new SpscQueue<StereoBundle*>(numBundles);
+  rectifyQueue = new SpscQueue<StereoBundle*>(numBundles);
+  stereoQueue  = new SpscQueue<StereoBundle*>(numBundles);
+  outputQueue  = new SpscQueue<StereoBundle*>(numBundles);
+
+  // size of the rectified output as configured in the context
+  int nrows, ncols;
+  triclopsGetResolution(stereoTriclops, &nrows, &ncols);
+  unsigned int n = nrows * ncols;
+
+  // a frame buffer per bundle: the input as in BumbleBee::init_stereo(),
+  // then the rectified images, the disparity and the color images
+  FrameLayout layout;
+  getFrameLayout(&stereoCamera, &layout);
+  size_t rectifiedOffset = layout.size;
+  size_t disparityOffset = rectifiedOffset + 2 * alignFrameSize(n);
+  size_t colorOffset = disparityOffset + alignFrameSize(n * sizeof(unsigned short));
+  size_t bundleSize = colorOffset + (color ? 2 * alignFrameSize(3 * n) : 0);
+  if(pool.init(bundleSize, numBundles)<0)
+    {
+      // start() fails without bundles
+      bundles = NULL;
+      return;
+    }
+
+  bundles = new StereoBundle[numBundles];
+  for(int k=0; k<numBundles; k++)
+    {
+      StereoBundle* b = &bundles[k];
+      memset(b, 0, sizeof(StereoBundle));
+      b->buffer = pool.acquire();
+      uint8_t* data = b->buffer->data;
+
+      b->deInterlaced = data + layout.deInterlaced;
+      if(stereoCamera.bColor)
+	{
+	  b->rgb          = data + layout.rgb;
+	  b->redGreenBlue = data + layout.redGreenBlue;
+	}
+
+      b->rectifiedRight.nrows = b->rectifiedLeft.nrows = nrows;
+      b->rectifiedRight.ncols = b->rectifiedLeft.ncols = ncols;
+      b->rectifiedRight.rowinc = b->rectifiedLeft.rowinc = ncols;
+      b->rectifiedRight.data = data + rectifiedOffset;
+      b->rectifiedLeft.data  = data + rectifiedOffset + alignFrameSize(n);
+
+      b->disparity.nrows  = nrows;
+      b->disparity.ncols  = ncols;
+      b->disparity.rowinc = ncols * sizeof(unsigned short);
+      b->disparity.data   = (unsigned short*)(data + disparityOffset);
+
+      if(color)
+	{
+	  TriclopsColorImage* c[2] = { &b->colorRight, &b->colorLeft };
+	  for(int j=0; j<2; j++)
+	    {
+	      c[j]->nrows  = nrows;
+	      c[j]->ncols  = ncols;
+	      c[j]->rowinc = ncols;
+	      c[j]->red    = data + colorOffset + j * alignFrameSize(3 * n);
+	      c[j]->green  = c[j]->red + n;
+	      c[j]->blue   = c[j]->red + 2 * n;
+	    }
+	}
+
+      freeQueue->push(b);
+    }
+}
+
+StereoPipeline::~StereoPipeline()
+{
+  this->stop();
+
+  if(bundles!=NULL)
+    {
+      for(int k=0; k<numBundles; k++)
+	pool.release(bundles[k].buffer);
+      delete[] bundles;
+    }
+  pool.fini();
+
+  delete freeQueue;
+  delete rectifyQueue;
+  delete stereoQueue;
+  delete outputQueue;
+
+  delete blockStereo;
+  triclopsDestroyContext( rectifyTriclops );
+  triclopsDestroyContext( stereoTriclops );
+
+  pthread_cond_destroy(&bundleTaken);
+  pthread_cond_destroy(&bundleQueued);
+  pthread_mutex_destroy(&mutex);
+}
+
+// use block matching in the stereo stage
+void StereoPipeline::setBlockStereo(const BlockStereoParams* params)
+{
+  if(started)
+    return;
+  delete blockStereo;
+  blockStereo = new BlockStereo(params);
+}
+
+// start the stage threads
+int StereoPipeline::start()
+{
+  if(bundles==NULL)
+    return -1;
+
+  running = true;
+  void* (*body[PIPELINE_STAGES])(void*) = { acquireThread, rectifyThread, stereoThread };
+  for(int k=0; k<PIPELINE_STAGES; k++)
+    {
+      if(pthread_create(&threads[k], NULL, body[k], this)!=0)
+	{
+	  fprintf( stderr, "Cannot start pipeline stage %d\n", k );
+	  running = false;
+	  for(int j=0; j<k; j++)
+	    pthread_join(threads[j], NULL);
+	  return -1;
+	}
+    }
+  started = true;
+  return 0;
+}
+
+// stop the stage threads
+void StereoPipeline::stop()
+{
+  pthread_mutex_lock(&mutex);
+  running = false;
+  pthread_cond_broadcast(&bundleQueued);
+  pthread_cond_broadcast(&bundleTaken);
+  pthread_mutex_unlock(&mutex);
+  if(!started)
+    return;
+  for(int k=0; k<PIPELINE_STAGES; k++)
+    pthread_join(threads[k], NULL);
+  started = false;
+}
+
+void* StereoPipeline::acquireThread(void* arg)
+{
+  ((StereoPipeline*)arg)->acquire();
+  return NULL;
+}
+
+void* StereoPipeline::rectifyThread(void* arg)
+{
+  ((StereoPipeline*)arg)->rectify();
+  return NULL;
+}
+
+void* StereoPipeline::stereoThread(void* arg)
+{
+  ((StereoPipeline*)arg)->stereo();
+  return NULL;
+}
+
+// wake the threads waiting on a queue; they check their queue holding
+// the mutex, so they are either asleep or yet to look
+void StereoPipeline::notify(pthread_cond_t* cond)
+{
+  pthread_mutex_lock(&mutex);
+  pthread_cond_broadcast(cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+// the next stage drains its queue and stops
+void StereoPipeline::finishStage(int stage)
+{
+  __sync_synchronize();
+  pthread_mutex_lock(&mutex);
+  stageDone[stage] = true;
+  pthread_cond_broadcast(&bundleQueued);
+  pthread_mutex_unlock(&mutex);
+}
+
+// wait for an item of the given queue while the previous stage runs
+bool StereoPipeline::waitPop(SpscQueue<StereoBundle*>* queue, volatile bool* upstreamDone, StereoBundle** bundle)
+{
+  bool popped = running && queue->pop(bundle);
+  if(!popped)
+    {
+      pthread_mutex_lock(&mutex);
+      while(running)
+	{
+	  if(queue->pop(bundle))
+	    {
+	      popped = true;
+	      break;
+	    }
+	  if(upstreamDone!=NULL && *upstreamDone)
+	    {
+	      // the last frames may have arrived just before
+	      __sync_synchronize();
+	      popped = queue->pop(bundle);
+	      break;
+	    }
+	  pthread_cond_wait(&bundleQueued, &mutex);
+	}
+      pthread_mutex_unlock(&mutex);
+    }
+
+  // the producer may be waiting for room
+  if(popped)
+    this->notify(&bundleTaken);
+  return popped;
+}
+
+// wait for room in the given queue
+void StereoPipeline::waitPush(SpscQueue<StereoBundle*>* queue, StereoBundle* bundle)
+{
+  // queues hold all bundles, so this only waits if a bundle is lost
+  if(!queue->push(bundle))
+    {
+      pthread_mutex_lock(&mutex);
+      while(!queue->push(bundle) && running)
+	pthread_cond_wait(&bundleTaken, &mutex);
+      pthread_mutex_unlock(&mutex);
+    }
+  this->notify(&bundleQueued);
+}
+
+// stage 1: deinterlace and debayer into a free bundle
+void StereoPipeline::acquire()
+{
+  unsigned int n = stereoCamera.nRows * stereoCamera.nCols;
+  StereoBundle* b = NULL;
+  uint64_t sequence = 0;
+
+  while(running)
+    {
+      // all bundles may be in flight or with the consumer
+      if(b==NULL && !waitPop(freeQueue, NULL, &b))
+	break;
+
+      // sleep until the source has a frame, checking for a stop now and
+      // then; at the end of a recording the grab below fails
+      if(source->waitFrame(PIPELINE_FRAME_WAIT)==GRAB_NO_FRAME)
+	continue;
+
+      b->stageStart[STAGE_ACQUIRE] = getWallclockTime();
+      b->timestamp = 0;
+      unsigned char* planar = b->redGreenBlue;
+      unsigned char *right, *left, *center;
+      int ret;
+      if(stereoCamera.bColor)
+	ret = source->grabColorRGB( DC1394_BAYER_METHOD_NEAREST,
+				    b->deInterlaced,
+				    b->rgb,
+				    &planar,
+				    &right,
+				    &left,
+				    &center,
+				    &b->input,
+				    &b->timestamp);
+      else
+	ret = source->grabMono( b->deInterlaced,
+				&right,
+				&left,
+				&center,
+				&b->input,
+				&b->timestamp);
+
+      // without a camera a failed grab is the end of the recording
+      if(ret<0 && stereoCamera.camera==NULL)
+	break;
+
+      // no new frame on the camera after all; keep the bundle and retry
+      if(ret!=0)
+	continue;
+
+      // keep the input in the bundle if the source handed out its own
+      if(stereoCamera.bColor && planar!=b->redGreenBlue)
+	{
+	  memcpy(b->redGreenBlue, planar, 6*n);
+	  b->input.u.rgb.red   = b->redGreenBlue + 2*n;
+	  b->input.u.rgb.green = b->redGreenBlue + 3*n;
+	  b->input.u.rgb.blue  = b->input.u.rgb.green;
+	}
+      if(!stereoCamera.bColor && (right < b->deInterlaced || right >= b->deInterlaced + 2*n))
+	{
+	  memcpy(b->deInterlaced, right, n);
+	  memcpy(b->deInterlaced + n, left, n);
+	  b->input.u.rgb.red   = b->deInterlaced;
+	  b->input.u.rgb.green = b->deInterlaced + n;
+	  b->input.u.rgb.blue  = b->input.u.rgb.green;
+	}
+
+      b->status = 0;
+      b->sequence = ++sequence;
+      b->stageEnd[STAGE_ACQUIRE] = getWallclockTime();
+      waitPush(rectifyQueue, b);
+      b = NULL;
+    }
+
+  this->finishStage(STAGE_ACQUIRE);
+}
+
+// stage 2: rectify the color images of both cameras
+void StereoPipeline::rectify()
+{
+  unsigned int n = stereoCamera.nRows * stereoCamera.nCols;
+  StereoBundle* b;
+  TriclopsInput input_right, input_left;
+  TriclopsColorImage color_right, color_left;
+
+  while(waitPop(rectifyQueue, &stageDone[STAGE_ACQUIRE], &b))
+    {
+      b->stageStart[STAGE_RECTIFY] = getWallclockTime();
+
+      if(color)
+	{
+	  unsigned char* planar = b->redGreenBlue;
+
+	  memcpy(&input_right, &b->input, sizeof(TriclopsInput));
+	  input_right.u.rgb.red   = planar;
+	  input_right.u.rgb.green = planar + 2 * n;
+	  input_right.u.rgb.blue  = planar + 4 * n;
+
+	  memcpy(&input_left, &b->input, sizeof(TriclopsInput));
+	  input_left.u.rgb.red   = planar + 1 * n;
+	  input_left.u.rgb.green = planar + 3 * n;
+	  input_left.u.rgb.blue  = planar + 5 * n;
+
+	  if(triclopsRectifyColorImage(rectifyTriclops, TriCam_REFERENCE, &input_right, &color_right)==TriclopsErrorOk)
+	    copyColorImage(&color_right, &b->colorRight);
+	  else
+	    b->status = -1;
+
+	  if(triclopsRectifyColorImage(rectifyTriclops, TriCam_LEFT, &input_left, &color_left)==TriclopsErrorOk)
+	    copyColorImage(&color_left, &b->colorLeft);
+	  else
+	    b->status = -1;
+	}
+
+      b->stageEnd[STAGE_RECTIFY] = getWallclockTime();
+      waitPush(stereoQueue, b);
+    }
+
+  this->finishStage(STAGE_RECTIFY);
+}
+
+// stage 3: grayscale rectification and stereo
+void StereoPipeline::stereo()
+{
+  StereoBundle* b;
+  TriclopsImage image;
+  TriclopsImage16 image16;
+
+  while(waitPop(stereoQueue, &stageDone[STAGE_RECTIFY], &b))
+    {
+      b->stageStart[STAGE_STEREO] = getWallclockTime();
+
+      if(b->status==0 &&
+	 triclopsRectify(stereoTriclops, &b->input)==TriclopsErrorOk &&
+	 (blockStereo!=NULL || triclopsStereo(stereoTriclops)==TriclopsErrorOk))
+	{
+	  triclopsGetImage( stereoTriclops, TriImg_RECTIFIED, TriCam_RIGHT, &image );
+	  copyImage(&image, &b->rectifiedRight);
+	  triclopsGetImage( stereoTriclops, TriImg_RECTIFIED, TriCam_LEFT, &image );
+	  copyImage(&image, &b->rectifiedLeft);
+
+	  if(blockStereo!=NULL)
+	    {
+	      // block matching straight into the bundle
+	      ImageView right, left;
+	      makeImageView(&right, &b->rectifiedRight, b->sequence, b->timestamp);
+	      makeImageView(&left, &b->rectifiedLeft, b->sequence, b->timestamp);
+	      if(blockStereo->compute(&right, &left, b->disparity.data, b->disparity.rowinc)<0)
+		b->status = -1;
+	    }
+	  else
+	    {
+	      triclopsGetImage16( stereoTriclops, TriImg16_DISPARITY, TriCam_REFERENCE, &image16 );
+	      copyImage16(&image16, &b->disparity);
+	    }
+	}
+      else
+	b->status = -1;
+
+      b->stageEnd[STAGE_STEREO] = getWallclockTime();
+      waitPush(outputQueue, b);
+    }
+
+  this->finishStage(STAGE_STEREO);
+}
+
+// wait for the next bundle in frame order
+int StereoPipeline::getBundle(StereoBundle** bundle)
+{
+  if(!waitPop(outputQueue, &stageDone[STAGE_STEREO], bundle))
+    return -1;
+
+  StereoBundle* b = *bundle;
+  stats.frames++;
+  for(int k=0; k<PIPELINE_STAGES; k++)
+    {
+      double t = (b->stageEnd[k] - b->stageStart[k]) * 1e-3;
+      stats.meanStage[k] += (t - stats.meanStage[k]) / stats.frames;
+      if(t > stats.maxStage[k])
+	stats.maxStage[k] = t;
+    }
+  double total = (b->stageEnd[STAGE_STEREO] - b->stageStart[STAGE_ACQUIRE]) * 1e-3;
+  stats.meanTotal += (total - stats.meanTotal) / stats.frames;
+  if(total > stats.maxTotal)
+    stats.maxTotal = total;
+
+  return 0;
+}
+
+// hand a bundle back for reuse (from the consumer thread only)
+void StereoPipeline::releaseBundle(StereoBundle* bundle)
+{
+  waitPush(freeQueue, bundle);
+}
+
+// timing of the stages (from the consumer thread only)
+void StereoPipeline::getStats(StereoPipelineStats* s)
+{
+  memcpy(s, &stats, sizeof(StereoPipelineStats));
+}
@@ -0,0 +1,177 @@
+/*
+ * Pipelined stereo processing. Each stage runs on its own thread and
+ * the stages are connected by bounded lock-free queues, so that while
+ * frame N is in stereo, frame N+1 is rectified and frame N+2 acquired:
+ *
+ *   acquire (deinterlace + debayer) -> rectify (color) -> stereo
+ *
+ * Triclops keeps the grayscale rectified images it computes stereo on
+ * inside its context, so grayscale rectification is done by the stereo
+ * stage; the rectify stage does the color rectification on a second
+ * context.
+ *
+ * Consumers get StereoBundles in frame order, each holding a coherent
+ * set of rectified images, disparity and timestamp, and give them back
+ * with releaseBundle() when done.
+ */
+
+#ifndef _STEREO_PIPELINE_HH_
+#define _STEREO_PIPELINE_HH_
+
+#include <pthread.h>
+
+#include "FrameSource.h"
+#include "FramePool.h"
+#include "SpscQueue.h"
+#include "BlockStereo.h"
+#include "TriclopsImageView.h"
+
+// pipeline stages
+enum PipelineStage{
+  STAGE_ACQUIRE = 0,
+  STAGE_RECTIFY,
+  STAGE_STEREO,
+  PIPELINE_STAGES,
+};
+
+// how long the acquisition stage sleeps on the source at a time before
+// it checks whether it should stop [ms]
+#define PIPELINE_FRAME_WAIT 100
+
+// everything computed for one frame
+typedef struct _StereoBundle
+{
+  // 0 if all stages succeeded
+  int status;
+
+  // frame number since the pipeline started and camera timestamp
+  uint64_t sequence;
+  uint64_t timestamp;
+
+  // rectified grayscale images (right = reference)
+  TriclopsImage rectifiedRight;
+  TriclopsImage rectifiedLeft;
+
+  // rectified color images (color cameras with color enabled only)
+  TriclopsColorImage colorRight;
+  TriclopsColorImage colorLeft;
+
+  // disparity image of the reference camera
+  TriclopsImage16 disparity;
+
+  // wall clock time each stage started and finished the frame [us]
+  uint64_t stageStart[PIPELINE_STAGES];
+  uint64_t stageEnd[PIPELINE_STAGES];
+
+  // frame buffer of the bundle, holding all images above and below
+  FrameBuffer* buffer;
+
+  // unrectified input owned by the bundle
+  unsigned char* deInterlaced;
+  unsigned char* rgb;
+  unsigned char* redGreenBlue;
+  TriclopsInput input;
+} StereoBundle;
+
+// per stage timing over all frames so far [ms]
+typedef struct _StereoPipelineStats
+{
+  uint64_t frames;
+  double meanStage[PIPELINE_STAGES];
+  double maxStage[PIPELINE_STAGES];
+
+  // from the start of acquisition to the end of stereo
+  double meanTotal;
+  double maxTotal;
+} StereoPipelineStats;
+
+
+class StereoPipeline
+{
+ public:
+  // the pipeline reads from source (already opened, with the given
+  // format) and takes over the two contexts, which must be set up
+  // alike (see BumbleBee::createContext()); depth bundles are in flight
+  StereoPipeline(FrameSource* frameSource, PGRStereoCamera_t* format,
+		 TriclopsContext rectifyContext, TriclopsContext stereoContext,
+		 bool enable_color, int depth=4);
+  ~StereoPipeline();
+
+  // compute disparities with block matching instead of triclopsStereo()
+  // (call before start())
+  void setBlockStereo(const BlockStereoParams* params);
+
+  // start the stage threads
+  int start();
+
+  // stop the stage threads
+  void stop();
+
+  // wait for the next bundle in frame order; -1 once the source is
+  // exhausted and all frames have been handed out
+  int getBundle(StereoBundle** bundle);
+
+  // hand a bundle back for reuse
+  void releaseBundle(StereoBundle* bundle);
+
+  // timing of the stages
+  void getStats(StereoPipelineStats* stats);
+
+ private:
+  static void* acquireThread(void* arg);
+  static void* rectifyThread(void* arg);
+  static void* stereoThread(void* arg);
+  void acquire();
+  void rectify();
+  void stereo();
+
+  // wait for an item of the given queue while the previous stage runs
+  // (upstreamDone NULL: while the pipeline runs)
+  bool waitPop(SpscQueue<StereoBundle*>* queue, volatile bool* upstreamDone, StereoBundle** bundle);
+
+  // wait for room in the given queue
+  void waitPush(SpscQueue<StereoBundle*>* queue, StereoBundle* bundle);
+
+  // wake the threads waiting on a queue
+  void notify(pthread_cond_t* cond);
+
+  // a stage is out of frames
+  void finishStage(int stage);
+
+  FrameSource* source;
+  PGRStereoCamera_t stereoCamera;
+  TriclopsContext rectifyTriclops;
+  TriclopsContext stereoTriclops;
+  bool color;
+
+  // block matcher of the stereo stage, if not Triclops
+  BlockStereo* blockStereo;
+
+  int numBundles;
+  StereoBundle* bundles;
+
+  // frame buffers of the bundles
+  FramePool pool;
+
+  // free -> acquire -> rectify -> stereo -> consumer -> free
+  SpscQueue<StereoBundle*>* freeQueue;
+  SpscQueue<StereoBundle*>* rectifyQueue;
+  SpscQueue<StereoBundle*>* stereoQueue;
+  SpscQueue<StereoBundle*>* outputQueue;
+
+  pthread_t threads[PIPELINE_STAGES];
+  volatile bool running;
+  volatile bool stageDone[PIPELINE_STAGES];
+  bool started;
+
+  // the queues stay lock-free; threads with nothing to pop or no room
+  // to push sleep on these until a bundle is queued or taken
+  pthread_mutex_t mutex;
+  pthread_cond_t bundleQueued;
+  pthread_cond_t bundleTaken;
+
+  // timing sums, updated by the consumer in getBundle()
+  StereoPipelineStats stats;
+};
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * Raw frame recording with a background writer thread and O_DIRECT
+ * chunk writes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "StereoRecorder.h"
+
+// write the whole buffer at the given offset, retrying on short writes
+static int pwriteFully(int fd, const void* buf, size_t n, uint64_t offset)
+{
+  const uint8_t* p = (const uint8_t*)buf;
+  while(n>0)
+    {
+      ssize_t w = pwrite(fd, p, n, offset);
+      if(w<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+	  return -1;
+	}
+      p += w;
+      n -= w;
+      offset += w;
+    }
+  return 0;
+}
+
+StereoRecorder::StereoRecorder()
+{
+  fd = -1;
+  indexFd = -1;
+  direct = false;
+  packer = NULL;
+  numChunks = 0;
+  chunkSize = 0;
+  chunks = NULL;
+  maxEntries = 0;
+  filled = 0;
+  written = 0;
+  closing = false;
+  failed = false;
+  running = false;
+  frames = 0;
+  dropped = 0;
+  bytesWritten = 0;
+  startTime = 0;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&chunkFilled, NULL);
+}
+
+StereoRecorder::~StereoRecorder()
+{
+  this->close();
+  pthread_cond_destroy(&chunkFilled);
+  pthread_mutex_destroy(&mutex);
+}
+
+int StereoRecorder::open(const char* fname, size_t rawSize, int nChunks, int nThreads)
+{
+  this->close();
+
+  if(nThreads>0)
+    {
+      packer = new StereoLogWriter();
+      if(packer->open(fname, true)<0 ||
+	 packer->enableCompression(nThreads, nChunks<nThreads ? nThreads : nChunks, true)<0)
+	{
+	  delete packer;
+	  packer = NULL;
+	  return -1;
+	}
+      startTime = getWallclockTime();
+      return 0;
+    }
+
+  // the chunks hold two records at least, and are written whole
+  size_t recordSize = STEREO_LOG_ALIGN(sizeof(StereoLogFrameHeader) + rawSize);
+  chunkSize = RECORDER_CHUNK_SIZE;
+  if(chunkSize < 2 * recordSize)
+    chunkSize = 2 * recordSize;
+  chunkSize = (chunkSize + RECORDER_BLOCK - 1) & ~(size_t)(RECORDER_BLOCK - 1);
+  numChunks = nChunks<2 ? 2 : nChunks;
+  maxEntries = chunkSize / recordSize + 1;
+
+  // the pool maps whole pages, so chunks of whole blocks stay block aligned
+  if(pool.init(chunkSize, numChunks)<0)
+    return -1;
+
+  fd = -1;
+  direct = false;
+#ifdef O_DIRECT
+  fd = ::open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  direct = (fd>=0);
+#endif
+  // file systems such as tmpfs do not take O_DIRECT
+  if(fd<0)
+    fd = ::open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd<0)
+    {
+      fprintf( stderr, "Cannot open log %s: %s\n", fname, strerror(errno) );
+      pool.fini();
+      return -1;
+    }
+
+  char idxname[512];
+  snprintf(idxname, sizeof(idxname), "%s.idx", fname);
+  indexFd = ::open(idxname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(indexFd<0)
+    {
+      fprintf( stderr, "Cannot open log index %s: %s\n", idxname, strerror(errno) );
+      ::close(fd);
+      fd = -1;
+      pool.fini();
+      return -1;
+    }
+
+  chunks = new RecorderChunk[numChunks];
+  for(int k=0; k<numChunks; k++)
+    {
+      chunks[k].buffer = pool.acquire();
+      chunks[k].used = 0;
+      chunks[k].entries = new StereoLogIndexEntry[maxEntries];
+      chunks[k].numEntries = 0;
+    }
+
+  // the log starts with its header
+  StereoLogHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = STEREO_LOG_MAGIC;
+  header.version = STEREO_LOG_VERSION;
+  memcpy(chunks[0].buffer->data, &header, sizeof(header));
+  chunks[0].used = sizeof(header);
+
+  filled = 0;
+  written = 0;
+  closing = false;
+  failed = false;
+  frames = 0;
+  dropped = 0;
+  bytesWritten = 0;
+  startTime = getWallclockTime();
+
+  if(pthread_create(&thread, NULL, StereoRecorder::writerThread, this)!=0)
+    {
+      fprintf( stderr, "Cannot start the log writer\n" );
+      this->close();
+      return -1;
+    }
+  running = true;
+  return 0;
+}
+
+int StereoRecorder::append(int32_t frameId, uint64_t timestamp, int32_t cols, int32_t rows,
+			   int32_t channels, BayerTile tile, const uint8_t* raw,
+			   float shutter, float gain)
+{
+  if(packer!=NULL)
+    return packer->appendRaw(frameId, timestamp, cols, rows, channels, tile, raw, shutter, gain);
+  if(fd<0)
+    return -1;
+
+  StereoLogFrameHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = STEREO_LOG_FRAME_MAGIC;
+  header.frameId = frameId;
+  header.timestamp = timestamp;
+  header.cols = cols;
+  header.rows = rows;
+  header.rowinc = cols;
+  header.channels = channels;
+  header.shutter = shutter;
+  header.gain = gain;
+  header.imageSize = rows * cols;
+  header.format = STEREO_LOG_RAW;
+  header.bayerTile = channels==3 ? tile : 0;
+
+  uint64_t rawBytes = 2 * (uint64_t)header.imageSize;
+  uint64_t recordSize = STEREO_LOG_ALIGN(sizeof(header) + rawBytes);
+
+  // room in the chunk being filled and the free ones after it; this
+  // thread alone moves filled on, so only written can change meanwhile
+  pthread_mutex_lock(&mutex);
+  if(failed)
+    {
+      pthread_mutex_unlock(&mutex);
+      return -1;
+    }
+  uint64_t pending = filled - written;
+  uint64_t room = 0;
+  if(pending < (uint64_t)numChunks)
+    room = (chunkSize - chunks[filled % numChunks].used) + (numChunks - 1 - pending) * chunkSize;
+  if(recordSize > room)
+    {
+      dropped++;
+      pthread_mutex_unlock(&mutex);
+      return -1;
+    }
+  frames++;
+  pthread_mutex_unlock(&mutex);
+
+  uint64_t offset = filled * chunkSize + chunks[filled % numChunks].used;
+  static const uint8_t zeros[8] = {0,0,0,0,0,0,0,0};
+  this->copy(&header, sizeof(header));
+  this->copy(raw, rawBytes);
+  this->copy(zeros, recordSize - sizeof(header) - rawBytes);
+
+  // the entry goes with the chunk the record ends in, so that it is
+  // never written before the record
+  RecorderChunk* chunk = &chunks[filled % numChunks];
+  StereoLogIndexEntry* entry = &chunk->entries[chunk->numEntries++];
+  memset(entry, 0, sizeof(StereoLogIndexEntry));
+  entry->frameId = frameId;
+  entry->timestamp = timestamp;
+  entry->offset = offset;
+  return 0;
+}
+
+// copy bytes to the chunk being filled; a full chunk is handed to the
+// writer once more bytes come, so that it can still take index entries
+void StereoRecorder::copy(const void* data, size_t size)
+{
+  const uint8_t* p = (const uint8_t*)data;
+  while(size>0)
+    {
+      RecorderChunk* chunk = &chunks[filled % numChunks];
+      if(chunk->used==chunkSize)
+	{
+	  pthread_mutex_lock(&mutex);
+	  filled++;
+	  pthread_cond_signal(&chunkFilled);
+	  pthread_mutex_unlock(&mutex);
+	  continue;
+	}
+      size_t n = chunkSize - chunk->used;
+      if(n > size)
+	n = size;
+      memcpy(chunk->buffer->data + chunk->used, p, n);
+      chunk->used += n;
+      p += n;
+      size -= n;
+    }
+}
+
+void* StereoRecorder::writerThread(void* arg)
+{
+  ((StereoRecorder*)arg)->write();
+  return NULL;
+}
+
+// write full chunks as they are handed over
+void StereoRecorder::write()
+{
+  pthread_mutex_lock(&mutex);
+  while(true)
+    {
+      while(written==filled && !closing)
+	pthread_cond_wait(&chunkFilled, &mutex);
+      if(written==filled)
+	break;
+
+      uint64_t seq = written;
+      RecorderChunk* chunk = &chunks[seq % numChunks];
+      bool skip = failed;
+      pthread_mutex_unlock(&mutex);
+
+      // after a failure chunks are only recycled
+      int ret = skip ? 0 : this->writeChunk(chunk, seq, chunkSize);
+
+      pthread_mutex_lock(&mutex);
+      if(ret<0)
+	failed = true;
+      else if(!skip)
+	bytesWritten += chunkSize;
+      chunk->used = 0;
+      chunk->numEntries = 0;
+      written++;
+    }
+  pthread_mutex_unlock(&mutex);
+}
+
+int StereoRecorder::writeChunk(RecorderChunk* chunk, uint64_t chunkSeq, size_t size)
+{
+  size_t n = (size + RECORDER_BLOCK - 1) & ~(size_t)(RECORDER_BLOCK - 1);
+  if(n > size)
+    memset(chunk->buffer->data + size, 0, n - size);
+
+  if(pwriteFully(fd, chunk->buffer->data, n, chunkSeq * chunkSize)<0)
+    {
+      fprintf( stderr, "Cannot write to log: %s\n", strerror(errno) );
+      return -1;
+    }
+
+  size_t entrySize = chunk->numEntries * sizeof(StereoLogIndexEntry);
+  if(entrySize>0 && ::write(indexFd, chunk->entries, entrySize)!=(ssize_t)entrySize)
+    {
+      fprintf( stderr, "Cannot write to log index: %s\n", strerror(errno) );
+      return -1;
+    }
+  return 0;
+}
+
+void StereoRecorder::getStats(RecorderStats* stats)
+{
+  memset(stats, 0, sizeof(RecorderStats));
+  if(packer!=NULL)
+    {
+      packer->getQueueCounts(&stats->frames, &stats->dropped, &stats->queued);
+      stats->bytesWritten = packer->getBytesWritten();
+    }
+  else
+    {
+      pthread_mutex_lock(&mutex);
+      stats->frames = frames;
+      stats->dropped = dropped;
+      stats->bytesWritten = bytesWritten;
+      stats->queued = filled - written;
+      pthread_mutex_unlock(&mutex);
+    }
+
+  stats->direct = direct;
+  if(startTime>0)
+    stats->elapsed = (getWallclockTime() - startTime) * 1e-6;
+  if(stats->elapsed>0)
+    stats->megabytesPerSec = stats->bytesWritten / stats->elapsed * 1e-6;
+}
+
+int StereoRecorder::close()
+{
+  if(packer!=NULL)
+    {
+      int ret = packer->close();
+      delete packer;
+      packer = NULL;
+      return ret;
+    }
+  if(fd<0)
+    return 0;
+
+  if(running)
+    {
+      pthread_mutex_lock(&mutex);
+      closing = true;
+      pthread_cond_signal(&chunkFilled);
+      pthread_mutex_unlock(&mutex);
+      pthread_join(thread, NULL);
+      running = false;
+    }
+
+  // the chunk being filled, then cut the block padding off the log
+  int ret = failed ? -1 : 0;
+  RecorderChunk* chunk = &chunks[filled % numChunks];
+  if(ret==0 && chunk->used>0)
+    {
+      ret = this->writeChunk(chunk, filled, chunk->used);
+      if(ret==0)
+	bytesWritten += chunk->used;
+    }
+  if(ftruncate(fd, filled * chunkSize + chunk->used)<0 && ret==0)
+    {
+      fprintf( stderr, "Cannot truncate log: %s\n", strerror(errno) );
+      ret = -1;
+    }
+
+  ::close(fd);
+  ::close(indexFd);
+  fd = -1;
+  indexFd = -1;
+
+  for(int k=0; k<numChunks; k++)
+    {
+      pool.release(chunks[k].buffer);
+      delete[] chunks[k].entries;
+    }
+  delete[] chunks;
+  chunks = NULL;
+  pool.fini();
+  return ret;
+}
@@ -0,0 +1,135 @@
+/*
+ * Recording of raw camera frames to a stereo log (see StereoLog.h) at
+ * the full camera rate. The capture thread only copies each raw frame,
+ * half the size of the demosaiced images, into a ring of large aligned
+ * chunks; a background thread writes full chunks with O_DIRECT (where
+ * the file system supports it), so the page cache neither fills up nor
+ * stalls the writer, and appends the sidecar index.
+ *
+ * If the disk cannot keep up and the ring is full, frames are dropped
+ * and counted rather than holding up capture.
+ *
+ * Alternatively the frames are compressed on a pool of threads by a
+ * StereoLogWriter (see StereoCodec.h), which writes about half as many
+ * bytes through the page cache; frames are then dropped when the
+ * compression queue is full.
+ */
+
+#ifndef _STEREO_RECORDER_HH_
+#define _STEREO_RECORDER_HH_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "StereoLog.h"
+#include "FramePool.h"
+
+// default size of a chunk [bytes] and number of chunks in the ring
+#define RECORDER_CHUNK_SIZE (8 << 20)
+#define RECORDER_CHUNKS 8
+
+// alignment O_DIRECT needs for buffers, sizes and offsets [bytes]
+#define RECORDER_BLOCK 4096
+
+// counters of a recording
+typedef struct _RecorderStats
+{
+  // frames queued and frames dropped because the ring was full
+  uint64_t frames;
+  uint64_t dropped;
+
+  // bytes written to the log, and the time since open() [s]
+  uint64_t bytesWritten;
+  double elapsed;
+
+  // sustained write rate [MB/s]
+  double megabytesPerSec;
+
+  // chunks waiting for the writer
+  int queued;
+
+  // the log is written with O_DIRECT
+  bool direct;
+} RecorderStats;
+
+// a chunk of the ring
+typedef struct _RecorderChunk
+{
+  FrameBuffer* buffer;
+
+  // bytes filled
+  size_t used;
+
+  // index entries of the records ending in the chunk
+  StereoLogIndexEntry* entries;
+  int numEntries;
+} RecorderChunk;
+
+
+class StereoRecorder
+{
+ public:
+  StereoRecorder();
+  ~StereoRecorder();
+
+  // Create a log for raw frames of up to rawSize bytes, with a ring of
+  // nChunks chunks (each at least two frames) and start the writer; with
+  // nThreads compression threads, nChunks frames are queued for them
+  // instead
+  int open(const char* fname, size_t rawSize, int nChunks=RECORDER_CHUNKS, int nThreads=0);
+
+  // Queue a raw frame of rows x cols 16 bit pixels (see
+  // StereoLogFormat); channels is 3 for the Bayer mosaic of a color
+  // camera, 1 otherwise. Returns -1 if the frame was dropped or the
+  // writer failed.
+  int append(int32_t frameId, uint64_t timestamp, int32_t cols, int32_t rows,
+	     int32_t channels, BayerTile tile, const uint8_t* raw,
+	     float shutter, float gain);
+
+  void getStats(RecorderStats* stats);
+
+  // write what is queued, stop the writer and close the log; -1 if any
+  // write failed
+  int close();
+
+ private:
+  static void* writerThread(void* arg);
+  void write();
+
+  // copy bytes to the chunk being filled, handing full ones to the writer
+  void copy(const void* data, size_t size);
+
+  // write a chunk (size rounded up to RECORDER_BLOCK) and its index entries
+  int writeChunk(RecorderChunk* chunk, uint64_t chunkSeq, size_t size);
+
+  int fd;
+  int indexFd;
+  bool direct;
+
+  // writer of compressed frames, NULL when writing the ring
+  StereoLogWriter* packer;
+
+  FramePool pool;
+  int numChunks;
+  size_t chunkSize;
+  RecorderChunk* chunks;
+  int maxEntries;
+
+  // chunks handed to the writer and chunks written since open(); chunk
+  // filled % numChunks is being filled
+  pthread_mutex_t mutex;
+  pthread_cond_t chunkFilled;
+  uint64_t filled;
+  uint64_t written;
+  bool closing;
+  bool failed;
+  pthread_t thread;
+  bool running;
+
+  uint64_t frames;
+  uint64_t dropped;
+  uint64_t bytesWritten;
+  uint64_t startTime;
+};
+
+#endif
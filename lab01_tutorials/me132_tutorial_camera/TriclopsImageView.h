@@ -0,0 +1,35 @@
+/*
+ * Views (see ImageView.h) of the images of the Triclops library.
+ */
+
+#ifndef _TRICLOPS_IMAGE_VIEW_HH_
+#define _TRICLOPS_IMAGE_VIEW_HH_
+
+#include <pgrlibdcstereo/pgr_stereocam.h>
+
+#include "ImageView.h"
+
+// view of a Triclops grayscale image
+inline void makeImageView(ImageView* view, const TriclopsImage* image, uint64_t frameId, uint64_t timestamp)
+{
+  makeImageView(view, image->data, image->ncols, image->nrows, image->rowinc,
+		IMAGE_MONO8, frameId, timestamp);
+}
+
+// view of a Triclops 16 bit image (rowinc is in bytes)
+inline void makeImageView(ImageView* view, const TriclopsImage16* image, uint64_t frameId, uint64_t timestamp)
+{
+  makeImageView(view, (const unsigned char*)image->data, image->ncols, image->nrows, image->rowinc,
+		IMAGE_MONO16, frameId, timestamp);
+}
+
+// view of a Triclops color image
+inline void makeImageView(ImageView* view, const TriclopsColorImage* image, uint64_t frameId, uint64_t timestamp)
+{
+  makeImageView(view, image->red, image->ncols, image->nrows, image->rowinc,
+		IMAGE_PLANAR_RGB8, frameId, timestamp);
+  view->planes[1] = image->green;
+  view->planes[2] = image->blue;
+}
+
+#endif
@@ -4,45 +4,48 @@
  * in part on their sample code. 
  */
 
+#include <poll.h>
+
 #include "bb2.h"
 
+static bool getDemosaicMethod(dc1394color_filter_t filter, dc1394bayer_method_t bayerMethod,
+			      BayerTile* tile, DemosaicMethod* method);
+
 // default constructor
 BumbleBee::BumbleBee()
 {
-  // initialize some variables
-  minDisparity = 0;
-  maxDisparity = 240;
-  scale = 2; //scale rectified and disparity image
-  
-  // by default, use 
-  bumblebeeId = 6021014;
-  color = false;
+  // by default, use camera 6021014 at downscale 2
+  this->initMembers(NULL, 6021014, 2, false, STEREO_TRICLOPS);
 }
 
 // loaded constructor
 BumbleBee::BumbleBee(int bbId)
 {
-  // initialize some variables
-  minDisparity = 0;
-  maxDisparity = 240;
-  scale = 2; //scale rectified and disparity image
-  bumblebeeId = bbId;
-  color = false;
+  this->initMembers(NULL, bbId, 2, false, STEREO_TRICLOPS);
 }
 
 // loaded constructor
 BumbleBee::BumbleBee(int bbId, int downscale)
 {
-  // initialize some variables
-  minDisparity = 0;
-  maxDisparity = 240;
-  scale = downscale;
-  bumblebeeId = bbId;
-  color = false;
+  this->initMembers(NULL, bbId, downscale, false, STEREO_TRICLOPS);
 }
 
 // loaded constructor
-BumbleBee::BumbleBee(int bbId, int downscale, bool enable_color)
+BumbleBee::BumbleBee(int bbId, int downscale, bool enable_color, StereoEngine engine)
+{
+  this->initMembers(NULL, bbId, downscale, enable_color, engine);
+}
+
+// constructor reading frames from a given source instead of the camera
+BumbleBee::BumbleBee(FrameSource* frameSource, int bbId, int downscale, bool enable_color, StereoEngine engine)
+{
+  this->initMembers(frameSource, bbId, downscale, enable_color, engine);
+}
+
+// initialize the members for the constructors; scale is that of the
+// rectified and disparity images, frameSource NULL for the camera
+void BumbleBee::initMembers(FrameSource* frameSource, int bbId, int downscale, bool enable_color,
+			    StereoEngine engine)
 {
   // initialize some variables
   minDisparity = 0;
@@ -50,6 +53,44 @@ BumbleBee::BumbleBee(int bbId, int downscale, bool enable_color)
   scale = downscale;
   bumblebeeId = bbId;
   color = enable_color;
+  source = frameSource;
+  ownSource = false;
+  asyncSource = NULL;
+  pipeline = NULL;
+  frameId = 0;
+  depthTable = NULL;
+  depthTableValid = false;
+  depthImage = NULL;
+  depthFrameId = 0;
+  stereoEngine = engine;
+  blockStereo = NULL;
+  blockDisparity = NULL;
+  remapRectify = false;
+  remapBuffer = NULL;
+  stereoOnly = false;
+  inputBuffer = NULL;
+  initCaptureTiming(&timingData);
+  timing = NULL;
+  frameWait = BB_FRAME_WAIT;
+  grabStart = 0;
+  settingsValid = false;
+  settingsFrame = 0;
+  cachedShutter = 0;
+  cachedGain = 0;
+  recorder = NULL;
+  initRemapTable(&remapRight);
+  initRemapTable(&remapLeft);
+  roiRow = 0;
+  roiRows = 0;
+  pyramidLevels = 1;
+  pyramidBuffer = NULL;
+  pyramidInput = NULL;
+  for(int l=0; l<PYRAMID_MAX_LEVELS; l++)
+    {
+      initRemapTable(&pyramidRemap[0][l]);
+      initRemapTable(&pyramidRemap[1][l]);
+    }
+  camera = NULL;
 }
 
 // default destructor
@@ -61,6 +102,17 @@ BumbleBee::~BumbleBee()
 // initialize stereocamera
 int BumbleBee::init(float shutter)
 {
+  // frames come from a source given at construction; no camera to set up
+  if(source!=NULL)
+    {
+      if(source->open(&stereoCamera)<0)
+	{
+	  fprintf( stderr, "Cannot open frame source\n" );
+	  return(-1);
+	}
+      return this->init_stereo();
+    }
+
   uint32_t nCameras;
   dc1394camera_t** cameras=NULL;
 
@@ -119,6 +171,25 @@ int BumbleBee::init(float shutter)
    // free the cameras object
    free(cameras);
 
+   return this->init_camera(shutter);
+}
+
+// initialize with a camera found on the bus by the caller
+int BumbleBee::init(dc1394camera_t* cam, float shutter)
+{
+  if(cam==NULL || !isStereoCamera(cam))
+    {
+      fprintf( stderr, "Not a stereo camera!\n" );
+      return(-1);
+    }
+  camera = cam;
+  printf( "Using this camera: %d\n", (int)(camera->euid_64) );
+  return this->init_camera(shutter);
+}
+
+// start the camera found by init() and set up stereo
+int BumbleBee::init_camera(float shutter)
+{
    // try to initialize
    for(int i=0; i<5; i++)
      {
@@ -130,31 +201,25 @@ int BumbleBee::init(float shutter)
        else
 	 break;
      }
-   
+
+   // the camera is now just another frame source
+   source = new DC1394FrameSource(&stereoCamera);
+   ownSource = true;
+
+   return this->init_stereo();
+}
+
+// set up the triclops context and buffers once the source is open
+int BumbleBee::init_stereo()
+{
    // load the configuration file for stereo processing
    sprintf(calibrationfile,"%d.cal",bumblebeeId);
-   tri_err = triclopsGetDefaultContextFromFile( &triclops, calibrationfile);
-   if ( tri_err != TriclopsErrorOk )
-   {
-      fprintf( stderr, "Can't get context from camera\n" );
-      this->cleanup(camera);
-      return (-1);
-   }
-  
-   // make sure we are in subpixel mode
-   triclopsSetSubpixelInterpolation( triclops, 1 );
-   
-   // Set output resolution of rectified image and disparity image-- could be smaller, just be sure to preserve 640x480 ratio;
-   // NOTE: this only sets the resolution of the disparity image and the rectified image
-   tri_err = triclopsSetResolution( triclops, stereoCamera.nRows/scale, stereoCamera.nCols/scale);
-   if ( tri_err != TriclopsErrorOk )
+   if(this->createContext(&triclops)<0)
      {
-       fprintf( stderr, "triclopsSetResolution failed!\n" );
-       triclopsDestroyContext( triclops );
        this->cleanup(camera);
        return (-1);
      }
-   
+
    // grab focal length
    tri_err = triclopsGetFocalLength( triclops, &focalLength);
    if ( tri_err != TriclopsErrorOk )
@@ -175,25 +240,26 @@ int BumbleBee::init(float shutter)
        return (-1);
      }
 
-   // Set disparity values
-   tri_err = triclopsSetDisparity( triclops, minDisparity, maxDisparity);
-   if ( tri_err != TriclopsErrorOk )
+   // specify buffer size and take the input buffers, aligned, from a
+   // pool of one frame
+   nBufferSize = stereoCamera.nRows * stereoCamera.nCols * stereoCamera.nBytesPerPixel;
+   FrameLayout layout;
+   getFrameLayout(&stereoCamera, &layout);
+   if(inputPool.init(layout.size, 1)<0)
      {
-       fprintf( stderr, "triclopsSetResolution failed!\n" );
        triclopsDestroyContext( triclops );
        this->cleanup(camera);
        return (-1);
      }
-
-   // specify buffer size and allocate memory
-   nBufferSize = stereoCamera.nRows * stereoCamera.nCols * stereoCamera.nBytesPerPixel;
-   pucDeInterlacedBuffer = new unsigned char[nBufferSize];
+   inputBuffer = inputPool.acquire();
+   pucDeInterlacedBuffer = inputBuffer->data + layout.deInterlaced;
 
    if(stereoCamera.bColor)
      {
-       pucRGBBuffer 	= new unsigned char[ 3 * nBufferSize ];
-       pucGreenBuffer 	= new unsigned char[ nBufferSize ];
-       pucRedGreenBlue  = new unsigned char[ 3 * nBufferSize ];
+       pucRGBBuffer 	= inputBuffer->data + layout.rgb;
+       pucGreenBuffer 	= inputBuffer->data + layout.green;
+       pucRedGreenBlue  = inputBuffer->data + layout.redGreenBlue;
+       pucPlanarRGB     = pucRedGreenBlue;
        pucRightRGB	= NULL;
        pucLeftRGB	= NULL;
        pucCenterRGB	= NULL;
@@ -216,22 +282,561 @@ int BumbleBee::init(float shutter)
    if ( tri_err != TriclopsErrorOk )
      {
        fprintf( stderr, "triclopsGetStereoBaseline failed!\n" );
-       triclopsDestroyContext( triclops );
-       this->cleanup(camera);
+       this->abortInit();
        return (-1);
      }
 
    printf("hfov: %f [deg]   vfov: %f [deg]  baseline: %f\n",
 	  this->hfov*180/M_PI, this->vfov*180/M_PI, this->baseline);
 
+   // set up the built-in stereo engine if one was selected
+   if(stereoEngine!=STEREO_TRICLOPS && this->initBlockStereo()<0)
+     {
+       this->abortInit();
+       return (-1);
+     }
+
    // do a quick capture
    while(this->capture()<0)
-     continue;
+     {
+       // a replayed recording cannot be waited on
+       if(camera==NULL)
+	 {
+	   this->abortInit();
+	   return (-1);
+	 }
+     }
 
 
    return 0;   
 }
 
+// undo init() after init_stereo() allocated its buffers
+void BumbleBee::abortInit()
+{
+  this->freeBuffers();
+  triclopsDestroyContext( triclops );
+  source->close();
+  if(ownSource)
+    {
+      delete source;
+      source = NULL;
+    }
+  this->cleanup(camera);
+  camera = NULL;
+}
+
+// give back the input buffers and free the block matcher
+void BumbleBee::freeBuffers()
+{
+  inputPool.release(inputBuffer);
+  inputBuffer = NULL;
+  inputPool.fini();
+  pucDeInterlacedBuffer = NULL;
+  pucRGBBuffer = NULL;
+  pucGreenBuffer = NULL;
+  pucRedGreenBlue = NULL;
+
+  delete blockStereo;
+  delete[] blockDisparity;
+  blockStereo = NULL;
+  blockDisparity = NULL;
+}
+
+// set up the block matching engine with the stereo settings of the
+// triclops context (mask size, edge correlation, validation)
+int BumbleBee::initBlockStereo()
+{
+   BlockStereoParams params;
+   if(this->getBlockStereoParams(&params)<0)
+     return (-1);
+
+   blockStereo = new BlockStereo(&params);
+   blockDisparity = new unsigned short[(stereoCamera.nRows/scale) * (stereoCamera.nCols/scale)];
+   return 0;
+}
+
+// get the block matching settings equivalent to the triclops context
+int BumbleBee::getBlockStereoParams(BlockStereoParams* params)
+{
+   getDefaultBlockStereoParams(params);
+   params->minDisparity = minDisparity;
+   params->maxDisparity = maxDisparity;
+   params->census = (stereoEngine==STEREO_BLOCK_CENSUS);
+   params->subpixel = true;
+
+   long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+   params->nThreads = nCpus>0 ? nCpus : 1;
+
+   TriclopsBool on;
+   if(triclopsGetStereoMask( triclops, &params->maskSize ) != TriclopsErrorOk ||
+      triclopsGetEdgeCorrelation( triclops, &on ) != TriclopsErrorOk)
+     {
+       fprintf( stderr, "Cannot get the stereo settings of the triclops context\n" );
+       return (-1);
+     }
+   params->edgeCorrelation = on;
+
+   if(triclopsGetTextureValidation( triclops, &on ) == TriclopsErrorOk)
+     params->textureValidation = on;
+   triclopsGetTextureValidationThreshold( triclops, &params->textureThreshold );
+   if(triclopsGetUniquenessValidation( triclops, &on ) == TriclopsErrorOk)
+     params->uniquenessValidation = on;
+   triclopsGetUniquenessValidationThreshold( triclops, &params->uniquenessThreshold );
+
+   return 0;
+}
+
+// create a triclops context from the calibration file with the
+// driver's resolution and disparity settings
+int BumbleBee::createContext(TriclopsContext* context)
+{
+   tri_err = triclopsGetDefaultContextFromFile( context, calibrationfile);
+   if ( tri_err != TriclopsErrorOk )
+   {
+      fprintf( stderr, "Can't get context from camera\n" );
+      return (-1);
+   }
+  
+   // make sure we are in subpixel mode
+   triclopsSetSubpixelInterpolation( *context, 1 );
+   
+   // Set output resolution of rectified image and disparity image-- could be smaller, just be sure to preserve 640x480 ratio;
+   // NOTE: this only sets the resolution of the disparity image and the rectified image
+   tri_err = triclopsSetResolution( *context, stereoCamera.nRows/scale, stereoCamera.nCols/scale);
+   if ( tri_err != TriclopsErrorOk )
+     {
+       fprintf( stderr, "triclopsSetResolution failed!\n" );
+       triclopsDestroyContext( *context );
+       return (-1);
+     }
+
+   // Set disparity values
+   tri_err = triclopsSetDisparity( *context, minDisparity, maxDisparity);
+   if ( tri_err != TriclopsErrorOk )
+     {
+       fprintf( stderr, "triclopsSetDisparity failed!\n" );
+       triclopsDestroyContext( *context );
+       return (-1);
+     }
+
+   return 0;
+}
+
+// build the remap tables of both cameras rectifying source images of
+// size srcRows x srcCols (packed rows) to nrows x ncols
+int BumbleBee::buildRemapTables(int srcRows, int srcCols, int nrows, int ncols,
+				RemapTable* right, RemapTable* left)
+{
+   freeRemapTable(right);
+   freeRemapTable(left);
+
+   // the calibration is big, and only needed while building the tables
+   Calibration* cal = new Calibration;
+   int ret = loadCalibration( calibrationfile, cal );
+   int rightCamera = findCalibrationCamera( cal, "red" );
+   int leftCamera = findCalibrationCamera( cal, "green" );
+   if(ret==0 && (rightCamera<0 || leftCamera<0))
+     {
+       fprintf( stderr, "No left/right camera in %s\n", calibrationfile );
+       ret = -1;
+     }
+   if(ret==0)
+     ret = buildRemapTable( cal, rightCamera, srcRows, srcCols, srcCols, nrows, ncols, right );
+   if(ret==0)
+     ret = buildRemapTable( cal, leftCamera, srcRows, srcCols, srcCols, nrows, ncols, left );
+   delete cal;
+   if(ret<0)
+     {
+       freeRemapTable(right);
+       freeRemapTable(left);
+       return (-1);
+     }
+   return 0;
+}
+
+// rectify with remap tables built from the calibration file instead of
+// triclopsRectify() and triclopsRectifyColorImage()
+int BumbleBee::setRemapRectify(bool enable)
+{
+   if(enable && remapBuffer==NULL)
+     {
+       if(this->buildRemapTables(stereoCamera.nRows, stereoCamera.nCols,
+				 stereoCamera.nRows/scale, stereoCamera.nCols/scale,
+				 &remapRight, &remapLeft)<0)
+	 return (-1);
+
+       // red, green, blue planes of the right, then the left image
+       remapBuffer = new unsigned char[6 * remapRight.nrows * remapRight.ncols];
+     }
+
+   remapRectify = enable;
+   return 0;
+}
+
+// absolute differences of rows [row, row+nrows) of two planes: their sum
+// and the pixels differing by more than tolerance
+static void comparePlanes(const unsigned char* a, int aRowinc, const unsigned char* b, int bRowinc,
+			  int row, int nrows, int ncols, int tolerance,
+			  uint64_t* sum, uint64_t* outliers)
+{
+   for(int i=row; i<row+nrows; i++)
+     for(int j=0; j<ncols; j++)
+       {
+	 int d = a[i*aRowinc + j] - b[i*bRowinc + j];
+	 if(d<0)
+	   d = -d;
+	 *sum += d;
+	 if(d>tolerance)
+	   (*outliers)++;
+       }
+}
+
+// compare remap rectification of the current frame with Triclops
+int BumbleBee::compareRemapRectify(int tolerance, double* meanError, double* outlierFraction)
+{
+   bool rgb = stereoCamera.bColor && color;
+   bool gray = blockStereo!=NULL;
+   if(!remapRectify || (!rgb && !gray))
+     {
+       fprintf( stderr, "No images are rectified with remap tables\n" );
+       return (-1);
+     }
+
+   int nrows = remapRight.nrows;
+   int ncols = remapRight.ncols;
+   int n = nrows * ncols;
+   int nInput = stereoCamera.nRows * stereoCamera.nCols;
+   int row = roiRows>0 ? roiRow : 0;
+   int rows = roiRows>0 ? roiRows : nrows;
+   uint64_t sum = 0, outliers = 0, count = 0;
+   for(int m=0; m<2; m++)
+     {
+       // the planes of the camera as processFrame() rectifies them
+       // without remap tables
+       const unsigned char* planes[3];
+       int nPlanes, rowinc, refRows, refCols;
+       if(rgb)
+	 {
+	   TriclopsInput in;
+	   memcpy(&in, &input, sizeof(TriclopsInput));
+	   in.u.rgb.red   = pucPlanarRGB + (0 + m) * nInput;
+	   in.u.rgb.green = pucPlanarRGB + (2 + m) * nInput;
+	   in.u.rgb.blue  = pucPlanarRGB + (4 + m) * nInput;
+	   TriclopsColorImage image;
+	   tri_err = triclopsRectifyColorImage( triclops, m ? TriCam_LEFT : TriCam_REFERENCE, &in, &image );
+	   if ( tri_err != TriclopsErrorOk )
+	     {
+	       fprintf( stderr, "triclopsRectifyColorImage failed!\n" );
+	       return (-1);
+	     }
+	   planes[0] = image.red;
+	   planes[1] = image.green;
+	   planes[2] = image.blue;
+	   nPlanes = 3;
+	   rowinc = image.rowinc;
+	   refRows = image.nrows;
+	   refCols = image.ncols;
+	 }
+       else
+	 {
+	   if(m==0)
+	     {
+	       tri_err = triclopsRectify( triclops, &input );
+	       if ( tri_err != TriclopsErrorOk )
+		 {
+		   fprintf( stderr, "triclopsRectify failed!\n" );
+		   return (-1);
+		 }
+	     }
+	   TriclopsImage image;
+	   triclopsGetImage( triclops, TriImg_RECTIFIED, m ? TriCam_LEFT : TriCam_RIGHT, &image );
+	   planes[0] = image.data;
+	   nPlanes = 1;
+	   rowinc = image.rowinc;
+	   refRows = image.nrows;
+	   refCols = image.ncols;
+	 }
+       if(refRows!=nrows || refCols!=ncols)
+	 {
+	   fprintf( stderr, "Triclops rectified %dx%d images, the remap tables %dx%d\n",
+		    refCols, refRows, ncols, nrows );
+	   return (-1);
+	 }
+
+       for(int p=0; p<nPlanes; p++)
+	 comparePlanes(remapBuffer + (3*m + p) * n, ncols, planes[p], rowinc,
+		       row, rows, ncols, tolerance, &sum, &outliers);
+       count += (uint64_t)nPlanes * rows * ncols;
+     }
+
+   *meanError = count>0 ? (double)sum / count : 0.0;
+   *outlierFraction = count>0 ? (double)outliers / count : 0.0;
+   return 0;
+}
+
+// grab only the green planes of color cameras, at the output scale,
+// for stereo without color output
+int BumbleBee::setStereoOnly(bool enable)
+{
+   if(enable && color)
+     {
+       fprintf( stderr, "The stereo only mode needs color output disabled\n" );
+       return (-1);
+     }
+   if(enable && pipeline!=NULL)
+     {
+       fprintf( stderr, "The stereo only mode is not available with the pipeline\n" );
+       return (-1);
+     }
+
+   stereoOnly = enable;
+   return 0;
+}
+
+// restrict stereo (and remap rectification) to a band of rows
+int BumbleBee::setRegionOfInterest(int row, int nrows)
+{
+   int height = stereoCamera.nRows/scale;
+   int width = stereoCamera.nCols/scale;
+   if(row<0 || nrows<0 || row+nrows>height)
+     {
+       fprintf( stderr, "Rows %d..%d outside the %d rows of the rectified images\n", row, row+nrows-1, height );
+       return (-1);
+     }
+   if(pipeline!=NULL)
+     {
+       fprintf( stderr, "A region of interest is not available with the pipeline\n" );
+       return (-1);
+     }
+
+   // triclopsStereo() takes it as its only ROI; none is the whole image
+   TriclopsROI* rois;
+   int maxROIs;
+   tri_err = triclopsGetROIs( triclops, &rois, &maxROIs );
+   if ( tri_err != TriclopsErrorOk || maxROIs<1 )
+     {
+       fprintf( stderr, "triclopsGetROIs failed!\n" );
+       return (-1);
+     }
+   rois[0].row = row;
+   rois[0].col = 0;
+   rois[0].nrows = nrows;
+   rois[0].ncols = width;
+   tri_err = triclopsSetNumberOfROIs( triclops, nrows>0 ? 1 : 0 );
+   if ( tri_err != TriclopsErrorOk )
+     {
+       fprintf( stderr, "triclopsSetNumberOfROIs failed!\n" );
+       return (-1);
+     }
+
+   roiRow = (nrows>0) ? row : 0;
+   roiRows = nrows;
+   return 0;
+}
+
+// reduce the rectified images to nLevels-1 coarser levels on every capture
+int BumbleBee::setPyramidLevels(int nLevels)
+{
+   int nrows = stereoCamera.nRows/scale;
+   int ncols = stereoCamera.nCols/scale;
+   if(nLevels<1 || nLevels>PYRAMID_MAX_LEVELS || (nrows>>(nLevels-1))<1 || (ncols>>(nLevels-1))<1)
+     {
+       fprintf( stderr, "Cannot make %d pyramid levels of %d x %d images\n", nLevels, ncols, nrows );
+       return (-1);
+     }
+   if(pipeline!=NULL)
+     {
+       fprintf( stderr, "The pyramid is not available with the pipeline\n" );
+       return (-1);
+     }
+
+   if(nLevels>1 && pyramidBuffer==NULL)
+     {
+       // the levels below an image take less than half its size
+       int n = nrows * ncols;
+       pyramidBuffer = new unsigned char[n];
+       for(int c=0; c<2; c++)
+	 {
+	   unsigned char* level = pyramidBuffer + c * n/2;
+	   for(int l=1; l<PYRAMID_MAX_LEVELS; l++)
+	     {
+	       pyramidLevel[c][l] = level;
+	       level += (nrows >> l) * (ncols >> l);
+	     }
+	 }
+       pyramidInput = new unsigned char[stereoCamera.nRows * stereoCamera.nCols];
+     }
+
+   pyramidLevels = nLevels;
+   return 0;
+}
+
+// rectify the current frame with the remap tables: the color images if
+// color is enabled, and the grayscale images if gray is set
+int BumbleBee::remapFrame(bool gray)
+{
+   int nrows = remapRight.nrows;
+   int ncols = remapRight.ncols;
+   int n = nrows * ncols;
+   int nInput = stereoCamera.nRows * stereoCamera.nCols;
+   bool rgb = stereoCamera.bColor && color;
+   if(!rgb && !gray)
+     return 0;
+
+   // the green planes of the stereo only mode are smaller than the
+   // frame; rebuild the tables when the size of the input changes
+   int srcRows = rgb ? stereoCamera.nRows : input.nrows;
+   int srcCols = rgb ? stereoCamera.nCols : input.ncols;
+   if(srcRows!=remapRight.srcRows || srcCols!=remapRight.srcCols)
+     {
+       if(this->buildRemapTables(srcRows, srcCols, nrows, ncols, &remapRight, &remapLeft)<0)
+	 return (-1);
+     }
+
+   // only the rows of the region of interest
+   int row = 0;
+   RemapTable tables[2] = {remapRight, remapLeft};
+   if(roiRows>0)
+     {
+       row = roiRow;
+       selectRemapRows(&remapRight, roiRow, roiRows, &tables[0]);
+       selectRemapRows(&remapLeft, roiRow, roiRows, &tables[1]);
+     }
+
+   // right and left planes alternate in the planar input: R R G G B B
+   RemapImage images[2];
+   for(int m=0; m<2; m++)
+     {
+       images[m].table = &tables[m];
+       images[m].nPlanes = rgb ? 3 : 1;
+       images[m].dstRowinc = ncols;
+       for(int p=0; p<images[m].nPlanes; p++)
+	 {
+	   if(rgb)
+	     images[m].src[p] = pucPlanarRGB + (2*p + m) * nInput;
+	   else
+	     images[m].src[p] = (const unsigned char*)(m ? input.u.rgb.green : input.u.rgb.red);
+	   images[m].dst[p] = remapBuffer + (3*m + p) * n + row * ncols;
+	 }
+     }
+   if(remapImages(images, 2)<0)
+     return (-1);
+
+   if(rgb)
+     {
+       TriclopsColorImage* image[2] = {&tri_color_image_right, &tri_color_image_left};
+       for(int m=0; m<2; m++)
+	 {
+	   image[m]->nrows = nrows;
+	   image[m]->ncols = ncols;
+	   image[m]->rowinc = ncols;
+	   image[m]->red = remapBuffer + (3*m + 0) * n;
+	   image[m]->green = remapBuffer + (3*m + 1) * n;
+	   image[m]->blue = remapBuffer + (3*m + 2) * n;
+	 }
+     }
+
+   if(gray)
+     {
+       // grayscale stereo runs on the green channel of color cameras
+       TriclopsImage* image[2] = {&tri_image_right, &tri_image_left};
+       for(int m=0; m<2; m++)
+	 {
+	   image[m]->nrows = nrows;
+	   image[m]->ncols = ncols;
+	   image[m]->rowinc = ncols;
+	   image[m]->data = remapBuffer + (3*m + (rgb ? 1 : 0)) * n;
+	 }
+     }
+
+   return 0;
+}
+
+// make the coarser levels of the pyramid: from the rectified images, or
+// with remap rectification by rectifying levels of the input images
+int BumbleBee::pyramidFrame()
+{
+   if(pyramidLevels<=1)
+     return 0;
+   int nrows = stereoCamera.nRows/scale;
+   int ncols = stereoCamera.nCols/scale;
+
+   if(!remapRectify)
+     {
+       TriclopsImage* image[2] = {&tri_image_right, &tri_image_left};
+       for(int c=0; c<2; c++)
+	 if(buildPyramid(image[c]->data, image[c]->nrows, image[c]->ncols, image[c]->rowinc,
+			 pyramidLevels, &pyramidLevel[c][1])<0)
+	   return (-1);
+       return 0;
+     }
+
+   // input level of each level: the smallest one at least as large
+   int srcRows = input.nrows;
+   int srcCols = input.ncols;
+   int source[PYRAMID_MAX_LEVELS];
+   int inputLevels = 1;
+   for(int l=1; l<pyramidLevels; l++)
+     {
+       int k = 0;
+       while(k+1<PYRAMID_MAX_LEVELS && (srcRows>>(k+1))>=(nrows>>l) && (srcCols>>(k+1))>=(ncols>>l))
+	 k++;
+       source[l] = k;
+       if(k+1>inputLevels)
+	 inputLevels = k+1;
+     }
+
+   // the gray input planes of both cameras, halved in one pass each
+   const unsigned char* src[2] = {(const unsigned char*)input.u.rgb.red,
+				  (const unsigned char*)input.u.rgb.green};
+   unsigned char* inputLevel[2][PYRAMID_MAX_LEVELS];
+   unsigned char* level = pyramidInput;
+   for(int c=0; c<2; c++)
+     {
+       inputLevel[c][0] = (unsigned char*)src[c];
+       for(int k=1; k<inputLevels; k++)
+	 {
+	   inputLevel[c][k] = level;
+	   level += (srcRows >> k) * (srcCols >> k);
+	 }
+       if(inputLevels>1 &&
+	  buildPyramid(src[c], srcRows, srcCols, input.rowinc, inputLevels, &inputLevel[c][1])<0)
+	 return (-1);
+     }
+
+   // rectify all levels of both cameras in one pass
+   RemapImage images[2 * PYRAMID_MAX_LEVELS];
+   int nImages = 0;
+   for(int l=1; l<pyramidLevels; l++)
+     {
+       int k = source[l];
+       RemapTable* table[2] = {&pyramidRemap[0][l], &pyramidRemap[1][l]};
+       // the tables take packed rows, as the input levels from 1 on are
+       if(k==0 && input.rowinc!=srcCols)
+	 {
+	   fprintf( stderr, "Cannot rectify pyramid level %d from padded input rows\n", l );
+	   return (-1);
+	 }
+       if(table[0]->srcRows!=(srcRows>>k) || table[0]->srcCols!=(srcCols>>k) || table[0]->nrows!=(nrows>>l))
+	 {
+	   if(this->buildRemapTables(srcRows>>k, srcCols>>k, nrows>>l, ncols>>l, table[0], table[1])<0)
+	     return (-1);
+	 }
+
+       for(int c=0; c<2; c++)
+	 {
+	   RemapImage* image = &images[nImages++];
+	   image->table = table[c];
+	   image->nPlanes = 1;
+	   image->src[0] = inputLevel[c][k];
+	   image->dst[0] = pyramidLevel[c][l];
+	   image->dstRowinc = ncols >> l;
+	 }
+     }
+   return remapImages(images, nImages);
+}
+
 // initialize sequence
 int BumbleBee::init_try(float shutter)
 {
@@ -280,94 +885,262 @@ int BumbleBee::init_try(float shutter)
 }
 
   
-// capture images from camera
-int BumbleBee::capture()
+// grab the next frame into the input buffers (only the green planes in
+// the stereo only mode if green is set); GRAB_NO_FRAME if the camera has
+// none newer than the last one, -1 on failure or at the end of a
+// recording
+int BumbleBee::grabFrame(bool green)
 {
   int ret;
-  fflush(stdout);
-  // get the images from the capture buffer and do all required processing
-  // note: produces a TriclopsInput that can be used for stereo processing
-  if(stereoCamera.bColor)
+  while(true)
     {
-      grabColorImages_RGB( &stereoCamera,
-			   DC1394_BAYER_METHOD_NEAREST,
-			   pucDeInterlacedBuffer,
-			   pucRGBBuffer,
-			   pucRedGreenBlue,
-			   &pucRightRGB,
-			   &pucLeftRGB,
-			   &pucCenterRGB,
-			   &input,
-			   &imagetimestamp);      
-    }
-  else
-    {
-      grabMonoImages( &stereoCamera,
-		      pucDeInterlacedBuffer,
-		      &pucRightMono,
-		      &pucLeftMono,
-		      &pucCenterMono,
-		      &input,
-		      &imagetimestamp);
+      // sleep until the camera has a frame; until the first one there is
+      // nothing to fall back on
+      uint64_t start = startTiming(timing);
+      int wait = frameId>0 ? frameWait : FRAME_WAIT_FOREVER;
+      if(wait!=FRAME_WAIT_NONE)
+	{
+	  ret = source->waitFrame(wait);
+	  recordTiming(timing, TIMING_WAIT, start);
+	  grabStart = startTiming(timing);
+
+	  // if the wait itself failed, the grab below polls
+	  if(ret==GRAB_NO_FRAME)
+	    {
+	      timingData.noFrame++;
+	      if(frameId>0)
+		return GRAB_NO_FRAME;
+	      continue;
+	    }
+	}
+      else
+	grabStart = start;
+
+      // get the images from the capture buffer and do all required processing
+      // note: produces a TriclopsInput that can be used for stereo processing
+      if(stereoCamera.bColor && green && stereoOnly)
+	{
+	  // only the green planes, at the output scale
+	  ret = source->grabGreen( scale,
+				   pucGreenBuffer,
+				   &input,
+				   &imagetimestamp);
+	}
+      else if(stereoCamera.bColor)
+	{
+	  pucPlanarRGB = pucRedGreenBlue;
+	  ret = source->grabColorRGB( DC1394_BAYER_METHOD_NEAREST,
+				      pucDeInterlacedBuffer,
+				      pucRGBBuffer,
+				      &pucPlanarRGB,
+				      &pucRightRGB,
+				      &pucLeftRGB,
+				      &pucCenterRGB,
+				      &input,
+				      &imagetimestamp);
+	}
+      else
+	{
+	  ret = source->grabMono( pucDeInterlacedBuffer,
+				  &pucRightMono,
+				  &pucLeftMono,
+				  &pucCenterMono,
+				  &input,
+				  &imagetimestamp);
+	}
+
+      if(ret==GRAB_NO_FRAME)
+	{
+	  timingData.noFrame++;
+
+	  // the buffers still hold the last frame, unless there was none
+	  if(frameId>0)
+	    return GRAB_NO_FRAME;
+	  continue;
+	}
+
+      if(ret<0)
+	{
+	  // a replayed recording has run out of frames
+	  if(camera!=NULL)
+	    this->reportFailure(TIMING_DEQUEUE, "Grabbing a frame", NULL);
+	  return (-1);
+	}
+
+      frameId++;
+      return 0;
     }
+}
 
-  // grab grayscale rectified images
-  tri_err = triclopsRectify( triclops, &input );
-  if ( tri_err != TriclopsErrorOk )
+// count a failure of a stage, and print the first one and every 100th
+void BumbleBee::reportFailure(TimingStage stage, const char* what, const char* reason)
+{
+  uint64_t n = ++timingData.errors[stage];
+  if(n==1 || n%100==0)
+    fprintf( stderr, "%s failed%s%s%s (%llu times so far)\n", what,
+	     reason ? " (" : "", reason ? reason : "", reason ? ")" : "",
+	     (unsigned long long)n );
+}
+
+// capture images from camera
+int BumbleBee::capture()
+{
+  fflush(stdout);
+  int ret = this->grabFrame(true);
+  if(ret<0)
+    return (-1);
+
+  // the rectified and disparity images of the last frame still hold
+  if(ret==GRAB_NO_FRAME)
+    return 0;
+
+  if(this->processFrame()<0)
+    return (-1);
+
+  recordTiming(timing, TIMING_TOTAL, grabStart);
+
+  // the camera timestamps frames by the wall clock
+  if(camera!=NULL)
+    recordTiming(timing, TIMING_LATENCY, imagetimestamp);
+  return 0;
+}
+
+// rectification and stereo of the frame capture() grabbed
+int BumbleBee::processFrame()
+{
+  // grab grayscale rectified images; the built-in engine can take them
+  // from the remap tables, triclopsStereo() needs triclopsRectify()
+  bool remapGray = remapRectify && blockStereo!=NULL;
+  uint64_t start = startTiming(timing);
+  if(!remapGray)
     {
-      //fprintf( stderr, "triclopsRectify failed!\n" );      
-      return (-1);
+      tri_err = triclopsRectify( triclops, &input );
+      if ( tri_err != TriclopsErrorOk )
+	{
+	  this->reportFailure(TIMING_RECTIFY, "triclopsRectify", triclopsErrorToString(tri_err));
+	  return (-1);
+	}
+      recordTiming(timing, TIMING_RECTIFY, start);
+      start = startTiming(timing);
     }
   
-  if(stereoCamera.bColor && color)
+  if(remapRectify)
+    {
+      // one pass for the color and grayscale images
+      TimingStage stage = remapGray ? TIMING_RECTIFY : TIMING_COLOR_RECTIFY;
+      if(this->remapFrame(remapGray)<0)
+	{
+	  this->reportFailure(stage, "Remap rectification", NULL);
+	  return (-1);
+	}
+      recordTiming(timing, stage, start);
+    }
+  else if(stereoCamera.bColor && color)
     {
       // grab color rectified images (right image only now)
       memcpy(&input_right, &input, sizeof(TriclopsInput));
-      input_right.u.rgb.red   = pucRedGreenBlue;
-      input_right.u.rgb.green = pucRedGreenBlue + 2 * stereoCamera.nRows * stereoCamera.nCols;
-      input_right.u.rgb.blue  = pucRedGreenBlue + 4 * stereoCamera.nRows * stereoCamera.nCols;
+      input_right.u.rgb.red   = pucPlanarRGB;
+      input_right.u.rgb.green = pucPlanarRGB + 2 * stereoCamera.nRows * stereoCamera.nCols;
+      input_right.u.rgb.blue  = pucPlanarRGB + 4 * stereoCamera.nRows * stereoCamera.nCols;
       tri_err = triclopsRectifyColorImage(triclops,
 					  TriCam_REFERENCE,
 					  &input_right,
 					  &tri_color_image_right);
+      if ( tri_err != TriclopsErrorOk )
+	this->reportFailure(TIMING_COLOR_RECTIFY, "triclopsRectifyColorImage", triclopsErrorToString(tri_err));
             
       memcpy(&input_left, &input, sizeof(TriclopsInput));
-      input_left.u.rgb.red   = pucRedGreenBlue + 1 * stereoCamera.nRows * stereoCamera.nCols;
-      input_left.u.rgb.green = pucRedGreenBlue + 3 * stereoCamera.nRows * stereoCamera.nCols;
-      input_left.u.rgb.blue  = pucRedGreenBlue + 5 * stereoCamera.nRows * stereoCamera.nCols;
+      input_left.u.rgb.red   = pucPlanarRGB + 1 * stereoCamera.nRows * stereoCamera.nCols;
+      input_left.u.rgb.green = pucPlanarRGB + 3 * stereoCamera.nRows * stereoCamera.nCols;
+      input_left.u.rgb.blue  = pucPlanarRGB + 5 * stereoCamera.nRows * stereoCamera.nCols;
       tri_err = triclopsRectifyColorImage(triclops,
 					  TriCam_LEFT,
 					  &input_left,
 					  &tri_color_image_left);      
+      if ( tri_err != TriclopsErrorOk )
+	this->reportFailure(TIMING_COLOR_RECTIFY, "triclopsRectifyColorImage", triclopsErrorToString(tri_err));
+      recordTiming(timing, TIMING_COLOR_RECTIFY, start);
     }
 
 
-  // now do stereo
+  // now do stereo, in the built-in engine if one was selected
+  if(blockStereo!=NULL)
+    {
+      if(!remapGray)
+	{
+	  triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_RIGHT, &tri_image_right );
+	  triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_LEFT, &tri_image_left );
+	}
+
+      if(this->pyramidFrame()<0)
+	return (-1);
+
+      ImageView right, left;
+      makeImageView(&right, &tri_image_right, frameId, imagetimestamp);
+      makeImageView(&left, &tri_image_left, frameId, imagetimestamp);
+      tri_image16.nrows = tri_image_right.nrows;
+      tri_image16.ncols = tri_image_right.ncols;
+      tri_image16.rowinc = tri_image_right.ncols * sizeof(unsigned short);
+      tri_image16.data = blockDisparity;
+      unsigned short* disparity = tri_image16.data;
+      if(roiRows>0)
+	{
+	  // match the rows of the region only (its first and last rows are
+	  // treated as image borders); the others are out of range
+	  selectImageViewRows(&right, roiRow, roiRows);
+	  selectImageViewRows(&left, roiRow, roiRows);
+	  int n = tri_image16.nrows * tri_image16.ncols;
+	  for(int k=0; k<roiRow * tri_image16.ncols; k++)
+	    tri_image16.data[k] = DISPARITY_OUT_OF_RANGE;
+	  for(int k=(roiRow + roiRows) * tri_image16.ncols; k<n; k++)
+	    tri_image16.data[k] = DISPARITY_OUT_OF_RANGE;
+	  disparity += roiRow * tri_image16.ncols;
+	}
+
+      start = startTiming(timing);
+      if(blockStereo->compute(&right, &left, disparity, tri_image16.rowinc)<0)
+	{
+	  this->reportFailure(TIMING_STEREO, "Block matching", NULL);
+	  return (-1);
+	}
+      recordTiming(timing, TIMING_STEREO, start);
+      return 0;
+    }
+
+  start = startTiming(timing);
   tri_err = triclopsStereo( triclops );
   if ( tri_err != TriclopsErrorOk )
     {
-      //fprintf( stderr, "triclopsStereo failed!\n" );
+      this->reportFailure(TIMING_STEREO, "triclopsStereo", triclopsErrorToString(tri_err));
       return (-1);
     }
+  recordTiming(timing, TIMING_STEREO, start);
   
    // grab the rectified and disparity images
    triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_RIGHT, &tri_image_right );
    triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_LEFT, &tri_image_left );
    triclopsGetImage16( triclops, TriImg16_DISPARITY, TriCam_REFERENCE, &tri_image16 );
 
-  return 0;
+  return this->pyramidFrame();
 }
 
 // capture fast and save left, right, and input images w/o online stereo
 int BumbleBee::captureBlob(StereoImageBlob* blob)
 {
+  // the images are copied whole, so they must fit the buffers
+  size_t imageSize = (size_t)stereoCamera.nRows * stereoCamera.nCols * (stereoCamera.bColor ? 3 : 1);
+  if(imageSize > sizeof(blob->left_buffer))
+    {
+      fprintf( stderr, "Images of %dx%d pixels do not fit a blob\n", stereoCamera.nCols, stereoCamera.nRows );
+      return -1;
+    }
+
   // get the images from the capture buffer and do all required processing
   // note: produces a TriclopsInput that can be used for stereo processing
   int ret;
   if(stereoCamera.bColor)
     {
-      ret = grabColorImages( &stereoCamera,
-			     DC1394_BAYER_METHOD_NEAREST,
+      ret = source->grabColor( DC1394_BAYER_METHOD_NEAREST,
 			     pucDeInterlacedBuffer,
 			     pucRGBBuffer,
 			     pucGreenBuffer,
@@ -377,148 +1150,374 @@ int BumbleBee::captureBlob(StereoImageBlob* blob)
 			     &input,
 			     &imagetimestamp);
 
-      if(ret<0)
+      // no frame newer than the one recorded last
+      if(ret!=0)
 	return -1;
 
-      // will this work?
-      memcpy(&blob->left_buffer, pucLeftRGB, sizeof(unsigned char)*stereoCamera.nRows*stereoCamera.nCols*3);
-      memcpy(&blob->right_buffer, pucRightRGB, sizeof(unsigned char)*stereoCamera.nRows*stereoCamera.nCols*3);      
+      memcpy(&blob->left_buffer, pucLeftRGB, imageSize);
+      memcpy(&blob->right_buffer, pucRightRGB, imageSize);
     }
   else
     {
-      ret = grabMonoImages( &stereoCamera,
-			    pucDeInterlacedBuffer,
+      ret = source->grabMono( pucDeInterlacedBuffer,
 			    &pucRightMono,
 			    &pucLeftMono,
 			    &pucCenterMono,
 			    &input,
 			    &imagetimestamp);
       
-      if(ret<0)
+      if(ret!=0)
 	return -1;
       
-      memcpy(&blob->left_buffer, pucLeftMono, sizeof(unsigned char)*stereoCamera.nRows*stereoCamera.nCols);
-      memcpy(&blob->right_buffer, pucRightMono, sizeof(unsigned char)*stereoCamera.nRows*stereoCamera.nCols);      
+      memcpy(&blob->left_buffer, pucLeftMono, imageSize);
+      memcpy(&blob->right_buffer, pucRightMono, imageSize);
     }
 
+  frameId++;
   blob->timestamp = imagetimestamp;
+  blob->version = STEREO_IMAGE_BLOB_VERSION;
   blob->cols = stereoCamera.nCols;
   blob->rows = stereoCamera.nRows;      
+  blob->rowinc = stereoCamera.nCols;
+  blob->channels = stereoCamera.bColor ? 3 : 1;
   blob->frameId++;
-  this->getShutter(&blob->shutter);
-  this->getGain(&blob->gain);
+  this->updateSettings();
+  blob->shutter = cachedShutter;
+  blob->gain = cachedGain;
   
   return 0;
 }
 
-// capture the left and right images only
-int BumbleBee::captureImageOnly()
+// capture the left and right images only
+int BumbleBee::captureImageOnly()
+{
+  int ret = this->grabFrame(true);
+  if(ret<0)
+    return (-1);
+
+  // the rectified images of the last frame still hold
+  if(ret==GRAB_NO_FRAME)
+    return 0;
+
+  // rectify with the remap tables instead of triclops if enabled
+  if(remapRectify)
+    {
+      if(this->remapFrame(true)<0)
+	return (-1);
+      return this->pyramidFrame();
+    }
+
+  // pre-process
+  tri_err = triclopsSetLowpass( triclops, 1);
+  tri_err = triclopsPreprocess( triclops, &input);
+  if ( tri_err != TriclopsErrorOk )
+    {
+      fprintf( stderr, "triclopsPreprocess failed!\n" );
+      triclopsDestroyContext( triclops );
+      this->cleanup(camera);
+      return (-1);
+    }
+
+  // grab grayscale rectified images
+  tri_err = triclopsRectify( triclops, &input );
+  if ( tri_err != TriclopsErrorOk )
+    {
+      fprintf( stderr, "triclopsRectify failed!\n" );
+      triclopsDestroyContext( triclops );
+      this->cleanup(camera);
+      return (-1);
+    }
+
+  if(stereoCamera.bColor && color)
+    {
+      // grab color rectified image -- right image only now
+      memcpy(&input_right, &input, sizeof(TriclopsInput));
+      input_right.u.rgb.red   = pucPlanarRGB;
+      input_right.u.rgb.green = pucPlanarRGB + 2 * stereoCamera.nRows * stereoCamera.nCols;
+      input_right.u.rgb.blue  = pucPlanarRGB + 4 * stereoCamera.nRows * stereoCamera.nCols;
+      tri_err = triclopsRectifyColorImage(triclops,
+					  TriCam_REFERENCE,
+					  &input_right,
+					  &tri_color_image_right);
+      
+      memcpy(&input_left, &input, sizeof(TriclopsInput));
+      input_left.u.rgb.red   = pucPlanarRGB + 1 * stereoCamera.nRows * stereoCamera.nCols;
+      input_left.u.rgb.green = pucPlanarRGB + 3 * stereoCamera.nRows * stereoCamera.nCols;
+      input_left.u.rgb.blue  = pucPlanarRGB + 5 * stereoCamera.nRows * stereoCamera.nCols;
+      tri_err = triclopsRectifyColorImage(triclops,
+					  TriCam_LEFT,
+					  &input_left,
+					  &tri_color_image_left);      
+    }
+
+  // grab the rectified image
+  triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_RIGHT, &tri_image_right );
+  triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_LEFT, &tri_image_left );
+
+  return this->pyramidFrame();
+}
+
+// capture the left and right images only
+int BumbleBee::captureRawImageOnly()
+{
+  if(this->grabFrame(false)<0)
+    return (-1);
+
+  return 0;
+}
+
+// record raw frames to a log
+// * function call must be made AFTER init()
+int BumbleBee::startRecording(const char* fname, int nChunks, int nThreads)
+{
+  if(asyncSource!=NULL || pipeline!=NULL || camera==NULL)
+    {
+      fprintf( stderr, "Recording needs a live camera without asynchronous capture or the pipeline\n" );
+      return (-1);
+    }
+
+  // the tile goes with every record of a color camera
+  DemosaicMethod method;
+  recordTile = BAYER_TILE_RGGB;
+  if(stereoCamera.bColor &&
+     !getDemosaicMethod(stereoCamera.bayerTile, DC1394_BAYER_METHOD_NEAREST, &recordTile, &method))
+    {
+      fprintf( stderr, "Cannot record unknown Bayer tile %d\n", stereoCamera.bayerTile );
+      return (-1);
+    }
+
+  this->stopRecording();
+  recorder = new StereoRecorder();
+  size_t rawSize = (size_t)stereoCamera.nRows * stereoCamera.nCols * stereoCamera.nBytesPerPixel;
+  if(recorder->open(fname, rawSize, nChunks, nThreads)<0)
+    {
+      delete recorder;
+      recorder = NULL;
+      return (-1);
+    }
+  return 0;
+}
+
+// grab the raw frame and queue it for the log
+int BumbleBee::captureRaw()
+{
+  if(recorder==NULL)
+    return (-1);
+
+  // as grabFrame(), without falling back on the last frame
+  int wait = frameId>0 ? frameWait : FRAME_WAIT_FOREVER;
+  if(wait!=FRAME_WAIT_NONE && source->waitFrame(wait)==GRAB_NO_FRAME)
+    {
+      timingData.noFrame++;
+      return GRAB_NO_FRAME;
+    }
+
+  unsigned char* pucRaw;
+  int ret = source->grabRaw(&pucRaw, &imagetimestamp);
+  if(ret<0)
+    {
+      this->reportFailure(TIMING_DEQUEUE, "grabRaw", NULL);
+      return (-1);
+    }
+  if(ret==GRAB_NO_FRAME)
+    {
+      timingData.noFrame++;
+      return GRAB_NO_FRAME;
+    }
+
+  frameId++;
+  this->updateSettings();
+  ret = recorder->append(frameId, imagetimestamp, stereoCamera.nCols, stereoCamera.nRows,
+			 stereoCamera.bColor ? 3 : 1, recordTile, pucRaw,
+			 cachedShutter, cachedGain);
+
+  // append() has copied the frame (or dropped it); the driver may refill
+  // its buffer now
+  source->releaseRaw();
+  return ret;
+}
+
+// get the counters of the recording
+int BumbleBee::getRecorderStats(RecorderStats* stats)
+{
+  if(recorder==NULL)
+    return (-1);
+  recorder->getStats(stats);
+  return 0;
+}
+
+// close the log
+int BumbleBee::stopRecording()
+{
+  if(recorder==NULL)
+    return 0;
+  int ret = recorder->close();
+  delete recorder;
+  recorder = NULL;
+  return ret;
+}
+
+// the shutter and gain registers take a bus transaction each, so they
+// are only read again every BB_SETTINGS_REFRESH frames
+void BumbleBee::updateSettings()
+{
+  if(settingsValid && frameId - settingsFrame < BB_SETTINGS_REFRESH)
+    return;
+  this->getShutter(&cachedShutter);
+  this->getGain(&cachedGain);
+  settingsFrame = frameId;
+  settingsValid = true;
+}
+
+// move acquisition to a background thread feeding nSlots frame buffers
+// * function call must be made AFTER init()
+int BumbleBee::enableAsyncCapture(int nSlots)
+{
+  if(asyncSource!=NULL)
+    return 0;
+
+  // the acquisition stages now run on the background thread; capture()
+  // only times the stages after them
+  source->setTiming(NULL);
+
+  AsyncFrameSource* async = new AsyncFrameSource(source, false, nSlots);
+  if(async->open(&stereoCamera)<0)
+    {
+      fprintf( stderr, "Cannot start asynchronous capture\n" );
+      delete async;
+      return (-1);
+    }
+
+  // the wrapped source now lives as long as the asynchronous one
+  if(ownSource)
+    async->takeOwnership();
+  source = async;
+  ownSource = true;
+  asyncSource = async;
+  return 0;
+}
+
+// how long capture() waits for a frame
+int BumbleBee::setFrameWait(int timeoutMs)
+{
+  if(timeoutMs<0 && timeoutMs!=FRAME_WAIT_FOREVER)
+    {
+      fprintf( stderr, "Invalid frame wait %d ms\n", timeoutMs );
+      return (-1);
+    }
+  frameWait = timeoutMs;
+  return 0;
+}
+
+// record the time of each stage of capture()
+int BumbleBee::enableTiming(bool enable)
+{
+  timing = enable ? &timingData : NULL;
+
+  // a background thread or the pipeline grabs from the source
+  if(asyncSource==NULL && pipeline==NULL)
+    source->setTiming(timing);
+  return 0;
+}
+
+// get the stage timings and counters so far
+int BumbleBee::getTiming(CaptureTiming* captureTiming)
+{
+  memcpy(captureTiming, &timingData, sizeof(CaptureTiming));
+  return 0;
+}
+
+// clear the stage timings and counters
+void BumbleBee::resetTiming()
+{
+  initCaptureTiming(&timingData);
+}
+
+// write the stage timings and counters to a JSON or CSV file
+int BumbleBee::writeTiming(const char* filename)
+{
+  size_t len = strlen(filename);
+  if(len>=5 && strcmp(filename + len - 5, ".json")==0)
+    return writeCaptureTimingJSON(&timingData, filename);
+  return writeCaptureTimingCSV(&timingData, filename);
+}
+
+// get the acquisition counters of the background thread
+int BumbleBee::getCaptureStats(AsyncCaptureStats* stats)
+{
+  if(asyncSource==NULL)
+    return (-1);
+  asyncSource->getStats(stats);
+  return 0;
+}
+
+// run acquisition, color rectification and stereo as pipeline stages
+// on their own threads with depth frames in flight
+// * function call must be made AFTER init(); use captureBundle() instead of capture()
+int BumbleBee::enablePipeline(int depth)
 {
-  // get the images from the capture buffer and do all required processing
-  // note: produces a TriclopsInput that can be used for stereo processing
-  if(stereoCamera.bColor)
-    {
-      grabColorImages_RGB( &stereoCamera,
-			   DC1394_BAYER_METHOD_NEAREST,
-			   pucDeInterlacedBuffer,
-			   pucRGBBuffer,
-			   pucRedGreenBlue,
-			   &pucRightRGB,
-			   &pucLeftRGB,
-			   &pucCenterRGB,
-			   &input,
-			   &imagetimestamp);
-    }
-  else
-    {
-      grabMonoImages( &stereoCamera,
-		      pucDeInterlacedBuffer,
-		      &pucRightMono,
-		      &pucLeftMono,
-		      &pucCenterMono,
-		      &input,
-		      &imagetimestamp);
-    }
-  
-  // pre-process
-  tri_err = triclopsSetLowpass( triclops, 1);
-  tri_err = triclopsPreprocess( triclops, &input);
-  if ( tri_err != TriclopsErrorOk )
+  if(pipeline!=NULL)
+    return 0;
+
+  // the stages rectify the color planes of whole frames
+  if(stereoOnly || roiRows>0 || pyramidLevels>1)
     {
-      fprintf( stderr, "triclopsPreprocess failed!\n" );
-      triclopsDestroyContext( triclops );
-      this->cleanup(camera);
+      fprintf( stderr, "The pipeline is not available with the stereo only mode, a region of interest or a pyramid\n" );
       return (-1);
     }
 
-  // grab grayscale rectified images
-  tri_err = triclopsRectify( triclops, &input );
-  if ( tri_err != TriclopsErrorOk )
+  TriclopsContext rectifyContext, stereoContext;
+  if(this->createContext(&rectifyContext)<0)
+    return (-1);
+  if(this->createContext(&stereoContext)<0)
     {
-      fprintf( stderr, "triclopsRectify failed!\n" );
-      triclopsDestroyContext( triclops );
-      this->cleanup(camera);
+      triclopsDestroyContext( rectifyContext );
       return (-1);
     }
 
-  if(stereoCamera.bColor && color)
+  // the pipeline has its own stage timing
+  source->setTiming(NULL);
+  pipeline = new StereoPipeline(source, &stereoCamera, rectifyContext, stereoContext, color, depth);
+  if(blockStereo!=NULL)
     {
-      // grab color rectified image -- right image only now
-      memcpy(&input_right, &input, sizeof(TriclopsInput));
-      input_right.u.rgb.red   = pucRedGreenBlue;
-      input_right.u.rgb.green = pucRedGreenBlue + 2 * stereoCamera.nRows * stereoCamera.nCols;
-      input_right.u.rgb.blue  = pucRedGreenBlue + 4 * stereoCamera.nRows * stereoCamera.nCols;
-      tri_err = triclopsRectifyColorImage(triclops,
-					  TriCam_REFERENCE,
-					  &input_right,
-					  &tri_color_image_right);
-      
-      memcpy(&input_left, &input, sizeof(TriclopsInput));
-      input_left.u.rgb.red   = pucRedGreenBlue + 1 * stereoCamera.nRows * stereoCamera.nCols;
-      input_left.u.rgb.green = pucRedGreenBlue + 3 * stereoCamera.nRows * stereoCamera.nCols;
-      input_left.u.rgb.blue  = pucRedGreenBlue + 5 * stereoCamera.nRows * stereoCamera.nCols;
-      tri_err = triclopsRectifyColorImage(triclops,
-					  TriCam_LEFT,
-					  &input_left,
-					  &tri_color_image_left);      
+      BlockStereoParams params;
+      blockStereo->getParams(&params);
+      pipeline->setBlockStereo(&params);
     }
+  if(pipeline->start()<0)
+    {
+      delete pipeline;
+      pipeline = NULL;
+      return (-1);
+    }
+  return 0;
+}
 
-  // grab the rectified image
-  triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_RIGHT, &tri_image_right );
-  triclopsGetImage( triclops, TriImg_RECTIFIED, TriCam_LEFT, &tri_image_left );
+// get the next frame from the pipeline, in frame order
+int BumbleBee::captureBundle(StereoBundle** bundle)
+{
+  if(pipeline==NULL)
+    return (-1);
+  if(pipeline->getBundle(bundle)<0)
+    return (-1);
 
+  imagetimestamp = (*bundle)->timestamp;
   return 0;
 }
 
-// capture the left and right images only
-int BumbleBee::captureRawImageOnly()
+// hand a bundle from captureBundle() back to the pipeline
+void BumbleBee::releaseBundle(StereoBundle* bundle)
 {
-  // get the images from the capture buffer and do all required processing
-  // note: produces a TriclopsInput that can be used for stereo processing
-  if(stereoCamera.bColor)
-    {
-      grabColorImages_RGB( &stereoCamera,
-			   DC1394_BAYER_METHOD_NEAREST,
-			   pucDeInterlacedBuffer,
-			   pucRGBBuffer,
-			   pucRedGreenBlue,
-			   &pucRightRGB,
-			   &pucLeftRGB,
-			   &pucCenterRGB,
-			   &input,
-			   &imagetimestamp);
-    }
-  else
-    {
-      grabMonoImages( &stereoCamera,
-		      pucDeInterlacedBuffer,
-		      &pucRightMono,
-		      &pucLeftMono,
-		      &pucCenterMono,
-		      &input,
-		      &imagetimestamp);
-    }
+  if(pipeline!=NULL)
+    pipeline->releaseBundle(bundle);
+}
 
+// get the per stage timing of the pipeline
+int BumbleBee::getPipelineStats(StereoPipelineStats* stats)
+{
+  if(pipeline==NULL)
+    return (-1);
+  pipeline->getStats(stats);
   return 0;
 }
 
@@ -614,6 +1613,10 @@ unsigned int BumbleBee::getInputHeight()
 // Get the left image from the stereocamera
 int BumbleBee::getLeftImage(unsigned char* imgBuffer)
 {
+  // the stereo only mode does not demosaic the images
+  if(stereoOnly)
+    return (-1);
+
   if(stereoCamera.bColor)
     memcpy(imgBuffer, pucLeftRGB, sizeof(pucLeftRGB[0]) * stereoCamera.nCols * stereoCamera.nRows * 3);
   else
@@ -625,6 +1628,10 @@ int BumbleBee::getLeftImage(unsigned char* imgBuffer)
 // Get the right image from the stereocamera
 int BumbleBee::getRightImage(unsigned char* imgBuffer)
 {
+  // the stereo only mode does not demosaic the images
+  if(stereoOnly)
+    return (-1);
+
   if(stereoCamera.bColor)
     memcpy(imgBuffer, pucRightRGB, sizeof(pucRightRGB[0]) * stereoCamera.nCols * stereoCamera.nRows * 3);
   else
@@ -636,15 +1643,18 @@ int BumbleBee::getRightImage(unsigned char* imgBuffer)
 // Get the rectified image
 int BumbleBee::getRectifiedImage(unsigned char* imgBuffer, CameraType type)
 {
+  TriclopsImage* image = &tri_image_left;
   if(type==BB_REFERENCE || type==BB_RIGHT)   
-    memcpy(imgBuffer, tri_image_right.data, sizeof(unsigned char) * tri_image_right.ncols * tri_image_right.nrows);    
-  else         
-    memcpy(imgBuffer, tri_image_left.data, sizeof(unsigned char) * tri_image_left.ncols * tri_image_left.nrows);    
+    image = &tri_image_right;
+
+  // rows are packed in imgBuffer but may be padded in the triclops image
+  for(int i=0; i<image->nrows; i++)
+    memcpy(imgBuffer + i * image->ncols, image->data + i * image->rowinc, sizeof(unsigned char) * image->ncols);
   return 0;
 }
 
-// Get the rectified color image -- this will be 4 channels
-int BumbleBee::getRectifiedColorBuffer(unsigned char* imgBuffer, CameraType type)
+// Get the rectified color image -- packed 3 channels, RGB unless bgr is set
+int BumbleBee::getRectifiedColorBuffer(unsigned char* imgBuffer, CameraType type, bool bgr)
 {  
   if(!stereoCamera.bColor)
     return -1;
@@ -652,40 +1662,121 @@ int BumbleBee::getRectifiedColorBuffer(unsigned char* imgBuffer, CameraType type
   if(!color)
     return -1;
 
+  TriclopsColorImage* image = &tri_color_image_left;
   if(type==BB_RIGHT || type==BB_REFERENCE)
-    {
-      for(int i=0; i<tri_color_image_right.nrows; i++)
-        for(int j=0; j<tri_color_image_right.ncols; j++)
-        {
-          imgBuffer[i*tri_color_image_right.ncols*3 + j*3 + 0] = tri_color_image_right.red[i*tri_color_image_right.ncols + j];
-          imgBuffer[i*tri_color_image_right.ncols*3 + j*3 + 1] = tri_color_image_right.green[i*tri_color_image_right.ncols + j];
-          imgBuffer[i*tri_color_image_right.ncols*3 + j*3 + 2] = tri_color_image_right.blue[i*tri_color_image_right.ncols + j];
-        }
-    }
+    image = &tri_color_image_right;
+
+  return packPlanarRGB(image->red, image->green, image->blue,
+		       image->nrows, image->ncols, image->rowinc,
+		       imgBuffer, image->ncols * 3,
+		       bgr ? PIXEL_ORDER_BGR : PIXEL_ORDER_RGB);
+}
+
+
+// Get the disparity image; the rows are packed in img16Buffer and rowinc
+// is set to its row increment in bytes (ncols * 2)
+int BumbleBee::getDisparityImage(unsigned short* img16Buffer, int* rowinc)
+{
+  for(int i=0; i<tri_image16.nrows; i++)
+    memcpy(img16Buffer + i * tri_image16.ncols,
+	   (unsigned char*)tri_image16.data + i * tri_image16.rowinc,
+	   sizeof(unsigned short) * tri_image16.ncols);
+  *rowinc = tri_image16.ncols * sizeof(unsigned short);
+  return 0;
+}
+
+// view of the left (unrectified) image of the last capture
+int BumbleBee::getLeftView(ImageView* view)
+{
+  if(frameId==0 || pipeline!=NULL || stereoOnly)
+    return (-1);
+
+  if(stereoCamera.bColor)
+    makeImageView(view, pucLeftRGB, stereoCamera.nCols, stereoCamera.nRows, stereoCamera.nCols * 3,
+		  IMAGE_RGB8, frameId, imagetimestamp);
   else
-    {
-      for(int i=0; i<tri_color_image_left.nrows; i++)
-        for(int j=0; j<tri_color_image_left.ncols; j++)
-        {
-          imgBuffer[i*tri_color_image_left.ncols*3 + j*3 + 0] = tri_color_image_left.red[i*tri_color_image_left.ncols + j];
-          imgBuffer[i*tri_color_image_left.ncols*3 + j*3 + 1] = tri_color_image_left.green[i*tri_color_image_left.ncols + j];
-          imgBuffer[i*tri_color_image_left.ncols*3 + j*3 + 2] = tri_color_image_left.blue[i*tri_color_image_left.ncols + j];
-        }
-    }
-      
+    makeImageView(view, pucLeftMono, stereoCamera.nCols, stereoCamera.nRows, stereoCamera.nCols,
+		  IMAGE_MONO8, frameId, imagetimestamp);
+  return 0;
+}
+
+// view of the right (unrectified) image of the last capture
+int BumbleBee::getRightView(ImageView* view)
+{
+  if(frameId==0 || pipeline!=NULL || stereoOnly)
+    return (-1);
 
+  if(stereoCamera.bColor)
+    makeImageView(view, pucRightRGB, stereoCamera.nCols, stereoCamera.nRows, stereoCamera.nCols * 3,
+		  IMAGE_RGB8, frameId, imagetimestamp);
+  else
+    makeImageView(view, pucRightMono, stereoCamera.nCols, stereoCamera.nRows, stereoCamera.nCols,
+		  IMAGE_MONO8, frameId, imagetimestamp);
   return 0;
 }
 
+// view of a rectified grayscale image of the last capture
+int BumbleBee::getRectifiedView(ImageView* view, CameraType type)
+{
+  if(frameId==0 || pipeline!=NULL)
+    return (-1);
 
-// Get the disparity image
-int BumbleBee::getDisparityImage(unsigned short* img16Buffer, int* rowinc)
+  if(type==BB_REFERENCE || type==BB_RIGHT)   
+    makeImageView(view, &tri_image_right, frameId, imagetimestamp);
+  else
+    makeImageView(view, &tri_image_left, frameId, imagetimestamp);
+  return 0;
+}
+
+// view of a rectified color image of the last capture (planar)
+int BumbleBee::getRectifiedColorView(ImageView* view, CameraType type)
+{
+  if(frameId==0 || pipeline!=NULL)
+    return (-1);
+
+  if(!stereoCamera.bColor || !color)
+    return (-1);
+
+  if(type==BB_REFERENCE || type==BB_RIGHT)   
+    makeImageView(view, &tri_color_image_right, frameId, imagetimestamp);
+  else
+    makeImageView(view, &tri_color_image_left, frameId, imagetimestamp);
+  return 0;
+}
+
+// view of a level of the rectified grayscale pyramid of the last capture
+int BumbleBee::getPyramidView(ImageView* view, CameraType type, int level)
+{
+  if(level==0)
+    return this->getRectifiedView(view, type);
+
+  if(frameId==0 || pipeline!=NULL || level<0 || level>=pyramidLevels)
+    return (-1);
+
+  int c = (type==BB_REFERENCE || type==BB_RIGHT) ? 0 : 1;
+  int nrows = (stereoCamera.nRows/scale) >> level;
+  int ncols = (stereoCamera.nCols/scale) >> level;
+  makeImageView(view, pyramidLevel[c][level], ncols, nrows, ncols,
+		IMAGE_MONO8, frameId, imagetimestamp);
+  return 0;
+}
+
+// view of the disparity image of the last capture()
+int BumbleBee::getDisparityView(ImageView* view)
 {
-  memcpy(img16Buffer, tri_image16.data, sizeof(unsigned short) * tri_image16.ncols * tri_image16.nrows);
-  *rowinc = tri_image16.rowinc;
+  if(frameId==0 || pipeline!=NULL)
+    return (-1);
+
+  makeImageView(view, &tri_image16, frameId, imagetimestamp);
   return 0;
 }
 
+// true if the view still refers to the last capture
+bool BumbleBee::isViewValid(const ImageView* view)
+{
+  return pipeline==NULL && view->frameId==frameId;
+}
+
 // Set disparity range (max can be as high as 1024 but then there's this offset issue;
 // -- just keep the max below 240
 // * function call must be made AFTER init()
@@ -703,6 +1794,9 @@ int BumbleBee::setDisparity(int minDisp, int maxDisp)
   
   minDisparity = minDisp;
   maxDisparity = maxDisp;
+  depthTableValid = false;
+  if(blockStereo!=NULL)
+    blockStereo->setDisparity(minDisp, maxDisp);
 
   return 0;
 }
@@ -714,8 +1808,6 @@ int BumbleBee::disparityToXYZ(int i, int j, unsigned short disparity, float* x,
   if ( tri_err != TriclopsErrorOk )
     {
       fprintf( stderr, "triclopsRCD16ToXYZ failed!\n" );
-      triclopsDestroyContext( triclops );
-      this->cleanup(camera);
       return (-1);
     }
 
@@ -728,15 +1820,91 @@ int BumbleBee::disparityToXYZ_f(float i, float j, float disparity, float* x, flo
   tri_err = triclopsRCDFloatToXYZ(triclops, i, j, disparity, x, y, z);
   if ( tri_err != TriclopsErrorOk )
     {
-      fprintf( stderr, "triclopsRCD16ToXYZ failed!\n" );
-      triclopsDestroyContext( triclops );
-      this->cleanup(camera);
+      fprintf( stderr, "triclopsRCDFloatToXYZ failed!\n" );
       return (-1);
     }
 
   return 0;
 }
 
+// Get the geometry of the rectified cameras for the bulk conversions
+void BumbleBee::getStereoGeometry(StereoGeometry* geometry)
+{
+  geometry->focalLength = focalLength;
+  geometry->centerRow = imageCenterRow;
+  geometry->centerCol = imageCenterCol;
+  geometry->baseline = baseline;
+
+  // createContext() turns subpixel interpolation on, which stores
+  // disparities as 8.8 fixed point
+  geometry->disparityScale = 1.0f / 256.0f;
+}
+
+// Get the depth of each 16 bit disparity value; the table is rebuilt
+// when the disparity range or the camera geometry changed
+const float* BumbleBee::getDepthTable()
+{
+  StereoGeometry geometry;
+  this->getStereoGeometry(&geometry);
+
+  if(depthTable==NULL)
+    depthTable = new float[DEPTH_TABLE_SIZE];
+  if(!depthTableValid || memcmp(&geometry, &depthTableGeometry, sizeof(StereoGeometry))!=0)
+    {
+      buildDepthTable(&geometry, depthTable);
+      memcpy(&depthTableGeometry, &geometry, sizeof(StereoGeometry));
+      depthTableValid = true;
+    }
+  return depthTable;
+}
+
+// Get the depth image of the last capture(), one float per pixel
+int BumbleBee::getDepthImage(float* depthBuffer)
+{
+  ImageView disparity;
+  if(this->getDisparityView(&disparity)<0)
+    return (-1);
+
+  return disparityToDepth(this->getDepthTable(), &disparity,
+			  depthBuffer, disparity.width * sizeof(float));
+}
+
+// view of the depth image of the last capture(), computed on the first
+// request for each frame
+int BumbleBee::getDepthView(ImageView* view)
+{
+  ImageView disparity;
+  if(this->getDisparityView(&disparity)<0)
+    return (-1);
+
+  // big enough for any stereo resolution
+  if(depthImage==NULL)
+    depthImage = new float[stereoCamera.nRows * stereoCamera.nCols];
+  if(depthFrameId!=frameId)
+    {
+      if(disparityToDepth(this->getDepthTable(), &disparity,
+			  depthImage, disparity.width * sizeof(float))<0)
+	return (-1);
+      depthFrameId = frameId;
+    }
+
+  makeImageView(view, (const unsigned char*)depthImage, disparity.width, disparity.height,
+		disparity.width * sizeof(float), IMAGE_FLOAT32, frameId, imagetimestamp);
+  return 0;
+}
+
+// Convert the whole disparity image of the last capture() to points
+int BumbleBee::getPointCloud(PointCloud* cloud, int nThreads)
+{
+  ImageView disparity;
+  if(this->getDisparityView(&disparity)<0)
+    return (-1);
+
+  StereoGeometry geometry;
+  this->getStereoGeometry(&geometry);
+  return disparityToPointCloud(&geometry, &disparity, cloud, nThreads);
+}
+
 // Get focal length
 float BumbleBee::getFocalLength()
 {
@@ -768,8 +1936,8 @@ void BumbleBee::getBaseline(float *stereo_baseline)
 // Get shutter
 void BumbleBee::getShutter(float *shutter)
 {
-  float val;
-  err = dc1394_feature_get_absolute_value(camera, DC1394_FEATURE_SHUTTER, &val);
+  float val = 0;
+  source->getShutter(&val);
   
   *shutter = val;
 
@@ -779,8 +1947,8 @@ void BumbleBee::getShutter(float *shutter)
 // get gain
 void BumbleBee::getGain(float *gain)
 {
-  float val;
-  err = dc1394_feature_get_absolute_value(camera, DC1394_FEATURE_GAIN, &val);
+  float val = 0;
+  source->getGain(&val);
   
   *gain = val;
 
@@ -792,6 +1960,10 @@ void BumbleBee::getGain(float *gain)
 // Cleanup camera pointers and close
 int BumbleBee::cleanup(dc1394camera_t* cam)
 {
+  // nothing to do when replaying frames
+  if(cam==NULL)
+    return 0;
+
   dc1394_capture_stop( cam );
   dc1394_video_set_transmission( cam , DC1394_OFF );
   dc1394_free_camera( cam );
@@ -802,18 +1974,51 @@ int BumbleBee::cleanup(dc1394camera_t* cam)
 int BumbleBee::fini()
 {
   //  Stop data transmission
-  if ( dc1394_video_set_transmission( stereoCamera.camera, DC1394_OFF ) != DC1394_SUCCESS ) 
+  if ( camera!=NULL &&
+       dc1394_video_set_transmission( stereoCamera.camera, DC1394_OFF ) != DC1394_SUCCESS ) 
     {
       fprintf( stderr, "Couldn't stop the camera?\n" );
     }
   
-  delete[] pucDeInterlacedBuffer;
+  this->stopRecording();
+  settingsValid = false;
 
-  if(stereoCamera.bColor)
+  // stop the pipeline before its source goes away
+  if(pipeline!=NULL)
+    {
+      delete pipeline;
+      pipeline = NULL;
+    }
+
+  this->freeBuffers();
+  delete[] depthTable;
+  delete[] depthImage;
+  depthTable = NULL;
+  depthImage = NULL;
+  depthFrameId = 0;
+  freeRemapTable(&remapRight);
+  freeRemapTable(&remapLeft);
+  delete[] remapBuffer;
+  remapBuffer = NULL;
+  remapRectify = false;
+  for(int l=0; l<PYRAMID_MAX_LEVELS; l++)
+    {
+      freeRemapTable(&pyramidRemap[0][l]);
+      freeRemapTable(&pyramidRemap[1][l]);
+    }
+  delete[] pyramidBuffer;
+  delete[] pyramidInput;
+  pyramidBuffer = NULL;
+  pyramidInput = NULL;
+  pyramidLevels = 1;
+  roiRows = 0;
+
+  source->close();
+  if(ownSource)
     {
-      delete[] pucRGBBuffer;
-      delete[] pucGreenBuffer;
-      delete[] pucRedGreenBlue;
+      delete source;
+      source = NULL;
+      asyncSource = NULL;
     }
 
   this->cleanup(camera);
@@ -835,6 +2040,18 @@ int BumbleBee::getScale()
   return this->scale;
 }
 
+// get the camera timestamp of the last frame
+uint64_t BumbleBee::getTimestamp()
+{
+  return this->imagetimestamp;
+}
+
+// get the number of the last frame
+uint64_t BumbleBee::getFrameId()
+{
+  return this->frameId;
+}
+
 
 
 
@@ -844,6 +2061,86 @@ int BumbleBee::getScale()
 // -------------------------------
 
 
+int waitForFrame(PGRStereoCamera_t* stereoCamera, int timeoutMs)
+{
+  struct pollfd pfd;
+  pfd.fd = dc1394_capture_get_fileno( stereoCamera->camera );
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  int ret = poll( &pfd, 1, timeoutMs );
+  if(ret<0)
+    {
+      // a signal is as good as a timeout
+      if(errno==EINTR)
+	return GRAB_NO_FRAME;
+      fprintf( stderr, "Waiting for a frame failed: %s\n", strerror(errno) );
+      return -1;
+    }
+  return ret>0 ? 0 : GRAB_NO_FRAME;
+}
+
+// Poll the camera for the newest frame (NULL if there is none); older
+// pending frames are skipped and given back to the driver at once, the
+// newest stays dequeued, so the driver cannot refill its buffer, until
+// releaseFrame()
+static dc1394video_frame_t* dequeueNewestFrame(PGRStereoCamera_t* stereoCamera, uint64_t* timestamp,
+					       CaptureTiming* timing)
+{
+  dc1394video_frame_t* frame;
+  dc1394video_frame_t* newest = NULL;
+  uint64_t start = startTiming(timing);
+
+  while( dc1394_capture_dequeue( stereoCamera->camera,
+				 DC1394_CAPTURE_POLICY_POLL,
+				 &frame ) == DC1394_SUCCESS && frame!=NULL )
+    {
+      if(timing!=NULL)
+	timing->dequeued++;
+      if(newest!=NULL)
+	{
+	  if(timing!=NULL)
+	    timing->discarded++;
+	  // return buffer for use
+	  dc1394_capture_enqueue( stereoCamera->camera, newest );
+	}
+      newest = frame;
+      *timestamp = frame->timestamp;
+    }
+
+  recordTiming(timing, TIMING_DEQUEUE, start);
+  return newest;
+}
+
+// give a frame of dequeueNewestFrame() back to the driver
+static void releaseFrame(PGRStereoCamera_t* stereoCamera, dc1394video_frame_t* frame)
+{
+  if(frame!=NULL)
+    dc1394_capture_enqueue( stereoCamera->camera, frame );
+}
+
+// grab the raw frame
+int grabRawFrame(
+		 PGRStereoCamera_t* 	stereoCamera,
+		 unsigned char**	ppucRaw,
+		 dc1394video_frame_t**	frame,
+		 uint64_t*		timestamp,
+		 CaptureTiming*		timing
+		 )
+{
+  *frame = dequeueNewestFrame( stereoCamera, timestamp, timing );
+  if(*frame==NULL)
+    return GRAB_NO_FRAME;
+  *ppucRaw = (*frame)->image;
+  return 0;
+}
+
+// give the frame of grabRawFrame() back to the driver
+void releaseRawFrame(PGRStereoCamera_t* stereoCamera, dc1394video_frame_t* frame)
+{
+  releaseFrame( stereoCamera, frame );
+}
+
 // grab color image
 int grabColorImages(
 		    PGRStereoCamera_t* 	stereoCamera, 
@@ -855,27 +2152,14 @@ int grabColorImages(
 		    unsigned char** 	ppucLeftRGB,
 		    unsigned char** 	ppucCenterRGB,
 		    TriclopsInput*  	pTriclopsInput,
-		    uint64_t*            timestamp
+		    uint64_t*            timestamp,
+		    CaptureTiming*       timing
 		    )
 {  
-  dc1394video_frame_t* frame;
-  unsigned char* pucGrabBuffer = NULL;
-  
-  while( dc1394_capture_dequeue( stereoCamera->camera,
-				 DC1394_CAPTURE_POLICY_POLL,
-				 &frame ) == DC1394_SUCCESS )
-    {
-      pucGrabBuffer = frame->image;
-      *timestamp = frame->timestamp;
-      // return buffer for use
-      dc1394_capture_enqueue( stereoCamera->camera, frame );
-    }
-  
-  if(pucGrabBuffer==NULL)
-    {
-      fprintf( stderr, "extractImagesColor - cannot dequeue image!\n" );
-      return -1;
-    }
+  dc1394video_frame_t* frame = dequeueNewestFrame( stereoCamera, timestamp, timing );
+  if(frame==NULL)
+    return GRAB_NO_FRAME;
+  unsigned char* pucGrabBuffer = frame->image;
   
   if ( stereoCamera->nBytesPerPixel == 2 )
     {
@@ -928,6 +2212,7 @@ int grabColorImages(
       *ppucCenterRGB 	= pucRGB + 3 * stereoCamera->nRows * stereoCamera->nCols;
       *ppucLeftRGB 	= pucRGB + 6 * stereoCamera->nRows * stereoCamera->nCols;
     }
+  releaseFrame( stereoCamera, frame );
   
   pTriclopsInput->inputType 	= TriInp_RGB;
   pTriclopsInput->nrows	= stereoCamera->nRows;
@@ -940,6 +2225,34 @@ int grabColorImages(
   return 0;
 }
 
+// the demosaicStereo() equivalent of a dc1394 Bayer tile and method;
+// false for methods it does not implement (SIMPLE averages the greens and
+// dc1394's EDGESENSE is a different filter, so both stay with dc1394)
+static bool getDemosaicMethod(dc1394color_filter_t filter, dc1394bayer_method_t bayerMethod,
+			      BayerTile* tile, DemosaicMethod* method)
+{
+  switch(filter)
+    {
+    case DC1394_COLOR_FILTER_RGGB: *tile = BAYER_TILE_RGGB; break;
+    case DC1394_COLOR_FILTER_GBRG: *tile = BAYER_TILE_GBRG; break;
+    case DC1394_COLOR_FILTER_GRBG: *tile = BAYER_TILE_GRBG; break;
+    case DC1394_COLOR_FILTER_BGGR: *tile = BAYER_TILE_BGGR; break;
+    default: return false;
+    }
+
+  switch(bayerMethod)
+    {
+    case DC1394_BAYER_METHOD_NEAREST:
+      *method = DEMOSAIC_NEAREST;
+      return true;
+    case DC1394_BAYER_METHOD_BILINEAR:
+      *method = DEMOSAIC_BILINEAR;
+      return true;
+    default:
+      return false;
+    }
+}
+
 // grab color image
 int grabColorImages_RGB(
 			PGRStereoCamera_t* 	stereoCamera, 
@@ -951,47 +2264,67 @@ int grabColorImages_RGB(
 			unsigned char** ppucLeftRGB,
 			unsigned char** ppucCenterRGB,
 			TriclopsInput*  	pTriclopsInput,
-			uint64_t*            timestamp
+			uint64_t*            timestamp,
+			CaptureTiming*       timing,
+			unsigned char*       pucWindow
 			)
 {
-  dc1394video_frame_t* frame;
-  unsigned char* pucGrabBuffer = NULL;
-  
-  while(dc1394_capture_dequeue( stereoCamera->camera,
-				DC1394_CAPTURE_POLICY_POLL,
-				&frame ) == DC1394_SUCCESS )
+  dc1394video_frame_t* frame = dequeueNewestFrame( stereoCamera, timestamp, timing );
+  if(frame==NULL)
+    return GRAB_NO_FRAME;
+  unsigned char* pucGrabBuffer = frame->image;
+
+  uint64_t start = startTiming(timing);
+  BayerTile tile;
+  DemosaicMethod method;
+  if(getDemosaicMethod(stereoCamera->bayerTile, bayerMethod, &tile, &method))
     {
-      pucGrabBuffer = frame->image;
-      *timestamp = frame->timestamp;
-      // return buffer for use
-      dc1394_capture_enqueue( stereoCamera->camera, frame );
+      // de-interlace and demosaic both images in one pass over the grab
+      // buffer, straight into the planar and packed RGB buffers
+      if(demosaicStereo( pucGrabBuffer,
+			 stereoCamera->nRows,
+			 stereoCamera->nCols,
+			 tile,
+			 method,
+			 pucRedGreenBlue,
+			 pucRGB,
+			 KERNEL_AUTO,
+			 pucWindow ) < 0)
+	{
+	  if(timing!=NULL)
+	    timing->errors[TIMING_DEBAYER]++;
+	  releaseFrame( stereoCamera, frame );
+	  return (-1);
+	}
+      recordTiming(timing, TIMING_DEBAYER, start);
     }
-  
-  if(pucGrabBuffer==NULL)
-    return 0;
-  
-    
-  
-  // de-interlace the 16 bit data into 2 bayer tile pattern images
-  dc1394_deinterlace_stereo( pucGrabBuffer,
-			     pucDeInterleaved,
-			     stereoCamera->nCols,
-			     2*stereoCamera->nRows );
-  // extract color from the bayer tile image
-  // note: this will alias colors on the top and bottom rows
-  dc1394_bayer_decoding_8bit( pucDeInterleaved,
-			      pucRGB,
+  else
+    {
+      // de-interlace the 16 bit data into 2 bayer tile pattern images
+      dc1394_deinterlace_stereo( pucGrabBuffer,
+				 pucDeInterleaved,
+				 stereoCamera->nCols,
+				 2*stereoCamera->nRows );
+      recordTiming(timing, TIMING_DEINTERLACE, start);
+      start = startTiming(timing);
+      // extract color from the bayer tile image
+      // note: this will alias colors on the top and bottom rows
+      dc1394_bayer_decoding_8bit( pucDeInterleaved,
+				  pucRGB,
+				  stereoCamera->nCols,
+				  2*stereoCamera->nRows,
+				  stereoCamera->bayerTile,
+				  bayerMethod );
+      // now deinterlace the RGB Buffer to extract the green channel
+      // The green channel is a quick and dirty approximation to the mono
+      // equivalent of the image and can be used for stereo processing
+      dc1394_deinterlace_rgb( pucRGB,
+			      pucRedGreenBlue,
 			      stereoCamera->nCols,
-			      2*stereoCamera->nRows,
-			      stereoCamera->bayerTile,
-			      bayerMethod );
-  // now deinterlace the RGB Buffer to extract the green channel
-  // The green channel is a quick and dirty approximation to the mono
-  // equivalent of the image and can be used for stereo processing
-  dc1394_deinterlace_rgb( pucRGB,
-			  pucRedGreenBlue,
-			  stereoCamera->nCols,
-			  6*stereoCamera->nRows);
+			      6*stereoCamera->nRows);
+      recordTiming(timing, TIMING_DEBAYER, start);
+    }
+  releaseFrame( stereoCamera, frame );
   
   *ppucRightRGB	 = pucRGB;
   *ppucLeftRGB 	 = pucRGB + 3 * stereoCamera->nRows * stereoCamera->nCols;
@@ -1008,6 +2341,64 @@ int grabColorImages_RGB(
   return 0;
 }
 
+// grab the green planes only, reduced by getGreenScale(scale)
+int grabGreenImages(
+		    PGRStereoCamera_t* 	stereoCamera,
+		    int			scale,
+		    unsigned char* 	pucGreen,
+		    TriclopsInput*  	pTriclopsInput,
+		    uint64_t*           timestamp,
+		    CaptureTiming*      timing,
+		    unsigned char*      pucWindow
+		    )
+{
+  dc1394video_frame_t* frame = dequeueNewestFrame( stereoCamera, timestamp, timing );
+  if(frame==NULL)
+    return GRAB_NO_FRAME;
+  unsigned char* pucGrabBuffer = frame->image;
+
+  BayerTile tile;
+  DemosaicMethod method;
+  if(!getDemosaicMethod(stereoCamera->bayerTile, DC1394_BAYER_METHOD_NEAREST, &tile, &method))
+    {
+      fprintf( stderr, "grabGreenImages: unknown Bayer tile %d\n", stereoCamera->bayerTile );
+      releaseFrame( stereoCamera, frame );
+      return (-1);
+    }
+
+  // the green pixels straight from the mosaic, without demosaicing
+  uint64_t start = startTiming(timing);
+  if(extractStereoGreen( pucGrabBuffer,
+			 stereoCamera->nRows,
+			 stereoCamera->nCols,
+			 tile,
+			 scale,
+			 pucGreen,
+			 KERNEL_AUTO,
+			 pucWindow ) < 0)
+    {
+      if(timing!=NULL)
+	timing->errors[TIMING_DEBAYER]++;
+      releaseFrame( stereoCamera, frame );
+      return (-1);
+    }
+  recordTiming(timing, TIMING_DEBAYER, start);
+  releaseFrame( stereoCamera, frame );
+
+  scale = getGreenScale(scale);
+  int nrows = stereoCamera->nRows / scale;
+  int ncols = stereoCamera->nCols / scale;
+  pTriclopsInput->inputType 	= TriInp_RGB;
+  pTriclopsInput->nrows 	= nrows;
+  pTriclopsInput->ncols	        = ncols;
+  pTriclopsInput->rowinc	= ncols;
+  pTriclopsInput->u.rgb.red     = pucGreen;                 // right green
+  pTriclopsInput->u.rgb.green   = pucGreen + nrows * ncols; // left green
+  pTriclopsInput->u.rgb.blue  	= pTriclopsInput->u.rgb.green;
+
+  return 0;
+}
+
 // grab color image
 int grabMonoImages(
 		   PGRStereoCamera_t* 	stereoCamera, 
@@ -1016,24 +2407,16 @@ int grabMonoImages(
 		   unsigned char** 	ppucLeftMono8,
 		   unsigned char** 	ppucCenterMono8,
 		   TriclopsInput*  	pTriclopsInput,
-		   uint64_t*            timestamp 
+		   uint64_t*            timestamp,
+		   CaptureTiming*       timing
 		   )
 {
-   dc1394video_frame_t* frame;
-   unsigned char* pucGrabBuffer = NULL;
+   dc1394video_frame_t* frame = dequeueNewestFrame( stereoCamera, timestamp, timing );
+   if(frame==NULL)
+     return GRAB_NO_FRAME;
+   unsigned char* pucGrabBuffer = frame->image;
 
-   while(dc1394_capture_dequeue( stereoCamera->camera,
-				 DC1394_CAPTURE_POLICY_POLL,
-				 &frame ) == DC1394_SUCCESS )
-     {
-       pucGrabBuffer = frame->image;
-      *timestamp = frame->timestamp;
-       // return buffer for use
-       dc1394_capture_enqueue( stereoCamera->camera, frame );
-     }
-   
-   if(pucGrabBuffer==NULL)
-     return -1;
+   uint64_t start = startTiming(timing);
 
    //unsigned char* pucGrabBuffer = frame->image;   
    unsigned char* right;
@@ -1063,6 +2446,8 @@ int grabMonoImages(
        center  	= pucDeInterleaved + stereoCamera->nRows * stereoCamera->nCols;
        left	= pucDeInterleaved + 2 * stereoCamera->nRows * stereoCamera->nCols;
      }
+   releaseFrame( stereoCamera, frame );
+   recordTiming(timing, TIMING_DEINTERLACE, start);
    
    *ppucRightMono8 	= right;
    *ppucLeftMono8 	= left;
@@ -30,6 +30,24 @@
 #include <math.h>
 
 #include "StereoImageBlob.h"
+#include "FrameSource.h"
+#include "AsyncFrameSource.h"
+#include "StereoPipeline.h"
+#include "ColorConvert.h"
+#include "ImageView.h"
+#include "TriclopsImageView.h"
+#include "PointCloud.h"
+#include "BlockStereo.h"
+#include "Rectify.h"
+#include "CaptureTiming.h"
+#include "FramePool.h"
+#include "StereoRecorder.h"
+
+// how long capture() waits for a frame by default [ms]
+#define BB_FRAME_WAIT 1000
+
+// frames between reads of the shutter and gain registers
+#define BB_SETTINGS_REFRESH 30
 
 enum CameraType{
   BB_REFERENCE = 0,
@@ -39,6 +57,15 @@ enum CameraType{
 
 
 
+// The grab functions poll the camera for its newest frame and return
+// GRAB_NO_FRAME (see FrameSource.h) if there is none since the last
+// grab; they record the time of their stages in timing unless it is NULL
+
+// Sleep on the capture file descriptor of the camera until a frame
+// arrives, for at most timeoutMs (FRAME_WAIT_FOREVER: no limit).
+// Returns 0 if a frame is ready, GRAB_NO_FRAME on timeout, -1 on failure.
+int waitForFrame(PGRStereoCamera_t* stereoCamera, int timeoutMs);
+
 // grab color image
 int grabColorImages(
 		    PGRStereoCamera_t* 	stereoCamera, 
@@ -50,7 +77,8 @@ int grabColorImages(
 		    unsigned char** 	ppucLeftRGB,
 		    unsigned char** 	ppucCenterRGB,
 		    TriclopsInput*  	pTriclopsInput,
-		    uint64_t*           timestamp
+		    uint64_t*           timestamp,
+		    CaptureTiming*      timing=NULL
 		    );
 
 // grab color image
@@ -61,9 +89,21 @@ int grabMonoImages(
 		   unsigned char** 	ppucLeftMono8,
 		   unsigned char** 	ppucCenterMono8,
 		   TriclopsInput*  	pTriclopsInput,
-		   uint64_t*            timestamp
+		   uint64_t*            timestamp,
+		   CaptureTiming*       timing=NULL
 		   );
 
+// grab the green planes only, reduced by getGreenScale(scale)
+int grabGreenImages(
+		    PGRStereoCamera_t* 	stereoCamera,
+		    int			scale,
+		    unsigned char* 	pucGreen,
+		    TriclopsInput*  	pTriclopsInput,
+		    uint64_t*           timestamp,
+		    CaptureTiming*      timing=NULL,
+		    unsigned char*      pucWindow=NULL
+		    );
+
 // grab color image
 int grabColorImages_RGB(
 			PGRStereoCamera_t* 	stereoCamera, 
@@ -75,9 +115,24 @@ int grabColorImages_RGB(
 			unsigned char** ppucLeftRGB,
 			unsigned char** ppucCenterRGB,
 			TriclopsInput*	pTriclopsInput,
-			uint64_t*       timestamp
+			uint64_t*       timestamp,
+			CaptureTiming*  timing=NULL,
+			unsigned char*  pucWindow=NULL
 			);
 
+// grab the raw frame, without de-interlacing or demosaicing it; the
+// frame stays dequeued (and *ppucRaw valid) until releaseRawFrame()
+int grabRawFrame(
+		 PGRStereoCamera_t* 	stereoCamera,
+		 unsigned char**	ppucRaw,
+		 dc1394video_frame_t**	frame,
+		 uint64_t*		timestamp,
+		 CaptureTiming*		timing=NULL
+		 );
+
+// give the frame of grabRawFrame() back to the driver
+void releaseRawFrame(PGRStereoCamera_t* stereoCamera, dc1394video_frame_t* frame);
+
 class BumbleBee
 {
  public:
@@ -90,8 +145,14 @@ class BumbleBee
   // constructor with specified camera ID and scale
   BumbleBee(int bbId, int downscale);
 
-  // constructor with specified camera ID and scale and color enabled
-  BumbleBee(int bbId, int downscale, bool enable_color);
+  // constructor with specified camera ID and scale and color enabled;
+  // engine selects triclopsStereo() or the built-in block matching
+  BumbleBee(int bbId, int downscale, bool enable_color, StereoEngine engine=STEREO_TRICLOPS);
+
+  // constructor reading frames from the given source instead of the
+  // camera (e.g. a BlobFileFrameSource); bbId selects the calibration file
+  BumbleBee(FrameSource* frameSource, int bbId, int downscale, bool enable_color,
+	    StereoEngine engine=STEREO_TRICLOPS);
 
   // default destructor
   ~BumbleBee();
@@ -99,9 +160,18 @@ class BumbleBee
   // initialize stereocamera
   int init(float shutter=0.0105);
 
+  // initialize with a camera the caller found on the bus (see
+  // BumbleBeeManager), after cleaning up its iso channels and bandwidth;
+  // the camera is freed by fini()
+  int init(dc1394camera_t* cam, float shutter=0.0105);
+
   // initialize sequence
   int init_try(float shutter);
 
+  // create a triclops context configured like the driver's own
+  // (calibration file, resolution, disparity range); call after init()
+  int createContext(TriclopsContext* context);
+
   // capture images from camera and do stereo processing
   int capture();
 
@@ -114,6 +184,70 @@ class BumbleBee
   // capture raw image only
   int captureRawImageOnly();
 
+  // Record raw frames of the camera to a stereo log (see
+  // StereoRecorder.h) with captureRaw(), written by a background thread
+  // through a ring of nChunks chunks, or compressed by nThreads threads
+  // with nChunks frames queued for them. Not with asynchronous capture,
+  // the pipeline or a replayed source
+  int startRecording(const char* fname, int nChunks=RECORDER_CHUNKS, int nThreads=0);
+
+  // grab the raw frame and queue it for the log, without de-interlacing,
+  // demosaicing or stereo; GRAB_NO_FRAME if the camera has no new frame,
+  // -1 on failure or if the frame was dropped (see getRecorderStats())
+  int captureRaw();
+
+  // get the frame, drop and write rate counters of the recording
+  int getRecorderStats(RecorderStats* stats);
+
+  // write what is queued and close the log; -1 if any write failed
+  int stopRecording();
+
+  // grab frames on a background thread into nSlots buffers, so capture()
+  // gets the latest completed frame while the next one is acquired
+  int enableAsyncCapture(int nSlots=3);
+
+  // get the frame counters of the background thread
+  int getCaptureStats(AsyncCaptureStats* stats);
+
+  // How long capture() and the other capture functions sleep waiting
+  // for a new frame [ms]: on timeout they keep the last frame (see
+  // capture()). FRAME_WAIT_NONE polls the camera, FRAME_WAIT_FOREVER
+  // blocks until a frame arrives; BB_FRAME_WAIT by default. The first
+  // frame is always waited for.
+  int setFrameWait(int timeoutMs);
+
+  // Record the time of each stage of capture() (see CaptureTiming.h),
+  // the latency from the camera timestamp, and the frames the camera poll
+  // loop skipped; off by default. With asynchronous capture the
+  // acquisition stages run on their own thread and are not timed.
+  // Failures are counted (and reported on stderr) either way
+  int enableTiming(bool enable);
+
+  // get the stage timings and counters so far
+  int getTiming(CaptureTiming* captureTiming);
+
+  // clear them
+  void resetTiming();
+
+  // write them to a file: JSON if its name ends in .json, CSV otherwise
+  int writeTiming(const char* filename);
+
+  // run acquisition, color rectification and stereo as a pipeline of
+  // threads with depth frames in flight; frames are then taken with
+  // captureBundle() instead of capture()
+  int enablePipeline(int depth=4);
+
+  // get the next processed frame in order (blocks; -1 when there are
+  // no more frames); check bundle->status, and give the bundle back
+  // with releaseBundle() when done
+  int captureBundle(StereoBundle** bundle);
+
+  // give a bundle back to the pipeline
+  void releaseBundle(StereoBundle* bundle);
+
+  // get the per stage timing of the pipeline
+  int getPipelineStats(StereoPipelineStats* stats);
+
   // return stereoimage width
   unsigned int getImageWidth();
   
@@ -153,12 +287,67 @@ class BumbleBee
   // Get the rectified image
   int getRectifiedImage(unsigned char* imgBuffer, CameraType type);
 
-  // Get the color rectified image (right image only now)
-  int getRectifiedColorBuffer(unsigned char* imgBuffer, CameraType type=BB_RIGHT);
+  // Get the color rectified image as packed 3 byte pixels; set bgr for
+  // OpenCV's IplImage channel order
+  int getRectifiedColorBuffer(unsigned char* imgBuffer, CameraType type=BB_RIGHT, bool bgr=false);
   
-  // Get the disparity image; each pixel is 16bits
+  // Get the disparity image; each pixel is 16bits, rowinc is in bytes
   int getDisparityImage(unsigned short* img16Buffer, int* rowinc);
+
+  // Views of the images of the last capture, pointing into the driver's
+  // buffers instead of copying them; they stay valid until the next
+  // capture (see isViewValid()). With the pipeline enabled the images
+  // are in the bundles instead (see makeImageView() in TriclopsImageView.h)
+  int getLeftView(ImageView* view);
+  int getRightView(ImageView* view);
+  int getRectifiedView(ImageView* view, CameraType type);
+  int getRectifiedColorView(ImageView* view, CameraType type);
+  int getDisparityView(ImageView* view);
+
+  // true if the view was taken since the last capture
+  bool isViewValid(const ImageView* view);
   
+  // Rectify with tables precomputed from the calibration file instead of
+  // triclopsRectify(): the color images of both cameras are rectified in
+  // one pass, and with the built-in stereo engine the grayscale images
+  // too (triclopsStereo() still rectifies its own). Call after init()
+  int setRemapRectify(bool enable);
+
+  // Compare the images remap rectification made of the current frame
+  // with those of triclopsRectifyColorImage() (triclopsRectify() for
+  // grayscale ones), over the rows of the region of interest: the mean
+  // absolute difference of the pixels and the fraction of them that
+  // differ by more than tolerance
+  int compareRemapRectify(int tolerance, double* meanError, double* outlierFraction);
+
+  // Stereo only mode for color cameras with color output disabled: only
+  // the green pixels of the mosaic are taken, reduced to the output size
+  // when the scale allows, instead of demosaicing both images. The left,
+  // right and color images are then unavailable
+  int setStereoOnly(bool enable);
+
+  // Restrict stereo to rows [row, row+nrows) of the rectified images
+  // (nrows 0 for all of them); the disparities of the other rows are
+  // invalid. With remap rectification only these rows are rectified, the
+  // others keep their contents. May change between any two captures
+  int setRegionOfInterest(int row, int nrows);
+
+  // Also reduce the rectified grayscale images to nLevels-1 coarser
+  // levels (1/2, 1/4, ... of the rectified size; up to
+  // PYRAMID_MAX_LEVELS levels, 1 for none) on every capture. With remap
+  // rectification the levels are rectified from a pyramid of the input
+  // images, so they cover the whole image even with a region of interest.
+  // May change between any two captures
+  int setPyramidLevels(int nLevels);
+
+  // view of a level of the pyramid of the last capture (level 0 is the
+  // rectified image, as getRectifiedView())
+  int getPyramidView(ImageView* view, CameraType type, int level);
+
+  // Get the block matching settings equivalent to the calibration file
+  // (mask size, edge correlation, validation) and disparity range
+  int getBlockStereoParams(BlockStereoParams* params);
+
   // Set disparity range (max can be as high as 1024 but then there's this offset issue);
   // -- just keep the max below 240
   // -- rule of thumb: if closer objects aren't valid, try increasing max disparity value
@@ -171,6 +360,29 @@ class BumbleBee
   // Convert the (i,j) image float disparity value to an XYZ value
   int disparityToXYZ_f(float i, float j, float disparity, float* x, float* y, float* z);
 
+  // Get the geometry of the rectified cameras (focal length, image
+  // center, baseline and disparity scale)
+  void getStereoGeometry(StereoGeometry* geometry);
+
+  // Convert the whole disparity image of the last capture() to points
+  // (x, y, z arrays, NaN where the disparity is invalid), splitting the
+  // rows between nThreads threads; much faster than disparityToXYZ()
+  // per pixel. Initialize the cloud with initPointCloud() first
+  int getPointCloud(PointCloud* cloud, int nThreads=1);
+
+  // Get the depth (Z) of each of the DEPTH_TABLE_SIZE 16 bit disparity
+  // values (NaN for invalid ones), e.g. to look up the depth of pipeline
+  // bundles with disparityToDepth()
+  const float* getDepthTable();
+
+  // Get the depth image of the last capture(), one float per pixel
+  // (packed rows of getDisparityWidth() floats); a lookup per pixel
+  int getDepthImage(float* depthBuffer);
+
+  // view of the depth image of the last capture() (IMAGE_FLOAT32),
+  // valid until the next capture
+  int getDepthView(ImageView* view);
+
   // Get focal length
   float getFocalLength();
 
@@ -201,7 +413,65 @@ class BumbleBee
   // get the downscale value
   int getScale();
 
+  // camera timestamp [us] and number of the last captured frame
+  uint64_t getTimestamp();
+  uint64_t getFrameId();
+
  private:
+  // initialize the members for the constructors
+  void initMembers(FrameSource* frameSource, int bbId, int downscale, bool enable_color,
+		   StereoEngine engine);
+
+  // start the camera and set up stereo, after init() found it
+  int init_camera(float shutter);
+
+  // set up the triclops context and buffers once the source is open
+  int init_stereo();
+
+  // undo init() after init_stereo() allocated its buffers
+  void abortInit();
+
+  // give back the input buffers and free the block matcher
+  void freeBuffers();
+
+  // set up the built-in stereo engine
+  int initBlockStereo();
+
+  // grab the next frame; GRAB_NO_FRAME if there is no new one
+  int grabFrame(bool green);
+
+  // rectify and compute stereo on the grabbed frame
+  int processFrame();
+
+  // read the shutter and gain every BB_SETTINGS_REFRESH frames instead
+  // of every frame
+  void updateSettings();
+
+  // count a failure of a stage and report it on stderr
+  void reportFailure(TimingStage stage, const char* what, const char* reason);
+
+  // build the remap tables of both cameras from source images of size
+  // srcRows x srcCols to nrows x ncols
+  int buildRemapTables(int srcRows, int srcCols, int nrows, int ncols,
+		       RemapTable* right, RemapTable* left);
+
+  // rectify the current frame with the remap tables
+  int remapFrame(bool gray);
+
+  // make the coarser levels of the pyramid of the current frame
+  int pyramidFrame();
+
+  // source of the left/right images (the camera unless given otherwise)
+  FrameSource* source;
+
+  // true if the source was created by init() and is deleted by fini()
+  bool ownSource;
+
+  // the source if asynchronous capture is enabled
+  AsyncFrameSource* asyncSource;
+
+  // stage threads if the pipeline is enabled
+  StereoPipeline* pipeline;
 
   // dc1394 camera object
   dc1394camera_t* camera;
@@ -257,6 +527,14 @@ class BumbleBee
   unsigned char* pucRGBBuffer;
   unsigned char* pucGreenBuffer;
   unsigned char* pucRedGreenBlue;
+
+  // the frame buffer the input buffers above are in (see FrameLayout)
+  FramePool inputPool;
+  FrameBuffer* inputBuffer;
+
+  // planar buffer holding the current frame (pucRedGreenBlue unless the
+  // source hands out its own)
+  unsigned char* pucPlanarRGB;
   unsigned char* pucRightRGB;
   unsigned char* pucLeftRGB;
   unsigned char* pucCenterRGB;
@@ -301,6 +579,69 @@ class BumbleBee
   // timestamp
   uint64_t imagetimestamp;
 
+  // number of frames captured so far; identifies the frame of a view
+  uint64_t frameId;
+
+  // depth per disparity value and the geometry it was built for;
+  // invalidated by setDisparity()
+  float* depthTable;
+  StereoGeometry depthTableGeometry;
+  bool depthTableValid;
+
+  // depth image of frame depthFrameId, for getDepthView()
+  float* depthImage;
+  uint64_t depthFrameId;
+
+  // stereo engine, and the block matcher and its output if not Triclops
+  StereoEngine stereoEngine;
+  BlockStereo* blockStereo;
+  unsigned short* blockDisparity;
+
+  // rectification with remap tables, and the rectified planes
+  bool remapRectify;
+  RemapTable remapRight;
+  RemapTable remapLeft;
+  unsigned char* remapBuffer;
+
+  // grab the green planes only (see setStereoOnly())
+  bool stereoOnly;
+
+  // stage timings and failure counts, and timingData if timing is enabled
+  CaptureTiming timingData;
+  CaptureTiming* timing;
+
+  // timeout of the wait for a frame [ms] (see setFrameWait()), and when
+  // grabFrame() last got done waiting [us]
+  int frameWait;
+  uint64_t grabStart;
+
+  // shutter and gain read at frame settingsFrame (see updateSettings())
+  float cachedShutter;
+  float cachedGain;
+  uint64_t settingsFrame;
+  bool settingsValid;
+
+  // log written by captureRaw(), NULL if not recording, and the Bayer
+  // tile of its records
+  StereoRecorder* recorder;
+  BayerTile recordTile;
+
+  // region of interest: rows [roiRow, roiRow+roiRows) of the rectified
+  // images, all of them if roiRows is 0
+  int roiRow;
+  int roiRows;
+
+  // levels of the pyramid, and levels 1.. of the right [0] and left [1]
+  // image in pyramidBuffer
+  int pyramidLevels;
+  unsigned char* pyramidBuffer;
+  unsigned char* pyramidLevel[2][PYRAMID_MAX_LEVELS];
+
+  // with remap rectification: the pyramid of the input images, and the
+  // tables rectifying each level from its input level
+  unsigned char* pyramidInput;
+  RemapTable pyramidRemap[2][PYRAMID_MAX_LEVELS];
+
 };
 
 #endif
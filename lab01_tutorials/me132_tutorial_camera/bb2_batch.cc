@@ -0,0 +1,105 @@
+/*
+ * This program reprocesses a recording offline with StereoBatch: the
+ * frames are rectified and matched on a pool of worker threads, each
+ * with its own stereo context, and the disparity (and depth) images are
+ * written in frame order (see StereoBatch.h for the output format).
+ *
+ * usage: bb2_batch <log file> <camera ID> <output file|-> [threads <n>] [scale <s>]
+ *                  [disparity <min> <max>] [sad|census] [remap] [depth] [frames <n>] [scaling]
+ *   - the log is either a stereo log (see StereoLog.h) or a file of
+ *     StereoImageBlob records
+ *   - the camera ID selects the <ID>.cal calibration file
+ *   - "-" as the output only times the processing
+ *   - "threads <n>" is the number of workers (default 4)
+ *   - "scale <s>" and "disparity <min> <max>" are as for BumbleBee
+ *     (default 2, and 0 to 240)
+ *   - "sad" or "census" computes disparities with the built-in block
+ *     matching engine instead of triclopsStereo()
+ *   - "remap" rectifies with the remap tables built from the calibration
+ *     file instead of Triclops
+ *   - "depth" also writes the depth image of every frame
+ *   - "frames <n>" stops after n frames
+ *   - "scaling" first processes the first frames (all of them if
+ *     "frames" is not given) with 1, 2, 4, ... workers up to n, without
+ *     writing them, and prints the frame rate and the scaling efficiency
+ *     against one worker
+ */
+
+// include some standard header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// finally, include the bumblebee header files
+#include "bb2.h"
+#include "StereoBatch.h"
+
+int main(int argc, char** argv)
+{
+  if(argc<4)
+  {
+    fprintf(stderr, "usage: %s <log file> <camera ID> <output file|-> [threads <n>] [scale <s>] "
+            "[disparity <min> <max>] [sad|census] [remap] [depth] [frames <n>] [scaling]\n", argv[0]);
+    return -1;
+  }
+
+  StereoBatchParams params;
+  initStereoBatchParams(&params, atoi(argv[2]));
+  const char* output = strcmp(argv[3], "-")==0 ? NULL : argv[3];
+  int nThreads = 4;
+  bool scaling = false;
+  for(int k=4; k<argc; k++)
+  {
+    if(strcmp(argv[k], "threads")==0 && k+1<argc)
+      nThreads = atoi(argv[++k]);
+    else if(strcmp(argv[k], "scale")==0 && k+1<argc)
+      params.scale = atoi(argv[++k]);
+    else if(strcmp(argv[k], "disparity")==0 && k+2<argc)
+    {
+      params.minDisparity = atoi(argv[++k]);
+      params.maxDisparity = atoi(argv[++k]);
+    }
+    else if(strcmp(argv[k], "sad")==0)
+      params.engine = STEREO_BLOCK_SAD;
+    else if(strcmp(argv[k], "census")==0)
+      params.engine = STEREO_BLOCK_CENSUS;
+    else if(strcmp(argv[k], "remap")==0)
+      params.remap = true;
+    else if(strcmp(argv[k], "depth")==0)
+      params.depth = true;
+    else if(strcmp(argv[k], "frames")==0 && k+1<argc)
+      params.maxFrames = atoi(argv[++k]);
+    else if(strcmp(argv[k], "scaling")==0)
+      scaling = true;
+  }
+
+  StereoBatch batch;
+  StereoBatchStats stats;
+  if(scaling)
+  {
+    double single = 0;
+    printf("threads  frames/sec  speedup  efficiency\n");
+    for(int t=1; ; t*=2)
+    {
+      if(t>nThreads)
+        t = nThreads;
+      if(batch.run(argv[1], NULL, t, &params)<0)
+        return(-1);
+      batch.getStats(&stats);
+      if(t==1)
+        single = stats.framesPerSec;
+      double speedup = single>0 ? stats.framesPerSec / single : 0;
+      printf("%7d  %10.2f  %7.2f  %9.0f%%\n", t, stats.framesPerSec, speedup, 100 * speedup / t);
+      if(t==nThreads)
+        break;
+    }
+  }
+
+  if(batch.run(argv[1], output, nThreads, &params)<0)
+    return(-1);
+  batch.getStats(&stats);
+  printf("%d frames on %d threads in %.2f sec (%.2f sec setup): %.2f frames/sec, %.1f MB written\n",
+         stats.frames, stats.threads, stats.elapsed, stats.setup, stats.framesPerSec,
+         stats.bytesWritten * 1e-6);
+  return 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * This program replays recorded stereo frames through the bumblebee
+ * driver without a camera attached and measures the end-to-end frame
+ * rate of rectification, stereo and SIFT extraction on the right image.
+ *
+ * usage: bb2_benchmark <log file> <camera ID> [fast] [pipeline] [xyz] [sad|census] [remap] [stereoonly] [roi] [pyramid] [timing <file>]
+ *   - the log is either a stereo log (see StereoLog.h) or a file of
+ *     StereoImageBlob records
+ *   - the camera ID selects the <ID>.cal calibration file
+ *   - "fast" replays frames as fast as possible instead of at the
+ *     recorded frame rate
+ *   - "pipeline" runs acquisition, rectification and stereo as pipeline
+ *     stages (SIFT then runs on the grayscale rectified image) and
+ *     reports the time spent in each stage
+ *   - "xyz" (without "pipeline") also converts every disparity image to
+ *     a point cloud, and checks the first one against the per pixel
+ *     Triclops conversion; the program fails if they differ by more
+ *     than POINT_CLOUD_TOLERANCE
+ *   - "sad" or "census" computes disparities with the built-in block
+ *     matching engine instead of triclopsStereo()
+ *   - "remap" (without "pipeline") rectifies with the remap tables built
+ *     from the calibration file instead of Triclops, and checks the first
+ *     frame against Triclops rectification; the program fails if more
+ *     than REMAP_OUTLIER_FRACTION of the pixels differ by more than
+ *     REMAP_PIXEL_TOLERANCE
+ *   - "stereoonly" (without "pipeline") disables color output and grabs
+ *     only the green planes of the mosaic at the output scale; SIFT then
+ *     runs on the grayscale rectified image
+ *   - "roi" (without "pipeline") restricts stereo to a band of a third of
+ *     the rows below the image center, as for the ground ahead
+ *   - "pyramid" (without "pipeline") also reduces the rectified images to
+ *     1/2 and 1/4 on every frame
+ *   - "timing <file>" (without "pipeline") prints the time spent in each
+ *     stage of capture() and writes the histograms to the file, JSON if
+ *     its name ends in .json and CSV otherwise
+ */
+
+// include some standard header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// now include the opencv header files
+#include <opencv/cv.h>
+
+// finally, include the bumblebee header files
+#include "bb2.h"
+#include "FrameSource.h"
+#include "StereoLog.h"
+
+// include the SIFT header files
+#include <sift/sift.h>
+#include <sift/imgfeatures.h>
+
+// most difference of a point of the cloud from the per pixel conversion,
+// relative to the distance of the point
+#define POINT_CLOUD_TOLERANCE 1e-3
+
+// most difference of a pixel rectified with the remap tables from the
+// Triclops one, and most fraction of the pixels (as at the image borders)
+// allowed to differ by more
+#define REMAP_PIXEL_TOLERANCE 4
+#define REMAP_OUTLIER_FRACTION 0.01
+
+// compare a point cloud with the per pixel conversion of Triclops and
+// print the largest difference relative to the distance of the point;
+// returns -1 if a point differs by more than POINT_CLOUD_TOLERANCE or
+// is valid in one and not in the other
+static int checkPointCloud(BumbleBee* bb, const PointCloud* cloud)
+{
+  ImageView disparity;
+  bb->getDisparityView(&disparity);
+
+  int compared = 0, mismatched = 0;
+  double maxError = 0;
+  uint64_t t0 = getWallclockTime();
+  for(int i=0; i<cloud->nrows; i++)
+    for(int j=0; j<cloud->ncols; j++)
+    {
+      unsigned short disp = imageViewPixel16(&disparity, i, j);
+      int k = i*cloud->ncols + j;
+      bool valid = (disp!=0 && disp<DISPARITY_INVALID_MIN);
+      if(!valid)
+      {
+        if(!isnan(cloud->z[k]))
+          mismatched++;
+        continue;
+      }
+
+      float x, y, z;
+      if(bb->disparityToXYZ(i, j, disp, &x, &y, &z)<0)
+        return -1;
+      if(isnan(cloud->z[k]))
+      {
+        mismatched++;
+        continue;
+      }
+      double range = sqrt(x*x + y*y + z*z);
+      double error = sqrt((x-cloud->x[k])*(x-cloud->x[k]) + (y-cloud->y[k])*(y-cloud->y[k]) +
+                          (z-cloud->z[k])*(z-cloud->z[k])) / range;
+      if(!(error<=maxError))
+        maxError = error;
+      compared++;
+    }
+  double elapsed = (getWallclockTime() - t0) * 1e-3;
+
+  printf("point cloud check: %d points, max relative error %g, %d pixels valid in only one\n",
+         compared, maxError, mismatched);
+  printf("per pixel conversion took %.2f ms\n", elapsed);
+
+  if(mismatched>0 || !(maxError<=POINT_CLOUD_TOLERANCE))
+  {
+    fprintf(stderr, "point cloud check failed (tolerance %g)\n", POINT_CLOUD_TOLERANCE);
+    return -1;
+  }
+  return 0;
+}
+
+// compare the remap rectification of the current frame with Triclops;
+// returns -1 if too many pixels differ by more than REMAP_PIXEL_TOLERANCE
+static int checkRemapRectify(BumbleBee* bb)
+{
+  double meanError, outlierFraction;
+  if(bb->compareRemapRectify(REMAP_PIXEL_TOLERANCE, &meanError, &outlierFraction)<0)
+    return -1;
+
+  printf("remap check: mean absolute difference %.3f, %.3f%% of the pixels differ by more than %d\n",
+         meanError, outlierFraction * 100, REMAP_PIXEL_TOLERANCE);
+  if(!(outlierFraction<=REMAP_OUTLIER_FRACTION))
+  {
+    fprintf(stderr, "remap check failed (at most %g%% of the pixels may differ by more than %d)\n",
+            REMAP_OUTLIER_FRACTION * 100, REMAP_PIXEL_TOLERANCE);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc<3)
+  {
+    fprintf(stderr, "usage: %s <log file> <camera ID> [fast] [pipeline] [xyz] [sad|census] [remap] [stereoonly] [roi] [pyramid] [timing <file>]\n", argv[0]);
+    return -1;
+  }
+
+  ReplayMode mode = REPLAY_REALTIME;
+  bool pipelined = false;
+  bool xyz = false;
+  bool remap = false;
+  bool stereoOnly = false;
+  bool roi = false;
+  bool pyramid = false;
+  const char* timingFile = NULL;
+  StereoEngine engine = STEREO_TRICLOPS;
+  for(int k=3; k<argc; k++)
+  {
+    if(strcmp(argv[k], "fast")==0)
+      mode = REPLAY_FAST;
+    else if(strcmp(argv[k], "pipeline")==0)
+      pipelined = true;
+    else if(strcmp(argv[k], "xyz")==0)
+      xyz = true;
+    else if(strcmp(argv[k], "sad")==0)
+      engine = STEREO_BLOCK_SAD;
+    else if(strcmp(argv[k], "census")==0)
+      engine = STEREO_BLOCK_CENSUS;
+    else if(strcmp(argv[k], "remap")==0)
+      remap = true;
+    else if(strcmp(argv[k], "stereoonly")==0)
+      stereoOnly = true;
+    else if(strcmp(argv[k], "roi")==0)
+      roi = true;
+    else if(strcmp(argv[k], "pyramid")==0)
+      pyramid = true;
+    else if(strcmp(argv[k], "timing")==0 && k+1<argc)
+      timingFile = argv[++k];
+  }
+
+  // the replay source takes the place of the camera
+  ReplayFrameSource* replay;
+  if(StereoLogReader::isLog(argv[1]))
+    replay = new LogFrameSource(argv[1], mode);
+  else
+    replay = new BlobFileFrameSource(argv[1], mode);
+  int scale = 2;
+  bool color = !stereoOnly;
+  BumbleBee bb(replay, atoi(argv[2]), scale, color, engine);
+
+  if(bb.init()<0)
+    return(-1);
+  if(remap && bb.setRemapRectify(true)<0)
+    return(-1);
+  if(stereoOnly && bb.setStereoOnly(true)<0)
+    return(-1);
+
+  int width = bb.getImageWidth()/scale;
+  int height = bb.getImageHeight()/scale;
+  if(roi && bb.setRegionOfInterest(height/2, height/3)<0)
+    return(-1);
+  if(pyramid && bb.setPyramidLevels(3)<0)
+    return(-1);
+  if(timingFile!=NULL)
+    bb.enableTiming(true);
+  IplImage *right = cvCreateImage(cvSize(width,height), IPL_DEPTH_8U, bb.isColor() && color ? 3 : 1);
+
+  // checks that failed
+  int status = 0;
+
+  int frames = 0;
+  long features = 0;
+  PointCloud cloud;
+  initPointCloud(&cloud);
+  uint64_t cloudTime = 0;
+  uint64_t start = getWallclockTime();
+  if(pipelined)
+  {
+    if(bb.enablePipeline()<0)
+      return(-1);
+
+    // SIFT works on the grayscale rectified image straight from the bundle
+    IplImage *gray = cvCreateImageHeader(cvSize(width,height), IPL_DEPTH_8U, 1);
+    StereoBundle* bundle;
+    while(bb.captureBundle(&bundle)==0)
+    {
+      if(bundle->status==0)
+      {
+        cvSetData(gray, bundle->rectifiedRight.data, bundle->rectifiedRight.rowinc);
+        struct feature* current_features = NULL;
+        features += sift_features(gray, &current_features);
+        free(current_features);
+      }
+      bb.releaseBundle(bundle);
+
+      frames++;
+      if(frames%100==0)
+      {
+        double elapsed = (getWallclockTime() - start) * 1e-6;
+        printf("%d frames, %.2f frames/sec\n", frames, frames/elapsed);
+      }
+    }
+    cvReleaseImageHeader(&gray);
+
+    StereoPipelineStats stats;
+    bb.getPipelineStats(&stats);
+    const char* names[PIPELINE_STAGES] = { "acquire", "rectify", "stereo" };
+    for(int k=0; k<PIPELINE_STAGES; k++)
+      printf("%-8s mean %6.2f ms   max %6.2f ms\n", names[k], stats.meanStage[k], stats.maxStage[k]);
+    printf("%-8s mean %6.2f ms   max %6.2f ms\n", "total", stats.meanTotal, stats.maxTotal);
+  }
+  else
+  {
+    while(bb.capture()==0)
+    {
+      if(remap && frames==0 && checkRemapRectify(&bb)<0)
+        status = -1;
+
+      if(bb.isColor() && color)
+        bb.getRectifiedColorBuffer((unsigned char*)right->imageData, BB_RIGHT, true);
+      else
+        bb.getRectifiedImage((unsigned char*)right->imageData, BB_RIGHT);
+
+      struct feature* current_features = NULL;
+      features += sift_features(right, &current_features);
+      free(current_features);
+
+      if(xyz)
+      {
+        uint64_t t0 = getWallclockTime();
+        if(bb.getPointCloud(&cloud, 4)<0)
+          status = -1;
+        cloudTime += getWallclockTime() - t0;
+        if(frames==0 && status==0 && checkPointCloud(&bb, &cloud)<0)
+          status = -1;
+      }
+
+      frames++;
+      if(frames%100==0)
+      {
+        double elapsed = (getWallclockTime() - start) * 1e-6;
+        printf("%d frames, %.2f frames/sec\n", frames, frames/elapsed);
+      }
+    }
+    if(xyz && frames>0)
+      printf("point cloud: %.2f ms/frame, %d valid points in the last frame\n",
+             cloudTime * 1e-3 / frames, cloud.numValid);
+  }
+  double elapsed = (getWallclockTime() - start) * 1e-6;
+
+  printf("processed %d frames in %.2f sec: %.2f frames/sec, %.1f features/frame\n",
+         frames, elapsed, frames>0 ? frames/elapsed : 0.0,
+         frames>0 ? (double)features/frames : 0.0);
+
+  if(timingFile!=NULL)
+  {
+    CaptureTiming timing;
+    bb.getTiming(&timing);
+    printCaptureTiming(&timing, stdout);
+    bb.writeTiming(timingFile);
+  }
+
+  bb.fini();
+  delete replay;
+  cvReleaseImage(&right);
+  freePointCloud(&cloud);
+
+  return status;
+}
@@ -0,0 +1,296 @@
+/*
+ * This program converts a recording into a compressed stereo log (see
+ * StereoLog.h and StereoCodec.h), reports the compression ratio and
+ * rate, checks that both replay the same images, and then times
+ * decompressing the frames of the new log in random order against the
+ * frame rate they were recorded at.
+ *
+ * usage: bb2_logpack <input file> <output log> [threads <n>] [mono]
+ *   - the input is either a stereo log (compressed or not, raw records
+ *     stay raw) or a file of StereoImageBlob records
+ *   - "threads <n>" is the number of compression threads (default 4)
+ *   - "mono" reads blobs from before version 5 that do not record their
+ *     channel count as mono (see readStereoImageBlob())
+ */
+
+// include some standard header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// finally, include the bumblebee header files
+#include "FrameSource.h"
+#include "StereoLog.h"
+
+// copy the frames of a log to the writer
+static int packLog(const char* fname, StereoLogWriter* writer)
+{
+  StereoLogReader reader;
+  if(reader.open(fname)<0)
+    return -1;
+
+  uint8_t* buffer = NULL;
+  size_t bufferSize = 0;
+  int ret = 0;
+  for(int k=0; k<reader.getFrameCount() && ret==0; k++)
+  {
+    StereoLogFrame f;
+    if(reader.getFrame(k, &f)<0)
+    {
+      fprintf(stderr, "Cannot read frame %d of %s\n", k, fname);
+      ret = -1;
+      break;
+    }
+    const StereoLogFrameHeader* h = f.header;
+    const uint8_t* left = f.left;
+    const uint8_t* right = f.right;
+    if(h->codec!=CODEC_NONE)
+    {
+      if(2 * (size_t)h->imageSize > bufferSize)
+      {
+        delete[] buffer;
+        bufferSize = 2 * (size_t)h->imageSize;
+        buffer = new uint8_t[bufferSize];
+      }
+      if(reader.unpackFrame(&f, buffer, buffer + h->imageSize)<0)
+      {
+        fprintf(stderr, "Cannot decompress frame %d of %s\n", k, fname);
+        ret = -1;
+        break;
+      }
+      left = buffer;
+      right = buffer + h->imageSize;
+    }
+    if(h->format==STEREO_LOG_RAW)
+      ret = writer->appendRaw(h->frameId, h->timestamp, h->cols, h->rows, h->channels,
+                              (BayerTile)h->bayerTile, left, h->shutter, h->gain);
+    else
+      ret = writer->append(h->frameId, h->timestamp, h->cols, h->rows, h->rowinc, h->channels,
+                           left, right, h->shutter, h->gain);
+  }
+  delete[] buffer;
+  return ret;
+}
+
+// copy the frames of a blob file to the writer
+static int packBlobs(const char* fname, StereoLogWriter* writer, bool legacyMono)
+{
+  FILE* file = fopen(fname, "rb");
+  if(file==NULL)
+  {
+    fprintf(stderr, "Cannot open %s\n", fname);
+    return -1;
+  }
+
+  StereoImageBlob* blob = new StereoImageBlob;
+  int ret = 0;
+  while(ret==0 && readStereoImageBlob(file, blob, legacyMono)==0)
+    ret = writer->append(blob);
+  if(ret==0 && !feof(file))
+  {
+    fprintf(stderr, "Cannot read all frames of %s\n", fname);
+    ret = -1;
+  }
+
+  delete blob;
+  fclose(file);
+  return ret;
+}
+
+// open a recording for replay as fast as it reads
+static ReplayFrameSource* openReplay(const char* fname, bool legacyMono, PGRStereoCamera_t* camera)
+{
+  ReplayFrameSource* source;
+  if(StereoLogReader::isLog(fname))
+    source = new LogFrameSource(fname, REPLAY_FAST);
+  else
+    source = new BlobFileFrameSource(fname, REPLAY_FAST, legacyMono);
+  if(source->open(camera)<0)
+  {
+    delete source;
+    return NULL;
+  }
+  return source;
+}
+
+// grab the images of the next frame; planes is room for the planar
+// copy of a color frame
+static int grabImages(ReplayFrameSource* source, bool color, unsigned char* planes,
+                      unsigned char** left, unsigned char** right)
+{
+  unsigned char* center;
+  TriclopsInput input;
+  uint64_t timestamp;
+  if(color)
+    return source->grabColorRGB(DC1394_BAYER_METHOD_NEAREST, NULL, NULL, &planes,
+                                right, left, &center, &input, &timestamp);
+  return source->grabMono(NULL, right, left, &center, &input, &timestamp);
+}
+
+// replay the input and the new log side by side and compare their
+// images, so that raw records are checked after de-interlacing and
+// demosaicing as well
+static int verifyLog(const char* input, const char* output, bool legacyMono)
+{
+  PGRStereoCamera_t inCamera, outCamera;
+  ReplayFrameSource* in = openReplay(input, legacyMono, &inCamera);
+  ReplayFrameSource* out = in!=NULL ? openReplay(output, false, &outCamera) : NULL;
+  if(out==NULL)
+  {
+    delete in;
+    return -1;
+  }
+  if(inCamera.nRows!=outCamera.nRows || inCamera.nCols!=outCamera.nCols ||
+     inCamera.bColor!=outCamera.bColor)
+  {
+    fprintf(stderr, "%s replays in another format than %s\n", output, input);
+    delete in;
+    delete out;
+    return -1;
+  }
+
+  bool color = inCamera.bColor;
+  size_t n = (size_t)inCamera.nRows * inCamera.nCols;
+  size_t size = color ? 3 * n : n;
+  unsigned char* inPlanes = new unsigned char[6 * n];
+  unsigned char* outPlanes = new unsigned char[6 * n];
+  int ret = 0;
+  int frames = 0;
+  while(true)
+  {
+    unsigned char *inLeft, *inRight, *outLeft, *outRight;
+    bool inMore = grabImages(in, color, inPlanes, &inLeft, &inRight)==0;
+    bool outMore = grabImages(out, color, outPlanes, &outLeft, &outRight)==0;
+    if((!inMore && !in->atEnd()) || (!outMore && !out->atEnd()))
+    {
+      fprintf(stderr, "Cannot replay frame %d of %s\n", frames, inMore ? output : input);
+      ret = -1;
+      break;
+    }
+    if(!inMore || !outMore)
+    {
+      if(inMore || outMore)
+      {
+        fprintf(stderr, "%s ends after %d frames, %s does not\n", inMore ? output : input, frames,
+                inMore ? input : output);
+        ret = -1;
+      }
+      break;
+    }
+    if(memcmp(inLeft, outLeft, size)!=0 || memcmp(inRight, outRight, size)!=0)
+    {
+      fprintf(stderr, "Frame %d of %s does not replay as in %s\n", frames, output, input);
+      ret = -1;
+      break;
+    }
+    frames++;
+  }
+  if(ret==0)
+    printf("%d frames replay the same from both\n", frames);
+
+  delete[] inPlanes;
+  delete[] outPlanes;
+  delete in;
+  delete out;
+  return ret;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc<3)
+  {
+    fprintf(stderr, "usage: %s <input file> <output log> [threads <n>] [mono]\n", argv[0]);
+    return -1;
+  }
+  int nThreads = 4;
+  bool legacyMono = false;
+  for(int k=3; k<argc; k++)
+  {
+    if(strcmp(argv[k], "threads")==0 && k+1<argc)
+      nThreads = atoi(argv[++k]);
+    else if(strcmp(argv[k], "mono")==0)
+      legacyMono = true;
+  }
+
+  // compress
+  StereoLogWriter writer;
+  if(writer.open(argv[2])<0 || writer.enableCompression(nThreads)<0)
+    return -1;
+
+  uint64_t start = getWallclockTime();
+  int ret;
+  if(StereoLogReader::isLog(argv[1]))
+    ret = packLog(argv[1], &writer);
+  else
+    ret = packBlobs(argv[1], &writer, legacyMono);
+  if(writer.close()<0)
+    ret = -1;
+  double elapsed = (getWallclockTime() - start) * 1e-6;
+  if(ret<0)
+    return -1;
+
+  int frames = writer.getFrameCount();
+  printf("%d frames, %.1f MB to %.1f MB (%.2fx) in %.2f sec: %.2f frames/sec, %.1f MB/sec with %d threads\n",
+         frames, writer.getImageBytes() * 1e-6, writer.getBytesWritten() * 1e-6,
+         writer.getBytesWritten()>0 ? (double)writer.getImageBytes() / writer.getBytesWritten() : 0.0,
+         elapsed, frames / elapsed, writer.getImageBytes() * 1e-6 / elapsed, nThreads);
+
+  if(verifyLog(argv[1], argv[2], legacyMono)<0)
+    return -1;
+
+  // decompress every frame once, in random order
+  StereoLogReader reader;
+  if(reader.open(argv[2])<0)
+    return -1;
+  int n = reader.getFrameCount();
+  if(n==0)
+    return 0;
+  int* order = new int[n];
+  for(int k=0; k<n; k++)
+    order[k] = k;
+  for(int k=n-1; k>0; k--)
+  {
+    int j = rand() % (k+1);
+    int t = order[k];
+    order[k] = order[j];
+    order[j] = t;
+  }
+
+  StereoLogFrame f;
+  reader.getFrame(0, &f);
+  uint64_t firstTimestamp = f.header->timestamp;
+  reader.getFrame(n-1, &f);
+  double recorded = (f.header->timestamp - firstTimestamp) * 1e-6;
+
+  uint8_t* buffer = NULL;
+  size_t bufferSize = 0;
+  int unpacked = 0;
+  start = getWallclockTime();
+  for(int k=0; k<n; k++)
+  {
+    if(reader.getFrame(order[k], &f)<0)
+      continue;
+    const StereoLogFrameHeader* h = f.header;
+    if(h->codec==CODEC_NONE)
+      continue;
+    if(2 * (size_t)h->imageSize > bufferSize)
+    {
+      delete[] buffer;
+      bufferSize = 2 * (size_t)h->imageSize;
+      buffer = new uint8_t[bufferSize];
+    }
+    if(reader.unpackFrame(&f, buffer, buffer + h->imageSize)<0)
+    {
+      fprintf(stderr, "Frame %d of %s is corrupt\n", order[k], argv[2]);
+      ret = -1;
+    }
+    unpacked++;
+  }
+  elapsed = (getWallclockTime() - start) * 1e-6;
+  printf("%d of %d frames decompressed in random order in %.2f sec: %.2f frames/sec (recorded at %.2f frames/sec)\n",
+         unpacked, n, elapsed, elapsed>0 ? unpacked / elapsed : 0.0, recorded>0 ? (n-1) / recorded : 0.0);
+
+  delete[] buffer;
+  delete[] order;
+  return ret;
+}
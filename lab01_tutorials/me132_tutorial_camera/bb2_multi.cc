@@ -0,0 +1,119 @@
+/*
+ * This program drives several stereo heads through BumbleBeeManager,
+ * either live cameras or recorded logs replayed as cameras, and reports
+ * the rate of time-aligned frame sets and the skew between their frames.
+ *
+ * usage: bb2_multi [fast] [skew <us>] [pin] <camera ID> <log file|live> [<camera ID> <log file|live> ...]
+ *   - each camera is given by the camera ID of its calibration file and
+ *     either a stereo log (see StereoLog.h) or blob file to replay, or
+ *     "live" for the camera with that ID on the bus
+ *   - "fast" replays frames as fast as possible instead of at the
+ *     recorded frame rate
+ *   - "skew <us>" is the largest difference between the timestamps of
+ *     the frames of a set (default half a frame at 20 fps)
+ *   - "pin" pins the worker of camera k to core k
+ */
+
+// include some standard header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// finally, include the bumblebee header files
+#include "bb2.h"
+#include "FrameSource.h"
+#include "StereoLog.h"
+#include "BumbleBeeManager.h"
+
+int main(int argc, char** argv)
+{
+  ReplayMode mode = REPLAY_REALTIME;
+  uint64_t maxSkew = 25000;
+  bool pin = false;
+  int k = 1;
+  for(; k<argc; k++)
+  {
+    if(strcmp(argv[k], "fast")==0)
+      mode = REPLAY_FAST;
+    else if(strcmp(argv[k], "skew")==0 && k+1<argc)
+      maxSkew = strtoull(argv[++k], NULL, 10);
+    else if(strcmp(argv[k], "pin")==0)
+      pin = true;
+    else
+      break;
+  }
+  if(k+2>argc || (argc-k)%2!=0)
+  {
+    fprintf(stderr, "usage: %s [fast] [skew <us>] [pin] <camera ID> <log file|live> [<camera ID> <log file|live> ...]\n", argv[0]);
+    return -1;
+  }
+
+  BumbleBeeManager manager;
+  ReplayFrameSource* replays[MANAGER_MAX_CAMERAS];
+  int nReplays = 0;
+  for(; k+1<argc; k+=2)
+  {
+    int bbId = atoi(argv[k]);
+    int index;
+    if(strcmp(argv[k+1], "live")==0)
+      index = manager.addCamera(bbId);
+    else
+    {
+      if(nReplays>=MANAGER_MAX_CAMERAS)
+        return(-1);
+      ReplayFrameSource* replay;
+      if(StereoLogReader::isLog(argv[k+1]))
+        replay = new LogFrameSource(argv[k+1], mode);
+      else
+        replay = new BlobFileFrameSource(argv[k+1], mode);
+      replays[nReplays++] = replay;
+      index = manager.addSource(replay, bbId);
+    }
+    if(index<0)
+      return(-1);
+    if(pin)
+      manager.setCore(index, index);
+  }
+
+  if(manager.init()<0)
+    return(-1);
+  if(manager.start()<0)
+    return(-1);
+
+  int sets = 0;
+  uint64_t skewSum = 0, skewMax = 0;
+  uint64_t start = getWallclockTime();
+  FrameSet set;
+  while(manager.captureFrameSet(&set, maxSkew)==0)
+  {
+    // the images of the set would be read from manager.getCamera(k) here
+    manager.releaseFrameSet();
+
+    sets++;
+    skewSum += set.skew;
+    if(set.skew>skewMax)
+      skewMax = set.skew;
+    if(sets%100==0)
+    {
+      double elapsed = (getWallclockTime() - start) * 1e-6;
+      printf("%d sets, %.2f sets/sec\n", sets, sets/elapsed);
+    }
+  }
+  double elapsed = (getWallclockTime() - start) * 1e-6;
+
+  printf("%d frame sets in %.2f sec: %.2f sets/sec, skew mean %.2f ms max %.2f ms\n",
+         sets, elapsed, sets>0 ? sets/elapsed : 0.0,
+         sets>0 ? skewSum * 1e-3 / sets : 0.0, skewMax * 1e-3);
+
+  ManagerStats stats;
+  manager.getStats(&stats);
+  for(int c=0; c<manager.getNumCameras(); c++)
+    printf("camera %d: %llu frames skipped, %llu failed captures\n", c,
+           (unsigned long long)stats.skipped[c], (unsigned long long)stats.failures[c]);
+
+  manager.fini();
+  for(int r=0; r<nReplays; r++)
+    delete replays[r];
+
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * This program records raw frames of a live camera to a stereo log (see
+ * StereoLog.h) at the full camera rate and reports the sustained write
+ * rate and the frames dropped because the disk could not keep up. The
+ * log replays through LogFrameSource like any other, e.g. with
+ * bb2_benchmark.
+ *
+ * usage: bb2_record <camera ID> <log file> [frames <n>] [chunks <n>] [compress <n>]
+ *   - the camera ID selects the camera and its <ID>.cal calibration file
+ *   - "frames <n>" stops after n frames (default 1000)
+ *   - "chunks <n>" is the number of chunks of the write ring (default
+ *     RECORDER_CHUNKS); more ride out longer disk stalls
+ *   - "compress <n>" compresses the frames on n threads (see
+ *     StereoCodec.h) instead; "chunks" is then the number of frames
+ *     queued for them
+ */
+
+// include some standard header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// finally, include the bumblebee header files
+#include "bb2.h"
+
+static void printStats(const RecorderStats* stats)
+{
+  printf("%llu frames, %llu dropped, %.1f MB in %.2f sec: %.2f MB/sec%s\n",
+	 (unsigned long long)stats->frames, (unsigned long long)stats->dropped,
+	 stats->bytesWritten * 1e-6, stats->elapsed, stats->megabytesPerSec,
+	 stats->direct ? " (O_DIRECT)" : "");
+}
+
+int main(int argc, char** argv)
+{
+  if(argc<3)
+  {
+    fprintf(stderr, "usage: %s <camera ID> <log file> [frames <n>] [chunks <n>] [compress <n>]\n", argv[0]);
+    return -1;
+  }
+
+  int bbId = atoi(argv[1]);
+  const char* fname = argv[2];
+  int nFrames = 1000;
+  int nChunks = RECORDER_CHUNKS;
+  int nThreads = 0;
+  for(int k=3; k+1<argc; k+=2)
+  {
+    if(strcmp(argv[k], "frames")==0)
+      nFrames = atoi(argv[k+1]);
+    else if(strcmp(argv[k], "chunks")==0)
+      nChunks = atoi(argv[k+1]);
+    else if(strcmp(argv[k], "compress")==0)
+      nThreads = atoi(argv[k+1]);
+  }
+
+  BumbleBee bb(bbId, 2, true);
+  if(bb.init()<0)
+    return(-1);
+  if(bb.startRecording(fname, nChunks, nThreads)<0)
+  {
+    bb.fini();
+    return(-1);
+  }
+
+  RecorderStats stats;
+  int frames = 0;
+  while(frames<nFrames)
+  {
+    // dropped frames still count, so that a slow disk cannot stall the run
+    if(bb.captureRaw()==GRAB_NO_FRAME)
+      continue;
+    frames++;
+    if(frames%100==0)
+    {
+      bb.getRecorderStats(&stats);
+      printStats(&stats);
+    }
+  }
+
+  bb.getRecorderStats(&stats);
+  int ret = bb.stopRecording();
+  printStats(&stats);
+  if(ret<0)
+    fprintf(stderr, "The log %s is incomplete\n", fname);
+
+  bb.fini();
+  return ret;
+}
@@ -0,0 +1,1263 @@
+/*
+ * This program times the image kernels of the bumblebee driver on
+ * synthetic images, without a camera or calibration file, and checks
+ * that every implementation gives the same result as the plain loop.
+ * It also times SIFT extraction, the descriptor distance kernels and
+ * place recognition queries against synthetic feature databases of
+ * growing size. It needs OpenCV and libfeat (for IplImage and struct
+ * feature) and libdc1394, to check the demosaicing against it, but none
+ * of the other camera libraries.
+ *
+ * SIFT extraction is also checked against sift_features() of libfeat on
+ * a real image, reference.png of the tutorials unless another is given.
+ *
+ * usage: kernel_benchmark [iterations] [reference image]
+ */
+
+// include some standard header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+#include <sift/sift.h>
+#include <dc1394/conversions.h>
+
+#include "ColorConvert.h"
+#include "PointCloud.h"
+#include "BlockStereo.h"
+#include "Rectify.h"
+#include "StereoCodec.h"
+#include "FeatureDB.h"
+#include "FeatureMatcher.h"
+#include "DescriptorDistance.h"
+#include "SiftExtractor.h"
+
+// image sizes to time the kernels at (rectified sizes of the Bumblebee2
+// at downscale 2 and 1)
+static const int benchSizes[][2] = { {384, 512}, {768, 1024} };
+static const int numBenchSizes = 2;
+
+// wall clock time [us]
+static uint64_t getTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// the loop getRectifiedColorBuffer() used before the packing kernels
+static void packReference(const uint8_t* red, const uint8_t* green, const uint8_t* blue,
+			  int nrows, int ncols, uint8_t* imgBuffer)
+{
+  for(int i=0; i<nrows; i++)
+    for(int j=0; j<ncols; j++)
+      {
+	imgBuffer[i*ncols*3 + j*3 + 0] = red[i*ncols + j];
+	imgBuffer[i*ncols*3 + j*3 + 1] = green[i*ncols + j];
+	imgBuffer[i*ncols*3 + j*3 + 2] = blue[i*ncols + j];
+      }
+}
+
+// planar to packed RGB/BGR
+static int benchPackRGB(int iterations)
+{
+  const char* kernelNames[] = { "auto", "scalar", "ssse3", "avx2" };
+  int failed = 0;
+
+  printf("planar to packed RGB (best kernel: %s)\n", kernelNames[getBestKernel()]);
+  for(int s=0; s<numBenchSizes; s++)
+    {
+      int nrows = benchSizes[s][0];
+      int ncols = benchSizes[s][1];
+      int n = nrows * ncols;
+
+      uint8_t* planes = new uint8_t[3*n];
+      uint8_t* expected = new uint8_t[3*n];
+      uint8_t* packed = new uint8_t[3*n];
+      for(int k=0; k<3*n; k++)
+	planes[k] = (uint8_t)rand();
+      uint8_t* red = planes;
+      uint8_t* green = planes + n;
+      uint8_t* blue = planes + 2*n;
+
+      uint64_t t0 = getTime();
+      for(int it=0; it<iterations; it++)
+	packReference(red, green, blue, nrows, ncols, expected);
+      double reference = (getTime() - t0) / 1000.0 / iterations;
+      printf("  %4dx%-4d %-10s %8.3f ms\n", ncols, nrows, "reference", reference);
+
+      for(int k=KERNEL_SCALAR; k<=KERNEL_AVX2; k++)
+	{
+	  ConvertKernel kernel = (ConvertKernel)k;
+	  if(!isKernelSupported(kernel))
+	    {
+	      printf("  %4dx%-4d %-10s not supported\n", ncols, nrows, kernelNames[k]);
+	      continue;
+	    }
+
+	  t0 = getTime();
+	  for(int it=0; it<iterations; it++)
+	    packPlanarRGB(red, green, blue, nrows, ncols, ncols, packed, 3*ncols, PIXEL_ORDER_RGB, kernel);
+	  double elapsed = (getTime() - t0) / 1000.0 / iterations;
+	  bool ok = (memcmp(packed, expected, 3*n)==0);
+
+	  // BGR must be RGB with the channels swapped
+	  packPlanarRGB(red, green, blue, nrows, ncols, ncols, packed, 3*ncols, PIXEL_ORDER_BGR, kernel);
+	  for(int p=0; p<n && ok; p++)
+	    ok = (packed[3*p]==expected[3*p+2] && packed[3*p+1]==expected[3*p+1] && packed[3*p+2]==expected[3*p]);
+
+	  printf("  %4dx%-4d %-10s %8.3f ms  x%5.2f  %s\n", ncols, nrows, kernelNames[k],
+		 elapsed, reference/elapsed, ok ? "ok" : "MISMATCH");
+	  if(!ok)
+	    failed++;
+	}
+
+      delete[] planes;
+      delete[] expected;
+      delete[] packed;
+    }
+  return failed;
+}
+
+// disparity image to point cloud
+static int benchPointCloud(int iterations)
+{
+  const char* kernelNames[] = { "auto", "scalar", "sse2", "avx2" };
+  int failed = 0;
+
+  printf("disparity to point cloud\n");
+  for(int s=0; s<numBenchSizes; s++)
+    {
+      int nrows = benchSizes[s][0];
+      int ncols = benchSizes[s][1];
+
+      StereoGeometry geometry;
+      geometry.focalLength = 0.8f * ncols;
+      geometry.centerRow = nrows / 2.0f;
+      geometry.centerCol = ncols / 2.0f;
+      geometry.baseline = 0.12f;
+      geometry.disparityScale = 1.0f / 256.0f;
+
+      // subpixel disparities up to 240 with some invalid codes and zeros
+      unsigned short* disp = new unsigned short[nrows*ncols];
+      for(int k=0; k<nrows*ncols; k++)
+	{
+	  int r = rand() % 20;
+	  disp[k] = r==0 ? 0xFFF0 + rand() % 16 : (r==1 ? 0 : rand() % (240*256));
+	}
+      ImageView view;
+      makeImageView(&view, (const unsigned char*)disp, ncols, nrows, ncols*sizeof(unsigned short),
+		    IMAGE_MONO16, 1, 0);
+
+      PointCloud expected, cloud;
+      initPointCloud(&expected);
+      initPointCloud(&cloud);
+      disparityToPointCloud(&geometry, &view, &expected, 1, KERNEL_SCALAR);
+
+      // the scalar kernel against the pinhole model in double precision
+      double maxError = 0;
+      for(int i=0; i<nrows; i++)
+	for(int j=0; j<ncols; j++)
+	  {
+	    int k = i*ncols + j;
+	    if(disp[k]==0 || disp[k]>=DISPARITY_INVALID_MIN)
+	      {
+		if(!isnan(expected.x[k]) || !isnan(expected.y[k]) || !isnan(expected.z[k]))
+		  maxError = INFINITY;
+		continue;
+	      }
+	    double z = geometry.focalLength * geometry.baseline / (disp[k] * (double)geometry.disparityScale);
+	    double x = (j - geometry.centerCol) * z / geometry.focalLength;
+	    double y = (i - geometry.centerRow) * z / geometry.focalLength;
+	    double error = sqrt((x-expected.x[k])*(x-expected.x[k]) + (y-expected.y[k])*(y-expected.y[k]) +
+				(z-expected.z[k])*(z-expected.z[k])) / sqrt(x*x + y*y + z*z);
+	    if(!(error<=maxError))
+	      maxError = error;
+	  }
+      bool accurate = (maxError<1e-5);
+      printf("  %4dx%-4d max relative error %g  %s\n", ncols, nrows, maxError, accurate ? "ok" : "INACCURATE");
+      if(!accurate)
+	failed++;
+
+      int threads[] = { 1, 2, 4 };
+      for(int k=KERNEL_SCALAR; k<=KERNEL_AVX2; k++)
+	for(int t=0; t<3; t++)
+	  {
+	    ConvertKernel kernel = (ConvertKernel)k;
+	    if(!isKernelSupported(kernel))
+	      {
+		if(t==0)
+		  printf("  %4dx%-4d %-10s not supported\n", ncols, nrows, kernelNames[k]);
+		continue;
+	      }
+
+	    uint64_t t0 = getTime();
+	    for(int it=0; it<iterations; it++)
+	      disparityToPointCloud(&geometry, &view, &cloud, threads[t], kernel);
+	    double elapsed = (getTime() - t0) / 1000.0 / iterations;
+
+	    // NaN compares unequal, so compare the bits
+	    int n = nrows*ncols;
+	    bool ok = (cloud.numValid==expected.numValid &&
+		       memcmp(cloud.x, expected.x, n*sizeof(float))==0 &&
+		       memcmp(cloud.y, expected.y, n*sizeof(float))==0 &&
+		       memcmp(cloud.z, expected.z, n*sizeof(float))==0);
+	    printf("  %4dx%-4d %-10s %d threads %8.3f ms  %s\n", ncols, nrows, kernelNames[k],
+		   threads[t], elapsed, ok ? "ok" : "MISMATCH");
+	    if(!ok)
+	      failed++;
+	  }
+
+      freePointCloud(&expected);
+      freePointCloud(&cloud);
+      delete[] disp;
+    }
+  return failed;
+}
+
+// de-interlacing and demosaicing a raw stereo frame, into the planes
+// only and into the packed images too
+static int benchDemosaic(int iterations)
+{
+  int failed = 0;
+
+  // the raw frame is always full size
+  int nrows = benchSizes[numBenchSizes-1][0];
+  int ncols = benchSizes[numBenchSizes-1][1];
+  int n = nrows * ncols;
+  uint8_t* raw = new uint8_t[2 * n];
+  for(int k=0; k<2*n; k++)
+    raw[k] = rand();
+  uint8_t* expectedPlanar = new uint8_t[6 * n];
+  uint8_t* expectedPacked = new uint8_t[6 * n];
+  uint8_t* planar = new uint8_t[6 * n];
+  uint8_t* packed = new uint8_t[6 * n];
+  // kept across frames, as by the frame sources
+  uint8_t* window = new uint8_t[getDemosaicWindowSize(ncols)];
+
+  printf("de-interlace + demosaic %dx%d stereo frame\n", ncols, nrows);
+  const char* methodNames[] = { "nearest", "bilinear", "edgesense" };
+  const ConvertKernel kernels[] = { KERNEL_SCALAR, KERNEL_SSSE3, KERNEL_AVX2 };
+  const char* kernelNames[] = { "scalar", "sse2+ssse3", "sse2+avx2" };
+  for(int m=0; m<3; m++)
+    for(int k=0; k<3; k++)
+      {
+	if(!isKernelSupported(kernels[k]))
+	  continue;
+	DemosaicMethod method = (DemosaicMethod)m;
+
+	uint64_t t0 = getTime();
+	for(int it=0; it<iterations; it++)
+	  demosaicStereo(raw, nrows, ncols, BAYER_TILE_BGGR, method, planar, NULL, kernels[k], window);
+	double planes = (getTime() - t0) / 1000.0 / iterations;
+
+	t0 = getTime();
+	for(int it=0; it<iterations; it++)
+	  demosaicStereo(raw, nrows, ncols, BAYER_TILE_BGGR, method, planar, packed, kernels[k], window);
+	double both = (getTime() - t0) / 1000.0 / iterations;
+
+	if(k==0)
+	  {
+	    memcpy(expectedPlanar, planar, 6*n);
+	    memcpy(expectedPacked, packed, 6*n);
+	  }
+	bool ok = (memcmp(planar, expectedPlanar, 6*n)==0 && memcmp(packed, expectedPacked, 6*n)==0);
+	printf("  %-9s %-10s planar %8.3f ms  planar+packed %8.3f ms  %s\n",
+	       methodNames[m], kernelNames[k], planes, both, ok ? "ok" : "MISMATCH");
+	if(!ok)
+	  failed++;
+      }
+
+  delete[] raw;
+  delete[] expectedPlanar;
+  delete[] expectedPacked;
+  delete[] planar;
+  delete[] packed;
+  delete[] window;
+  return failed;
+}
+
+// green planes for stereo only, against the full demosaic of the color
+// path; at scale 1 the planes must match the bilinear green
+static int benchGreen(int iterations)
+{
+  int failed = 0;
+
+  int nrows = benchSizes[numBenchSizes-1][0];
+  int ncols = benchSizes[numBenchSizes-1][1];
+  int n = nrows * ncols;
+  uint8_t* raw = new uint8_t[2 * n];
+  for(int k=0; k<2*n; k++)
+    raw[k] = rand();
+  uint8_t* planar = new uint8_t[6 * n];
+  uint8_t* packed = new uint8_t[6 * n];
+  uint8_t* expected = new uint8_t[2 * n];
+  uint8_t* green = new uint8_t[2 * n];
+  uint8_t* window = new uint8_t[getDemosaicWindowSize(ncols)];
+
+  printf("stereo only green planes of a %dx%d stereo frame\n", ncols, nrows);
+  uint64_t t0 = getTime();
+  for(int it=0; it<iterations; it++)
+    demosaicStereo(raw, nrows, ncols, BAYER_TILE_BGGR, DEMOSAIC_NEAREST, planar, packed, KERNEL_AUTO, window);
+  double full = (getTime() - t0) / 1000.0 / iterations;
+  printf("  %-22s %8.3f ms\n", "demosaic+pack (color)", full);
+
+  const ConvertKernel kernels[] = { KERNEL_SCALAR, KERNEL_SSSE3, KERNEL_AVX2 };
+  const char* kernelNames[] = { "scalar", "sse2+ssse3", "sse2+avx2" };
+  const int scales[] = { 1, 2 };
+  for(int s=0; s<2; s++)
+    {
+      int m = (nrows / scales[s]) * (ncols / scales[s]);
+      if(scales[s]==1)
+	{
+	  // right and left green are planes 2 and 3 of the demosaic
+	  demosaicStereo(raw, nrows, ncols, BAYER_TILE_BGGR, DEMOSAIC_BILINEAR, planar, NULL, KERNEL_SCALAR);
+	  memcpy(expected, planar + 2*n, 2*n);
+	}
+      for(int k=0; k<3; k++)
+	{
+	  if(!isKernelSupported(kernels[k]))
+	    continue;
+
+	  t0 = getTime();
+	  for(int it=0; it<iterations; it++)
+	    extractStereoGreen(raw, nrows, ncols, BAYER_TILE_BGGR, scales[s], green, kernels[k], window);
+	  double elapsed = (getTime() - t0) / 1000.0 / iterations;
+
+	  if(k==0 && scales[s]!=1)
+	    memcpy(expected, green, 2*m);
+	  bool ok = (memcmp(green, expected, 2*m)==0);
+	  printf("  green scale %d %-10s %8.3f ms  (%.1fx)  %s\n",
+		 scales[s], kernelNames[k], elapsed, full / elapsed, ok ? "ok" : "MISMATCH");
+	  if(!ok)
+	    failed++;
+	}
+    }
+
+  delete[] raw;
+  delete[] planar;
+  delete[] packed;
+  delete[] expected;
+  delete[] green;
+  delete[] window;
+  return failed;
+}
+
+// the fused demosaicing against the dc1394 passes it replaced in
+// grabColorImages_RGB(), for every tile: the same inside a one pixel
+// border of each image, up to the rounding of bilinear (see
+// demosaicStereo())
+static int benchDemosaicDc1394(int iterations)
+{
+  int failed = 0;
+
+  int nrows = benchSizes[numBenchSizes-1][0];
+  int ncols = benchSizes[numBenchSizes-1][1];
+  int n = nrows * ncols;
+  uint8_t* raw = new uint8_t[2 * n];
+  for(int k=0; k<2*n; k++)
+    raw[k] = rand();
+  uint8_t* deInterlaced = new uint8_t[2 * n];
+  uint8_t* expected = new uint8_t[6 * n];
+  uint8_t* planar = new uint8_t[6 * n];
+  uint8_t* packed = new uint8_t[6 * n];
+
+  printf("demosaicing against dc1394 on a %dx%d stereo frame\n", ncols, nrows);
+  const BayerTile tiles[] = { BAYER_TILE_RGGB, BAYER_TILE_GBRG, BAYER_TILE_GRBG, BAYER_TILE_BGGR };
+  const dc1394color_filter_t filters[] = { DC1394_COLOR_FILTER_RGGB, DC1394_COLOR_FILTER_GBRG,
+					   DC1394_COLOR_FILTER_GRBG, DC1394_COLOR_FILTER_BGGR };
+  const char* tileNames[] = { "RGGB", "GBRG", "GRBG", "BGGR" };
+  const DemosaicMethod methods[] = { DEMOSAIC_NEAREST, DEMOSAIC_BILINEAR };
+  const dc1394bayer_method_t bayerMethods[] = { DC1394_BAYER_METHOD_NEAREST, DC1394_BAYER_METHOD_BILINEAR };
+  const char* methodNames[] = { "nearest", "bilinear" };
+  for(int m=0; m<2; m++)
+    for(int t=0; t<4; t++)
+      {
+	// both images stacked, as grabColorImages_RGB() decoded them
+	uint64_t t0 = getTime();
+	for(int it=0; it<iterations; it++)
+	  {
+	    dc1394_deinterlace_stereo(raw, deInterlaced, ncols, 2*nrows);
+	    dc1394_bayer_decoding_8bit(deInterlaced, expected, ncols, 2*nrows, filters[t], bayerMethods[m]);
+	  }
+	double reference = (getTime() - t0) / 1000.0 / iterations;
+
+	t0 = getTime();
+	for(int it=0; it<iterations; it++)
+	  demosaicStereo(raw, nrows, ncols, tiles[t], methods[m], planar, packed);
+	double fused = (getTime() - t0) / 1000.0 / iterations;
+
+	int tolerance = methods[m]==DEMOSAIC_BILINEAR ? 1 : 0;
+	int wrong = 0;
+	for(int c=0; c<2; c++)
+	  for(int i=1; i<nrows-1; i++)
+	    for(int j=3; j<3*(ncols-1); j++)
+	      {
+		size_t k = 3 * (size_t)(c * n + i * ncols) + j;
+		int diff = packed[k] - expected[k];
+		if(diff<0 || diff>tolerance)
+		  wrong++;
+	      }
+	printf("  %-9s %s dc1394 %8.3f ms  fused %8.3f ms  %s\n",
+	       methodNames[m], tileNames[t], reference, fused, wrong==0 ? "ok" : "MISMATCH");
+	if(wrong)
+	  failed++;
+      }
+
+  delete[] raw;
+  delete[] deInterlaced;
+  delete[] expected;
+  delete[] planar;
+  delete[] packed;
+  return failed;
+}
+
+// disparity image to depth image, by division and by table lookup
+static int benchDepthTable(int iterations)
+{
+  int failed = 0;
+
+  printf("disparity to depth\n");
+  for(int s=0; s<numBenchSizes; s++)
+    {
+      int nrows = benchSizes[s][0];
+      int ncols = benchSizes[s][1];
+      int n = nrows * ncols;
+
+      StereoGeometry geometry;
+      geometry.focalLength = 0.8f * ncols;
+      geometry.centerRow = nrows / 2.0f;
+      geometry.centerCol = ncols / 2.0f;
+      geometry.baseline = 0.12f;
+      geometry.disparityScale = 1.0f / 256.0f;
+
+      unsigned short* disp = new unsigned short[n];
+      for(int k=0; k<n; k++)
+	disp[k] = rand() % 20==0 ? 0xFFF0 : rand() % (240*256);
+      ImageView view;
+      makeImageView(&view, (const unsigned char*)disp, ncols, nrows, ncols*sizeof(unsigned short),
+		    IMAGE_MONO16, 1, 0);
+
+      float* expected = new float[n];
+      float* depth = new float[n];
+      float* table = new float[DEPTH_TABLE_SIZE];
+
+      float fbd = geometry.focalLength * geometry.baseline / geometry.disparityScale;
+      uint64_t t0 = getTime();
+      for(int it=0; it<iterations; it++)
+	for(int k=0; k<n; k++)
+	  expected[k] = (disp[k]==0 || disp[k]>=DISPARITY_INVALID_MIN) ? NAN : fbd / disp[k];
+      double divide = (getTime() - t0) / 1000.0 / iterations;
+
+      t0 = getTime();
+      buildDepthTable(&geometry, table);
+      double build = (getTime() - t0) / 1000.0;
+
+      t0 = getTime();
+      for(int it=0; it<iterations; it++)
+	disparityToDepth(table, &view, depth, ncols*sizeof(float));
+      double lookup = (getTime() - t0) / 1000.0 / iterations;
+
+      bool ok = (memcmp(depth, expected, n*sizeof(float))==0);
+      printf("  %4dx%-4d divide %8.3f ms  lookup %8.3f ms  (table built in %.3f ms)  %s\n",
+	     ncols, nrows, divide, lookup, build, ok ? "ok" : "MISMATCH");
+      if(!ok)
+	failed++;
+
+      delete[] disp;
+      delete[] expected;
+      delete[] depth;
+      delete[] table;
+    }
+  return failed;
+}
+
+// block matching on a synthetic pair with a known disparity
+static int benchBlockStereo(int iterations)
+{
+  const int trueDisparity = 17;
+  int failed = 0;
+
+  printf("block matching stereo (true disparity %d)\n", trueDisparity);
+  for(int s=0; s<numBenchSizes; s++)
+    {
+      int nrows = benchSizes[s][0];
+      int ncols = benchSizes[s][1];
+      int n = nrows * ncols;
+
+      // textured right image, the left one shifted by trueDisparity
+      uint8_t* right = new uint8_t[n];
+      uint8_t* left = new uint8_t[n];
+      for(int i=0; i<nrows; i++)
+	for(int j=0; j<ncols; j++)
+	  right[i*ncols + j] = (uint8_t)(128 + 60*sin(j*0.37 + i*0.11) + 40*sin(i*0.7 + j*i*0.0013) + rand()%20);
+      for(int i=0; i<nrows; i++)
+	for(int j=0; j<ncols; j++)
+	  left[i*ncols + j] = j>=trueDisparity ? right[i*ncols + j - trueDisparity] : 0;
+      ImageView rightView, leftView;
+      makeImageView(&rightView, right, ncols, nrows, ncols, IMAGE_MONO8, 1, 0);
+      makeImageView(&leftView, left, ncols, nrows, ncols, IMAGE_MONO8, 1, 0);
+      unsigned short* disparity = new unsigned short[n];
+
+      const char* names[] = { "sad", "edge sad", "census" };
+      for(int m=0; m<3; m++)
+	for(int threads=1; threads<=4; threads*=2)
+	  {
+	    BlockStereoParams params;
+	    getDefaultBlockStereoParams(&params);
+	    params.edgeCorrelation = (m==1);
+	    params.census = (m==2);
+	    params.nThreads = threads;
+	    BlockStereo stereo(&params);
+
+	    uint64_t t0 = getTime();
+	    for(int it=0; it<iterations; it++)
+	      stereo.compute(&rightView, &leftView, disparity, ncols*sizeof(unsigned short));
+	    double elapsed = (getTime() - t0) / 1000.0 / iterations;
+
+	    // pixels far enough from the borders to have a match
+	    int h = params.maskSize / 2;
+	    int matched = 0, correct = 0;
+	    for(int i=h; i<nrows-h; i++)
+	      for(int j=h; j<ncols-h-trueDisparity; j++)
+		{
+		  unsigned short d = disparity[i*ncols + j];
+		  if(d>=DISPARITY_INVALID_MIN)
+		    continue;
+		  matched++;
+		  if(abs(d - trueDisparity*256)<64)
+		    correct++;
+		}
+	    bool ok = (matched>0 && correct>0.99*matched);
+	    printf("  %4dx%-4d %-10s %d threads %8.3f ms  %5.1f%% valid  %5.1f%% correct  %s\n",
+		   ncols, nrows, names[m], threads, elapsed,
+		   100.0*matched/((nrows-2*h)*(ncols-2*h-trueDisparity)),
+		   matched>0 ? 100.0*correct/matched : 0.0, ok ? "ok" : "WRONG");
+	    if(!ok)
+	      failed++;
+	  }
+
+      delete[] right;
+      delete[] left;
+      delete[] disparity;
+    }
+  return failed;
+}
+
+// a calibration with a slightly distorting cubic inverse warp per camera
+static void makeBenchCalibration(Calibration* cal)
+{
+  memset(cal, 0, sizeof(Calibration));
+  cal->numCameras = 2;
+  cal->numWarps = 4;
+  for(int c=0; c<2; c++)
+    {
+      cal->cameras[c].id = c;
+      strcpy(cal->cameras[c].channel, c ? "green" : "red");
+      cal->cameras[c].iwarp[0] = 2*c;
+      cal->cameras[c].iwarp[1] = 2*c + 1;
+    }
+  for(int w=0; w<4; w++)
+    {
+      CalibrationWarp* warp = &cal->warps[w];
+      warp->id = w;
+      warp->numKnots = 8;
+      warp->numCoefsX = warp->numCoefsY = 4;
+      for(int k=0; k<8; k++)
+	warp->knotsX[k] = warp->knotsY[k] = k<4 ? 0 : 1;
+      for(int a=0; a<4; a++)
+	for(int b=0; b<4; b++)
+	  warp->coefs[a*4 + b] = (w%2 ? b : a) / 3.0f + 0.02f * sin(a + 2*b + w);
+    }
+}
+
+// rectification of both color images of a frame, by the plain and SSE2
+// remap kernels
+static int benchRemap(int iterations)
+{
+  int failed = 0;
+  Calibration* cal = new Calibration;
+  makeBenchCalibration(cal);
+
+  printf("remap rectification (6 planes)\n");
+  for(int s=0; s<numBenchSizes; s++)
+    {
+      // rectified images at the bench size from a full resolution frame
+      int srcRows = benchSizes[numBenchSizes-1][0];
+      int srcCols = benchSizes[numBenchSizes-1][1];
+      int nrows = benchSizes[s][0];
+      int ncols = benchSizes[s][1];
+      int nSrc = srcRows * srcCols;
+      int n = nrows * ncols;
+
+      RemapTable tables[2];
+      uint64_t t0 = getTime();
+      for(int c=0; c<2; c++)
+	{
+	  initRemapTable(&tables[c]);
+	  buildRemapTable(cal, c, srcRows, srcCols, srcCols, nrows, ncols, &tables[c]);
+	}
+      double build = (getTime() - t0) / 1000.0;
+
+      uint8_t* src = new uint8_t[6 * nSrc];
+      for(int k=0; k<6*nSrc; k++)
+	src[k] = rand();
+      uint8_t* expected = new uint8_t[6 * n];
+      uint8_t* dst = new uint8_t[6 * n];
+
+      const ConvertKernel kernels[] = { KERNEL_SCALAR, KERNEL_SSSE3 };
+      const char* names[] = { "scalar", "sse2" };
+      for(int k=0; k<2; k++)
+	{
+	  RemapImage images[2];
+	  for(int c=0; c<2; c++)
+	    {
+	      images[c].table = &tables[c];
+	      images[c].nPlanes = 3;
+	      images[c].dstRowinc = ncols;
+	      for(int p=0; p<3; p++)
+		{
+		  images[c].src[p] = src + (2*p + c) * nSrc;
+		  images[c].dst[p] = (k ? dst : expected) + (3*c + p) * n;
+		}
+	    }
+
+	  t0 = getTime();
+	  for(int it=0; it<iterations; it++)
+	    remapImages(images, 2, kernels[k]);
+	  double elapsed = (getTime() - t0) / 1000.0 / iterations;
+
+	  bool ok = (k==0 || memcmp(dst, expected, 6*n)==0);
+	  printf("  %4dx%-4d %-6s %8.3f ms  (tables built in %.1f ms)  %s\n",
+		 ncols, nrows, names[k], elapsed, build, ok ? "ok" : "MISMATCH");
+	  if(!ok)
+	    failed++;
+	}
+
+      // a band of a third of the rows, as with a region of interest
+      RemapTable band[2];
+      RemapImage images[2];
+      for(int c=0; c<2; c++)
+	{
+	  selectRemapRows(&tables[c], nrows/3, nrows/3, &band[c]);
+	  images[c].table = &band[c];
+	  images[c].nPlanes = 3;
+	  images[c].dstRowinc = ncols;
+	  for(int p=0; p<3; p++)
+	    {
+	      images[c].src[p] = src + (2*p + c) * nSrc;
+	      images[c].dst[p] = dst + (3*c + p) * n + nrows/3 * ncols;
+	    }
+	}
+      memset(dst, 0, 6*n);
+      t0 = getTime();
+      for(int it=0; it<iterations; it++)
+	remapImages(images, 2);
+      double elapsed = (getTime() - t0) / 1000.0 / iterations;
+      bool ok = true;
+      for(int p=0; p<6; p++)
+	if(memcmp(dst + p*n + nrows/3 * ncols, expected + p*n + nrows/3 * ncols, nrows/3 * ncols)!=0)
+	  ok = false;
+      printf("  %4dx%-4d %-6s %8.3f ms  (rows %d..%d)  %s\n",
+	     ncols, nrows, "band", elapsed, nrows/3, 2*nrows/3 - 1, ok ? "ok" : "MISMATCH");
+      if(!ok)
+	failed++;
+
+      freeRemapTable(&tables[0]);
+      freeRemapTable(&tables[1]);
+      delete[] src;
+      delete[] expected;
+      delete[] dst;
+    }
+
+  delete cal;
+  return failed;
+}
+
+// 1/2, 1/4 and 1/8 of a full resolution image in one pass
+static int benchPyramid(int iterations)
+{
+  int failed = 0;
+  int nrows = benchSizes[numBenchSizes-1][0];
+  int ncols = benchSizes[numBenchSizes-1][1];
+  int nLevels = 4;
+  uint8_t* src = new uint8_t[nrows * ncols];
+  for(int k=0; k<nrows*ncols; k++)
+    src[k] = rand();
+  uint8_t* expected = new uint8_t[nrows * ncols];
+  uint8_t* levels = new uint8_t[nrows * ncols];
+
+  printf("pyramid of a %dx%d image, %d levels\n", ncols, nrows, nLevels);
+  const ConvertKernel kernels[] = { KERNEL_SCALAR, KERNEL_SSSE3 };
+  const char* names[] = { "scalar", "sse2" };
+  for(int k=0; k<2; k++)
+    {
+      uint8_t* level[PYRAMID_MAX_LEVELS];
+      uint8_t* p = k ? levels : expected;
+      int n = 0;
+      for(int l=1; l<nLevels; l++)
+	{
+	  level[l-1] = p;
+	  p += (nrows >> l) * (ncols >> l);
+	  n += (nrows >> l) * (ncols >> l);
+	}
+
+      uint64_t t0 = getTime();
+      for(int it=0; it<iterations; it++)
+	buildPyramid(src, nrows, ncols, ncols, nLevels, level, kernels[k]);
+      double elapsed = (getTime() - t0) / 1000.0 / iterations;
+
+      bool ok = (k==0 || memcmp(levels, expected, n)==0);
+      printf("  %-6s %8.3f ms  %s\n", names[k], elapsed, ok ? "ok" : "MISMATCH");
+      if(!ok)
+	failed++;
+    }
+
+  delete[] src;
+  delete[] expected;
+  delete[] levels;
+  return failed;
+}
+
+// lossless compression of a full size color image for stereo logs, on
+// a smooth synthetic scene with sensor noise (random images do not
+// compress and are stored as they are)
+static int benchCodec(int iterations)
+{
+  int failed = 0;
+  int nrows = benchSizes[numBenchSizes-1][0];
+  int ncols = benchSizes[numBenchSizes-1][1];
+  int n = nrows * ncols * 3;
+  uint8_t* image = new uint8_t[n];
+  for(int i=0; i<nrows; i++)
+    for(int j=0; j<ncols; j++)
+      for(int c=0; c<3; c++)
+	{
+	  double v = 128 + 60 * sin(i * 0.02 + c) * cos(j * 0.013) + (i * j % 997) * 0.02;
+	  image[(i*ncols + j)*3 + c] = (uint8_t)(v + rand() % 4);
+	}
+  uint8_t* packed = new uint8_t[n];
+  uint8_t* decoded = new uint8_t[n];
+
+  CodecLayout layout;
+  getCodecLayout(nrows, ncols, 3, &layout);
+  size_t size = 0;
+  uint64_t t0 = getTime();
+  for(int it=0; it<iterations; it++)
+    size = encodeImage(image, &layout, packed, n);
+  double encode = (getTime() - t0) / 1000.0 / iterations;
+
+  t0 = getTime();
+  int ret = 0;
+  for(int it=0; it<iterations && ret==0; it++)
+    ret = decodeImage(packed, size, &layout, decoded);
+  double decode = (getTime() - t0) / 1000.0 / iterations;
+
+  bool ok = (size>0 && ret==0 && memcmp(image, decoded, n)==0);
+  printf("lossless codec %dx%d RGB image: %.2fx\n", ncols, nrows, size>0 ? (double)n / size : 0.0);
+  printf("  encode %8.3f ms (%6.1f MB/s)  decode %8.3f ms (%6.1f MB/s)  %s\n",
+	 encode, n / encode * 1e-3, decode, n / decode * 1e-3, ok ? "ok" : "MISMATCH");
+  if(!ok)
+    failed++;
+
+  delete[] image;
+  delete[] packed;
+  delete[] decoded;
+  return failed;
+}
+
+// synthetic reference images for the feature database: each feature is
+// one of a vocabulary of visual words, perturbed differently in every
+// image it occurs in
+#define BENCH_WORDS         4096
+#define BENCH_IMAGE_FEATURES 300
+
+static void makeBenchImage(const float* words, unsigned int seed, float* descr)
+{
+  for(int i=0; i<BENCH_IMAGE_FEATURES; i++)
+    {
+      const float* w = words + (size_t)(rand_r(&seed) % BENCH_WORDS) * FEATURE_DB_DIMS;
+      for(int d=0; d<FEATURE_DB_DIMS; d++)
+	descr[i*FEATURE_DB_DIMS + d] = (float)(int)(w[d] + rand_r(&seed) % 24);
+    }
+}
+
+// SIFT features of a rectified image (blobs and edges on a smooth
+// background) on more and more threads; every thread count must give
+// the features of one thread
+static int benchSiftExtractor(int iterations)
+{
+  int failed = 0;
+  int nrows = benchSizes[0][0];
+  int ncols = benchSizes[0][1];
+  uint8_t* image = new uint8_t[nrows * ncols];
+  for(int i=0; i<nrows; i++)
+    for(int j=0; j<ncols; j++)
+      {
+	double v = 100 + 40 * sin(i * 0.05) * cos(j * 0.04) + 60 * (sin(i * 0.31 + j * 0.17) > 0.6);
+	image[i*ncols + j] = (uint8_t)(v + rand() % 8);
+      }
+  int frames = iterations < 10 ? iterations : 10;
+
+  struct feature* expected = NULL;
+  int numExpected = 0;
+  long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nCpus>SIFT_MAX_THREADS)
+    nCpus = SIFT_MAX_THREADS;
+  printf("SIFT features of a %dx%d image\n", ncols, nrows);
+  double single = 0;
+  for(int t=1; ; t*=2)
+    {
+      if(t>nCpus)
+	t = nCpus>1 ? nCpus : 1;
+      SiftExtractor extractor;
+      if(extractor.init(t)<0)
+	{
+	  failed++;
+	  break;
+	}
+
+      // the first frame allocates the pyramid
+      struct feature* features = NULL;
+      int n = extractor.extract(image, ncols, nrows, ncols, &features);
+      uint64_t t0 = getTime();
+      for(int f=0; f<frames; f++)
+	{
+	  free(features);
+	  n = extractor.extract(image, ncols, nrows, ncols, &features);
+	}
+      double elapsed = (getTime() - t0) / 1000.0 / frames;
+      if(t==1)
+	{
+	  single = elapsed;
+	  expected = features;
+	  numExpected = n;
+	}
+
+      bool ok = (n>0 && n==numExpected && memcmp(features, expected, n * sizeof(struct feature))==0);
+      printf("  %2d threads %8.3f ms (%5.2fx)  %d features  %s\n", t, elapsed, single / elapsed, n,
+	     ok ? "ok" : "MISMATCH");
+      if(!ok)
+	failed++;
+      if(features!=expected)
+	free(features);
+      if(t>=nCpus)
+	break;
+    }
+
+  free(expected);
+  delete[] image;
+  return failed;
+}
+
+// how close the features of SiftExtractor must be to those of
+// sift_features(): their count (relative), and the position [pixels],
+// scale (relative), orientation [rad] and descriptor (distance relative
+// to the length of the libfeat one) of a feature; at least
+// SIFT_MATCH_FRACTION of the libfeat features must have one that close
+#define SIFT_COUNT_TOLERANCE    0.05
+#define SIFT_POSITION_TOLERANCE 0.5
+#define SIFT_SCALE_TOLERANCE    0.02
+#define SIFT_ORI_TOLERANCE      0.05
+#define SIFT_DESCR_TOLERANCE    0.1
+#define SIFT_MATCH_FRACTION     0.95
+
+// the feature of features[0..n) closest to ref in orientation of those
+// at its position and scale, -1 if there is none
+static int findSiftFeature(const struct feature* ref, const struct feature* features, int n,
+			   double* oriError)
+{
+  int best = -1;
+  for(int k=0; k<n; k++)
+    {
+      const struct feature* f = &features[k];
+      if(fabs(f->x - ref->x)>SIFT_POSITION_TOLERANCE || fabs(f->y - ref->y)>SIFT_POSITION_TOLERANCE ||
+	 fabs(f->scl - ref->scl)>SIFT_SCALE_TOLERANCE * ref->scl)
+	continue;
+      double d = fabs(f->ori - ref->ori);
+      if(d>M_PI)
+	d = 2*M_PI - d;
+      if(best<0 || d<*oriError)
+	{
+	  best = k;
+	  *oriError = d;
+	}
+    }
+  return best;
+}
+
+// SIFT features of a real image on all cores against sift_features()
+static int benchSiftReference(const char* fname)
+{
+  IplImage* img = cvLoadImage(fname, CV_LOAD_IMAGE_GRAYSCALE);
+  if(img==NULL)
+    {
+      fprintf(stderr, "Cannot load %s for the SIFT check\n", fname);
+      return 1;
+    }
+  printf("SIFT features of %s (%dx%d) against sift_features()\n", fname, img->width, img->height);
+
+  struct feature* expected = NULL;
+  uint64_t t0 = getTime();
+  int numExpected = sift_features(img, &expected);
+  double libfeatTime = (getTime() - t0) / 1000.0;
+
+  long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nCpus<1)
+    nCpus = 1;
+  if(nCpus>SIFT_MAX_THREADS)
+    nCpus = SIFT_MAX_THREADS;
+  SiftExtractor extractor;
+  struct feature* features = NULL;
+  int n = -1;
+  double extractTime = 0;
+  if(extractor.init(nCpus)==0)
+    {
+      t0 = getTime();
+      n = extractor.extract(img, &features);
+      extractTime = (getTime() - t0) / 1000.0;
+    }
+
+  // every libfeat feature should have one of ours at its place
+  int matched = 0;
+  double maxOriError = 0, maxDescrError = 0;
+  for(int i=0; i<numExpected && n>0; i++)
+    {
+      double oriError = 0;
+      int k = findSiftFeature(&expected[i], features, n, &oriError);
+      if(k<0 || oriError>SIFT_ORI_TOLERANCE)
+	continue;
+      double distSq = 0, lengthSq = 0;
+      for(int d=0; d<expected[i].d; d++)
+	{
+	  double e = features[k].descr[d] - expected[i].descr[d];
+	  distSq += e*e;
+	  lengthSq += expected[i].descr[d] * expected[i].descr[d];
+	}
+      double descrError = lengthSq>0 ? sqrt(distSq / lengthSq) : sqrt(distSq);
+      if(features[k].d!=expected[i].d || descrError>SIFT_DESCR_TOLERANCE)
+	continue;
+      matched++;
+      if(oriError>maxOriError)
+	maxOriError = oriError;
+      if(descrError>maxDescrError)
+	maxDescrError = descrError;
+    }
+
+  bool ok = numExpected>0 && n>=0 &&
+    fabs((double)(n - numExpected)) <= SIFT_COUNT_TOLERANCE * numExpected &&
+    matched >= SIFT_MATCH_FRACTION * numExpected;
+  printf("  sift_features() %8.3f ms  %d features\n", libfeatTime, numExpected);
+  printf("  %2ld threads      %8.3f ms  %d features, %d of libfeat matched (orientation %.3f, descriptor %.3f at most)  %s\n",
+	 nCpus, extractTime, n, matched, maxOriError, maxDescrError, ok ? "ok" : "MISMATCH");
+
+  free(features);
+  free(expected);
+  cvReleaseImage(&img);
+  return ok ? 0 : 1;
+}
+
+// squared distances of a query to a vocabulary of descriptors, as
+// doubles (descr_dist_sq() on struct feature), floats (version 2
+// databases) and bytes with each kernel, and sums of absolute differences
+static int benchDescriptorDistance(int iterations)
+{
+  int failed = 0;
+  int n = BENCH_WORDS;
+  double* doubles = new double[(size_t)n * FEATURE_DB_DIMS];
+  float* floats = new float[(size_t)n * FEATURE_DB_DIMS];
+  uint8_t* bytes = new uint8_t[(size_t)n * DESCRIPTOR_BYTES];
+  for(int k=0; k<n * FEATURE_DB_DIMS; k++)
+    floats[k] = doubles[k] = rand() % 256;
+  quantizeDescriptors(floats, n, bytes);
+  uint32_t* expected = new uint32_t[n];
+  uint32_t* dist = new uint32_t[n];
+
+  printf("distances of a descriptor to %d others\n", n);
+  for(int m=0; m<2; m++)
+    {
+      const char* metric = m ? "sad" : "l2";
+
+      // the plain loops on doubles and floats, as before
+      if(m==0)
+	{
+	  uint64_t t0 = getTime();
+	  for(int it=0; it<iterations; it++)
+	    for(int i=0; i<n; i++)
+	      {
+		const double* a = doubles + (size_t)(it % n) * FEATURE_DB_DIMS;
+		const double* b = doubles + (size_t)i * FEATURE_DB_DIMS;
+		double sum = 0;
+		for(int d=0; d<FEATURE_DB_DIMS; d++)
+		  sum += (a[d] - b[d]) * (a[d] - b[d]);
+		expected[i] = (uint32_t)sum;
+	      }
+	  double elapsed = (getTime() - t0) / 1000.0 / iterations;
+	  printf("  %-3s double %4d B %8.3f ms\n", metric, (int)(FEATURE_DB_DIMS * sizeof(double)), elapsed);
+
+	  t0 = getTime();
+	  for(int it=0; it<iterations; it++)
+	    for(int i=0; i<n; i++)
+	      {
+		const float* a = floats + (size_t)(it % n) * FEATURE_DB_DIMS;
+		const float* b = floats + (size_t)i * FEATURE_DB_DIMS;
+		float sum = 0;
+		for(int d=0; d<FEATURE_DB_DIMS; d++)
+		  sum += (a[d] - b[d]) * (a[d] - b[d]);
+		dist[i] = (uint32_t)sum;
+	      }
+	  elapsed = (getTime() - t0) / 1000.0 / iterations;
+	  bool ok = memcmp(dist, expected, n * sizeof(uint32_t))==0;
+	  printf("  %-3s float  %4d B %8.3f ms  %s\n", metric, (int)(FEATURE_DB_DIMS * sizeof(float)),
+		 elapsed, ok ? "ok" : "MISMATCH");
+	  if(!ok)
+	    failed++;
+	}
+
+      const ConvertKernel kernels[] = { KERNEL_SCALAR, KERNEL_SSSE3, KERNEL_AVX2 };
+      const char* names[] = { "scalar", "sse2", "avx2" };
+      for(int k=0; k<3; k++)
+	{
+	  DescriptorDistance f = m ? getDescriptorSAD(kernels[k]) : getDescriptorDistSq(kernels[k]);
+	  if(f==NULL)
+	    {
+	      printf("  %-3s %-6s not supported\n", metric, names[k]);
+	      continue;
+	    }
+	  uint64_t t0 = getTime();
+	  for(int it=0; it<iterations; it++)
+	    {
+	      const uint8_t* a = bytes + (size_t)(it % n) * DESCRIPTOR_BYTES;
+	      for(int i=0; i<n; i++)
+		dist[i] = f(a, bytes + (size_t)i * DESCRIPTOR_BYTES);
+	    }
+	  double elapsed = (getTime() - t0) / 1000.0 / iterations;
+
+	  // the scalar sums are the reference for the others
+	  if(m==1 && k==0)
+	    memcpy(expected, dist, n * sizeof(uint32_t));
+	  bool ok = memcmp(dist, expected, n * sizeof(uint32_t))==0;
+	  printf("  %-3s %-6s %4d B %8.3f ms  %s\n", metric, names[k], DESCRIPTOR_BYTES, elapsed,
+		 ok ? "ok" : "MISMATCH");
+	  if(!ok)
+	    failed++;
+	}
+    }
+
+  delete[] doubles;
+  delete[] floats;
+  delete[] bytes;
+  delete[] expected;
+  delete[] dist;
+  return failed;
+}
+
+// place recognition against databases of more and more reference images:
+// a frame is the features of one of them with a little noise, and must
+// get the most votes for it
+static int benchFeatureDB(int iterations)
+{
+  int failed = 0;
+  const int numImages[] = { 50, 200, 800 };
+  const int numTrees[] = { 1, 4 };
+  const char* fname = "/tmp/kernel_benchmark.fdb";
+  int frames = iterations < 20 ? iterations : 20;
+
+  float* words = new float[BENCH_WORDS * FEATURE_DB_DIMS];
+  for(int k=0; k<BENCH_WORDS * FEATURE_DB_DIMS; k++)
+    words[k] = rand() % 232;
+  float* descr = new float[BENCH_IMAGE_FEATURES * FEATURE_DB_DIMS];
+  FeatureKeypoint* keypoints = new FeatureKeypoint[BENCH_IMAGE_FEATURES];
+  memset(keypoints, 0, BENCH_IMAGE_FEATURES * sizeof(FeatureKeypoint));
+
+  printf("feature database, %d features per image, %d checks per feature\n",
+	 BENCH_IMAGE_FEATURES, 210);
+  for(int s=0; s<3; s++)
+    for(int t=0; t<2; t++)
+      {
+	FeatureDBBuilder builder;
+	for(int m=0; m<numImages[s]; m++)
+	  {
+	    makeBenchImage(words, m, descr);
+	    builder.addImage(NULL, keypoints, descr, BENCH_IMAGE_FEATURES, 640, 480);
+	  }
+	uint64_t t0 = getTime();
+	FeatureDB db;
+	if(builder.write(fname, numTrees[t])<0 || db.open(fname)<0)
+	  {
+	    failed++;
+	    continue;
+	  }
+	double build = (getTime() - t0) * 1e-6;
+
+	FeatureSearch search;
+	FeatureDBVote votes[1];
+	int correct = 0;
+	uint64_t elapsed = 0;
+	for(int f=0; f<frames; f++)
+	  {
+	    int image = rand() % numImages[s];
+	    makeBenchImage(words, image, descr);
+	    for(int k=0; k<BENCH_IMAGE_FEATURES * FEATURE_DB_DIMS; k++)
+	      descr[k] += rand() % 4;
+
+	    t0 = getTime();
+	    int n = db.matchImages(descr, BENCH_IMAGE_FEATURES, 210, 0.64f, votes, 1, &search);
+	    elapsed += getTime() - t0;
+	    if(n>0 && votes[0].image==image)
+	      correct++;
+	  }
+	double perFrame = elapsed / 1000.0 / frames;
+
+	bool ok = (correct==frames);
+	printf("  %4d images (%6d features) %d trees: build %6.2f s  query %8.3f ms/frame (%5.1f us/feature)  %s\n",
+	       numImages[s], db.getFeatureCount(), numTrees[t], build, perFrame,
+	       perFrame * 1000 / BENCH_IMAGE_FEATURES, ok ? "ok" : "WRONG IMAGE");
+	if(!ok)
+	  failed++;
+      }
+  unlink(fname);
+
+  delete[] words;
+  delete[] descr;
+  delete[] keypoints;
+  return failed;
+}
+
+// the features of a large frame matched against a database of 200
+// reference images, one at a time and in batches on more and more
+// threads; every batch must find the same neighbours
+static int benchFeatureMatcher(int iterations)
+{
+  int failed = 0;
+  const int numImages = 200;
+  const int numQueries = 2000;
+  const char* fname = "/tmp/kernel_benchmark.fdb";
+  int frames = iterations < 20 ? iterations : 20;
+
+  float* words = new float[BENCH_WORDS * FEATURE_DB_DIMS];
+  for(int k=0; k<BENCH_WORDS * FEATURE_DB_DIMS; k++)
+    words[k] = rand() % 232;
+  float* descr = new float[numQueries * FEATURE_DB_DIMS];
+  FeatureKeypoint* keypoints = new FeatureKeypoint[BENCH_IMAGE_FEATURES];
+  memset(keypoints, 0, BENCH_IMAGE_FEATURES * sizeof(FeatureKeypoint));
+
+  FeatureDBBuilder builder;
+  for(int m=0; m<numImages; m++)
+    {
+      makeBenchImage(words, m, descr);
+      builder.addImage(NULL, keypoints, descr, BENCH_IMAGE_FEATURES, 640, 480);
+    }
+  FeatureDB db;
+  if(builder.write(fname, 1)<0 || db.open(fname)<0)
+    {
+      delete[] words;
+      delete[] descr;
+      delete[] keypoints;
+      return 1;
+    }
+  unlink(fname);
+
+  // a frame of features of the reference images
+  for(int q=0; q<numQueries; q+=BENCH_IMAGE_FEATURES)
+    {
+      float image[BENCH_IMAGE_FEATURES * FEATURE_DB_DIMS];
+      makeBenchImage(words, rand() % numImages, image);
+      int n = numQueries - q < BENCH_IMAGE_FEATURES ? numQueries - q : BENCH_IMAGE_FEATURES;
+      for(int k=0; k<n * FEATURE_DB_DIMS; k++)
+	descr[q * FEATURE_DB_DIMS + k] = image[k] + rand() % 4;
+    }
+
+  printf("batched matching of %d features against %d, %d checks per feature\n",
+	 numQueries, db.getFeatureCount(), 210);
+  FeatureMatch* expected = new FeatureMatch[numQueries];
+  FeatureMatch* matches = new FeatureMatch[numQueries];
+  FeatureSearch search;
+  FeatureNeighbor nbrs[2];
+  uint64_t t0 = getTime();
+  for(int f=0; f<frames; f++)
+    for(int q=0; q<numQueries; q++)
+      {
+	int found = db.findNearest(descr + q * FEATURE_DB_DIMS, 2, 210, nbrs, &search);
+	expected[q].index = found>0 ? nbrs[0].index : -1;
+	expected[q].second = found>1 ? nbrs[1].index : -1;
+      }
+  double serial = (getTime() - t0) / 1000.0 / frames;
+  printf("  one at a time %8.3f ms\n", serial);
+
+  long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nCpus>MATCHER_MAX_THREADS)
+    nCpus = MATCHER_MAX_THREADS;
+  for(int t=1; ; t*=2)
+    {
+      if(t>nCpus)
+	t = nCpus>1 ? nCpus : 1;
+      FeatureMatcher matcher;
+      if(matcher.init(&db, t)<0)
+	{
+	  failed++;
+	  break;
+	}
+      t0 = getTime();
+      for(int f=0; f<frames; f++)
+	matcher.match(descr, numQueries, 210, matches);
+      double elapsed = (getTime() - t0) / 1000.0 / frames;
+
+      bool ok = true;
+      for(int q=0; q<numQueries; q++)
+	if(matches[q].query!=q || matches[q].index!=expected[q].index || matches[q].second!=expected[q].second)
+	  ok = false;
+      printf("  %2d threads    %8.3f ms (%5.2fx)  %s\n", t, elapsed, serial / elapsed, ok ? "ok" : "MISMATCH");
+      if(!ok)
+	failed++;
+      if(t>=nCpus)
+	break;
+    }
+
+  delete[] expected;
+  delete[] matches;
+  delete[] words;
+  delete[] descr;
+  delete[] keypoints;
+  return failed;
+}
+
+int main(int argc, char** argv)
+{
+  int iterations = 100;
+  if(argc>1)
+    iterations = atoi(argv[1]);
+  if(iterations<1)
+    iterations = 1;
+  const char* reference = argc>2 ? argv[2] : "reference.png";
+
+  int failed = 0;
+  failed += benchPackRGB(iterations);
+  failed += benchDemosaic(iterations);
+  failed += benchGreen(iterations);
+  failed += benchDemosaicDc1394(iterations);
+  failed += benchPointCloud(iterations);
+  failed += benchDepthTable(iterations);
+  failed += benchBlockStereo(iterations);
+  failed += benchRemap(iterations);
+  failed += benchPyramid(iterations);
+  failed += benchCodec(iterations);
+  failed += benchSiftExtractor(iterations);
+  failed += benchSiftReference(reference);
+  failed += benchDescriptorDistance(iterations);
+  failed += benchFeatureDB(iterations);
+  failed += benchFeatureMatcher(iterations);
+
+  if(failed)
+    {
+      fprintf(stderr, "%d kernels gave wrong results\n", failed);
+      return -1;
+    }
+  return 0;
+}
@@ -1,14 +1,21 @@
 /*
  * This program loads a reference image and test image and 
- * performs SIFT feature extraction on both. Features are
+ * performs SIFT feature extraction on both (on all cores, see
+ * SiftExtractor.h). Features are
  * matched between to the two images and drawn using
  * OpenCV's draw commands.
+ *
+ * The features of the reference image come from its feature database
+ * (see FeatureDB.h), which is built by sift_db; if there is none yet, or
+ * it was built from another reference image, it is built here and
+ * reused on the next runs.
  */
 
 // include some standard header files
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
 
 // now include the opencv header files
 #include <opencv/cv.h>
@@ -21,32 +28,65 @@
 #include <sift/kdtree.h>
 #include <sift/xform.h>
 
+#include "FeatureDB.h"
+#include "FeatureMatcher.h"
+#include "SiftExtractor.h"
+
 /* the maximum number of keypoint NN candidates to check during BBF search */
 #define KDTREE_BBF_MAX_NN_CHKS     210
 #define NN_SQ_DIST_RATIO_THR       0.30
 
+// the reference image and its feature database
+#define REFERENCE_IMAGE "reference.png"
+#define REFERENCE_DB    "reference.fdb"
+
 // this is the beginning of the "main" program
 int main(int argc, char** argv)
 {
   // let's load the reference image into an opencv image container
-  IplImage *reference_img = cvLoadImage("reference.png", CV_LOAD_IMAGE_GRAYSCALE);
+  IplImage *reference_img = cvLoadImage(REFERENCE_IMAGE, CV_LOAD_IMAGE_GRAYSCALE);
   IplImage *test_img = cvLoadImage("test.png", CV_LOAD_IMAGE_GRAYSCALE);
 
-  // extract features from the reference image and call these "database features"
-  struct feature* database_features = NULL;
-  fprintf(stderr, "extracting features from the reference image ... \n");
-  int num_database_features = sift_features(reference_img, &database_features);
+  // extract and match on all cores
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_threads<1)
+    num_threads = 1;
+  if(num_threads>MATCHER_MAX_THREADS)
+    num_threads = MATCHER_MAX_THREADS;
+  SiftExtractor extractor;
+  if(extractor.init(num_threads)<0)
+    return -1;
+
+  // the features of the reference image are the "database features"; extract
+  // them and save them with their kd-tree only if there is no database of
+  // this reference image yet (the database keeps a hash of the image file)
+  uint32_t reference_hash = hashFeatureSource(REFERENCE_IMAGE);
+  if(!FeatureDB::isDB(REFERENCE_DB, reference_hash))
+  {
+    struct feature* reference_features = NULL;
+    fprintf(stderr, "extracting features from the reference image ... \n");
+    int num_reference_features = extractor.extract(reference_img, &reference_features);
+    if(num_reference_features<0)
+      return -1;
+    int ret = writeFeatureDB(REFERENCE_DB, reference_features, num_reference_features,
+                             reference_img->width, reference_img->height, reference_hash);
+    free(reference_features);
+    if(ret<0)
+      return -1;
+  }
+
+  // map the database; its kd-tree is ready to search
+  FeatureDB database;
+  if(database.open(REFERENCE_DB)<0)
+    return -1;
+  int num_database_features = database.getFeatureCount();
 
   // extract features from the test image and call these "current features"
   struct feature* current_features = NULL;
   fprintf(stderr, "extracting features from the test image ... \n");
-  int num_current_features = sift_features(test_img, &current_features);
-
-  // now build a kd-tree to hold the database features
-  struct kd_node* kd_tree = NULL;
-  kd_tree = kdtree_build(database_features, num_database_features);
-
-
+  int num_current_features = extractor.extract(test_img, &current_features);
+  if(num_current_features<0)
+    return -1;
 
   
   // create a display image that will be tiled with the reference image
@@ -84,7 +124,7 @@ int main(int argc, char** argv)
   for(i=0; i<num_database_features; i++)
   {
     cvCircle( display,
-              cvPoint((int)database_features[i].img_pt.x, (int)database_features[i].img_pt.y),  // feature point
+              cvPoint((int)database.getKeypoint(i)->x, (int)database.getKeypoint(i)->y),  // feature point
               1,           // radius of the circle
               CV_RGB(255,0,0),  // red circle
               2,                // thickness of circle 
@@ -107,44 +147,33 @@ int main(int argc, char** argv)
               );
   }
 
-  // find the matches
-  struct feature curr_feat;
-  struct feature database_feat;
-  struct feature** nbrs;
-  double d0, d1;
-  int k;
-  for(i=0; i<num_current_features; i++)
+  // find the matches of all current features at once, on all cores
+  FeatureMatcher matcher;
+  if(matcher.init(&database, num_threads)<0)
+    return -1;
+  FeatureMatch* matches = new FeatureMatch[num_current_features];
+  matcher.match(current_features, num_current_features, KDTREE_BBF_MAX_NN_CHKS, matches);
+
+  // keep the ones whose nearest database feature is much closer than the second
+  int num_matches = filterMatches(matches, num_current_features, NN_SQ_DIST_RATIO_THR);
+  for(i=0; i<num_matches; i++)
   {
-    curr_feat = current_features[i];
-    k = kdtree_bbf_knn(  kd_tree,       // kd tree
-                         &curr_feat,     // feature to match
-                         2,             // number of interest neighbors to find
-                         &nbrs,         // nearest neighbor features
-                         KDTREE_BBF_MAX_NN_CHKS
-                         );
-
-    if( k == 2 )
-    {
-      d0 = descr_dist_sq( &curr_feat, nbrs[0] );
-      d1 = descr_dist_sq( &curr_feat, nbrs[1] );
-      if( d0 < d1 * NN_SQ_DIST_RATIO_THR )
-      {
-        // this database feature matches the current feature
-        // curr_feat <==> database_feat
-        database_feat = *nbrs[0];
-
-        // draw the match as a line
-        cvLine( display,
-                cvPoint((int)database_feat.img_pt.x, (int)database_feat.img_pt.y), // database point from ref img
-                cvPoint((int)curr_feat.img_pt.x + reference_img->width, (int)curr_feat.img_pt.y + reference_img->height), // current point from test img
-                CV_RGB(0,255,0),
-                1,   // thickness
-                8,   // line type
-                0    // shift
-                );
-      }      
-    }
+    // this database feature matches the current feature
+    // curr_feat <==> database_feat
+    const struct feature* curr_feat = &current_features[matches[i].query];
+    const FeatureKeypoint* database_feat = database.getKeypoint(matches[i].index);
+
+    // draw the match as a line
+    cvLine( display,
+            cvPoint((int)database_feat->x, (int)database_feat->y), // database point from ref img
+            cvPoint((int)curr_feat->img_pt.x + reference_img->width, (int)curr_feat->img_pt.y + reference_img->height), // current point from test img
+            CV_RGB(0,255,0),
+            1,   // thickness
+            8,   // line type
+            0    // shift
+            );
   }
+  delete[] matches;
 
   
   // now let's enter a while loop to continually show the image but exit
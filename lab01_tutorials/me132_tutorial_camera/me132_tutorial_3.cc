@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
 
 // now include the opencv header files
 #include <opencv/cv.h>
@@ -24,6 +25,8 @@
 #include <sift/kdtree.h>
 #include <sift/xform.h>
 
+#include "SiftExtractor.h"
+
 // this is the beginning of the "main" program
 int main(int argc, char** argv)
 {
@@ -50,6 +53,10 @@ int main(int argc, char** argv)
   // initialization fails 
   if(bb.init()<0)
     return(-1);  
+
+  // grab frames on a background thread so that SIFT and the display
+  // below do not hold up the camera
+  bb.enableAsyncCapture();
   
   // what's the width and height of the camera? -- remember to scale it
   int width = bb.getImageWidth()/scale;
@@ -60,9 +67,17 @@ int main(int argc, char** argv)
   IplImage *left = cvCreateImage(cvSize(width,height), IPL_DEPTH_8U, 3);
   IplImage *right = cvCreateImage(cvSize(width,height), IPL_DEPTH_8U, 3);
 
-  // let's create a buffer to hold the disparity image
-  unsigned short disparity_buffer[width*height];
-  
+  // SIFT on all cores; the extractor keeps its pyramid from one frame to
+  // the next
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_threads<1)
+    num_threads = 1;
+  if(num_threads>SIFT_MAX_THREADS)
+    num_threads = SIFT_MAX_THREADS;
+  SiftExtractor extractor;
+  if(extractor.init(num_threads)<0)
+    return(-1);
+
   // let's create two windows to display the left and right images
   cvNamedWindow("Left",1);
   cvNamedWindow("Right",1);
@@ -82,18 +97,20 @@ int main(int argc, char** argv)
     // if here, then the capture succeeded so let's grab the left and
     // right rectified images and place them into the opencv containers
     // we setup earlier
-    bb.getRectifiedColorBuffer((unsigned char*)left->imageData, BB_LEFT);
-    bb.getRectifiedColorBuffer((unsigned char*)right->imageData, BB_RIGHT);
-
-    // lets grab the disparity buffer too along with the row size
-    int rowinc;
-    bb.getDisparityImage(disparity_buffer, &rowinc);
+    bb.getRectifiedColorBuffer((unsigned char*)left->imageData, BB_LEFT, true);
+    bb.getRectifiedColorBuffer((unsigned char*)right->imageData, BB_RIGHT, true);
+
+    // lets get a view of the disparity image too; it points into the
+    // driver's buffer, so there is nothing to copy (but it is only
+    // valid until the next capture)
+    ImageView disparity;
+    bb.getDisparityView(&disparity);
     
     // extract SIFT features for the small right image only, plot them,
     // then calculate the 3d point to the first feature then delete them
     // to avoid memory leak
     struct feature* current_features = NULL;
-    int num_current_features = sift_features(right, &current_features);
+    int num_current_features = extractor.extract(right, &current_features);
     printf("detected %d features ... \n", num_current_features);
     for(int i=0; i<num_current_features; i++)
     {
@@ -116,7 +133,7 @@ int main(int argc, char** argv)
         float x, y, z;
         row = (int)current_features[i].img_pt.y;
         col = (int)current_features[i].img_pt.x;
-        disp = disparity_buffer[row*width + col];
+        disp = imageViewPixel16(&disparity, row, col);
         bb.disparityToXYZ(row, col, disp, &x, &y, &z);
         printf("feature 0 is at %f, %f, %f\n", x, y, z);
       }
@@ -138,6 +155,14 @@ int main(int argc, char** argv)
     }
   }
   
+  // how many frames did we not get to?
+  AsyncCaptureStats stats;
+  if(bb.getCaptureStats(&stats)==0)
+    printf("captured %llu frames, processed %llu, dropped %llu\n",
+           (unsigned long long)stats.captured,
+           (unsigned long long)stats.delivered,
+           (unsigned long long)stats.dropped);
+
   // cleanup, close, and finish the bumblebee camera
   bb.fini();
 
@@ -0,0 +1,177 @@
+/*
+ * This program extracts the SIFT features of reference images and saves
+ * them with one index over all of them as a feature database (see
+ * FeatureDB.h), so that matchers only have to map it at startup. It
+ * also matches images against a database and reports the reference
+ * images they vote for.
+ *
+ * usage: sift_db <database file> <image>... [trees <n>]
+ *        sift_db query <database file> <image>... [checks <n>]
+ *   - "trees <n>" builds a forest of n randomized kd-trees (default 1
+ *     for one image, 4 for more)
+ *   - "checks <n>" is the number of features a query examines for each
+ *     of its features (default 210)
+ */
+
+// include some standard header files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// now include the opencv header files
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+// include the SIFT header files
+#include <sift/sift.h>
+#include <sift/imgfeatures.h>
+
+#include "FeatureDB.h"
+#include "SiftExtractor.h"
+
+// ratio test of the votes, as in me132_tutorial_2
+#define NN_SQ_DIST_RATIO_THR 0.30
+
+// images listed for a query
+#define QUERY_VOTES 5
+
+// monotonic time [s]
+static double getSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the features of an image; returns their number, -1 if it cannot be
+// loaded
+static int extractFeatures(SiftExtractor* extractor, const char* fname, struct feature** features,
+                           int* width, int* height)
+{
+  IplImage *img = cvLoadImage(fname, CV_LOAD_IMAGE_GRAYSCALE);
+  if(img==NULL)
+  {
+    fprintf(stderr, "Cannot load %s\n", fname);
+    return -1;
+  }
+  *width = img->width;
+  *height = img->height;
+  int n = extractor->extract(img, features);
+  cvReleaseImage(&img);
+  return n;
+}
+
+static int build(SiftExtractor* extractor, const char* dbname, char** images, int numImages, int numTrees)
+{
+  FeatureDBBuilder builder;
+  double start = getSeconds();
+  for(int k=0; k<numImages; k++)
+  {
+    struct feature* features = NULL;
+    int width, height;
+    int n = extractFeatures(extractor, images[k], &features, &width, &height);
+    if(n<0)
+      return -1;
+    builder.addImage(images[k], features, n, width, height);
+    if(k==0)
+      builder.setSourceHash(hashFeatureSource(images[k]));
+    free(features);
+  }
+  double extracted = getSeconds();
+  if(builder.write(dbname, numTrees)<0)
+    return -1;
+  double written = getSeconds();
+
+  // what a matcher pays at startup now
+  FeatureDB db;
+  if(db.open(dbname)<0)
+    return -1;
+  double opened = getSeconds();
+
+  printf("%d images, %d features: extracted in %.3f sec, %d trees written in %.3f sec, mapped in %.3f ms\n",
+         db.getImageCount(), db.getFeatureCount(), extracted - start, db.getTreeCount(),
+         written - extracted, (opened - written) * 1e3);
+  return 0;
+}
+
+static int query(SiftExtractor* extractor, const char* dbname, char** images, int numImages, int maxChecks)
+{
+  FeatureDB db;
+  if(db.open(dbname)<0)
+    return -1;
+
+  FeatureSearch search;
+  for(int k=0; k<numImages; k++)
+  {
+    struct feature* features = NULL;
+    int width, height;
+    int n = extractFeatures(extractor, images[k], &features, &width, &height);
+    if(n<0)
+      return -1;
+    float* descr = new float[(size_t)(n>0 ? n : 1) * FEATURE_DB_DIMS];
+    for(int i=0; i<n; i++)
+      getFeatureDescriptor(&features[i], descr + (size_t)i * FEATURE_DB_DIMS);
+    free(features);
+
+    FeatureDBVote votes[QUERY_VOTES];
+    double start = getSeconds();
+    int nv = db.matchImages(descr, n, maxChecks, NN_SQ_DIST_RATIO_THR, votes, QUERY_VOTES, &search);
+    double elapsed = getSeconds() - start;
+    delete[] descr;
+
+    printf("%s: %d features matched in %.3f ms\n", images[k], n, elapsed * 1e3);
+    for(int v=0; v<nv; v++)
+    {
+      const FeatureDBImage* image = db.getImage(votes[v].image);
+      printf("  %5d votes  %s\n", votes[v].votes,
+             image!=NULL && image->name[0] ? image->name : "(reference image)");
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  bool querying = argc>1 && strcmp(argv[1], "query")==0;
+  int first = querying ? 2 : 1;
+  if(argc<first+2)
+  {
+    fprintf(stderr, "usage: %s <database file> <image>... [trees <n>]\n"
+            "       %s query <database file> <image>... [checks <n>]\n", argv[0], argv[0]);
+    return -1;
+  }
+
+  // the images, without the options
+  char** images = new char*[argc];
+  int numImages = 0;
+  int numTrees = 0;
+  int maxChecks = 210;
+  for(int k=first+1; k<argc; k++)
+  {
+    if(strcmp(argv[k], "trees")==0 && k+1<argc)
+      numTrees = atoi(argv[++k]);
+    else if(strcmp(argv[k], "checks")==0 && k+1<argc)
+      maxChecks = atoi(argv[++k]);
+    else
+      images[numImages++] = argv[k];
+  }
+  if(numTrees==0)
+    numTrees = numImages>1 ? 4 : 1;
+
+  // SIFT on all cores
+  long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(numThreads<1)
+    numThreads = 1;
+  if(numThreads>SIFT_MAX_THREADS)
+    numThreads = SIFT_MAX_THREADS;
+  SiftExtractor extractor;
+  int ret = extractor.init(numThreads);
+  if(ret==0 && querying)
+    ret = query(&extractor, argv[first], images, numImages, maxChecks);
+  else if(ret==0)
+    ret = build(&extractor, argv[first], images, numImages, numTrees);
+  delete[] images;
+  return ret;
+}